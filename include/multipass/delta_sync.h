@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MULTIPASS_DELTA_SYNC_H
+#define MULTIPASS_DELTA_SYNC_H
+
+#include <QByteArray>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class QIODevice;
+
+namespace multipass
+{
+namespace delta_sync
+{
+// Weak checksums are Adler-32 so that a remote helper can compute them with zlib.adler32()
+class RollingChecksum
+{
+public:
+    RollingChecksum(const char* data, int64_t length);
+
+    void roll(unsigned char out, unsigned char in);
+    uint32_t value() const;
+
+private:
+    uint32_t a;
+    uint32_t b;
+    int64_t length;
+};
+
+struct BlockSignature
+{
+    uint32_t weak;
+    std::string strong;
+};
+
+struct Signature
+{
+    int64_t block_size;
+    std::vector<BlockSignature> blocks;
+};
+
+struct DeltaStats
+{
+    int64_t matched_blocks;
+    int64_t literal_bytes;
+};
+
+// Block checksums of a whole file, published next to it so that holders of an older version only fetch the blocks
+// they lack, as with zsync. As text, a "<block size> <length>" line comes before a "<weak> <strong>" line per block.
+struct FileSignature
+{
+    int64_t length;
+    Signature signature;
+};
+
+int64_t block_size_for(int64_t file_size);
+std::string strong_checksum(const char* data, int64_t length);
+Signature signature_for(const char* data, int64_t length, int64_t block_size);
+
+FileSignature file_signature_for(const char* data, int64_t length);
+QByteArray to_text(const FileSignature& file_signature);
+FileSignature parse_file_signature(const QByteArray& text);
+
+// Returns where in data each block of the target is found, -1 for the blocks data does not have
+std::vector<int64_t> locate_blocks(const char* data, int64_t length, const FileSignature& target);
+
+// The delta is a sequence of 'C' <block index> and 'D' <length> <bytes> records, integers in big endian
+DeltaStats write_delta(const char* data, int64_t length, const Signature& basis, QIODevice& output);
+QByteArray apply_delta(const QByteArray& basis, const QByteArray& delta, int64_t block_size);
+} // namespace delta_sync
+} // namespace multipass
+#endif // MULTIPASS_DELTA_SYNC_H
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MULTIPASS_DOWNLOAD_SCHEDULER_H
+#define MULTIPASS_DOWNLOAD_SCHEDULER_H
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+namespace multipass
+{
+// Decides when downloads get to transfer data. Only so many transfers run at once, higher priorities go first and
+// take over the slots of lower priority transfers, which are held back until slots free up again. Transfers below
+// the interactive priority also share a bandwidth budget. Running transfers are never blocked: they are told to hold
+// their reads back instead, for the event loop of their replies to keep going.
+class DownloadScheduler
+{
+public:
+    enum class Priority
+    {
+        prefetch,
+        background,
+        interactive
+    };
+
+    struct Limits
+    {
+        int max_transfers;
+        // Shared by the transfers below interactive priority, 0 for unlimited
+        int64_t background_bytes_per_second;
+    };
+
+    // Holds a transfer slot for its lifetime, waiting for one to be available when constructed
+    class Transfer
+    {
+    public:
+        Transfer(DownloadScheduler& scheduler, Priority priority);
+        ~Transfer();
+
+        // Accounts for the bytes received, returning how long to hold reads back to stay within the bandwidth budget
+        std::chrono::milliseconds pace(int64_t bytes);
+        // Gives the slot up while a higher priority transfer waits for one and takes it back once it can, returning
+        // false for as long as the transfer is to stay paused
+        bool may_proceed();
+
+    private:
+        Transfer(const Transfer&) = delete;
+        Transfer& operator=(const Transfer&) = delete;
+
+        DownloadScheduler& scheduler;
+        const Priority priority;
+        bool suspended{false};
+    };
+
+    // Sets the priority of the downloads started by the current thread for as long as it lives
+    class PriorityScope
+    {
+    public:
+        explicit PriorityScope(Priority priority);
+        ~PriorityScope();
+
+    private:
+        PriorityScope(const PriorityScope&) = delete;
+        PriorityScope& operator=(const PriorityScope&) = delete;
+
+        const Priority previous;
+    };
+
+    explicit DownloadScheduler(const Limits& limits);
+
+    // Interactive unless the current thread says otherwise
+    static Priority current_priority();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    void admit(Priority priority, std::unique_lock<std::mutex>& lock);
+    bool can_admit(Priority priority) const;
+    bool preempted(Priority priority) const;
+    Clock::duration take_tokens(int64_t bytes);
+
+    const Limits limits;
+    std::mutex mutex;
+    std::condition_variable slot_freed;
+    int active{0};
+    std::array<int, 3> waiting{};
+    double tokens;
+    Clock::time_point last_refill;
+};
+} // namespace multipass
+#endif // MULTIPASS_DOWNLOAD_SCHEDULER_H
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MULTIPASS_FILE_HASHER_H
+#define MULTIPASS_FILE_HASHER_H
+
+#include <multipass/path.h>
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace multipass
+{
+// Computes the SHA-256 digest of whole files. Digests are remembered along with the size and modification time of
+// the file, so an unchanged file is only ever hashed once; giving a cache file keeps them across runs.
+class FileHasher
+{
+public:
+    explicit FileHasher(const Path& cache_file_path = {});
+
+    std::string sha256_of(const Path& file_path);
+
+    // Hashes the files concurrently, returning their digests in the same order. The cache file is written once.
+    std::vector<std::string> sha256_of(const std::vector<Path>& file_paths);
+
+private:
+    struct Digest
+    {
+        int64_t size;
+        int64_t last_modified;
+        std::string sha256;
+    };
+
+    // Tells whether the file had to be hashed, its digest then needing to be persisted
+    std::string cached_sha256_of(const Path& file_path, bool& hashed);
+    void persist();
+
+    const Path cache_file_path;
+    std::mutex mutex;
+    std::unordered_map<std::string, Digest> digests;
+};
+} // namespace multipass
+#endif // MULTIPASS_FILE_HASHER_H
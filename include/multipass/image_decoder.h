@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MULTIPASS_IMAGE_DECODER_H
+#define MULTIPASS_IMAGE_DECODER_H
+
+#include <multipass/path.h>
+#include <multipass/progress_monitor.h>
+
+#include <QByteArray>
+
+#include <cstddef>
+#include <memory>
+
+class QIODevice;
+
+namespace multipass
+{
+class ImageDecoder
+{
+public:
+    using UPtr = std::unique_ptr<ImageDecoder>;
+    virtual ~ImageDecoder() = default;
+
+    // Decodes the whole compressed file the decoder was made for
+    virtual void decode_to(const Path& decoded_file_path, const ProgressMonitor& monitor) = 0;
+
+    // Decodes the next piece of a stream fed incrementally, returns false once the end of the stream is reached
+    virtual bool decode_chunk(const char* data, size_t size, QIODevice& decoded_file) = 0;
+
+    // Completes the decoded file once a stream fed incrementally ran out, throws if the stream was cut short
+    virtual void finish(QIODevice& decoded_file) = 0;
+
+protected:
+    ImageDecoder() = default;
+    ImageDecoder(const ImageDecoder&) = delete;
+    ImageDecoder& operator=(const ImageDecoder&) = delete;
+};
+
+// Picks the decoder of a compressed image by its leading bytes, or by its extension when they tell nothing.
+// Returns nullptr for images that are not compressed.
+ImageDecoder::UPtr make_image_decoder(const Path& image_path);
+ImageDecoder::UPtr make_image_decoder(const QByteArray& leading_bytes, const Path& image_path);
+
+// Where an image decodes to, or an empty path if its extension is not that of a compressed image
+Path decoded_path_for(const Path& image_path);
+} // namespace multipass
+#endif // MULTIPASS_IMAGE_DECODER_H
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MULTIPASS_QCOW2_WRITER_H
+#define MULTIPASS_QCOW2_WRITER_H
+
+#include <multipass/path.h>
+
+#include <QFile>
+#include <QIODevice>
+
+#include <cstdint>
+#include <vector>
+
+namespace multipass
+{
+// Writes the raw disk image streamed into it as a qcow2 image, only allocating clusters for data that is not zeroed.
+// Streams that already hold a disk image in some other format are written out as they are.
+class Qcow2Writer : public QIODevice
+{
+public:
+    explicit Qcow2Writer(const Path& image_path);
+
+    bool open(OpenMode mode) override;
+    bool isSequential() const override;
+
+    // Writes out the image metadata once the whole stream was written
+    void finish();
+
+protected:
+    qint64 readData(char* data, qint64 max_size) override;
+    qint64 writeData(const char* data, qint64 size) override;
+
+private:
+    bool write_cluster();
+    bool write_metadata();
+    bool write_at(int64_t offset, const char* data, int64_t size);
+
+    QFile image_file;
+    std::vector<char> cluster;
+    int64_t cluster_fill{0};
+    int64_t stream_offset{0};
+    int64_t next_host_cluster{1};
+    bool format_checked{false};
+    bool wraps_raw_image{true};
+    std::vector<uint64_t> host_clusters;
+};
+} // namespace multipass
+#endif // MULTIPASS_QCOW2_WRITER_H
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MULTIPASS_SHA256_H
+#define MULTIPASS_SHA256_H
+
+#include <QByteArray>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+struct sha256_state_st;
+
+namespace multipass
+{
+class Sha256
+{
+public:
+    Sha256();
+    ~Sha256();
+
+    void add_data(const char* data, int64_t size);
+    std::string hex_result() const;
+
+    // The intermediate state can be persisted and restored later to carry on hashing where it left off
+    QByteArray state() const;
+    bool restore(const QByteArray& state);
+
+private:
+    std::unique_ptr<sha256_state_st> context;
+};
+} // namespace multipass
+#endif // MULTIPASS_SHA256_H
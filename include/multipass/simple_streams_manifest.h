@@ -23,7 +23,7 @@
 #include <multipass/vm_image_info.h>
 
 #include <QByteArray>
-#include <QMap>
+#include <QHash>
 #include <QString>
 
 #include <memory>
@@ -37,10 +37,18 @@ struct SimpleStreamsManifest
     SimpleStreamsManifest(const SimpleStreamsManifest&) = delete;
     SimpleStreamsManifest& operator=(const SimpleStreamsManifest&) = delete;
     static std::unique_ptr<SimpleStreamsManifest> fromJson(const QByteArray& json);
+    // Indexes products that were already parsed, such as those of a cached catalogue
+    static std::unique_ptr<SimpleStreamsManifest> fromProducts(const QString& updated_at,
+                                                               std::vector<VMImageInfo> products);
+
+    // Returns the products whose id starts with the prefix, ordered by id
+    std::vector<const VMImageInfo*> products_with_id_prefix(const QString& prefix) const;
 
     const QString updated_at;
     const std::vector<VMImageInfo> products;
-    const QMap<QString, const VMImageInfo*> image_records;
+    // Products by id and by alias, release names being among the aliases
+    const QHash<QString, const VMImageInfo*> image_records;
+    const std::vector<const VMImageInfo*> products_by_id;
 };
 }
 #endif // MULTIPASS_SIMPLE_STREAMS_MANIFEST_H
@@ -38,11 +38,14 @@ public:
     OpenSSHKeyProvider(const Path& cache_dir);
     std::string private_key_as_base64() const override;
     std::string public_key_as_base64() const override;
+    std::string public_key_type() const override;
     ssh_key private_key() const override;
+    ssh_key legacy_private_key() const override;
 
 private:
     QDir ssh_key_dir;
     KeyUPtr priv_key;
+    KeyUPtr legacy_priv_key;
 };
 }
 #endif // MULTIPASS_OPENSSH_KEY_PROVIDER_H
@@ -28,6 +28,7 @@
 
 namespace multipass
 {
+class FileHasher;
 using SSHSessionUPtr = std::unique_ptr<SSHSession>;
 
 class SCPClient
@@ -38,6 +39,8 @@ public:
 
     void push_file(const std::string& source_path, const std::string& destination_path);
     void pull_file(const std::string& source_path, const std::string& destination_path);
+    void sync_file(const std::string& source_path, const std::string& destination_path,
+                   FileHasher* hasher = nullptr);
 
 private:
     SSHSessionUPtr ssh_session;
@@ -32,7 +32,9 @@ public:
     virtual ~SSHKeyProvider() = default;
     virtual std::string private_key_as_base64() const = 0;
     virtual std::string public_key_as_base64() const = 0;
+    virtual std::string public_key_type() const = 0;
     virtual ssh_key private_key() const = 0;
+    virtual ssh_key legacy_private_key() const = 0;
 
 protected:
     SSHKeyProvider() = default;
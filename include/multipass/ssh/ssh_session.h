@@ -46,6 +46,8 @@ private:
     SSHSession(const std::string& host, int port, const std::string& ssh_username, const SSHKeyProvider* key_provider,
                const std::chrono::milliseconds timeout = std::chrono::seconds(20));
     void set_option(ssh_options_e type, const void* value);
+    void authenticate(const SSHKeyProvider& key_provider);
+    void authorize_public_key(const SSHKeyProvider& key_provider);
     std::unique_ptr<ssh_session_struct, void (*)(ssh_session)> session;
 };
 } // namespace multipass
@@ -21,6 +21,8 @@
 #ifndef MULTIPASS_URL_DOWNLOADER_H
 #define MULTIPASS_URL_DOWNLOADER_H
 
+#include <multipass/download_scheduler.h>
+#include <multipass/optional.h>
 #include <multipass/path.h>
 #include <multipass/progress_monitor.h>
 
@@ -28,7 +30,10 @@
 #include <QDateTime>
 
 #include <chrono>
+#include <memory>
+#include <vector>
 
+class QNetworkAccessManager;
 class QUrl;
 class QString;
 namespace multipass
@@ -36,20 +41,73 @@ namespace multipass
 class URLDownloader
 {
 public:
+    // Receives the downloaded bytes in order as they arrive
+    class DataSink
+    {
+    public:
+        virtual ~DataSink() = default;
+
+        // Returning false aborts the download
+        virtual bool write(const char* data, int64_t size) = 0;
+
+        // Opaque state covering every byte written so far, saved along with an interrupted download
+        virtual QByteArray checkpoint() const
+        {
+            return {};
+        }
+
+        // Carries on from a saved checkpoint, or returns false to be fed the partial download from the start
+        virtual bool restore(const QByteArray& /*state*/)
+        {
+            return false;
+        }
+    };
+
+    // What a server is told about the version of a resource already at hand, to only send it back if it changed
+    struct Validators
+    {
+        QByteArray etag;
+        QByteArray last_modified;
+    };
+
+    struct ByteRange
+    {
+        int64_t start;
+        int64_t end;
+    };
+
     URLDownloader(std::chrono::milliseconds timeout);
     URLDownloader(const Path& cache_dir, std::chrono::milliseconds timeout);
-    virtual ~URLDownloader() = default;
+    URLDownloader(const Path& cache_dir, std::chrono::milliseconds timeout,
+                  const DownloadScheduler::Limits& download_limits);
+    virtual ~URLDownloader();
     virtual void download_to(const QUrl& url, const QString& file_name, int64_t size, const int download_type,
-                             const ProgressMonitor& monitor);
+                             const ProgressMonitor& monitor, DataSink* sink = nullptr);
+    // Fetches the rest of a file of the resource's length whose present ranges are already in place, with range
+    // requests. Fails if the server cannot serve ranges, an interrupted transfer being resumed by either call.
+    virtual void download_missing_to(const QUrl& url, const QString& file_name, const std::vector<ByteRange>& present,
+                                     const int download_type, const ProgressMonitor& monitor,
+                                     DataSink* sink = nullptr);
     virtual QByteArray download(const QUrl& url);
+    // Returns the bytes of the resource between start and end, meant for ranges of a few megabytes at most
+    virtual QByteArray download_range(const QUrl& url, int64_t start, int64_t end);
+    // Returns nothing if the resource did not change since the validators were taken, updating them otherwise
+    virtual optional<QByteArray> download_if_changed(const QUrl& url, Validators& validators);
     virtual QDateTime last_modified(const QUrl& url);
 
 private:
     URLDownloader(const URLDownloader&) = delete;
     URLDownloader& operator=(const URLDownloader&) = delete;
 
+    // Returns the network manager of the calling thread
+    QNetworkAccessManager* network_manager();
+
+    struct NetworkManagers;
+
     const Path cache_dir_path;
     std::chrono::milliseconds timeout;
+    DownloadScheduler scheduler;
+    std::shared_ptr<NetworkManagers> network_managers;
 };
 }
 #endif // MULTIPASS_URL_DOWNLOADER_H
@@ -51,6 +51,36 @@ public:
     virtual FetchType fetch_type() = 0;
     virtual VMImage prepare_source_image(const VMImage& source_image) = 0;
     virtual void prepare_instance_image(const VMImage& instance_image, const VirtualMachineDescription& desc) = 0;
+
+    /** Creates an instance disk as a thin overlay on top of a prepared image, instead of a full copy of it.
+     *
+     * @param base_image_path The prepared image, which must be kept for as long as the overlay exists
+     * @param instance_image_path Where to create the overlay
+     * @return false if the backend cannot use the image as a backing file
+     */
+    virtual bool create_instance_overlay(const Path& /*base_image_path*/, const Path& /*instance_image_path*/)
+    {
+        return false;
+    }
+
+    /** Points an instance disk created by create_instance_overlay at another base image holding the same data.
+     *
+     * @param base_image_path The new base image, which must be kept for as long as the overlay exists
+     * @param instance_image_path The overlay, which must not be in use
+     * @return false if the overlay could not be changed
+     */
+    virtual bool rebase_instance_overlay(const Path& /*base_image_path*/, const Path& /*instance_image_path*/)
+    {
+        return false;
+    }
+
+    /** Tells whether instance disks can be overlays on images the daemon serves while they download, which takes
+     * the hypervisor reaching the daemon's root-owned NBD socket.
+     */
+    virtual bool can_boot_from_streamed_images()
+    {
+        return false;
+    }
     virtual void configure(const std::string& name, YAML::Node& meta_config, YAML::Node& user_config) = 0;
     virtual void check_hypervisor_support() = 0;
 
@@ -37,6 +37,8 @@ public:
     const QString id;
     const QString version;
     const int64_t size;
+    // Block checksums of the image for fetching it by delta from an older version, empty unless the remote has them
+    const QString delta_signature_location;
 };
 }
 #endif // MULTIPASS_VM_IMAGE_INFO_H
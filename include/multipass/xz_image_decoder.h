@@ -18,10 +18,10 @@
 #ifndef MULTIPASS_XZ_IMAGE_DECODER_H
 #define MULTIPASS_XZ_IMAGE_DECODER_H
 
-#include <multipass/path.h>
-#include <multipass/progress_monitor.h>
+#include <multipass/image_decoder.h>
 
 #include <memory>
+#include <vector>
 
 #include <QFile>
 
@@ -29,18 +29,23 @@
 
 namespace multipass
 {
-class XzImageDecoder
+class XzImageDecoder : public ImageDecoder
 {
 public:
+    XzImageDecoder();
     XzImageDecoder(const Path& xz_file_path);
 
-    void decode_to(const Path& decoded_file_path, const ProgressMonitor& monitor);
+    void decode_to(const Path& decoded_file_path, const ProgressMonitor& monitor) override;
+    bool decode_chunk(const char* data, size_t size, QIODevice& decoded_file) override;
+    void finish(QIODevice& decoded_file) override;
 
     using XzDecoderUPtr = std::unique_ptr<xz_dec, decltype(xz_dec_end)*>;
 
 private:
     QFile xz_file;
     XzDecoderUPtr xz_decoder;
+    std::vector<unsigned char> decoded_data;
+    bool stream_ended{false};
 };
 } // namespace multipass
 #endif // MULTIPASS_XZ_IMAGE_DECODER_H
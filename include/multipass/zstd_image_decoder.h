@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MULTIPASS_ZSTD_IMAGE_DECODER_H
+#define MULTIPASS_ZSTD_IMAGE_DECODER_H
+
+#include <multipass/image_decoder.h>
+
+#include <memory>
+#include <vector>
+
+#include <QFile>
+
+#include <zstd.h>
+
+namespace multipass
+{
+class ZstdImageDecoder : public ImageDecoder
+{
+public:
+    ZstdImageDecoder();
+    ZstdImageDecoder(const Path& zstd_file_path);
+
+    void decode_to(const Path& decoded_file_path, const ProgressMonitor& monitor) override;
+    bool decode_chunk(const char* data, size_t size, QIODevice& decoded_file) override;
+    void finish(QIODevice& decoded_file) override;
+
+    using ZstdDecoderUPtr = std::unique_ptr<ZSTD_DCtx, decltype(ZSTD_freeDCtx)*>;
+
+private:
+    QFile zstd_file;
+    ZstdDecoderUPtr zstd_decoder;
+    std::vector<char> decoded_data;
+    bool frame_pending{false};
+    bool frame_decoded{false};
+};
+} // namespace multipass
+#endif // MULTIPASS_ZSTD_IMAGE_DECODER_H
@@ -20,10 +20,14 @@
 
 #include <multipass/cli/argparser.h>
 #include <multipass/cli/client_platform.h>
+#include <multipass/file_hasher.h>
 #include <multipass/ssh/scp_client.h>
 
 #include <QDir>
 #include <QFileInfo>
+#include <QStandardPaths>
+
+#include <memory>
 
 namespace mp = multipass;
 namespace cmd = multipass::cmd;
@@ -43,6 +47,13 @@ mp::ReturnCode cmd::CopyFiles::run(mp::ArgParser* parser)
         if (reply.ssh_info().empty())
             return ReturnCode::Ok;
 
+        // Files are only hashed once the instance's copy turns out to differ in size or modification time, and
+        // unchanged files are not hashed again on later syncs
+        std::unique_ptr<mp::FileHasher> hasher;
+        if (delta && !destination.first.empty())
+            hasher = std::make_unique<mp::FileHasher>(
+                QDir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation)).filePath("file_hashes.json"));
+
         for (const auto& source : sources)
         {
             mp::SSHInfo ssh_info;
@@ -63,7 +74,9 @@ mp::ReturnCode cmd::CopyFiles::run(mp::ArgParser* parser)
             try
             {
                 mp::SCPClient scp_client{host, port, username, priv_key_blob};
-                if (!destination.first.empty())
+                if (!destination.first.empty() && delta)
+                    scp_client.sync_file(source.second, destination.second, hasher.get());
+                else if (!destination.first.empty())
                     scp_client.push_file(source.second, destination.second);
                 else
                     scp_client.pull_file(source.second, destination.second);
@@ -109,10 +122,16 @@ mp::ParseCode cmd::CopyFiles::parse_args(mp::ArgParser* parser)
                                                  "a path inside the instance",
                                   "<destination>");
 
+    QCommandLineOption delta_option("delta", "Only send the parts of files that differ from an existing copy in the "
+                                             "instance");
+    parser->addOption(delta_option);
+
     auto status = parser->commandParse(this);
     if (status != ParseCode::Ok)
         return status;
 
+    delta = parser->isSet(delta_option);
+
     if (parser->positionalArguments().count() < 2)
     {
         cerr << "Not enough arguments given\n";
@@ -210,6 +229,12 @@ mp::ParseCode cmd::CopyFiles::parse_args(mp::ArgParser* parser)
         return ParseCode::CommandLineError;
     }
 
+    if (delta && instance_name.isEmpty())
+    {
+        cerr << "Delta transfers are only supported when copying into an instance\n";
+        return ParseCode::CommandLineError;
+    }
+
     destination = std::make_pair(instance_name.toStdString(), destination_path.toStdString());
     return ParseCode::Ok;
 }
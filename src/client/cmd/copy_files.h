@@ -41,6 +41,7 @@ private:
     SSHInfoRequest request;
     std::vector<std::pair<std::string, std::string>> sources;
     std::pair<std::string, std::string> destination;
+    bool delta{false};
 
     ParseCode parse_args(ArgParser* parser) override;
 };
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "catalogue_cache.h"
+
+#include <multipass/logging/log.h>
+
+#include <fmt/format.h>
+
+#include <QFile>
+#include <QSaveFile>
+
+#include <stdexcept>
+
+namespace mp = multipass;
+namespace mpl = multipass::logging;
+
+namespace
+{
+constexpr auto category = "catalogue cache";
+constexpr quint32 catalogue_magic{0x4d504354}; // "MPCT"
+// Bump whenever what hosts write changes, for older files to be dropped rather than misread
+constexpr quint32 format_version{2};
+constexpr auto stream_version = QDataStream::Qt_5_6;
+
+QString read_string(QDataStream& stream, QSet<QString>& strings)
+{
+    QString string;
+    stream >> string;
+
+    return *strings.insert(string);
+}
+} // namespace
+
+mp::CatalogueCache::CatalogueCache(const QString& file_path) : file_path{file_path}
+{
+}
+
+bool mp::CatalogueCache::load(const Reader& reader) const
+{
+    if (file_path.isEmpty())
+        return false;
+
+    QFile file{file_path};
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream stream{&file};
+    stream.setVersion(stream_version);
+
+    quint32 magic{0}, version{0};
+    stream >> magic >> version;
+    if (stream.status() != QDataStream::Ok || magic != catalogue_magic || version != format_version)
+        return false;
+
+    try
+    {
+        reader(stream);
+    }
+    catch (const std::exception& e)
+    {
+        mpl::log(mpl::Level::warning, category,
+                 fmt::format("Could not read {}: {}", file_path.toStdString(), e.what()));
+        return false;
+    }
+
+    return stream.status() == QDataStream::Ok && stream.atEnd();
+}
+
+void mp::CatalogueCache::save(const Writer& writer) const
+{
+    if (file_path.isEmpty())
+        return;
+
+    QSaveFile file{file_path};
+    if (file.open(QIODevice::WriteOnly))
+    {
+        QDataStream stream{&file};
+        stream.setVersion(stream_version);
+
+        stream << catalogue_magic << format_version;
+        writer(stream);
+
+        if (stream.status() == QDataStream::Ok && file.commit())
+            return;
+    }
+
+    mpl::log(mpl::Level::warning, category,
+             fmt::format("Could not write {}: {}", file_path.toStdString(), file.errorString().toStdString()));
+}
+
+QDataStream& mp::operator<<(QDataStream& stream, const VMImageInfo& info)
+{
+    return stream << info.aliases << info.os << info.release << info.release_title << info.supported
+                  << info.image_location << info.kernel_location << info.initrd_location << info.id << info.version
+                  << static_cast<qint64>(info.size) << info.delta_signature_location;
+}
+
+mp::VMImageInfo mp::read_image_info(QDataStream& stream, QSet<QString>& strings)
+{
+    quint32 alias_count{0};
+    stream >> alias_count;
+
+    QStringList aliases;
+    for (quint32 i = 0; i < alias_count && stream.status() == QDataStream::Ok; ++i)
+        aliases.append(read_string(stream, strings));
+
+    const auto os = read_string(stream, strings);
+    const auto release = read_string(stream, strings);
+    const auto release_title = read_string(stream, strings);
+    bool supported{false};
+    stream >> supported;
+    const auto image_location = read_string(stream, strings);
+    const auto kernel_location = read_string(stream, strings);
+    const auto initrd_location = read_string(stream, strings);
+    const auto id = read_string(stream, strings);
+    const auto version = read_string(stream, strings);
+    qint64 size{0};
+    stream >> size;
+    const auto delta_signature_location = read_string(stream, strings);
+
+    if (stream.status() != QDataStream::Ok)
+        throw std::runtime_error("truncated image record");
+
+    return {aliases, os, release, release_title, supported, image_location, kernel_location, initrd_location,
+            id, version, size, delta_signature_location};
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MULTIPASS_CATALOGUE_CACHE_H
+#define MULTIPASS_CATALOGUE_CACHE_H
+
+#include <multipass/vm_image_info.h>
+
+#include <QDataStream>
+#include <QSet>
+#include <QString>
+
+#include <functional>
+
+namespace multipass
+{
+// Versioned binary file holding the image catalogues a host last fetched, so that the daemon can serve them as soon
+// as it starts rather than waiting on the remotes. Files of another format version are ignored, as missing ones are.
+class CatalogueCache
+{
+public:
+    using Reader = std::function<void(QDataStream&)>;
+    using Writer = std::function<void(QDataStream&)>;
+
+    // Without a file, nothing is ever cached
+    CatalogueCache() = default;
+    explicit CatalogueCache(const QString& file_path);
+
+    // Returns false when the file holds no usable catalogue, in which case whatever the reader got out of it must be
+    // discarded.
+    bool load(const Reader& reader) const;
+    void save(const Writer& writer) const;
+
+private:
+    QString file_path;
+};
+
+QDataStream& operator<<(QDataStream& stream, const VMImageInfo& info);
+// Strings read again are shared with the ones already in the set
+VMImageInfo read_image_info(QDataStream& stream, QSet<QString>& strings);
+} // namespace multipass
+#endif // MULTIPASS_CATALOGUE_CACHE_H
@@ -0,0 +1,291 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "chunk_store.h"
+
+#include <multipass/logging/log.h>
+#include <multipass/sha256.h>
+
+#include <fmt/format.h>
+
+#include <QCryptographicHash>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QSet>
+#include <QTemporaryFile>
+#include <QTextStream>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+namespace mp = multipass;
+namespace mpl = multipass::logging;
+
+namespace
+{
+constexpr auto category = "chunk store";
+constexpr auto zero_chunk = "0";
+
+// Matches the default qcow2 cluster size, so that equal clusters of different images line up on chunks
+constexpr int64_t chunk_size{64 * 1024};
+
+bool is_zero(const char* data, int64_t size)
+{
+    return data[0] == 0 && std::memcmp(data, data + 1, static_cast<size_t>(size - 1)) == 0;
+}
+
+bool reflinks_unsupported(int error)
+{
+    return error == EOPNOTSUPP || error == ENOTTY || error == EXDEV || error == ENOSYS;
+}
+
+bool punch_hole(int fd, int64_t offset, int64_t length)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+    return ::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0;
+#else
+    return false;
+#endif
+}
+
+// Makes the destination range share the source's extents
+bool clone_range(int source_fd, int64_t source_offset, int destination_fd, int64_t destination_offset, int64_t length)
+{
+#ifdef FICLONERANGE
+    file_clone_range range{};
+    range.src_fd = source_fd;
+    range.src_offset = static_cast<__u64>(source_offset);
+    range.src_length = static_cast<__u64>(length);
+    range.dest_offset = static_cast<__u64>(destination_offset);
+
+    return ::ioctl(destination_fd, FICLONERANGE, &range) == 0;
+#else
+    errno = EOPNOTSUPP;
+    return false;
+#endif
+}
+
+// Like clone_range, but the kernel first checks that both ranges hold the same data
+int64_t dedupe_range(int source_fd, int destination_fd, int64_t destination_offset, int64_t length)
+{
+#ifdef FIDEDUPERANGE
+    std::vector<char> buffer(sizeof(file_dedupe_range) + sizeof(file_dedupe_range_info), 0);
+    auto range = reinterpret_cast<file_dedupe_range*>(buffer.data());
+    range->src_offset = 0;
+    range->src_length = static_cast<__u64>(length);
+    range->dest_count = 1;
+    range->info[0].dest_fd = destination_fd;
+    range->info[0].dest_offset = static_cast<__u64>(destination_offset);
+
+    if (::ioctl(source_fd, FIDEDUPERANGE, range) != 0)
+        return -1;
+
+    return range->info[0].status == FILE_DEDUPE_RANGE_SAME ? static_cast<int64_t>(range->info[0].bytes_deduped) : 0;
+#else
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+QString file_stamp(const QFileInfo& info)
+{
+    return QString("%1 %2").arg(info.size()).arg(info.lastModified().toMSecsSinceEpoch());
+}
+
+// Clones a chunk's worth of data between two scratch files, which only works where the store can share extents
+bool supports_reflinks(const QDir& store_dir)
+{
+    store_dir.mkpath(".");
+
+    QTemporaryFile source{store_dir.filePath("probe-XXXXXX")};
+    QTemporaryFile destination{store_dir.filePath("probe-XXXXXX")};
+    if (!source.open() || !destination.open())
+        return false;
+
+    const std::vector<char> data(chunk_size, 'p');
+    if (source.write(data.data(), chunk_size) != chunk_size || !source.flush())
+        return false;
+
+    if (clone_range(source.handle(), 0, destination.handle(), 0, chunk_size))
+        return true;
+
+    const auto error = errno;
+    mpl::log(mpl::Level::info, category,
+             fmt::format("{} cannot share extents between files ({}), only zeroed chunks will be reclaimed",
+                         store_dir.path().toStdString(), std::strerror(error)));
+    return false;
+}
+} // namespace
+
+mp::ChunkStore::ChunkStore(const Path& store_dir)
+    : chunks_dir{QDir(store_dir).filePath("chunks")},
+      manifests_dir{QDir(store_dir).filePath("manifests")},
+      reflinks_supported{supports_reflinks(QDir{store_dir})}
+{
+}
+
+int64_t mp::ChunkStore::add(const Path& file_path)
+{
+    QFile file{file_path};
+    if (!file.open(QIODevice::ReadWrite))
+        throw std::runtime_error(fmt::format("cannot open {} to store its chunks", file_path.toStdString()));
+
+    QStringList chunks;
+    std::vector<char> data(chunk_size);
+    bool reflinks{reflinks_supported};
+    int64_t reclaimed{0};
+
+    if (reflinks)
+        chunks_dir.mkpath(".");
+    for (int64_t offset = 0;; offset += chunk_size)
+    {
+        const auto size = ::pread(file.handle(), data.data(), chunk_size, offset);
+        if (size < 0)
+            throw std::runtime_error(
+                fmt::format("cannot read {}: {}", file_path.toStdString(), std::strerror(errno)));
+        if (size == 0)
+            break;
+
+        if (is_zero(data.data(), size))
+        {
+            if (punch_hole(file.handle(), offset, size))
+                reclaimed += size;
+            chunks << zero_chunk;
+            continue;
+        }
+
+        // Chunks are only kept where they can share their extents with the files, elsewhere they would only be
+        // copies taking up space of their own
+        if (!reflinks)
+            continue;
+
+        Sha256 hash;
+        hash.add_data(data.data(), size);
+        const auto digest = QString::fromStdString(hash.hex_result());
+        chunks << digest;
+
+        QFile chunk_file{chunk_path_for(digest)};
+        if (chunk_file.exists())
+        {
+            if (!chunk_file.open(QIODevice::ReadOnly))
+                continue;
+
+            const auto deduped = dedupe_range(chunk_file.handle(), file.handle(), offset, size);
+            if (deduped > 0)
+                reclaimed += deduped;
+            else if (deduped < 0 && reflinks_unsupported(errno))
+                reflinks = false;
+        }
+        else
+        {
+            QDir{chunks_dir}.mkpath(QFileInfo{chunk_file}.path());
+            if (!chunk_file.open(QIODevice::WriteOnly))
+                continue;
+
+            if (!clone_range(file.handle(), offset, chunk_file.handle(), 0, size))
+            {
+                reflinks = !reflinks_unsupported(errno);
+                chunk_file.remove();
+            }
+        }
+    }
+
+    if (reflinks_supported && !reflinks)
+        mpl::log(mpl::Level::debug, category,
+                 fmt::format("{} cannot share extents with the store, only holes were punched",
+                             file_path.toStdString()));
+
+    manifests_dir.mkpath(".");
+    QSaveFile manifest{manifest_path_for(file_path)};
+    if (manifest.open(QIODevice::WriteOnly | QIODevice::Text))
+    {
+        QTextStream stream{&manifest};
+        stream << QFileInfo{file_path}.absoluteFilePath() << '\n' << file_stamp(QFileInfo{file_path}) << '\n';
+        stream << chunks.join('\n') << '\n';
+        stream.flush();
+        manifest.commit();
+    }
+
+    return reclaimed;
+}
+
+bool mp::ChunkStore::contains(const Path& file_path) const
+{
+    QFile manifest{manifest_path_for(file_path)};
+    if (!manifest.open(QIODevice::ReadOnly | QIODevice::Text))
+        return false;
+
+    // A file replaced since it was added has to be added again
+    manifest.readLine();
+    return QString::fromUtf8(manifest.readLine()).trimmed() == file_stamp(QFileInfo{file_path});
+}
+
+void mp::ChunkStore::remove(const Path& file_path)
+{
+    QFile::remove(manifest_path_for(file_path));
+}
+
+void mp::ChunkStore::collect_garbage()
+{
+    QSet<QString> referenced;
+    for (const auto& manifest_info : manifests_dir.entryInfoList(QDir::Files))
+    {
+        QFile manifest{manifest_info.filePath()};
+        if (!manifest.open(QIODevice::ReadOnly | QIODevice::Text))
+            return; // Better keep everything than remove chunks that may still be in use
+
+        manifest.readLine();
+        manifest.readLine();
+        while (!manifest.atEnd())
+            referenced.insert(QString::fromUtf8(manifest.readLine()).trimmed());
+    }
+
+    int removed{0};
+    QDirIterator it{chunks_dir.path(), QDir::Files, QDirIterator::Subdirectories};
+    while (it.hasNext())
+    {
+        const auto chunk_path = it.next();
+        if (!referenced.contains(it.fileName()) && QFile::remove(chunk_path))
+            ++removed;
+    }
+
+    if (removed > 0)
+        mpl::log(mpl::Level::debug, category, fmt::format("removed {} unreferenced chunks", removed));
+}
+
+QString mp::ChunkStore::manifest_path_for(const Path& file_path) const
+{
+    const auto absolute_path = QFileInfo{file_path}.absoluteFilePath();
+    return manifests_dir.filePath(QCryptographicHash::hash(absolute_path.toUtf8(), QCryptographicHash::Sha256).toHex());
+}
+
+QString mp::ChunkStore::chunk_path_for(const QString& digest) const
+{
+    return chunks_dir.filePath(QString("%1/%2").arg(digest.left(2)).arg(digest));
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MULTIPASS_CHUNK_STORE_H
+#define MULTIPASS_CHUNK_STORE_H
+
+#include <multipass/path.h>
+
+#include <QDir>
+
+#include <cstdint>
+
+namespace multipass
+{
+// Content-addressed store of fixed-size chunks shared between the files added to it.
+// Chunks are reflinked out of the files rather than copied, so on filesystems supporting it a file's data only
+// takes up space once no matter how many files contain it. Support is probed once, when the store is created;
+// elsewhere no chunks are kept at all and only zeroed chunks are reclaimed, as holes.
+class ChunkStore
+{
+public:
+    explicit ChunkStore(const Path& store_dir);
+
+    // Returns the number of bytes of the file that no longer take up space of their own
+    int64_t add(const Path& file_path);
+    bool contains(const Path& file_path) const;
+    void remove(const Path& file_path);
+
+    // Deletes the chunks no file references anymore
+    void collect_garbage();
+
+private:
+    QString manifest_path_for(const Path& file_path) const;
+    QString chunk_path_for(const QString& digest) const;
+
+    const QDir chunks_dir;
+    const QDir manifests_dir;
+    const bool reflinks_supported;
+};
+} // namespace multipass
+#endif // MULTIPASS_CHUNK_STORE_H
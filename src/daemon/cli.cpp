@@ -18,6 +18,7 @@
 #include "cli.h"
 
 #include <multipass/logging/standard_logger.h>
+#include <multipass/memory_size.h>
 #include <multipass/platform.h>
 #include <multipass/utils.h>
 
@@ -60,10 +61,35 @@ mp::DaemonConfigBuilder mp::cli::parse(const QCoreApplication& app)
                                       "specifies which address to use for the multipassd service;"
                                       " a socket can be specified using unix:<socket_file>",
                                       "server_name:port"};
+    QCommandLineOption image_cache_size_option{
+        "image-cache-size", "limits the disk space taken by cached source images; unlimited by default", "size"};
+    QCommandLineOption image_cache_high_watermark_option{
+        "image-cache-high-watermark",
+        "cached source images are evicted once they take more disk space than this; the cache size by default",
+        "size"};
+    QCommandLineOption image_cache_low_watermark_option{
+        "image-cache-low-watermark",
+        "evictions stop once cached source images take less disk space than this; 80% of the high watermark by "
+        "default",
+        "size"};
+    QCommandLineOption max_downloads_option{"max-downloads", "limits how many images are downloaded at once",
+                                            "count"};
+    QCommandLineOption background_download_rate_option{
+        "background-download-rate",
+        "limits the bandwidth per second taken by image refreshes in the background; unlimited by default", "size"};
+    QCommandLineOption stream_images_option{
+        "stream-images",
+        "boots new instances from their image while it downloads, fetching what they read first; QEMU backend only"};
 
     parser.addOption(logger_option);
     parser.addOption(verbosity_option);
     parser.addOption(address_option);
+    parser.addOption(image_cache_size_option);
+    parser.addOption(image_cache_high_watermark_option);
+    parser.addOption(image_cache_low_watermark_option);
+    parser.addOption(max_downloads_option);
+    parser.addOption(background_download_rate_option);
+    parser.addOption(stream_images_option);
 
     parser.process(app);
 
@@ -90,5 +116,31 @@ mp::DaemonConfigBuilder mp::cli::parse(const QCoreApplication& app)
         builder.server_address = address;
     }
 
+    if (parser.isSet(image_cache_size_option))
+        builder.image_cache_budget = mp::MemorySize{parser.value(image_cache_size_option).toStdString()}.in_bytes();
+
+    if (parser.isSet(image_cache_high_watermark_option))
+        builder.image_cache_high_watermark =
+            mp::MemorySize{parser.value(image_cache_high_watermark_option).toStdString()}.in_bytes();
+
+    if (parser.isSet(image_cache_low_watermark_option))
+        builder.image_cache_low_watermark =
+            mp::MemorySize{parser.value(image_cache_low_watermark_option).toStdString()}.in_bytes();
+
+    if (parser.isSet(max_downloads_option))
+    {
+        bool ok{false};
+        builder.download_limits.max_transfers = parser.value(max_downloads_option).toInt(&ok);
+        if (!ok || builder.download_limits.max_transfers < 1)
+            throw std::runtime_error(fmt::format("invalid maximum number of downloads '{}'",
+                                                 parser.value(max_downloads_option).toStdString()));
+    }
+
+    if (parser.isSet(background_download_rate_option))
+        builder.download_limits.background_bytes_per_second =
+            mp::MemorySize{parser.value(background_download_rate_option).toStdString()}.in_bytes();
+
+    builder.stream_images = parser.isSet(stream_images_option);
+
     return builder;
 }
@@ -21,23 +21,60 @@
 
 #include <fmt/format.h>
 
+#include <QRunnable>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <vector>
+
 namespace mp = multipass;
 namespace mpl = multipass::logging;
 
 namespace
 {
 constexpr auto category = "VMImageHost";
-}
+// Metadata requests are small, so they are bound by round trips rather than bandwidth
+constexpr std::size_t max_concurrent_fetches{8};
+
+class FetchTask : public QRunnable
+{
+public:
+    explicit FetchTask(const std::function<void()>& task) : task{task}
+    {
+    }
+
+    void run() override
+    {
+        task();
+    }
+
+private:
+    const std::function<void()> task;
+};
+} // namespace
 
 mp::CommonVMImageHost::CommonVMImageHost(std::chrono::seconds manifest_time_to_live)
   : manifest_time_to_live{manifest_time_to_live}, last_update{}
 {
+    // Fetch threads are kept for the lifetime of the host, so that the network connections of each carry over
+    // from one refresh to the next
+    fetch_pool.setMaxThreadCount(static_cast<int>(max_concurrent_fetches));
+    fetch_pool.setExpiryTimeout(-1);
+
     // careful: the functor below relies on polymorphic behavior, which is not available in constructors
     // fine here as the call is deferred to after the constructor is done (independently of connection type)
     QObject::connect(&manifest_single_shot, &QTimer::timeout, [this]() {
         try
         {
-            update_manifests();
+            std::lock_guard<std::mutex> lock{update_mutex};
+            if (refresh_restored_manifests)
+            {
+                refresh_restored_manifests = false;
+                need_extra_update = true;
+            }
+
+            start_refresh_if_stale();
         }
         catch (const std::exception& e)
         {
@@ -63,22 +100,111 @@ auto mp::CommonVMImageHost::info_for_full_hash(const std::string& full_hash) ->
     return info_for_full_hash_impl(full_hash);
 }
 
+void mp::CommonVMImageHost::wait_for_refresh()
+{
+    std::unique_lock<std::mutex> lock{update_mutex};
+    refreshed.wait(lock, [this] { return !refreshing; });
+}
+
 void mp::CommonVMImageHost::update_manifests()
+{
+    std::unique_lock<std::mutex> lock{update_mutex};
+    start_refresh_if_stale();
+
+    refreshed.wait(lock, [this] { return !refreshing || has_manifests(); });
+}
+
+void mp::CommonVMImageHost::on_manifest_update_failure(const std::string& details)
+{
+    {
+        std::lock_guard<std::mutex> lock{update_mutex};
+        need_extra_update = true;
+    }
+
+    mpl::log(mpl::Level::warning, category, fmt::format("Could not update manifest: {}", details));
+}
+
+void mp::CommonVMImageHost::on_manifests_restored()
+{
+    std::lock_guard<std::mutex> lock{update_mutex};
+    last_update = std::chrono::steady_clock::now();
+    need_extra_update = false;
+    refresh_restored_manifests = true;
+}
+
+// Expects the update mutex to be held. Requests that find the manifests expired together only start one refresh.
+void mp::CommonVMImageHost::start_refresh_if_stale()
 {
     const auto now = std::chrono::steady_clock::now();
-    if ((now - last_update) > manifest_time_to_live || need_extra_update)
+    if (!refreshing && ((now - last_update) > manifest_time_to_live || need_extra_update))
     {
         need_extra_update = false;
+        refreshing = true;
+
+        refresh = std::async(std::launch::async, [this, now] { refresh_manifests(now); });
+    }
+}
 
-        clear();
+void mp::CommonVMImageHost::refresh_manifests(std::chrono::steady_clock::time_point started)
+{
+    try
+    {
         fetch_manifests();
+    }
+    catch (const std::exception& e)
+    {
+        on_manifest_update_failure(e.what());
+    }
 
-        last_update = now;
+    {
+        std::lock_guard<std::mutex> lock{update_mutex};
+        last_update = started;
+        refreshing = false;
     }
+
+    refreshed.notify_all();
 }
 
-void mp::CommonVMImageHost::on_manifest_update_failure(const std::string& details)
+void mp::CommonVMImageHost::fetch_concurrently(std::size_t count, const std::function<void(std::size_t)>& fetch)
 {
-    need_extra_update = true;
-    mpl::log(mpl::Level::warning, category, fmt::format("Could not update manifest: {}", details));
+    std::vector<std::exception_ptr> errors(count);
+    std::atomic<std::size_t> next_fetch{0};
+
+    auto run_fetches = [&] {
+        for (auto i = next_fetch++; i < count; i = next_fetch++)
+        {
+            try
+            {
+                fetch(i);
+            }
+            catch (...)
+            {
+                errors[i] = std::current_exception();
+            }
+        }
+    };
+
+    // Not QThreadPool::waitForDone(), which also ends the pool's threads
+    std::mutex workers_mutex;
+    std::condition_variable workers_done;
+    auto workers_running = std::min(max_concurrent_fetches, count);
+    for (auto i = workers_running; i > 0; --i)
+    {
+        fetch_pool.start(new FetchTask{[&] {
+            run_fetches();
+
+            std::lock_guard<std::mutex> lock{workers_mutex};
+            if (--workers_running == 0)
+                workers_done.notify_all();
+        }});
+    }
+
+    std::unique_lock<std::mutex> lock{workers_mutex};
+    workers_done.wait(lock, [&workers_running] { return workers_running == 0; });
+
+    for (const auto& error : errors)
+    {
+        if (error)
+            std::rethrow_exception(error);
+    }
 }
@@ -20,13 +20,21 @@
 
 #include "multipass/vm_image_host.h"
 
+#include <QThreadPool>
 #include <QTimer>
 
 #include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <mutex>
 
 namespace multipass
 {
 
+// Manifests are refreshed in the background once they expire, readers being served the ones at hand meanwhile.
+// Derived hosts swap in new manifests as a whole, for readers on other threads to never see them half updated.
 class CommonVMImageHost : public VMImageHost
 {
 public:
@@ -34,20 +42,41 @@ public:
     void for_each_entry_do(const Action& action) final;
     VMImageInfo info_for_full_hash(const std::string& full_hash) final;
 
+    // Blocks until the refresh in flight, if any, is done. Derived hosts call this before they go, since the
+    // refresh calls back into them.
+    void wait_for_refresh();
+
 protected:
+    // Only waits for the manifests to be fetched when there are none to serve yet
     void update_manifests();
     void on_manifest_update_failure(const std::string& details);
+    // Restored manifests are served as if just fetched, until the refresh scheduled at construction replaces them
+    void on_manifests_restored();
 
     virtual void for_each_entry_do_impl(const Action& action) = 0;
     virtual VMImageInfo info_for_full_hash_impl(const std::string& full_hash) = 0;
-    virtual void clear() = 0;
+    // Called on a thread of its own, never concurrently with itself
     virtual void fetch_manifests() = 0;
+    virtual bool has_manifests() = 0;
+
+    // Runs fetch for every index up to count on the host's fetch threads, with a bounded number of them in flight at
+    // once. Returns when all are done, rethrowing the first exception any of them let through.
+    void fetch_concurrently(std::size_t count, const std::function<void(std::size_t)>& fetch);
 
 private:
+    void start_refresh_if_stale();
+    void refresh_manifests(std::chrono::steady_clock::time_point started);
+
     std::chrono::seconds manifest_time_to_live;
     std::chrono::steady_clock::time_point last_update;
     bool need_extra_update = true;
+    bool refresh_restored_manifests = false;
+    bool refreshing = false;
+    std::mutex update_mutex;
+    std::condition_variable refreshed;
     QTimer manifest_single_shot;
+    QThreadPool fetch_pool;
+    std::future<void> refresh;
 };
 
 }
@@ -27,6 +27,7 @@
 #include <QMap>
 #include <QUrl>
 
+#include <algorithm>
 #include <utility>
 
 namespace mp = multipass;
@@ -119,57 +120,52 @@ auto map_aliases_to_vm_info_for(const std::vector<mp::VMImageInfo>& images)
     return map;
 }
 
-auto full_image_info_for(const QMap<QString, CustomImageInfo>& custom_image_info, mp::URLDownloader* url_downloader,
-                         const QString& path_prefix)
+mp::VMImageInfo full_image_info_for(const QString& image_file, const CustomImageInfo& image_info,
+                                    mp::URLDownloader* url_downloader, const QString& path_prefix)
 {
-    std::vector<mp::VMImageInfo> default_images;
-
-    for (const auto& image_info : custom_image_info.toStdMap())
-    {
-        auto image_file = image_info.first;
-        QString image_url{
-            (path_prefix.isEmpty() ? image_info.second.url_prefix : QUrl::fromLocalFile(path_prefix).toString()) +
-            image_info.first};
-        QString hash_url{
-            (path_prefix.isEmpty() ? image_info.second.url_prefix : QUrl::fromLocalFile(path_prefix).toString()) +
-            QStringLiteral("SHA256SUMS")};
-
-        auto base_image_info = base_image_info_for(url_downloader, image_url, hash_url, image_file);
-        mp::VMImageInfo full_image_info{image_info.second.aliases,
-                                        image_info.second.os,
-                                        image_info.second.release,
-                                        image_info.second.release_string,
-                                        true,
-                                        image_url,
-                                        image_info.second.kernel_location,
-                                        image_info.second.initrd_location,
-                                        base_image_info.hash,
-                                        base_image_info.last_modified,
-                                        0};
-
-        default_images.push_back(full_image_info);
-    }
-
-    auto map = map_aliases_to_vm_info_for(default_images);
-
-    return std::unique_ptr<mp::CustomManifest>(new mp::CustomManifest{std::move(default_images), std::move(map)});
+    const auto url_prefix = path_prefix.isEmpty() ? image_info.url_prefix : QUrl::fromLocalFile(path_prefix).toString();
+    QString image_url{url_prefix + image_file};
+    QString hash_url{url_prefix + QStringLiteral("SHA256SUMS")};
+
+    auto base_image_info = base_image_info_for(url_downloader, image_url, hash_url, image_file);
+
+    return {image_info.aliases,
+            image_info.os,
+            image_info.release,
+            image_info.release_string,
+            true,
+            image_url,
+            image_info.kernel_location,
+            image_info.initrd_location,
+            base_image_info.hash,
+            base_image_info.last_modified,
+            0,
+            {}};
 }
 
 } // namespace
 
-mp::CustomVMImageHost::CustomVMImageHost(URLDownloader* downloader, std::chrono::seconds manifest_time_to_live)
-    : CustomVMImageHost{downloader, manifest_time_to_live, ""}
+mp::CustomVMImageHost::CustomVMImageHost(URLDownloader* downloader, std::chrono::seconds manifest_time_to_live,
+                                         const CatalogueCache& catalogue_cache)
+    : CustomVMImageHost{downloader, manifest_time_to_live, "", catalogue_cache}
 {
 }
 
 mp::CustomVMImageHost::CustomVMImageHost(URLDownloader* downloader, std::chrono::seconds manifest_time_to_live,
-                                         const QString& path_prefix)
+                                         const QString& path_prefix, const CatalogueCache& catalogue_cache)
     : CommonVMImageHost{manifest_time_to_live},
       url_downloader{downloader},
       path_prefix{path_prefix},
-      custom_image_info{},
-      remotes{no_remote, snapcraft_remote}
+      custom_image_info{std::make_shared<const CustomManifests>()},
+      remotes{no_remote, snapcraft_remote},
+      catalogue_cache{catalogue_cache}
 {
+    restore_catalogue();
+}
+
+mp::CustomVMImageHost::~CustomVMImageHost()
+{
+    wait_for_refresh();
 }
 
 mp::optional<mp::VMImageInfo> mp::CustomVMImageHost::info_for(const Query& query)
@@ -216,7 +212,7 @@ std::vector<mp::VMImageInfo> mp::CustomVMImageHost::all_images_for(const std::st
 
 void mp::CustomVMImageHost::for_each_entry_do_impl(const Action& action)
 {
-    for (const auto& manifest : custom_image_info)
+    for (const auto& manifest : *std::atomic_load(&custom_image_info))
     {
         for (const auto& info : manifest.second->products)
         {
@@ -232,32 +228,137 @@ std::vector<std::string> mp::CustomVMImageHost::supported_remotes()
 
 void mp::CustomVMImageHost::fetch_manifests()
 {
-    for (const auto& spec :
-         {std::make_pair(no_remote, multipass_image_info), std::make_pair(snapcraft_remote, snapcraft_image_info)})
+    const std::vector<std::pair<std::string, const QMap<QString, CustomImageInfo>*>> specs{
+        {no_remote, &multipass_image_info}, {snapcraft_remote, &snapcraft_image_info}};
+
+    // The images of all remotes are fetched together, each being a separate round of requests
+    std::vector<std::pair<std::size_t, QMap<QString, CustomImageInfo>::const_iterator>> images;
+    for (std::size_t i = 0; i < specs.size(); ++i)
     {
+        for (auto it = specs[i].second->cbegin(); it != specs[i].second->cend(); ++it)
+            images.emplace_back(i, it);
+    }
+
+    std::vector<std::unique_ptr<VMImageInfo>> image_infos(images.size());
+    fetch_concurrently(images.size(), [this, &images, &image_infos](std::size_t i) {
         try
         {
-            custom_image_info.emplace(spec.first, full_image_info_for(spec.second, url_downloader, path_prefix));
+            const auto& image = images[i].second;
+            image_infos[i].reset(
+                new VMImageInfo(full_image_info_for(image.key(), image.value(), url_downloader, path_prefix)));
         }
         catch (mp::DownloadException& e)
         {
+            // The manifest at hand keeps being served while the remote is unreachable
             on_manifest_update_failure(e.what());
         }
+    });
+
+    auto updated_image_info = *std::atomic_load(&custom_image_info);
+    auto fetched = false;
+
+    for (std::size_t i = 0; i < specs.size(); ++i)
+    {
+        std::vector<VMImageInfo> products;
+        auto complete = true;
+
+        for (std::size_t j = 0; j < images.size(); ++j)
+        {
+            if (images[j].first != i)
+                continue;
+
+            if (image_infos[j])
+                products.push_back(*image_infos[j]);
+            else
+                complete = false;
+        }
+
+        if (!complete)
+            continue;
+
+        auto map = map_aliases_to_vm_info_for(products);
+        updated_image_info[specs[i].first] =
+            std::shared_ptr<const CustomManifest>(new CustomManifest{std::move(products), std::move(map)});
+        fetched = true;
     }
+
+    if (fetched)
+    {
+        auto snapshot = std::make_shared<const CustomManifests>(std::move(updated_image_info));
+        std::atomic_store(&custom_image_info, snapshot);
+
+        save_catalogue(*snapshot);
+    }
+}
+
+bool mp::CustomVMImageHost::has_manifests()
+{
+    return !std::atomic_load(&custom_image_info)->empty();
+}
+
+void mp::CustomVMImageHost::restore_catalogue()
+{
+    CustomManifests restored_image_info;
+
+    const auto restored = catalogue_cache.load([this, &restored_image_info](QDataStream& stream) {
+        QSet<QString> strings;
+        quint32 manifest_count{0};
+        stream >> manifest_count;
+
+        for (quint32 i = 0; i < manifest_count && stream.status() == QDataStream::Ok; ++i)
+        {
+            QString remote_name;
+            quint32 product_count{0};
+            stream >> remote_name >> product_count;
+
+            std::vector<VMImageInfo> products;
+            for (quint32 j = 0; j < product_count && stream.status() == QDataStream::Ok; ++j)
+                products.push_back(read_image_info(stream, strings));
+
+            const auto name = remote_name.toStdString();
+            if (std::find(remotes.cbegin(), remotes.cend(), name) == remotes.cend())
+                continue;
+
+            auto map = map_aliases_to_vm_info_for(products);
+            restored_image_info.emplace(
+                name, std::shared_ptr<const CustomManifest>(new CustomManifest{std::move(products), std::move(map)}));
+        }
+    });
+
+    if (!restored)
+        return;
+
+    const auto restored_count = restored_image_info.size();
+    std::atomic_store(&custom_image_info, std::make_shared<const CustomManifests>(std::move(restored_image_info)));
+
+    // Remotes missing from the catalogue are still waited on when first needed
+    if (restored_count == remotes.size())
+        on_manifests_restored();
 }
 
-void mp::CustomVMImageHost::clear()
+void mp::CustomVMImageHost::save_catalogue(const CustomManifests& saved_manifests)
 {
-    custom_image_info.clear();
+    catalogue_cache.save([&saved_manifests](QDataStream& stream) {
+        stream << static_cast<quint32>(saved_manifests.size());
+
+        for (const auto& manifest : saved_manifests)
+        {
+            stream << QString::fromStdString(manifest.first) << static_cast<quint32>(manifest.second->products.size());
+
+            for (const auto& product : manifest.second->products)
+                stream << product;
+        }
+    });
 }
 
-mp::CustomManifest* mp::CustomVMImageHost::manifest_from(const std::string& remote_name)
+std::shared_ptr<const mp::CustomManifest> mp::CustomVMImageHost::manifest_from(const std::string& remote_name)
 {
     update_manifests();
 
-    auto it = custom_image_info.find(remote_name);
-    if (it == custom_image_info.end())
+    const auto snapshot = std::atomic_load(&custom_image_info);
+    auto it = snapshot->find(remote_name);
+    if (it == snapshot->end())
         throw std::runtime_error(fmt::format("Remote \"{}\" is unknown or unreachable.", remote_name));
 
-    return it->second.get();
+    return it->second;
 }
@@ -18,6 +18,7 @@
 #ifndef MULTIPASS_CUSTOM_IMAGE_HOST
 #define MULTIPASS_CUSTOM_IMAGE_HOST
 
+#include "catalogue_cache.h"
 #include "common_image_host.h"
 
 #include <QString>
@@ -40,9 +41,12 @@ struct CustomManifest
 class CustomVMImageHost final : public CommonVMImageHost
 {
 public:
-    CustomVMImageHost(URLDownloader* downloader, std::chrono::seconds manifest_time_to_live);
+    CustomVMImageHost(URLDownloader* downloader, std::chrono::seconds manifest_time_to_live,
+                      const CatalogueCache& catalogue_cache = {});
     // For testing
-    CustomVMImageHost(URLDownloader* downloader, std::chrono::seconds manifest_time_to_live, const QString& path_prefix);
+    CustomVMImageHost(URLDownloader* downloader, std::chrono::seconds manifest_time_to_live, const QString& path_prefix,
+                      const CatalogueCache& catalogue_cache = {});
+    ~CustomVMImageHost();
 
     optional<VMImageInfo> info_for(const Query& query) override;
     std::vector<VMImageInfo> all_info_for(const Query& query) override;
@@ -53,15 +57,21 @@ protected:
     void for_each_entry_do_impl(const Action& action) override;
     VMImageInfo info_for_full_hash_impl(const std::string& full_hash) override;
     void fetch_manifests() override;
-    void clear() override;
+    bool has_manifests() override;
 
 private:
-    CustomManifest* manifest_from(const std::string& remote_name);
+    using CustomManifests = std::unordered_map<std::string, std::shared_ptr<const CustomManifest>>;
+
+    void restore_catalogue();
+    void save_catalogue(const CustomManifests& saved_manifests);
+    std::shared_ptr<const CustomManifest> manifest_from(const std::string& remote_name);
 
     URLDownloader* const url_downloader;
     const QString path_prefix;
-    std::unordered_map<std::string, std::unique_ptr<CustomManifest>> custom_image_info;
+    // Replaced as a whole whenever a manifest changes, and only ever accessed atomically
+    std::shared_ptr<const CustomManifests> custom_image_info;
     std::vector<std::string> remotes;
+    const CatalogueCache catalogue_cache;
 };
 } // namespace multipass
 #endif // MULTIPASS_CUSTOM_IMAGE_HOST
@@ -54,6 +54,7 @@
 #include <QtConcurrent/QtConcurrent>
 
 #include <cassert>
+#include <cstdlib>
 #include <functional>
 #include <stdexcept>
 #include <unordered_set>
@@ -99,7 +100,8 @@ mp::Query query_from(const mp::LaunchRequest* request, const std::string& name)
 auto make_cloud_init_vendor_config(const mp::SSHKeyProvider& key_provider, const std::string& time_zone,
                                    const std::string& username)
 {
-    auto ssh_key_line = fmt::format("ssh-rsa {} multipass@localhost", key_provider.public_key_as_base64());
+    auto ssh_key_line = fmt::format("{} {} multipass@localhost", key_provider.public_key_type(),
+                                    key_provider.public_key_as_base64());
 
     auto config = YAML::Load(mp::base_cloud_init_config);
     config["ssh_authorized_keys"].push_back(ssh_key_line);
@@ -541,6 +543,18 @@ grpc::Status ssh_reboot(const std::string& hostname, int port, const std::string
     return grpc::Status::OK;
 }
 
+std::string legacy_private_key_as_base64(const mp::SSHKeyProvider& key_provider)
+{
+    char* base64{nullptr};
+    auto ret = ssh_pki_export_privkey_base64(key_provider.legacy_private_key(), nullptr, nullptr, nullptr, &base64);
+    std::unique_ptr<char, decltype(std::free)*> base64_output{base64, std::free};
+
+    if (ret != SSH_OK)
+        throw std::runtime_error("unable to export legacy private key as base64");
+
+    return {base64};
+}
+
 } // namespace
 
 mp::Daemon::Daemon(std::unique_ptr<const DaemonConfig> the_config)
@@ -714,6 +728,7 @@ catch (const mp::StartException& e)
 
     release_resources(name);
     vm_instances.erase(name);
+    ssh_key_checked_instances.erase(name);
     persist_instances();
 
     status_promise->set_value(grpc::Status(grpc::StatusCode::ABORTED, e.what(), ""));
@@ -1332,10 +1347,30 @@ try // clang-format on
             }
         }
 
+        // The client only gets one key, so make sure instances from before the key switch accept the current one.
+        // That is only worth a try: the client gets the legacy key if the instance could not be migrated.
+        auto private_key = config->ssh_key_provider->private_key_as_base64();
+        if (config->ssh_key_provider->legacy_private_key() &&
+            ssh_key_checked_instances.find(name) == ssh_key_checked_instances.end())
+        {
+            try
+            {
+                mp::SSHSession{vm->ssh_hostname(), vm->ssh_port(), vm->ssh_username(), *config->ssh_key_provider};
+                ssh_key_checked_instances.insert(name);
+            }
+            catch (const std::exception& e)
+            {
+                mpl::log(mpl::Level::warning, category,
+                         fmt::format("could not check the ssh key of \"{}\", falling back to the legacy key: {}", name,
+                                     e.what()));
+                private_key = legacy_private_key_as_base64(*config->ssh_key_provider);
+            }
+        }
+
         mp::SSHInfo ssh_info;
         ssh_info.set_host(vm->ssh_hostname());
         ssh_info.set_port(vm->ssh_port());
-        ssh_info.set_priv_key_base64(config->ssh_key_provider->private_key_as_base64());
+        ssh_info.set_priv_key_base64(private_key);
         ssh_info.set_username(vm->ssh_username());
         (*response.mutable_ssh_info())[name] = ssh_info;
     }
@@ -1548,6 +1583,7 @@ try // clang-format on
             }
 
             vm_instances.erase(name);
+            ssh_key_checked_instances.erase(name);
         }
 
         if (purge)
@@ -1859,6 +1895,7 @@ void mp::Daemon::create_vm(const CreateRequest* request, grpc::ServerWriter<Crea
                 auto vm_desc = prepare_future_watcher->future().result();
 
                 vm_instances[name] = config->factory->create_virtual_machine(vm_desc, *this);
+                ssh_key_checked_instances.erase(name);
                 vm_instance_specs[name] = {vm_desc.num_cores,
                                            vm_desc.mem_size,
                                            vm_desc.disk_space,
@@ -30,6 +30,7 @@
 #include <multipass/ssl_cert_provider.h>
 #include <multipass/utils.h>
 
+#include <QDir>
 #include <QStandardPaths>
 
 #include <chrono>
@@ -75,19 +76,21 @@ std::unique_ptr<const mp::DaemonConfig> mp::DaemonConfigBuilder::build()
     if (data_directory.isEmpty())
         data_directory = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
     if (url_downloader == nullptr)
-        url_downloader = std::make_unique<URLDownloader>(cache_directory, std::chrono::seconds{10});
+        url_downloader = std::make_unique<URLDownloader>(cache_directory, std::chrono::seconds{10}, download_limits);
     if (factory == nullptr)
         factory = platform::vm_backend(data_directory);
     if (update_prompt == nullptr)
         update_prompt = platform::make_update_prompt();
     if (image_hosts.empty())
     {
-        image_hosts.push_back(std::make_unique<mp::CustomVMImageHost>(url_downloader.get(), manifest_ttl));
+        const QDir catalogue_dir{mp::utils::make_dir(cache_directory, "catalogues")};
+        image_hosts.push_back(std::make_unique<mp::CustomVMImageHost>(
+            url_downloader.get(), manifest_ttl, CatalogueCache{catalogue_dir.filePath("custom.catalogue")}));
         image_hosts.push_back(std::make_unique<mp::UbuntuVMImageHost>(
             std::vector<std::pair<std::string, std::string>>{
                 {mp::release_remote, "http://cloud-images.ubuntu.com/releases/"},
                 {mp::daily_remote, "http://cloud-images.ubuntu.com/daily/"}},
-            url_downloader.get(), manifest_ttl));
+            url_downloader.get(), manifest_ttl, CatalogueCache{catalogue_dir.filePath("ubuntu.catalogue")}));
     }
     if (vault == nullptr)
     {
@@ -96,8 +99,21 @@ std::unique_ptr<const mp::DaemonConfig> mp::DaemonConfigBuilder::build()
         {
             hosts.push_back(image.get());
         }
+        auto create_overlay = [factory = factory.get()](const Path& base_image_path, const Path& instance_image_path) {
+            return factory->create_instance_overlay(base_image_path, instance_image_path);
+        };
+        auto rebase_overlay = [factory = factory.get()](const Path& base_image_path, const Path& instance_image_path) {
+            return factory->rebase_instance_overlay(base_image_path, instance_image_path);
+        };
+        if (stream_images && !factory->can_boot_from_streamed_images())
+        {
+            mpl::log(mpl::Level::warning, "daemon", "This backend cannot boot instances from streamed images");
+            stream_images = false;
+        }
         vault = std::make_unique<DefaultVMImageVault>(hosts, url_downloader.get(), cache_directory, data_directory,
-                                                      days_to_expire);
+                                                      days_to_expire, create_overlay, image_cache_budget,
+                                                      rebase_overlay, stream_images, image_cache_low_watermark,
+                                                      image_cache_high_watermark);
     }
     if (name_generator == nullptr)
         name_generator = mp::make_default_name_generator();
@@ -21,6 +21,7 @@
 #include <multipass/cert_provider.h>
 #include <multipass/cert_store.h>
 #include <multipass/days.h>
+#include <multipass/download_scheduler.h>
 #include <multipass/logging/logger.h>
 #include <multipass/logging/multiplexing_logger.h>
 #include <multipass/name_generator.h>
@@ -34,6 +35,7 @@
 #include <multipass/vm_image_host.h>
 #include <multipass/vm_image_vault.h>
 
+#include <cstdint>
 #include <memory>
 #include <vector>
 
@@ -78,6 +80,12 @@ struct DaemonConfigBuilder
     std::string ssh_username;
     multipass::days days_to_expire{14};
     std::chrono::hours image_refresh_timer{6};
+    int64_t image_cache_budget{0};
+    // Zero for the vault's defaults
+    int64_t image_cache_low_watermark{0};
+    int64_t image_cache_high_watermark{0};
+    bool stream_images{false};
+    DownloadScheduler::Limits download_limits{4, 0};
     multipass::logging::Level verbosity_level{multipass::logging::Level::info};
     RpcConnectionType connection_type{RpcConnectionType::ssl};
 
@@ -18,24 +18,40 @@
 #include "default_vm_image_vault.h"
 #include "json_writer.h"
 
+#include <multipass/delta_sync.h>
+#include <multipass/download_scheduler.h>
+#include <multipass/image_decoder.h>
 #include <multipass/logging/log.h>
+#include <multipass/optional.h>
 #include <multipass/platform.h>
+#include <multipass/qcow2_writer.h>
 #include <multipass/query.h>
+#include <multipass/exceptions/download_exception.h>
 #include <multipass/rpc/multipass.grpc.pb.h>
+#include <multipass/sha256.h>
 #include <multipass/url_downloader.h>
 #include <multipass/utils.h>
 #include <multipass/vm_image.h>
-#include <multipass/xz_image_decoder.h>
 
 #include <fmt/format.h>
 
 #include <QCryptographicHash>
+#include <QDirIterator>
 #include <QJsonArray>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QUrl>
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <exception>
+#include <future>
+#include <mutex>
+#include <thread>
+
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace mp = multipass;
 namespace mpl = multipass::logging;
@@ -43,8 +59,12 @@ namespace mpl = multipass::logging;
 namespace
 {
 constexpr auto category = "image vault";
+constexpr auto stream_socket_name = "streams.sock";
+constexpr std::chrono::minutes stream_retry_interval{1};
 constexpr auto instance_db_name = "multipassd-instance-image-records.json";
 constexpr auto image_db_name = "multipassd-image-records.json";
+// Marks the records of custom images replaced by a newer version while instances were still layered on them
+constexpr auto superseded_marker = "-superseded-";
 
 auto filename_for(const QString& path)
 {
@@ -91,6 +111,8 @@ auto record_to_json(const mp::VaultRecord& record)
     json.insert("image", image_to_json(record.image));
     json.insert("query", query_to_json(record.query));
     json.insert("last_accessed", static_cast<qint64>(record.last_accessed.time_since_epoch().count()));
+    json.insert("backing_image_path", record.backing_image_path);
+    json.insert("stream_url", record.stream_url);
     return json;
 }
 
@@ -166,7 +188,9 @@ std::unordered_map<std::string, mp::VaultRecord> load_db(const QString& db_name)
         reconstructed_records[key] = {
             {image_path, kernel_path, initrd_path, image_id, original_release, current_release, release_date, aliases},
             {"", release.toStdString(), persistent.toBool(), remote_name.toStdString(), query_type},
-            last_accessed};
+            last_accessed,
+            record["backing_image_path"].toString(),
+            record["stream_url"].toString()};
     }
     return reconstructed_records;
 }
@@ -186,6 +210,28 @@ QString copy(const QString& file_name, const QDir& output_dir)
     return new_path;
 }
 
+constexpr int64_t default_low_watermark_percent{80};
+
+// Counts allocated blocks rather than file sizes, images are mostly sparse
+int64_t disk_usage_of(const QString& dir_path)
+{
+    int64_t usage{0};
+    QDirIterator it{dir_path, QDir::Files | QDir::Hidden, QDirIterator::Subdirectories};
+    while (it.hasNext())
+    {
+        struct stat file_stat;
+        if (::stat(QFile::encodeName(it.next()).constData(), &file_stat) == 0)
+            usage += static_cast<int64_t>(file_stat.st_blocks) * 512;
+    }
+
+    return usage;
+}
+
+bool is_superseded(const std::string& key)
+{
+    return key.find(superseded_marker) != std::string::npos;
+}
+
 void delete_file(const QString& path)
 {
     QFile file{path};
@@ -203,25 +249,157 @@ void remove_source_images(const mp::VMImage& source_image, const mp::VMImage& pr
         delete_file(source_image.initrd_path);
 }
 
-void verify_image_download(const mp::Path& image_path, const std::string& image_hash)
+// Hashes and decodes a compressed image while it is being downloaded, so the download finishes verified and
+// extracted in a single pass instead of being read back from disk twice afterwards
+class ImageDownloadPipeline : public mp::URLDownloader::DataSink
 {
-    QFile image_file(image_path);
-    if (!image_file.open(QFile::ReadOnly))
+public:
+    ImageDownloadPipeline(const mp::Path& image_path, bool compute_hash)
+        : image_path{image_path}, decoded_image_path{mp::decoded_path_for(image_path)}, compute_hash{compute_hash}
     {
-        throw std::runtime_error("Cannot open image file for computing hash");
+        if (!decoded_image_path.isEmpty())
+            decoder = std::thread{[this] { decode(); }};
     }
 
-    QCryptographicHash hash(QCryptographicHash::Sha256);
-    if (!hash.addData(&image_file))
+    ~ImageDownloadPipeline()
     {
-        throw std::runtime_error("Cannot read image file to compute hash");
+        close();
     }
 
-    if (hash.result().toHex().toStdString() != image_hash)
+    bool write(const char* data, int64_t size) override
     {
-        throw std::runtime_error("Downloaded image hash does not match");
+        if (compute_hash)
+            hash.add_data(data, size);
+
+        if (!decoder.joinable())
+            return true;
+
+        std::unique_lock<std::mutex> lock{mutex};
+        space_available.wait(lock, [this] { return pending_bytes < max_pending_bytes || decoder_failed; });
+        if (decoder_failed)
+            return false;
+
+        pending.emplace_back(data, static_cast<int>(size));
+        pending_bytes += size;
+        data_available.notify_one();
+
+        return true;
     }
-}
+
+    // Only the hash can carry on from a resumed download, the decoder has to see the whole stream again
+    QByteArray checkpoint() const override
+    {
+        return compute_hash && !decoder.joinable() ? hash.state() : QByteArray{};
+    }
+
+    bool restore(const QByteArray& state) override
+    {
+        if (decoder.joinable())
+            return false;
+
+        return !compute_hash || hash.restore(state);
+    }
+
+    // Waits for the decoder to catch up and rethrows whatever error it ran into
+    void finish()
+    {
+        close();
+
+        if (decoder_error)
+            std::rethrow_exception(decoder_error);
+    }
+
+    void verify(const std::string& image_hash)
+    {
+        if (hash.hex_result() != image_hash)
+            throw std::runtime_error("Downloaded image hash does not match");
+    }
+
+private:
+
+    void close()
+    {
+        if (!decoder.joinable())
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            closed = true;
+        }
+        data_available.notify_one();
+        decoder.join();
+    }
+
+    void decode()
+    {
+        try
+        {
+            // Writing the decoded image as qcow2 saves converting a raw copy of it when preparing the image
+            mp::Qcow2Writer decoded_file{decoded_image_path};
+            if (!decoded_file.open(QIODevice::WriteOnly))
+                throw std::runtime_error(
+                    fmt::format("failed to open {} for writing", decoded_image_path.toStdString()));
+
+            mp::ImageDecoder::UPtr image_decoder;
+            auto stream_ended = false;
+            while (true)
+            {
+                QByteArray chunk;
+                {
+                    std::unique_lock<std::mutex> lock{mutex};
+                    data_available.wait(lock, [this] { return !pending.empty() || closed; });
+                    if (pending.empty())
+                        break;
+
+                    chunk = pending.front();
+                    pending.pop_front();
+                    pending_bytes -= chunk.size();
+                }
+                space_available.notify_one();
+
+                // The format is told by the data itself, an extension may be misleading
+                if (!image_decoder)
+                    image_decoder = mp::make_image_decoder(chunk, image_path);
+
+                // Anything after the end of the stream is padding
+                if (!stream_ended && !image_decoder->decode_chunk(chunk.constData(), chunk.size(), decoded_file))
+                    stream_ended = true;
+            }
+
+            if (!image_decoder)
+                image_decoder = mp::make_image_decoder(QByteArray{}, image_path);
+
+            image_decoder->finish(decoded_file);
+            decoded_file.finish();
+        }
+        catch (...)
+        {
+            {
+                std::lock_guard<std::mutex> lock{mutex};
+                decoder_error = std::current_exception();
+                decoder_failed = true;
+            }
+            space_available.notify_one();
+        }
+    }
+
+    static constexpr int64_t max_pending_bytes{16 * 1024 * 1024};
+
+    const mp::Path image_path;
+    const mp::Path decoded_image_path;
+    const bool compute_hash;
+    mp::Sha256 hash;
+
+    std::thread decoder;
+    std::mutex mutex;
+    std::condition_variable data_available;
+    std::condition_variable space_available;
+    std::deque<QByteArray> pending;
+    int64_t pending_bytes{0};
+    bool closed{false};
+    bool decoder_failed{false};
+    std::exception_ptr decoder_error;
+};
 
 class DeleteOnException
 {
@@ -237,13 +415,143 @@ public:
         }
     }
 
+    void keep()
+    {
+        file.setFileName({});
+    }
+
 private:
     QFile file;
 };
+
+void download_through(mp::URLDownloader* url_downloader, ImageDownloadPipeline& pipeline, const QUrl& url,
+                      const mp::Path& image_path, int64_t size, DeleteOnException& image_file,
+                      const mp::ProgressMonitor& monitor)
+{
+    try
+    {
+        url_downloader->download_to(url, image_path, size, mp::LaunchProgress::IMAGE, monitor, &pipeline);
+    }
+    catch (const mp::DownloadException&)
+    {
+        // The downloader only leaves the partial file behind when a later attempt can resume it
+        if (QFileInfo::exists(image_path))
+            image_file.keep();
+
+        // A decoder failure aborts the download, report that rather than the aborted transfer
+        pipeline.finish();
+        throw;
+    }
+    catch (const std::exception&)
+    {
+        pipeline.finish();
+        throw;
+    }
+
+    if (!QFileInfo::exists(image_path))
+        throw std::runtime_error("Downloaded image file is missing");
+
+    pipeline.finish();
+}
+
+// Fetches a new version of an image reusing the blocks it shares with an older one, as zsync does: the block
+// checksums the remote publishes for the image tell which of its blocks the older version has, and only the others are
+// downloaded, with range requests. Returns false when the image has to be downloaded whole, a partial file only
+// being left behind for that download to resume.
+bool download_delta(mp::URLDownloader* url_downloader, const QString& image_url, const QString& signature_url,
+                    const mp::Path& basis_path, const mp::Path& image_path, const std::string& image_hash,
+                    const mp::ProgressMonitor& monitor)
+{
+    try
+    {
+        const auto signature = mp::delta_sync::parse_file_signature(url_downloader->download(signature_url));
+        const auto block_size = signature.signature.block_size;
+
+        std::vector<mp::URLDownloader::ByteRange> present;
+        int64_t present_bytes{0};
+        {
+            QFile basis{basis_path};
+            QFile image{image_path};
+            if (!basis.open(QIODevice::ReadOnly) || basis.size() <= 0)
+                return false;
+            if (!image.open(QIODevice::WriteOnly | QIODevice::Truncate) || !image.resize(signature.length))
+                throw std::runtime_error(fmt::format("failed to create {}", image_path.toStdString()));
+
+            const auto basis_data = reinterpret_cast<const char*>(basis.map(0, basis.size()));
+            if (!basis_data)
+                return false;
+
+            const auto offsets = mp::delta_sync::locate_blocks(basis_data, basis.size(), signature);
+            for (std::size_t i = 0; i < offsets.size(); ++i)
+            {
+                if (offsets[i] < 0)
+                    continue;
+
+                const auto start = static_cast<int64_t>(i) * block_size;
+                const auto size = std::min(block_size, signature.length - start);
+                if (::pwrite(image.handle(), basis_data + offsets[i], size, start) != size)
+                    throw std::runtime_error(fmt::format("failed to write {}", image_path.toStdString()));
+
+                if (!present.empty() && present.back().end == start)
+                    present.back().end += size;
+                else
+                    present.push_back({start, start + size});
+                present_bytes += size;
+            }
+        }
+
+        mpl::log(mpl::Level::info, category,
+                 fmt::format("Reusing {} of the {} bytes of {} from {}", present_bytes, signature.length,
+                             image_url.toStdString(), basis_path.toStdString()));
+
+        ImageDownloadPipeline pipeline{{}, true};
+        url_downloader->download_missing_to(image_url, image_path, present, mp::LaunchProgress::IMAGE, monitor,
+                                            &pipeline);
+        pipeline.finish();
+
+        monitor(mp::LaunchProgress::VERIFY, -1);
+        pipeline.verify(image_hash);
+
+        return true;
+    }
+    catch (const mp::DownloadException& e)
+    {
+        mpl::log(mpl::Level::info, category, fmt::format("Cannot download {} by delta: {}", image_url.toStdString(),
+                                                         e.what()));
+    }
+    catch (const std::exception& e)
+    {
+        mpl::log(mpl::Level::info, category, fmt::format("Cannot download {} by delta: {}", image_url.toStdString(),
+                                                         e.what()));
+        QFile::remove(image_path);
+    }
+
+    return false;
+}
+
 } // namespace
 
+struct mp::DefaultVMImageVault::InFlightFetch
+{
+    std::condition_variable finished;
+    bool done{false};
+    VMImage image;
+    std::exception_ptr error;
+    std::vector<ProgressMonitor> followers;
+};
+
+struct mp::DefaultVMImageVault::PendingStream
+{
+    Query query;
+    // Where the stream is kept once back, for the reads that waited for it
+    std::shared_ptr<std::shared_ptr<ImageStream>> stream;
+};
+
 mp::DefaultVMImageVault::DefaultVMImageVault(std::vector<VMImageHost*> image_hosts, URLDownloader* downloader,
-                                             mp::Path cache_dir_path, mp::Path data_dir_path, mp::days days_to_expire)
+                                             mp::Path cache_dir_path, mp::Path data_dir_path, mp::days days_to_expire,
+                                             OverlayAction create_overlay, int64_t cache_budget,
+                                             RebaseAction rebase_overlay, bool stream_images,
+                                             int64_t cache_low_watermark, int64_t cache_high_watermark)
     : image_hosts{image_hosts},
       url_downloader{downloader},
       cache_dir{QDir(cache_dir_path).filePath("vault")},
@@ -251,9 +559,25 @@ mp::DefaultVMImageVault::DefaultVMImageVault(std::vector<VMImageHost*> image_hos
       instances_dir(data_dir.filePath("instances")),
       images_dir(cache_dir.filePath("images")),
       days_to_expire{days_to_expire},
+      create_overlay{create_overlay},
+      cache_budget{cache_budget},
+      cache_high_watermark{cache_high_watermark > 0 ? cache_high_watermark : cache_budget},
+      cache_low_watermark{cache_low_watermark > 0 ? cache_low_watermark
+                                                  : this->cache_high_watermark * default_low_watermark_percent / 100},
+      rebase_overlay{rebase_overlay},
+      stream_images{stream_images},
+      chunk_store{cache_dir.filePath("chunks")},
       prepared_image_records{load_db(cache_dir.filePath(image_db_name))},
       instance_image_records{load_db(data_dir.filePath(instance_db_name))}
 {
+    if (cache_budget <= 0 && (cache_low_watermark > 0 || cache_high_watermark > 0))
+        throw std::runtime_error("image cache watermarks need an image cache budget");
+
+    if (this->cache_low_watermark > this->cache_high_watermark || this->cache_high_watermark > cache_budget)
+        throw std::runtime_error(fmt::format("invalid image cache watermarks: the low one ({} bytes) cannot be over "
+                                             "the high one ({} bytes), nor that over the budget ({} bytes)",
+                                             this->cache_low_watermark, this->cache_high_watermark, cache_budget));
+
     for (const auto& image_host : image_hosts)
     {
         for (const auto& remote : image_host->supported_remotes())
@@ -261,17 +585,40 @@ mp::DefaultVMImageVault::DefaultVMImageVault(std::vector<VMImageHost*> image_hos
             remote_image_host_map[remote] = image_host;
         }
     }
+
+    resume_streamed_instances();
+}
+
+mp::DefaultVMImageVault::~DefaultVMImageVault()
+{
+    {
+        std::lock_guard<std::mutex> lock{stream_mutex};
+        stopping_streams = true;
+        for (const auto& stream : image_streams)
+            stream.second->cancel();
+    }
+    streams_stopped.notify_all();
+    streams_resumed.notify_all();
+
+    if (stream_resumption.valid())
+        stream_resumption.wait();
+
+    for (auto& fill : stream_fills)
+        fill.wait();
 }
 
 mp::VMImage mp::DefaultVMImageVault::fetch_image(const FetchType& fetch_type, const Query& query,
                                                  const PrepareAction& prepare, const ProgressMonitor& monitor)
 {
-    auto name_entry = instance_image_records.find(query.name);
-    if (name_entry != instance_image_records.end())
     {
-        const auto& record = name_entry->second;
+        std::lock_guard<std::mutex> lock{fetch_mutex};
+        auto name_entry = instance_image_records.find(query.name);
+        if (name_entry != instance_image_records.end())
+        {
+            const auto& record = name_entry->second;
 
-        return record.image;
+            return record.image;
+        }
     }
 
     if (query.query_type != Query::Type::Alias)
@@ -280,18 +627,19 @@ mp::VMImage mp::DefaultVMImageVault::fetch_image(const FetchType& fetch_type, co
             throw std::runtime_error(fmt::format("http and file based images are not supported"));
 
         QUrl image_url(QString::fromStdString(query.release));
-        VMImage source_image, vm_image;
 
         if (image_url.isLocalFile())
         {
+            VMImage source_image;
             if (!QFile::exists(image_url.path()))
                 throw std::runtime_error(
                     fmt::format("Custom image `{}` does not exist.", image_url.path().toStdString()));
             source_image.image_path = image_url.path();
 
-            if (source_image.image_path.endsWith(".xz"))
+            auto image_decoder = mp::make_image_decoder(source_image.image_path);
+            if (image_decoder)
             {
-                source_image = extract_image_from(query.name, source_image, monitor);
+                source_image = extract_image_from(query.name, source_image, *image_decoder, monitor);
             }
             else
             {
@@ -307,77 +655,116 @@ mp::VMImage mp::DefaultVMImageVault::fetch_image(const FetchType& fetch_type, co
                                                        QFileInfo(source_image.image_path).absoluteDir(), monitor);
             }
 
-            vm_image = prepare(source_image);
+            auto vm_image = prepare(source_image);
             remove_source_images(source_image, vm_image);
+
+            std::lock_guard<std::mutex> lock{fetch_mutex};
+            instance_image_records[query.name] = {vm_image, query, std::chrono::system_clock::now(), {}, {}};
+            persist_instance_records();
+
+            return vm_image;
         }
-        else
-        {
-            // Generate a sha256 hash based on the URL and use that for the id
-            auto hash =
-                QCryptographicHash::hash(query.release.c_str(), QCryptographicHash::Sha256).toHex().toStdString();
-            auto last_modified = url_downloader->last_modified(image_url);
 
+        // Generate a sha256 hash based on the URL and use that for the id
+        auto hash = QCryptographicHash::hash(query.release.c_str(), QCryptographicHash::Sha256).toHex().toStdString();
+        auto last_modified = url_downloader->last_modified(image_url);
+
+        {
+            std::unique_lock<std::mutex> lock{fetch_mutex};
             auto entry = prepared_image_records.find(hash);
-            if (entry != prepared_image_records.end())
+            if (entry != prepared_image_records.end() && last_modified.isValid() &&
+                last_modified.toString().toStdString() == entry->second.image.release_date &&
+                images_being_evicted.find(hash) == images_being_evicted.end())
+            {
+                entry->second.last_accessed = std::chrono::system_clock::now();
+                persist_image_records();
+                ++images_in_use[hash];
+                const auto prepared_image = entry->second.image;
+                lock.unlock();
+
+                return instance_image_for(hash, query, prepared_image);
+            }
+        }
+
+        const auto prepared_image = fetch_once(hash, monitor, [&](const ProgressMonitor& shared_monitor) {
+            VMImage source_image;
             {
-                auto& record = entry->second;
+                std::lock_guard<std::mutex> lock{fetch_mutex};
+                auto entry = prepared_image_records.find(hash);
 
-                if (last_modified.isValid() && (last_modified.toString().toStdString() == record.image.release_date))
+                // The stale image cannot be refreshed in place while instances are layered on top of it
+                if (entry != prepared_image_records.end() && !backs_instances(entry->second.image.image_path))
                 {
-                    auto vm_image = image_instance_from(query.name, record.image);
-                    instance_image_records[query.name] = {vm_image, query, std::chrono::system_clock::now()};
-                    persist_instance_records();
-                    record.last_accessed = std::chrono::system_clock::now();
-                    persist_image_records();
-                    return vm_image;
+                    source_image = entry->second.image;
                 }
                 else
                 {
-                    source_image = record.image;
+                    const auto image_filename = filename_for(image_url.path());
+                    const auto decoded_filename = decoded_path_for(image_filename);
+                    // Attempt to make a sane directory name based on the filename of the image
+                    auto image_dir_name =
+                        QString("%1-%2")
+                            .arg((decoded_filename.isEmpty() ? image_filename : decoded_filename).section(".", 0, -2))
+                            .arg(last_modified.toString("yyyyMMdd"));
+                    const QDir same_day_dir{images_dir.filePath(image_dir_name)};
+                    if (std::any_of(prepared_image_records.cbegin(), prepared_image_records.cend(),
+                                    [&same_day_dir](const auto& record) {
+                                        return QFileInfo{record.second.image.image_path}.dir() == same_day_dir;
+                                    }))
+                        image_dir_name += last_modified.toString("-hhmmss");
+                    const QDir image_dir{mp::utils::make_dir(images_dir, image_dir_name)};
+
+                    source_image.id = hash;
+                    source_image.image_path = image_dir.filePath(image_filename);
                 }
             }
-            else
-            {
-                const auto image_filename = filename_for(image_url.path());
-                // Attempt to make a sane directory name based on the filename of the image
-                const auto image_dir_name = QString("%1-%2")
-                                          .arg(image_filename.section(".", 0, image_filename.endsWith(".xz") ? -3 : -2))
-                                          .arg(last_modified.toString("yyyyMMdd"));
-                const QDir image_dir{mp::utils::make_dir(images_dir, image_dir_name)};
-
-                source_image.id = hash;
-                source_image.image_path = image_dir.filePath(image_filename);
-            }
 
+            const auto decoded_image_path = decoded_path_for(source_image.image_path);
             DeleteOnException image_file{source_image.image_path};
-            url_downloader->download_to(image_url, source_image.image_path, 0, LaunchProgress::IMAGE, monitor);
+            DeleteOnException decoded_image_file{decoded_image_path};
+
+            ImageDownloadPipeline pipeline{source_image.image_path, false};
+            download_through(url_downloader, pipeline, image_url, source_image.image_path, 0, image_file,
+                             shared_monitor);
 
             if (fetch_type == FetchType::ImageKernelAndInitrd)
             {
                 Query kernel_query{query.name, "default", false, "", Query::Type::Alias};
                 auto info = info_for(kernel_query);
 
-                source_image = fetch_kernel_and_initrd(info, source_image,
-                                                       QFileInfo(source_image.image_path).absoluteDir(), monitor);
+                source_image = fetch_kernel_and_initrd(
+                    info, source_image, QFileInfo(source_image.image_path).absoluteDir(), shared_monitor);
             }
 
-            if (source_image.image_path.endsWith(".xz"))
+            if (!decoded_image_path.isEmpty())
             {
-                source_image = extract_downloaded_image(source_image, monitor);
+                delete_file(source_image.image_path);
+                source_image.image_path = decoded_image_path;
             }
 
-            vm_image = prepare(source_image);
+            auto vm_image = prepare(source_image);
             vm_image.release_date = last_modified.toString().toStdString();
-            prepared_image_records[hash] = {vm_image, query, std::chrono::system_clock::now()};
             remove_source_images(source_image, vm_image);
+
+            std::lock_guard<std::mutex> lock{fetch_mutex};
+            // The version this replaces stays on record until the instances layered on it are gone
+            auto superseded = prepared_image_records.find(hash);
+            if (superseded != prepared_image_records.end() &&
+                QFileInfo{superseded->second.image.image_path}.dir() != QFileInfo{vm_image.image_path}.dir())
+            {
+                const auto record = superseded->second;
+                const auto superseded_dir = QFileInfo{record.image.image_path}.dir().dirName().toStdString();
+                prepared_image_records[hash + superseded_marker + superseded_dir] = record;
+            }
+
+            prepared_image_records[hash] = {vm_image, query, std::chrono::system_clock::now(), {}, {}};
             persist_image_records();
-            vm_image = image_instance_from(query.name, vm_image);
-        }
+            schedule_eviction();
 
-        instance_image_records[query.name] = {vm_image, query, std::chrono::system_clock::now()};
-        persist_instance_records();
+            return vm_image;
+        });
 
-        return vm_image;
+        return instance_image_for(hash, query, prepared_image);
     }
     else
     {
@@ -396,85 +783,132 @@ mp::VMImage mp::DefaultVMImageVault::fetch_image(const FetchType& fetch_type, co
 
         if (!query.name.empty())
         {
-            for (auto& record : prepared_image_records)
+            mp::optional<std::pair<std::string, VMImage>> cached_image;
             {
-                if (record.second.query.remote_name != query.remote_name)
-                    continue;
-
-                const auto aliases = record.second.image.aliases;
-                if (id == record.first || std::find(aliases.cbegin(), aliases.cend(), query.release) != aliases.cend())
+                std::lock_guard<std::mutex> lock{fetch_mutex};
+                for (auto& record : prepared_image_records)
                 {
-                    const auto prepared_image = record.second.image;
-                    try
+                    if (record.second.query.remote_name != query.remote_name ||
+                        images_being_evicted.find(record.first) != images_being_evicted.end())
+                        continue;
+
+                    const auto aliases = record.second.image.aliases;
+                    if (id == record.first ||
+                        std::find(aliases.cbegin(), aliases.cend(), query.release) != aliases.cend())
                     {
-                        auto vm_image = image_instance_from(query.name, prepared_image);
-                        instance_image_records[query.name] = {vm_image, query, std::chrono::system_clock::now()};
-                        persist_instance_records();
                         record.second.last_accessed = std::chrono::system_clock::now();
                         persist_image_records();
-                        return vm_image;
-                    }
-                    catch (const std::exception& e)
-                    {
-                        mpl::log(mpl::Level::warning, category,
-                                 fmt::format("Cannot create instance image: {}", e.what()));
-
+                        ++images_in_use[record.first];
+                        cached_image = std::make_pair(record.first, record.second.image);
                         break;
                     }
                 }
             }
-        }
 
-        const auto image_dir_name = QString("%1-%2").arg(info.release).arg(info.version);
-        const QDir image_dir{mp::utils::make_dir(images_dir, image_dir_name)};
+            if (cached_image)
+            {
+                try
+                {
+                    return instance_image_for(cached_image->first, query, cached_image->second);
+                }
+                catch (const std::exception& e)
+                {
+                    mpl::log(mpl::Level::warning, category, fmt::format("Cannot create instance image: {}", e.what()));
+                }
+            }
+        }
 
-        VMImage source_image;
-        source_image.id = id;
-        source_image.image_path = image_dir.filePath(filename_for(info.image_location));
-        source_image.original_release = info.release_title.toStdString();
-        for (const auto& alias : info.aliases)
+        if (query.name.empty())
+        {
+            // Streamed images are added to the prepared ones once downloaded
+            std::lock_guard<std::mutex> lock{stream_mutex};
+            if (image_streams.find(id) != image_streams.end())
+                return {};
+        }
+        else if (const auto instance_image = stream_instance_image(fetch_type, query, info))
         {
-            source_image.aliases.push_back(alias.toStdString());
+            return *instance_image;
         }
-        DeleteOnException image_file{source_image.image_path};
 
-        url_downloader->download_to(info.image_location, source_image.image_path, info.size, LaunchProgress::IMAGE,
-                                    monitor);
+        const auto prepared_image = fetch_once(id, monitor, [&](const ProgressMonitor& shared_monitor) {
+            const auto image_dir_name = QString("%1-%2").arg(info.release).arg(info.version);
+            const QDir image_dir{mp::utils::make_dir(images_dir, image_dir_name)};
 
-        monitor(LaunchProgress::VERIFY, -1);
-        verify_image_download(source_image.image_path, id);
+            VMImage source_image;
+            source_image.id = id;
+            source_image.image_path = image_dir.filePath(filename_for(info.image_location));
+            source_image.original_release = info.release_title.toStdString();
+            for (const auto& alias : info.aliases)
+            {
+                source_image.aliases.push_back(alias.toStdString());
+            }
+            const auto decoded_image_path = decoded_path_for(source_image.image_path);
+            DeleteOnException image_file{source_image.image_path};
+            DeleteOnException decoded_image_file{decoded_image_path};
 
-        if (fetch_type == FetchType::ImageKernelAndInitrd)
-        {
-            source_image = fetch_kernel_and_initrd(info, source_image, image_dir, monitor);
-        }
+            // Compressed images hardly share any blocks with their older versions, and only remotes that publish the
+            // block checksums of an image allow fetching it by delta
+            auto downloaded_by_delta = false;
+            if (decoded_image_path.isEmpty() && !info.delta_signature_location.isEmpty())
+            {
+                if (const auto basis = pin_delta_basis_for(query, id))
+                {
+                    downloaded_by_delta =
+                        download_delta(url_downloader, info.image_location, info.delta_signature_location,
+                                       basis->second, source_image.image_path, id, shared_monitor);
 
-        if (source_image.image_path.endsWith(".xz"))
-        {
-            source_image = extract_downloaded_image(source_image, monitor);
-        }
+                    std::lock_guard<std::mutex> lock{fetch_mutex};
+                    release_image(basis->first);
+                }
+            }
 
-        auto prepared_image = prepare(source_image);
-        prepared_image_records[id] = {prepared_image, query, std::chrono::system_clock::now()};
-        remove_source_images(source_image, prepared_image);
+            if (!downloaded_by_delta)
+            {
+                ImageDownloadPipeline pipeline{source_image.image_path, true};
+                download_through(url_downloader, pipeline, info.image_location, source_image.image_path, info.size,
+                                 image_file, shared_monitor);
 
-        VMImage vm_image;
+                shared_monitor(LaunchProgress::VERIFY, -1);
+                pipeline.verify(id);
+            }
 
-        if (!query.name.empty())
+            if (fetch_type == FetchType::ImageKernelAndInitrd)
+            {
+                source_image = fetch_kernel_and_initrd(info, source_image, image_dir, shared_monitor);
+            }
+
+            if (!decoded_image_path.isEmpty())
+            {
+                delete_file(source_image.image_path);
+                source_image.image_path = decoded_image_path;
+            }
+
+            auto prepared_image = prepare(source_image);
+            remove_source_images(source_image, prepared_image);
+
+            std::lock_guard<std::mutex> lock{fetch_mutex};
+            prepared_image_records[id] = {prepared_image, query, std::chrono::system_clock::now(), {}, {}};
+            persist_image_records();
+            schedule_eviction();
+
+            return prepared_image;
+        });
+
+        if (query.name.empty())
         {
-            vm_image = image_instance_from(query.name, prepared_image);
-            instance_image_records[query.name] = {vm_image, query, std::chrono::system_clock::now()};
+            std::lock_guard<std::mutex> lock{fetch_mutex};
+            release_image(id);
+            return {};
         }
 
-        persist_image_records();
-        persist_instance_records();
-
-        return vm_image;
+        return instance_image_for(id, query, prepared_image);
     }
 }
 
 void mp::DefaultVMImageVault::remove(const std::string& name)
 {
+    std::lock_guard<std::mutex> stream_lock{stream_mutex};
+    std::lock_guard<std::mutex> lock{fetch_mutex};
     const auto& name_entry = instance_image_records.find(name);
     if (name_entry == instance_image_records.end())
         return;
@@ -483,93 +917,122 @@ void mp::DefaultVMImageVault::remove(const std::string& name)
     if (instance_dir.cd(QString::fromStdString(name)))
         instance_dir.removeRecursively();
 
+    const auto id = name_entry->second.image.id;
     instance_image_records.erase(name);
     persist_instance_records();
+    drop_unused_export(id);
 }
 
 bool mp::DefaultVMImageVault::has_record_for(const std::string& name)
 {
+    std::lock_guard<std::mutex> lock{fetch_mutex};
     return instance_image_records.find(name) != instance_image_records.end();
 }
 
 void mp::DefaultVMImageVault::prune_expired_images()
 {
-    std::vector<decltype(prepared_image_records)::key_type> expired_keys;
-    for (const auto& record : prepared_image_records)
+    std::vector<std::pair<std::string, VMImage>> expired_images;
     {
-        // Expire source images if they aren't persistent and haven't been accessed in 14 days
-        if (record.second.query.query_type == Query::Type::Alias && !record.second.query.persistent &&
-            record.second.last_accessed + days_to_expire <= std::chrono::system_clock::now())
+        std::lock_guard<std::mutex> lock{fetch_mutex};
+        std::vector<decltype(prepared_image_records)::key_type> expired_keys;
+        for (const auto& record : prepared_image_records)
         {
-            mpl::log(
-                mpl::Level::info, category,
-                fmt::format("Source image {} is expired. Removing it from the cache.\n", record.second.query.release));
-            expired_keys.push_back(record.first);
-            QFileInfo image_file{record.second.image.image_path};
-            if (image_file.exists())
-                image_file.dir().removeRecursively();
+            if (images_being_evicted.find(record.first) != images_being_evicted.end())
+                continue;
+
+            // Superseded custom images are only kept for as long as instances are layered on them
+            if (is_superseded(record.first))
+            {
+                if (!backs_instances(record.second.image.image_path) &&
+                    images_in_use.find(record.first) == images_in_use.end())
+                {
+                    mpl::log(mpl::Level::info, category,
+                             fmt::format("Removing superseded version of custom image {}.\n",
+                                         record.second.query.release));
+                    expired_keys.push_back(record.first);
+                }
+                continue;
+            }
+
+            // Expire source images if they aren't persistent and haven't been accessed in 14 days
+            if (record.second.query.query_type == Query::Type::Alias && !record.second.query.persistent &&
+                record.second.last_accessed + days_to_expire <= std::chrono::system_clock::now())
+            {
+                if (backs_instances(record.second.image.image_path) ||
+                    images_in_use.find(record.first) != images_in_use.end())
+                {
+                    mpl::log(mpl::Level::debug, category,
+                             fmt::format("Source image {} is expired but instances still depend on it.\n",
+                                         record.second.query.release));
+                    continue;
+                }
+
+                mpl::log(mpl::Level::info, category,
+                         fmt::format("Source image {} is expired. Removing it from the cache.\n",
+                                     record.second.query.release));
+                expired_keys.push_back(record.first);
+            }
         }
+
+        expired_images = mark_for_eviction(expired_keys);
     }
 
-    for (const auto& key : expired_keys)
-        prepared_image_records.erase(key);
+    std::vector<std::string> removed_keys;
+    for (const auto& expired_image : expired_images)
+    {
+        remove_image_files(expired_image.second);
+        removed_keys.push_back(expired_image.first);
+    }
+    finish_eviction(expired_images, removed_keys);
 
-    persist_image_records();
+    evict_least_recently_used();
 }
 
 void mp::DefaultVMImageVault::update_images(const FetchType& fetch_type, const PrepareAction& prepare,
                                             const ProgressMonitor& monitor)
 {
-    std::vector<decltype(prepared_image_records)::key_type> keys_to_update;
-    for (const auto& record : prepared_image_records)
+    // Refreshes give way to the downloads of instances being launched
+    DownloadScheduler::PriorityScope priority{DownloadScheduler::Priority::background};
+
+    std::vector<std::pair<decltype(prepared_image_records)::key_type, Query>> alias_records;
     {
-        if (record.second.query.query_type == Query::Type::Alias &&
-            record.first.compare(0, record.second.query.release.length(), record.second.query.release) != 0)
+        std::lock_guard<std::mutex> lock{fetch_mutex};
+        for (const auto& record : prepared_image_records)
         {
-            auto info = info_for(record.second.query);
-            if (info.id.toStdString() != record.first)
-            {
-                keys_to_update.push_back(record.first);
-            }
+            if (record.second.query.query_type == Query::Type::Alias &&
+                record.first.compare(0, record.second.query.release.length(), record.second.query.release) != 0)
+                alias_records.emplace_back(record.first, record.second.query);
         }
     }
 
-    for (const auto& key : keys_to_update)
+    for (const auto& record : alias_records)
     {
-        const auto& record = prepared_image_records[key];
-        mpl::log(mpl::Level::info, category, fmt::format("Updating {} source image to latest", record.query.release));
-        fetch_image(fetch_type, record.query, prepare, monitor);
+        auto info = info_for(record.second);
+        if (info.id.toStdString() != record.first)
+        {
+            mpl::log(mpl::Level::info, category,
+                     fmt::format("Updating {} source image to latest", record.second.release));
+            fetch_image(fetch_type, record.second, prepare, monitor);
+        }
     }
+
+    // Done here rather than when fetching so that launching instances does not wait on it
+    deduplicate_prepared_images();
 }
 
 mp::VMImage mp::DefaultVMImageVault::extract_image_from(const std::string& instance_name, const VMImage& source_image,
-                                                        const ProgressMonitor& monitor)
+                                                        ImageDecoder& image_decoder, const ProgressMonitor& monitor)
 {
     const auto name = QString::fromStdString(instance_name);
     const QDir output_dir{mp::utils::make_dir(instances_dir, name)};
-    QFileInfo file_info{source_image.image_path};
-    const auto image_name = file_info.fileName().remove(".xz");
-    const auto image_path = output_dir.filePath(image_name);
+    const auto file_name = QFileInfo{source_image.image_path}.fileName();
+    const auto decoded_name = decoded_path_for(file_name);
+    const auto image_path = output_dir.filePath(decoded_name.isEmpty() ? file_name : decoded_name);
 
     VMImage image{source_image};
     image.image_path = image_path;
 
-    XzImageDecoder xz_decoder(source_image.image_path);
-    xz_decoder.decode_to(image_path, monitor);
-
-    return image;
-}
-
-mp::VMImage mp::DefaultVMImageVault::extract_downloaded_image(const VMImage& source_image,
-                                                              const ProgressMonitor& monitor)
-{
-    VMImage image{source_image};
-    XzImageDecoder xz_decoder(image.image_path);
-    auto image_path = image.image_path.remove(".xz");
-
-    xz_decoder.decode_to(image_path, monitor);
-    delete_file(source_image.image_path);
-    image.image_path = image_path;
+    image_decoder.decode_to(image_path, monitor);
 
     return image;
 }
@@ -590,6 +1053,656 @@ mp::VMImage mp::DefaultVMImageVault::image_instance_from(const std::string& inst
             {}};
 }
 
+mp::VaultRecord mp::DefaultVMImageVault::instance_record_from(const Query& query, const VMImage& prepared_image)
+{
+    if (create_overlay && !prepared_image.image_path.isEmpty())
+    {
+        const QDir output_dir{mp::utils::make_dir(instances_dir, QString::fromStdString(query.name))};
+        const auto overlay_path = output_dir.filePath(filename_for(prepared_image.image_path));
+
+        if (create_overlay(QFileInfo{prepared_image.image_path}.absoluteFilePath(), overlay_path))
+        {
+            VMImage vm_image{overlay_path,
+                             copy(prepared_image.kernel_path, output_dir),
+                             copy(prepared_image.initrd_path, output_dir),
+                             prepared_image.id,
+                             prepared_image.original_release,
+                             prepared_image.current_release,
+                             prepared_image.release_date,
+                             {}};
+
+            return {vm_image, query, std::chrono::system_clock::now(), prepared_image.image_path, {}};
+        }
+
+        mpl::log(mpl::Level::debug, category,
+                 fmt::format("Cannot layer an instance image on {}, copying it instead",
+                             prepared_image.image_path.toStdString()));
+    }
+
+    return {image_instance_from(query.name, prepared_image), query, std::chrono::system_clock::now(), {}, {}};
+}
+
+// The prepared image is expected to be marked in use, which it no longer is afterwards
+mp::VMImage mp::DefaultVMImageVault::instance_image_for(const std::string& key, const Query& query,
+                                                        const VMImage& prepared_image)
+{
+    VaultRecord instance_record;
+    try
+    {
+        instance_record = instance_record_from(query, prepared_image);
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock{fetch_mutex};
+        release_image(key);
+        throw;
+    }
+
+    std::lock_guard<std::mutex> lock{fetch_mutex};
+    release_image(key);
+    instance_image_records[query.name] = instance_record;
+    persist_instance_records();
+
+    return instance_record.image;
+}
+
+mp::VMImage mp::DefaultVMImageVault::fetch_once(const std::string& id, const ProgressMonitor& monitor,
+                                                const std::function<VMImage(const ProgressMonitor&)>& fetch)
+{
+    std::unique_lock<std::mutex> lock{fetch_mutex};
+
+    // An image being evicted is fetched anew once its files are gone, rather than along with their removal
+    images_evicted.wait(lock, [this, &id] { return images_being_evicted.find(id) == images_being_evicted.end(); });
+
+    // Keeps the image from being evicted until the instance image is created from it
+    ++images_in_use[id];
+
+    auto it = in_flight_fetches.find(id);
+    if (it != in_flight_fetches.end())
+    {
+        // Someone else is getting this image already, follow along with their progress until they are done
+        const auto in_flight = it->second;
+        in_flight->followers.push_back(monitor);
+        in_flight->finished.wait(lock, [&in_flight] { return in_flight->done; });
+
+        if (in_flight->error)
+        {
+            release_image(id);
+            std::rethrow_exception(in_flight->error);
+        }
+
+        return in_flight->image;
+    }
+
+    const auto in_flight = std::make_shared<InFlightFetch>();
+    in_flight_fetches[id] = in_flight;
+    lock.unlock();
+
+    // The fetch carries on for as long as anyone waiting on it wants it to
+    auto shared_monitor = [this, &monitor, &in_flight](int download_type, int progress) {
+        std::vector<ProgressMonitor> followers;
+        {
+            std::lock_guard<std::mutex> lock{fetch_mutex};
+            followers = in_flight->followers;
+        }
+
+        auto keep_going = monitor(download_type, progress);
+        for (const auto& follower : followers)
+            keep_going = follower(download_type, progress) || keep_going;
+
+        return keep_going;
+    };
+
+    try
+    {
+        in_flight->image = fetch(shared_monitor);
+    }
+    catch (...)
+    {
+        in_flight->error = std::current_exception();
+    }
+
+    lock.lock();
+    in_flight->done = true;
+    in_flight_fetches.erase(id);
+    if (in_flight->error)
+        release_image(id);
+    lock.unlock();
+    in_flight->finished.notify_all();
+
+    if (in_flight->error)
+        std::rethrow_exception(in_flight->error);
+
+    return in_flight->image;
+}
+
+// Called with the records locked. Keeps the images from being used until finish_eviction, their files being removed
+// without the records locked meanwhile, for fetches not to wait on that.
+auto mp::DefaultVMImageVault::mark_for_eviction(const std::vector<std::string>& keys)
+    -> std::vector<std::pair<std::string, VMImage>>
+{
+    std::vector<std::pair<std::string, VMImage>> marked;
+    for (const auto& key : keys)
+    {
+        images_being_evicted.insert(key);
+        marked.emplace_back(key, prepared_image_records[key].image);
+    }
+
+    return marked;
+}
+
+void mp::DefaultVMImageVault::remove_image_files(const VMImage& image)
+{
+    QFileInfo image_file{image.image_path};
+    if (image_file.exists())
+        image_file.dir().removeRecursively();
+
+    for (const auto& path : {image.image_path, image.kernel_path, image.initrd_path})
+    {
+        if (!path.isEmpty())
+            chunk_store.remove(path);
+    }
+}
+
+// Forgets the images whose files were removed and lets the fetches that waited for any of the marked ones go ahead
+void mp::DefaultVMImageVault::finish_eviction(const std::vector<std::pair<std::string, VMImage>>& marked,
+                                              const std::vector<std::string>& removed)
+{
+    {
+        std::lock_guard<std::mutex> lock{fetch_mutex};
+        for (const auto& key : removed)
+            prepared_image_records.erase(key);
+        for (const auto& image : marked)
+            images_being_evicted.erase(image.first);
+
+        if (!removed.empty())
+            persist_image_records();
+    }
+    images_evicted.notify_all();
+
+    if (!removed.empty())
+        collect_chunk_garbage();
+}
+
+// Evicts the least recently used source images once the cache goes over its high watermark, until it is back under
+// the low one. Images that are being fetched, that instances are being created from or that instances are layered on
+// are never evicted. The records are only locked to pick the images and to forget them, disk usage being measured and
+// files removed without.
+void mp::DefaultVMImageVault::evict_least_recently_used()
+{
+    if (cache_budget <= 0)
+        return;
+
+    auto cache_size = disk_usage_of(images_dir.path());
+    if (cache_size <= cache_high_watermark)
+        return;
+
+    std::vector<std::pair<std::string, VMImage>> candidates;
+    {
+        std::lock_guard<std::mutex> lock{fetch_mutex};
+        std::vector<std::pair<std::chrono::system_clock::time_point, std::string>> unused;
+        for (const auto& record : prepared_image_records)
+        {
+            if (!record.second.query.persistent && images_in_use.find(record.first) == images_in_use.end() &&
+                in_flight_fetches.find(record.first) == in_flight_fetches.end() &&
+                images_being_evicted.find(record.first) == images_being_evicted.end() &&
+                !backs_instances(record.second.image.image_path))
+                unused.emplace_back(record.second.last_accessed, record.first);
+        }
+        std::sort(unused.begin(), unused.end());
+
+        std::vector<std::string> keys;
+        for (const auto& image : unused)
+            keys.push_back(image.second);
+        candidates = mark_for_eviction(keys);
+    }
+
+    std::vector<std::string> evicted;
+    for (const auto& candidate : candidates)
+    {
+        if (cache_size <= cache_low_watermark)
+            break;
+
+        const auto image_size = disk_usage_of(QFileInfo{candidate.second.image_path}.absolutePath());
+        mpl::log(mpl::Level::info, category,
+                 fmt::format("Image cache is over its high watermark. Removing least recently used source image {}.",
+                             QFileInfo{candidate.second.image_path}.fileName().toStdString()));
+
+        remove_image_files(candidate.second);
+        cache_size -= image_size;
+        evicted.push_back(candidate.first);
+    }
+    finish_eviction(candidates, evicted);
+
+    if (cache_size > cache_budget)
+        mpl::log(mpl::Level::warning, category,
+                 fmt::format("Image cache takes {} MiB, over its {} MiB budget, but the remaining images are in use",
+                             cache_size / (1024 * 1024), cache_budget / (1024 * 1024)));
+}
+
+// Called with the records locked
+void mp::DefaultVMImageVault::schedule_eviction()
+{
+    if (cache_budget <= 0 ||
+        (eviction.valid() && eviction.wait_for(std::chrono::seconds::zero()) != std::future_status::ready))
+        return;
+
+    eviction = std::async(std::launch::async, [this] {
+        try
+        {
+            evict_least_recently_used();
+        }
+        catch (const std::exception& e)
+        {
+            mpl::log(mpl::Level::warning, category, fmt::format("Cannot evict source images: {}", e.what()));
+        }
+    });
+}
+
+void mp::DefaultVMImageVault::release_image(const std::string& key)
+{
+    auto it = images_in_use.find(key);
+    if (it != images_in_use.end() && --it->second == 0)
+        images_in_use.erase(it);
+}
+
+// Looks for a cached older version of the image the query is for, to be the basis of a delta download of the image
+// with the given id. The image found is pinned so that it cannot be evicted while being read.
+auto mp::DefaultVMImageVault::pin_delta_basis_for(const Query& query, const std::string& id)
+    -> optional<std::pair<std::string, Path>>
+{
+    std::lock_guard<std::mutex> lock{fetch_mutex};
+    for (const auto& record : prepared_image_records)
+    {
+        const auto& record_query = record.second.query;
+        const auto& aliases = record.second.image.aliases;
+        if (record_query.query_type != Query::Type::Alias || record_query.remote_name != query.remote_name ||
+            (record_query.release != query.release &&
+             std::find(aliases.cbegin(), aliases.cend(), query.release) == aliases.cend()))
+            continue;
+
+        if (record.first == id || !QFileInfo::exists(record.second.image.image_path) ||
+            images_being_evicted.find(record.first) != images_being_evicted.end())
+            continue;
+
+        ++images_in_use[record.first];
+        return std::make_pair(record.first, record.second.image.image_path);
+    }
+
+    return nullopt;
+}
+
+// Layers an instance image on its image while that downloads, if streaming is enabled or the image streams already.
+// Returns nothing when the image is to be fetched whole instead.
+auto mp::DefaultVMImageVault::stream_instance_image(const FetchType& fetch_type, const Query& query,
+                                                    const VMImageInfo& info) -> optional<VMImage>
+{
+    // Only images that are used as they are downloaded can be streamed
+    if (!create_overlay || !rebase_overlay || fetch_type != FetchType::ImageOnly || info.size <= 0 ||
+        !decoded_path_for(info.image_location).isEmpty())
+        return nullopt;
+
+    const auto id = info.id.toStdString();
+    std::shared_ptr<ImageStream> stream;
+
+    // Held until the instance is recorded, for the image not to stop being served in between
+    std::lock_guard<std::mutex> stream_lock{stream_mutex};
+    auto it = image_streams.find(id);
+    if (it != image_streams.end())
+    {
+        stream = it->second;
+    }
+    else if (stream_images)
+    {
+        {
+            // A whole download of the image under way is joined instead, and an image being evicted is fetched anew
+            std::lock_guard<std::mutex> fetch_lock{fetch_mutex};
+            if (in_flight_fetches.find(id) != in_flight_fetches.end() ||
+                images_being_evicted.find(id) != images_being_evicted.end())
+                return nullopt;
+        }
+
+        stream = start_stream(query, info);
+    }
+
+    if (!stream)
+        return nullopt;
+
+    const auto stream_url = nbd_server->url_for(id);
+
+    const QDir output_dir{mp::utils::make_dir(instances_dir, QString::fromStdString(query.name))};
+    const auto overlay_path = output_dir.filePath(filename_for(stream->image_path()));
+    if (!create_overlay(stream_url, overlay_path))
+        throw std::runtime_error(fmt::format("Cannot layer an instance image on {}", stream_url.toStdString()));
+
+    mpl::log(mpl::Level::info, category,
+             fmt::format("Booting {} from {} while it downloads", query.name, info.image_location.toStdString()));
+
+    const VMImage vm_image{overlay_path, {}, {}, id, info.release_title.toStdString(), {}, {}, {}};
+
+    std::lock_guard<std::mutex> lock{fetch_mutex};
+    instance_image_records[query.name] = {vm_image, query, std::chrono::system_clock::now(), stream->image_path(),
+                                          stream_url};
+    persist_instance_records();
+
+    return vm_image;
+}
+
+// Expects the stream lock to be held. Returns nothing if the image cannot be streamed.
+std::shared_ptr<mp::ImageStream> mp::DefaultVMImageVault::start_stream(const Query& query, const VMImageInfo& info)
+{
+    const QDir image_dir{mp::utils::make_dir(images_dir, QString("%1-%2").arg(info.release).arg(info.version))};
+
+    VMImage source_image;
+    source_image.id = info.id.toStdString();
+    source_image.image_path = image_dir.filePath(filename_for(info.image_location));
+    source_image.original_release = info.release_title.toStdString();
+    for (const auto& alias : info.aliases)
+    {
+        source_image.aliases.push_back(alias.toStdString());
+    }
+
+    // What was downloaded of an image that is not streamed is left to nothing, unless instances streamed it before
+    std::shared_ptr<ImageStream> stream;
+    auto discard_stream = [this, &stream, &source_image] {
+        stream.reset();
+
+        std::lock_guard<std::mutex> lock{fetch_mutex};
+        if (!backs_instances(source_image.image_path))
+            QFile::remove(source_image.image_path);
+    };
+
+    try
+    {
+        stream =
+            std::make_shared<ImageStream>(url_downloader, info.image_location, source_image.image_path, info.size);
+
+        // Only qcow2 images can back instance images without being prepared first
+        char magic[4];
+        if (!stream->read(magic, 0, sizeof magic) || QByteArray(magic, sizeof magic) != QByteArray("QFI\xfb", 4))
+        {
+            discard_stream();
+            return nullptr;
+        }
+
+        if (!nbd_server)
+            nbd_server = std::make_unique<NBDServer>(cache_dir.filePath(stream_socket_name));
+
+        nbd_server->add_export(source_image.id, stream->length(), [stream](char* data, int64_t offset, int64_t size) {
+            return stream->read(data, offset, size);
+        });
+
+        image_streams[source_image.id] = stream;
+        stream_fills.push_back(std::async(std::launch::async, [this, stream, query, source_image] {
+            finish_stream(*stream, query, source_image);
+        }));
+
+        return stream;
+    }
+    catch (const std::exception& e)
+    {
+        mpl::log(mpl::Level::warning, category,
+                 fmt::format("Cannot stream {}: {}", info.image_location.toStdString(), e.what()));
+        discard_stream();
+    }
+
+    return nullptr;
+}
+
+// Downloads the rest of a streamed image, then verifies it and adds it to the prepared images. Instances keep reading
+// it through the NBD server until the daemon restarts and rebases them on it, as they may be running meanwhile.
+void mp::DefaultVMImageVault::finish_stream(ImageStream& stream, const Query& query, const VMImage& source_image)
+{
+    auto monitor = [](int, int) { return true; };
+
+    try
+    {
+        while (true)
+        {
+            try
+            {
+                ImageDownloadPipeline pipeline{{}, true};
+                stream.fill(monitor, &pipeline);
+                pipeline.finish();
+                pipeline.verify(source_image.id);
+                break;
+            }
+            catch (const mp::DownloadException& e)
+            {
+                std::unique_lock<std::mutex> lock{stream_mutex};
+                if (stopping_streams || !QFileInfo::exists(stream.image_path()))
+                    throw;
+
+                mpl::log(mpl::Level::warning, category,
+                         fmt::format("Download of {} interrupted, retrying: {}",
+                                     source_image.image_path.toStdString(), e.what()));
+                if (streams_stopped.wait_for(lock, stream_retry_interval, [this] { return stopping_streams; }))
+                    throw;
+            }
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::lock_guard<std::mutex> lock{stream_mutex};
+        mpl::log(stopping_streams ? mpl::Level::info : mpl::Level::error, category,
+                 fmt::format("Cannot finish downloading {}: {}", source_image.image_path.toStdString(), e.what()));
+        image_streams.erase(source_image.id);
+
+        std::lock_guard<std::mutex> fetch_lock{fetch_mutex};
+        drop_unused_export(source_image.id);
+        return;
+    }
+
+    mpl::log(mpl::Level::info, category, fmt::format("Downloaded {}", source_image.image_path.toStdString()));
+
+    {
+        std::lock_guard<std::mutex> lock{fetch_mutex};
+        prepared_image_records[source_image.id] = {source_image, query, std::chrono::system_clock::now(), {}, {}};
+        persist_image_records();
+        schedule_eviction();
+    }
+
+    std::lock_guard<std::mutex> lock{stream_mutex};
+    image_streams.erase(source_image.id);
+
+    std::lock_guard<std::mutex> fetch_lock{fetch_mutex};
+    drop_unused_export(source_image.id);
+}
+
+// Rebases the instance images streamed during an earlier run of the daemon on their image, when it finished
+// downloading. The images that did not carry on streaming in the background, as looking them up takes the network;
+// they are served right away nonetheless, for their instances to start, reads waiting until the streams are back.
+void mp::DefaultVMImageVault::resume_streamed_instances()
+{
+    // Set before anything is served, for the first reads to wait too
+    {
+        std::lock_guard<std::mutex> lock{stream_mutex};
+        resuming_streams = true;
+    }
+
+    auto rebased = false;
+    std::unordered_map<std::string, PendingStream> pending;
+    for (auto& record : instance_image_records)
+    {
+        auto& instance = record.second;
+        if (instance.stream_url.isEmpty())
+            continue;
+
+        const auto& id = instance.image.id;
+        const auto prepared = prepared_image_records.find(id);
+        if (prepared != prepared_image_records.end() &&
+            prepared->second.image.image_path == instance.backing_image_path && rebase_overlay &&
+            rebase_overlay(QFileInfo{instance.backing_image_path}.absoluteFilePath(), instance.image.image_path))
+        {
+            instance.stream_url.clear();
+            rebased = true;
+            continue;
+        }
+
+        if (pending.find(id) != pending.end())
+            continue;
+
+        try
+        {
+            if (!nbd_server)
+                nbd_server = std::make_unique<NBDServer>(cache_dir.filePath(stream_socket_name));
+
+            auto stream = std::make_shared<std::shared_ptr<ImageStream>>();
+            nbd_server->add_export(id, QFileInfo{instance.backing_image_path}.size(),
+                                   [this, stream](char* data, int64_t offset, int64_t size) {
+                                       std::shared_ptr<ImageStream> resumed;
+                                       {
+                                           std::unique_lock<std::mutex> lock{stream_mutex};
+                                           streams_resumed.wait(
+                                               lock, [this] { return !resuming_streams || stopping_streams; });
+                                           resumed = *stream;
+                                       }
+
+                                       return resumed && resumed->read(data, offset, size);
+                                   });
+            pending.emplace(id, PendingStream{instance.query, stream});
+        }
+        catch (const std::exception& e)
+        {
+            mpl::log(mpl::Level::error, category,
+                     fmt::format("Cannot resume streaming the image of {}: {}", record.first, e.what()));
+        }
+    }
+
+    if (rebased)
+        persist_instance_records();
+
+    if (pending.empty())
+    {
+        std::lock_guard<std::mutex> lock{stream_mutex};
+        resuming_streams = false;
+        return;
+    }
+
+    stream_resumption = std::async(std::launch::async, [this, pending] { resume_streams(pending); });
+}
+
+// Streams again the images instances streamed during an earlier run of the daemon, handing them to the reads that
+// waited for them
+void mp::DefaultVMImageVault::resume_streams(const std::unordered_map<std::string, PendingStream>& pending)
+{
+    for (const auto& image : pending)
+    {
+        const auto& id = image.first;
+        try
+        {
+            {
+                std::lock_guard<std::mutex> lock{stream_mutex};
+                if (stopping_streams)
+                    break;
+            }
+
+            const auto info = info_for({"", id, false, image.second.query.remote_name, Query::Type::Alias, true});
+
+            std::lock_guard<std::mutex> lock{stream_mutex};
+            if (stopping_streams)
+                break;
+
+            // New instances may have streamed the image meanwhile
+            std::shared_ptr<ImageStream> stream;
+            auto it = image_streams.find(id);
+            if (it != image_streams.end())
+                stream = it->second;
+            else if (info.id.toStdString() == id)
+                stream = start_stream(image.second.query, info);
+
+            if (!stream)
+                throw std::runtime_error("the image cannot be streamed anymore");
+
+            *image.second.stream = stream;
+        }
+        catch (const std::exception& e)
+        {
+            mpl::log(mpl::Level::error, category, fmt::format("Cannot resume streaming image {}: {}", id, e.what()));
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock{stream_mutex};
+        resuming_streams = false;
+    }
+    streams_resumed.notify_all();
+}
+
+// Expects the stream and fetch locks to be held. Stops serving an image that is done streaming once no instance reads
+// it anymore, which lets its stream go.
+void mp::DefaultVMImageVault::drop_unused_export(const std::string& id)
+{
+    if (!nbd_server || image_streams.find(id) != image_streams.end())
+        return;
+
+    const auto streamed = std::any_of(
+        instance_image_records.cbegin(), instance_image_records.cend(),
+        [&id](const auto& record) { return record.second.image.id == id && !record.second.stream_url.isEmpty(); });
+    if (!streamed)
+        nbd_server->remove_export(id);
+}
+
+bool mp::DefaultVMImageVault::backs_instances(const Path& image_path) const
+{
+    return std::any_of(instance_image_records.cbegin(), instance_image_records.cend(),
+                       [&image_path](const auto& record) { return record.second.backing_image_path == image_path; });
+}
+
+// Works on a snapshot of the records, the images in it being pinned so that they are not removed while being read
+void mp::DefaultVMImageVault::deduplicate_prepared_images()
+{
+    std::vector<std::pair<std::string, VMImage>> prepared_images;
+    {
+        std::lock_guard<std::mutex> lock{fetch_mutex};
+        for (const auto& record : prepared_image_records)
+        {
+            if (images_being_evicted.find(record.first) != images_being_evicted.end())
+                continue;
+
+            ++images_in_use[record.first];
+            prepared_images.emplace_back(record.first, record.second.image);
+        }
+    }
+
+    int64_t reclaimed{0};
+    for (const auto& prepared_image : prepared_images)
+    {
+        const auto& image = prepared_image.second;
+        for (const auto& path : {image.image_path, image.kernel_path, image.initrd_path})
+        {
+            try
+            {
+                std::lock_guard<std::mutex> lock{chunk_store_mutex};
+                if (path.isEmpty() || !QFile::exists(path) || chunk_store.contains(path))
+                    continue;
+
+                reclaimed += chunk_store.add(path);
+            }
+            catch (const std::exception& e)
+            {
+                mpl::log(mpl::Level::warning, category,
+                         fmt::format("Cannot deduplicate {}: {}", path.toStdString(), e.what()));
+            }
+        }
+
+        std::lock_guard<std::mutex> lock{fetch_mutex};
+        release_image(prepared_image.first);
+    }
+
+    if (reclaimed > 0)
+        mpl::log(mpl::Level::info, category,
+                 fmt::format("Deduplicating source images reclaimed {} MiB", reclaimed / (1024 * 1024)));
+}
+
+// Garbage is left for the next collection while a deduplication is adding files
+void mp::DefaultVMImageVault::collect_chunk_garbage()
+{
+    std::unique_lock<std::mutex> lock{chunk_store_mutex, std::try_to_lock};
+    if (lock.owns_lock())
+        chunk_store.collect_garbage();
+}
+
 mp::VMImage mp::DefaultVMImageVault::fetch_kernel_and_initrd(const VMImageInfo& info, const VMImage& source_image,
                                                              const QDir& image_dir, const ProgressMonitor& monitor)
 {
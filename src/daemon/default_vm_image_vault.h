@@ -18,7 +18,12 @@
 #ifndef MULTIPASS_DEFAULT_VM_IMAGE_VAULT_H
 #define MULTIPASS_DEFAULT_VM_IMAGE_VAULT_H
 
+#include "chunk_store.h"
+#include "image_stream.h"
+#include "nbd_server.h"
+
 #include <multipass/days.h>
+#include <multipass/optional.h>
 #include <multipass/path.h>
 #include <multipass/query.h>
 #include <multipass/vm_image.h>
@@ -26,11 +31,19 @@
 #include <multipass/vm_image_vault.h>
 
 #include <QDir>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 namespace multipass
 {
+class ImageDecoder;
 class URLDownloader;
 class VMImageHost;
 class VaultRecord
@@ -39,12 +52,27 @@ public:
     multipass::VMImage image;
     multipass::Query query;
     std::chrono::system_clock::time_point last_accessed;
+    multipass::Path backing_image_path;
+    // Where the instance image reads its backing image from while that is being streamed
+    QString stream_url;
 };
 class DefaultVMImageVault final : public VMImageVault
 {
 public:
+    // Creates an instance image backed by a prepared one, returning false when it has to be copied instead
+    using OverlayAction = std::function<bool(const Path& base_image_path, const Path& instance_image_path)>;
+    // Points an instance image at another base image holding the same data, returning false when it cannot
+    using RebaseAction = std::function<bool(const Path& base_image_path, const Path& instance_image_path)>;
+
+    // Streaming has new instances boot from their image while it downloads, which takes both actions. Source images
+    // are evicted once the cache goes over its high watermark, until it is under its low one; by default the high
+    // watermark is the budget and the low one 80% of the high one.
     DefaultVMImageVault(std::vector<VMImageHost*> image_host, URLDownloader* downloader, multipass::Path cache_dir_path,
-                        multipass::Path data_dir_path, multipass::days days_to_expire);
+                        multipass::Path data_dir_path, multipass::days days_to_expire,
+                        OverlayAction create_overlay = nullptr, int64_t cache_budget = 0,
+                        RebaseAction rebase_overlay = nullptr, bool stream_images = false,
+                        int64_t cache_low_watermark = 0, int64_t cache_high_watermark = 0);
+    ~DefaultVMImageVault();
     VMImage fetch_image(const FetchType& fetch_type, const Query& query, const PrepareAction& prepare,
                         const ProgressMonitor& monitor) override;
     void remove(const std::string& name) override;
@@ -55,9 +83,30 @@ public:
 
 private:
     VMImage image_instance_from(const std::string& name, const VMImage& prepared_image);
+    VaultRecord instance_record_from(const Query& query, const VMImage& prepared_image);
+    VMImage instance_image_for(const std::string& key, const Query& query, const VMImage& prepared_image);
+    VMImage fetch_once(const std::string& id, const ProgressMonitor& monitor,
+                       const std::function<VMImage(const ProgressMonitor&)>& fetch);
+    bool backs_instances(const Path& image_path) const;
+    std::vector<std::pair<std::string, VMImage>> mark_for_eviction(const std::vector<std::string>& keys);
+    void remove_image_files(const VMImage& image);
+    void finish_eviction(const std::vector<std::pair<std::string, VMImage>>& marked,
+                         const std::vector<std::string>& removed);
+    void evict_least_recently_used();
+    void schedule_eviction();
+    void release_image(const std::string& key);
+    optional<std::pair<std::string, Path>> pin_delta_basis_for(const Query& query, const std::string& id);
+    optional<VMImage> stream_instance_image(const FetchType& fetch_type, const Query& query, const VMImageInfo& info);
+    std::shared_ptr<ImageStream> start_stream(const Query& query, const VMImageInfo& info);
+    void finish_stream(ImageStream& stream, const Query& query, const VMImage& source_image);
+    void resume_streamed_instances();
+    struct PendingStream;
+    void resume_streams(const std::unordered_map<std::string, PendingStream>& pending);
+    void drop_unused_export(const std::string& id);
+    void deduplicate_prepared_images();
+    void collect_chunk_garbage();
     VMImage extract_image_from(const std::string& instance_name, const VMImage& source_image,
-                               const ProgressMonitor& monitor);
-    VMImage extract_downloaded_image(const VMImage& source_image, const ProgressMonitor& monitor);
+                               ImageDecoder& image_decoder, const ProgressMonitor& monitor);
     VMImage fetch_kernel_and_initrd(const VMImageInfo& info, const VMImage& source_image, const QDir& image_dir,
                                     const ProgressMonitor& monitor);
     VMImageInfo info_for(const Query& query);
@@ -71,10 +120,44 @@ private:
     const QDir instances_dir;
     const QDir images_dir;
     const days days_to_expire;
+    const OverlayAction create_overlay;
+    const int64_t cache_budget;
+    const int64_t cache_high_watermark;
+    const int64_t cache_low_watermark;
+    const RebaseAction rebase_overlay;
+    const bool stream_images;
+    ChunkStore chunk_store;
 
     std::unordered_map<std::string, VaultRecord> prepared_image_records;
     std::unordered_map<std::string, VaultRecord> instance_image_records;
     std::unordered_map<std::string, VMImageHost*> remote_image_host_map;
+
+    // Guards the records, image fetches run concurrently
+    struct InFlightFetch;
+    std::mutex fetch_mutex;
+    std::unordered_map<std::string, std::shared_ptr<InFlightFetch>> in_flight_fetches;
+    std::unordered_map<std::string, int> images_in_use;
+    // Images whose files are being removed without the records locked, which fetches of them wait for
+    std::unordered_set<std::string> images_being_evicted;
+    std::condition_variable images_evicted;
+
+    // Keeps chunks from being collected while a deduplication, which runs without the records locked, adds files
+    std::mutex chunk_store_mutex;
+
+    // Guards the images being streamed to instances, which are served to the hypervisor by the NBD server
+    std::mutex stream_mutex;
+    std::condition_variable streams_stopped;
+    bool stopping_streams{false};
+    std::unordered_map<std::string, std::shared_ptr<ImageStream>> image_streams;
+    std::unique_ptr<NBDServer> nbd_server;
+    std::vector<std::future<void>> stream_fills;
+    // Images streamed during an earlier run of the daemon are looked up again in the background, reads of them wait
+    bool resuming_streams{false};
+    std::condition_variable streams_resumed;
+    std::future<void> stream_resumption;
+
+    // Last, so that a running eviction is waited for before anything else goes away
+    std::future<void> eviction;
 };
 }
 #endif // MULTIPASS_DEFAULT_VM_IMAGE_VAULT_H
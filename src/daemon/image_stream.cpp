@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "image_stream.h"
+
+#include <multipass/download_scheduler.h>
+#include <multipass/logging/log.h>
+#include <multipass/rpc/multipass.grpc.pb.h>
+
+#include <fmt/format.h>
+
+#include <QUrl>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <unistd.h>
+
+namespace mp = multipass;
+namespace mpl = multipass::logging;
+
+namespace
+{
+constexpr auto category = "image stream";
+
+// What a read fetches at least, so that booting from the image takes a request per few reads at most
+constexpr int64_t chunk_size{1024 * 1024};
+} // namespace
+
+// Tells the stream how much of the image arrived in order, on the way to the fill's own sink
+class mp::ImageStream::Sink : public mp::URLDownloader::DataSink
+{
+public:
+    Sink(ImageStream& stream, URLDownloader::DataSink* next) : stream{stream}, next{next}
+    {
+    }
+
+    bool write(const char* data, int64_t size) override
+    {
+        if (next && !next->write(data, size))
+            return false;
+
+        std::lock_guard<std::mutex> lock{stream.mutex};
+        stream.contiguous += size;
+        return true;
+    }
+
+private:
+    ImageStream& stream;
+    URLDownloader::DataSink* const next;
+};
+
+mp::ImageStream::ImageStream(URLDownloader* downloader, const QString& image_url, const Path& image_path,
+                             int64_t length)
+    : downloader{downloader},
+      image_url{image_url},
+      path{image_path},
+      size{length},
+      file{image_path},
+      chunks(static_cast<std::size_t>((length + chunk_size - 1) / chunk_size), ChunkState::missing)
+{
+    if (!file.open(QIODevice::ReadWrite | QIODevice::Unbuffered) || !file.resize(length))
+        throw std::runtime_error(
+            fmt::format("failed to create {}: {}", path.toStdString(), file.errorString().toStdString()));
+}
+
+const mp::Path& mp::ImageStream::image_path() const
+{
+    return path;
+}
+
+int64_t mp::ImageStream::length() const
+{
+    return size;
+}
+
+void mp::ImageStream::fill(const ProgressMonitor& monitor, URLDownloader::DataSink* sink)
+{
+    std::vector<URLDownloader::ByteRange> present;
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+
+        // What an earlier fill received in order stays in the file, to be handed to the sink again from there
+        for (std::size_t i = 0; i < chunks.size(); ++i)
+        {
+            const auto received = std::min(static_cast<int64_t>(i + 1) * chunk_size, size) <= contiguous;
+            if (received && chunks[i] == ChunkState::missing)
+                chunks[i] = ChunkState::present;
+            if (chunks[i] != ChunkState::present)
+                continue;
+
+            const auto start = static_cast<int64_t>(i) * chunk_size;
+            const auto end = std::min(start + chunk_size, size);
+            if (!present.empty() && present.back().end == start)
+                present.back().end = end;
+            else
+                present.push_back({start, end});
+        }
+        contiguous = 0;
+    }
+
+    Sink stream_sink{*this, sink};
+    auto cancellable_monitor = [this, &monitor](int download_type, int percentage) {
+        return !cancelled && monitor(download_type, percentage);
+    };
+
+    // Reads take over the transfer slot whenever they need one
+    DownloadScheduler::PriorityScope priority{DownloadScheduler::Priority::background};
+    downloader->download_missing_to(image_url, path, present, LaunchProgress::IMAGE, cancellable_monitor,
+                                    &stream_sink);
+}
+
+void mp::ImageStream::cancel()
+{
+    cancelled = true;
+}
+
+bool mp::ImageStream::read(char* data, int64_t offset, int64_t count)
+{
+    if (offset < 0 || count < 0 || offset + count > size)
+        return false;
+
+    if (count == 0)
+        return true;
+
+    {
+        std::unique_lock<std::mutex> lock{mutex};
+        const auto last = static_cast<std::size_t>((offset + count - 1) / chunk_size);
+        for (auto chunk = static_cast<std::size_t>(offset / chunk_size); chunk <= last; ++chunk)
+        {
+            const auto chunk_end = std::min(static_cast<int64_t>(chunk + 1) * chunk_size, size);
+            if (chunk_end > contiguous && !fetch_chunk(chunk, lock))
+                return false;
+        }
+    }
+
+    return ::pread(file.handle(), data, static_cast<size_t>(count), offset) == count;
+}
+
+// Expects the lock to be held, releasing it while the chunk downloads
+bool mp::ImageStream::fetch_chunk(std::size_t chunk, std::unique_lock<std::mutex>& lock)
+{
+    chunk_fetched.wait(lock, [this, chunk] { return chunks[chunk] != ChunkState::fetching; });
+    if (chunks[chunk] == ChunkState::present)
+        return true;
+
+    chunks[chunk] = ChunkState::fetching;
+    lock.unlock();
+
+    const auto start = static_cast<int64_t>(chunk) * chunk_size;
+    const auto end = std::min(start + chunk_size, size);
+    auto fetched = false;
+    try
+    {
+        // Something is waiting on these bytes, unlike on the rest of the image
+        DownloadScheduler::PriorityScope priority{DownloadScheduler::Priority::interactive};
+        const auto data = downloader->download_range(image_url, start, end);
+        fetched = ::pwrite(file.handle(), data.constData(), static_cast<size_t>(data.size()), start) == data.size();
+    }
+    catch (const std::exception& e)
+    {
+        mpl::log(mpl::Level::warning, category,
+                 fmt::format("Cannot fetch bytes {}-{} of {}: {}", start, end, image_url.toStdString(), e.what()));
+    }
+
+    lock.lock();
+    chunks[chunk] = fetched ? ChunkState::present : ChunkState::missing;
+    chunk_fetched.notify_all();
+
+    return fetched;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MULTIPASS_IMAGE_STREAM_H
+#define MULTIPASS_IMAGE_STREAM_H
+
+#include <multipass/path.h>
+#include <multipass/progress_monitor.h>
+#include <multipass/url_downloader.h>
+
+#include <QFile>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace multipass
+{
+// An image downloading in the background whose bytes can be read before the download completes. Reads of bytes that
+// have not arrived yet fetch the chunks holding them right away, ahead of the rest of the download.
+class ImageStream
+{
+public:
+    // Keeps what an earlier stream of the same image left in the file
+    ImageStream(URLDownloader* downloader, const QString& image_url, const Path& image_path, int64_t length);
+
+    const Path& image_path() const;
+    int64_t length() const;
+
+    // Downloads the rest of the image, handing all of it to the sink in order
+    void fill(const ProgressMonitor& monitor, URLDownloader::DataSink* sink);
+    // Makes a running fill give up, leaving what it received for a later stream to carry on from
+    void cancel();
+
+    // Returns false if the bytes could not be fetched
+    bool read(char* data, int64_t offset, int64_t size);
+
+private:
+    class Sink;
+    enum class ChunkState : char
+    {
+        missing,
+        fetching,
+        present
+    };
+
+    bool fetch_chunk(std::size_t chunk, std::unique_lock<std::mutex>& lock);
+
+    URLDownloader* const downloader;
+    const QString image_url;
+    const Path path;
+    const int64_t size;
+    QFile file;
+    std::atomic<bool> cancelled{false};
+
+    std::mutex mutex;
+    std::condition_variable chunk_fetched;
+    // Bytes the fill handed on in order, which are in the file
+    int64_t contiguous{0};
+    std::vector<ChunkState> chunks;
+};
+} // namespace multipass
+#endif // MULTIPASS_IMAGE_STREAM_H
@@ -0,0 +1,399 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "nbd_server.h"
+
+#include <multipass/logging/log.h>
+
+#include <fmt/format.h>
+
+#include <QByteArray>
+#include <QFile>
+#include <QtEndian>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace mp = multipass;
+namespace mpl = multipass::logging;
+
+namespace
+{
+constexpr auto category = "nbd server";
+
+// The fixed newstyle handshake and simple replies of https://github.com/NetworkBlockDevice/nbd/blob/master/doc/proto.md
+constexpr quint64 server_magic{0x4e42444d41474943};
+constexpr quint64 option_magic{0x49484156454f5054};
+constexpr quint64 option_reply_magic{0x3e889045565a9};
+constexpr quint32 request_magic{0x25609513};
+constexpr quint32 simple_reply_magic{0x67446698};
+
+constexpr quint16 handshake_fixed_newstyle{1 << 0};
+constexpr quint16 handshake_no_zeroes{1 << 1};
+constexpr quint32 client_no_zeroes{1 << 1};
+constexpr quint16 transmission_flags{(1 << 0) | (1 << 1)}; // Has flags, read-only
+
+constexpr quint32 option_export_name{1};
+constexpr quint32 option_abort{2};
+constexpr quint32 option_info{6};
+constexpr quint32 option_go{7};
+
+constexpr quint32 reply_ack{1};
+constexpr quint32 reply_info{3};
+constexpr quint32 reply_error_unsupported{(1u << 31) + 1};
+constexpr quint32 reply_error_invalid{(1u << 31) + 3};
+constexpr quint32 reply_error_unknown{(1u << 31) + 6};
+constexpr quint16 info_export{0};
+
+constexpr quint16 command_read{0};
+constexpr quint16 command_write{1};
+constexpr quint16 command_disconnect{2};
+constexpr quint16 command_flush{3};
+
+// Error values are those of Linux
+constexpr quint32 error_perm{EPERM};
+constexpr quint32 error_io{EIO};
+constexpr quint32 error_invalid{EINVAL};
+
+// QEMU asks for 32 MiB at most at a time
+constexpr quint32 max_request_size{32 * 1024 * 1024};
+constexpr quint32 max_option_size{4096};
+
+bool receive(int fd, void* data, size_t size)
+{
+    auto bytes = static_cast<char*>(data);
+    while (size > 0)
+    {
+        const auto received = ::recv(fd, bytes, size, 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return false;
+
+        bytes += received;
+        size -= static_cast<size_t>(received);
+    }
+
+    return true;
+}
+
+bool send(int fd, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        const auto sent = ::send(fd, data, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+
+        data += sent;
+        size -= static_cast<size_t>(sent);
+    }
+
+    return true;
+}
+
+bool send(int fd, const QByteArray& message)
+{
+    return send(fd, message.constData(), static_cast<size_t>(message.size()));
+}
+
+// Integers go over the wire in network byte order
+template <typename T>
+bool receive(int fd, T& value)
+{
+    if (!receive(fd, &value, sizeof value))
+        return false;
+
+    value = qFromBigEndian(value);
+    return true;
+}
+
+template <typename T>
+void append(QByteArray& message, T value)
+{
+    value = qToBigEndian(value);
+    message.append(reinterpret_cast<const char*>(&value), sizeof value);
+}
+
+bool send_option_reply(int fd, quint32 option, quint32 type, const QByteArray& data = {})
+{
+    QByteArray reply;
+    append(reply, option_reply_magic);
+    append(reply, option);
+    append(reply, type);
+    append(reply, static_cast<quint32>(data.size()));
+    reply.append(data);
+
+    return send(fd, reply);
+}
+} // namespace
+
+mp::NBDServer::NBDServer(const Path& socket_path)
+    : socket_path{socket_path}, listen_fd{::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)}
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+
+    const auto path = QFile::encodeName(socket_path);
+    if (listen_fd < 0 || static_cast<size_t>(path.size()) >= sizeof address.sun_path)
+    {
+        if (listen_fd >= 0)
+            ::close(listen_fd);
+        throw std::runtime_error(fmt::format("cannot serve images on {}", socket_path.toStdString()));
+    }
+    std::copy(path.cbegin(), path.cend(), address.sun_path);
+
+    // Left behind by an earlier daemon
+    QFile::remove(socket_path);
+
+    if (::bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof address) < 0 || ::listen(listen_fd, 16) < 0)
+    {
+        const auto error = errno;
+        ::close(listen_fd);
+        throw std::runtime_error(
+            fmt::format("cannot serve images on {}: {}", socket_path.toStdString(), std::strerror(error)));
+    }
+
+    acceptor = std::thread{&NBDServer::accept_connections, this};
+}
+
+mp::NBDServer::~NBDServer()
+{
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        stopping = true;
+        for (const auto fd : connections)
+            ::shutdown(fd, SHUT_RDWR);
+    }
+
+    ::shutdown(listen_fd, SHUT_RDWR);
+    acceptor.join();
+
+    for (auto& thread : connection_threads)
+        thread.join();
+
+    ::close(listen_fd);
+    QFile::remove(socket_path);
+}
+
+void mp::NBDServer::add_export(const std::string& name, int64_t size, const Reader& read)
+{
+    std::lock_guard<std::mutex> lock{mutex};
+    exports[name] = std::shared_ptr<const Export>(new Export{size, read});
+}
+
+// Clients already using the export keep it until they disconnect
+void mp::NBDServer::remove_export(const std::string& name)
+{
+    std::lock_guard<std::mutex> lock{mutex};
+    exports.erase(name);
+}
+
+QString mp::NBDServer::url_for(const std::string& name) const
+{
+    return QString("nbd+unix:///%1?socket=%2").arg(QString::fromStdString(name)).arg(socket_path);
+}
+
+void mp::NBDServer::accept_connections()
+{
+    while (true)
+    {
+        const auto fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        const auto error = errno;
+
+        std::lock_guard<std::mutex> lock{mutex};
+        if (stopping)
+        {
+            if (fd >= 0)
+                ::close(fd);
+            return;
+        }
+
+        if (fd < 0)
+        {
+            if (error == EINTR || error == ECONNABORTED)
+                continue;
+
+            mpl::log(mpl::Level::error, category,
+                     fmt::format("cannot accept connections on {}: {}", socket_path.toStdString(),
+                                 std::strerror(error)));
+            return;
+        }
+
+        connections.push_back(fd);
+        connection_threads.emplace_back([this, fd] {
+            serve(fd);
+
+            std::lock_guard<std::mutex> lock{mutex};
+            connections.erase(std::remove(connections.begin(), connections.end(), fd), connections.end());
+            ::close(fd);
+        });
+    }
+}
+
+void mp::NBDServer::serve(int fd)
+{
+    QByteArray greeting;
+    append(greeting, server_magic);
+    append(greeting, option_magic);
+    append(greeting, static_cast<quint16>(handshake_fixed_newstyle | handshake_no_zeroes));
+
+    quint32 client_flags;
+    if (!send(fd, greeting) || !receive(fd, client_flags))
+        return;
+
+    std::shared_ptr<const Export> image;
+    while (!image)
+    {
+        quint64 magic;
+        quint32 option, length;
+        if (!receive(fd, magic) || magic != option_magic || !receive(fd, option) || !receive(fd, length) ||
+            length > max_option_size)
+            return;
+
+        QByteArray data(static_cast<int>(length), '\0');
+        if (!receive(fd, data.data(), length))
+            return;
+
+        if (option == option_export_name)
+        {
+            // There is no reporting an unknown export to clients asking this way, other than by hanging up
+            image = export_named(data.toStdString());
+            if (!image)
+                return;
+
+            QByteArray reply;
+            append(reply, static_cast<quint64>(image->size));
+            append(reply, transmission_flags);
+            if (!(client_flags & client_no_zeroes))
+                reply.append(QByteArray(124, '\0'));
+
+            if (!send(fd, reply))
+                return;
+        }
+        else if (option == option_info || option == option_go)
+        {
+            // The export name comes first, the information requests that follow all get the same answer
+            quint32 name_length{0};
+            if (length >= sizeof name_length)
+                name_length = qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(data.constData()));
+
+            if (length < sizeof name_length || name_length > length - sizeof name_length)
+            {
+                if (!send_option_reply(fd, option, reply_error_invalid))
+                    return;
+                continue;
+            }
+
+            const auto name = data.mid(sizeof name_length, static_cast<int>(name_length));
+            const auto requested = export_named(name.toStdString());
+            if (!requested)
+            {
+                if (!send_option_reply(fd, option, reply_error_unknown))
+                    return;
+                continue;
+            }
+
+            QByteArray info;
+            append(info, info_export);
+            append(info, static_cast<quint64>(requested->size));
+            append(info, transmission_flags);
+
+            if (!send_option_reply(fd, option, reply_info, info) || !send_option_reply(fd, option, reply_ack))
+                return;
+
+            if (option == option_go)
+                image = requested;
+        }
+        else if (option == option_abort)
+        {
+            send_option_reply(fd, option, reply_ack);
+            return;
+        }
+        else if (!send_option_reply(fd, option, reply_error_unsupported))
+        {
+            return;
+        }
+    }
+
+    std::vector<char> buffer;
+    while (true)
+    {
+        quint32 magic, length;
+        quint16 flags, type;
+        quint64 handle, offset;
+        if (!receive(fd, magic) || magic != request_magic || !receive(fd, flags) || !receive(fd, type) ||
+            !receive(fd, handle) || !receive(fd, offset) || !receive(fd, length))
+            return;
+
+        if (type == command_disconnect)
+            return;
+
+        quint32 error{0};
+        if (type == command_read)
+        {
+            if (length > max_request_size || offset > static_cast<quint64>(image->size) ||
+                length > static_cast<quint64>(image->size) - offset)
+            {
+                error = error_invalid;
+            }
+            else
+            {
+                buffer.resize(length);
+                if (!image->read(buffer.data(), static_cast<int64_t>(offset), length))
+                    error = error_io;
+            }
+        }
+        else if (type == command_write)
+        {
+            // What is written has to be consumed to keep in step with the client, even though it is refused
+            buffer.resize(std::min(length, max_request_size));
+            if (length > max_request_size || !receive(fd, buffer.data(), length))
+                return;
+
+            error = error_perm;
+        }
+        else if (type != command_flush)
+        {
+            error = error_invalid;
+        }
+
+        QByteArray reply;
+        append(reply, simple_reply_magic);
+        append(reply, error);
+        append(reply, handle);
+
+        if (!send(fd, reply) || (type == command_read && !error && !send(fd, buffer.data(), length)))
+            return;
+    }
+}
+
+std::shared_ptr<const mp::NBDServer::Export> mp::NBDServer::export_named(const std::string& name)
+{
+    std::lock_guard<std::mutex> lock{mutex};
+    auto it = exports.find(name);
+
+    return it != exports.end() ? it->second : nullptr;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MULTIPASS_NBD_SERVER_H
+#define MULTIPASS_NBD_SERVER_H
+
+#include <multipass/path.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace multipass
+{
+// Serves read-only disk images to the local hypervisor over the NBD protocol, on a Unix socket, so that instances can
+// use images whose bytes come from somewhere other than a file, like an image still being downloaded
+class NBDServer
+{
+public:
+    // Returns false if the bytes cannot be read
+    using Reader = std::function<bool(char* data, int64_t offset, int64_t size)>;
+
+    explicit NBDServer(const Path& socket_path);
+    ~NBDServer();
+
+    void add_export(const std::string& name, int64_t size, const Reader& read);
+    void remove_export(const std::string& name);
+
+    // How QEMU refers to the export, in a backing file name for instance
+    QString url_for(const std::string& name) const;
+
+private:
+    struct Export
+    {
+        int64_t size;
+        Reader read;
+    };
+
+    NBDServer(const NBDServer&) = delete;
+    NBDServer& operator=(const NBDServer&) = delete;
+
+    void accept_connections();
+    void serve(int fd);
+    std::shared_ptr<const Export> export_named(const std::string& name);
+
+    const Path socket_path;
+    int listen_fd;
+
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<const Export>> exports;
+    std::vector<int> connections;
+    std::vector<std::thread> connection_threads;
+    bool stopping{false};
+
+    // Last, so that it starts once everything else is in place
+    std::thread acceptor;
+};
+} // namespace multipass
+#endif // MULTIPASS_NBD_SERVER_H
@@ -36,13 +36,27 @@ namespace
 {
 constexpr auto index_path = "streams/v1/index.json";
 
-auto download_manifest(const QString& host_url, mp::URLDownloader* url_downloader)
+// Returns nothing if the manifest did not change since it was last downloaded from the source
+std::unique_ptr<mp::SimpleStreamsManifest> download_manifest(const QString& host_url, mp::URLDownloader* url_downloader,
+                                                             mp::SimpleStreamsSource& source)
 {
-    auto json_index = url_downloader->download({host_url + index_path});
-    auto index = mp::SimpleStreamsIndex::fromJson(json_index);
+    auto json_index = url_downloader->download_if_changed({host_url + index_path}, source.index_validators);
+    if (json_index)
+    {
+        auto index = mp::SimpleStreamsIndex::fromJson(*json_index);
+        if (index.manifest_path != source.manifest_path)
+        {
+            source.manifest_path = index.manifest_path;
+            source.manifest_validators = {};
+        }
+    }
+
+    auto json_manifest =
+        url_downloader->download_if_changed({host_url + source.manifest_path}, source.manifest_validators);
+    if (!json_manifest)
+        return nullptr;
 
-    auto json_manifest = url_downloader->download({host_url + index.manifest_path});
-    return mp::SimpleStreamsManifest::fromJson(json_manifest);
+    return mp::SimpleStreamsManifest::fromJson(*json_manifest);
 }
 
 mp::VMImageInfo with_location_fully_resolved(const QString& host_url, const mp::VMImageInfo& info)
@@ -57,7 +71,8 @@ mp::VMImageInfo with_location_fully_resolved(const QString& host_url, const mp::
             host_url + info.initrd_location,
             info.id,
             info.version,
-            info.size};
+            info.size,
+            info.delta_signature_location.isEmpty() ? QString{} : host_url + info.delta_signature_location};
 }
 
 auto key_from(const std::string& search_string)
@@ -70,38 +85,40 @@ auto key_from(const std::string& search_string)
 } // namespace
 
 mp::UbuntuVMImageHost::UbuntuVMImageHost(std::vector<std::pair<std::string, std::string>> remotes,
-                                         URLDownloader* downloader, std::chrono::seconds manifest_time_to_live)
-    : CommonVMImageHost{manifest_time_to_live}, url_downloader{downloader}, remotes{std::move(remotes)}
+                                         URLDownloader* downloader, std::chrono::seconds manifest_time_to_live,
+                                         const CatalogueCache& catalogue_cache)
+    : CommonVMImageHost{manifest_time_to_live},
+      manifests{std::make_shared<const Manifests>()},
+      url_downloader{downloader},
+      remotes{std::move(remotes)},
+      catalogue_cache{catalogue_cache}
+{
+    restore_catalogue();
+}
+
+mp::UbuntuVMImageHost::~UbuntuVMImageHost()
 {
+    wait_for_refresh();
 }
 
 mp::optional<mp::VMImageInfo> mp::UbuntuVMImageHost::info_for(const Query& query)
 {
     auto key = key_from(query.release);
-    mp::SimpleStreamsManifest* manifest;
     const VMImageInfo* info{nullptr};
 
     auto remote_name = query.remote_name.empty() ? release_remote : query.remote_name;
 
-    manifest = manifest_from(remote_name);
+    const auto manifest = manifest_from(remote_name);
     match_alias(key, &info, *manifest);
 
     if (!info)
     {
-        int num_matches = 0;
-
-        auto predicate = [&](const VMImageInfo& entry) {
-            auto partial_match = false;
-            if (entry.id.startsWith(key))
-            {
-                info = &entry;
-                partial_match = true;
-            }
-            return partial_match;
-        };
-        num_matches += std::count_if(manifest->products.begin(), manifest->products.end(), predicate);
-        if (num_matches > 1)
+        const auto matches = manifest->products_with_id_prefix(key);
+        if (matches.size() > 1)
             throw std::runtime_error(fmt::format("Too many images matching \"{}\"", query.release));
+
+        if (!matches.empty())
+            info = matches.front();
     }
 
     if (info)
@@ -120,12 +137,11 @@ std::vector<mp::VMImageInfo> mp::UbuntuVMImageHost::all_info_for(const Query& qu
     std::vector<mp::VMImageInfo> images;
 
     auto key = key_from(query.release);
-    mp::SimpleStreamsManifest* manifest;
     const VMImageInfo* info{nullptr};
 
     auto remote_name = query.remote_name.empty() ? release_remote : query.remote_name;
 
-    manifest = manifest_from(remote_name);
+    const auto manifest = manifest_from(remote_name);
     match_alias(key, &info, *manifest);
 
     if (info)
@@ -139,14 +155,14 @@ std::vector<mp::VMImageInfo> mp::UbuntuVMImageHost::all_info_for(const Query& qu
     {
         std::unordered_set<std::string> found_hashes;
 
-        for (const auto& entry : manifest->products)
+        for (const auto entry : manifest->products_with_id_prefix(key))
         {
-            if (entry.id.startsWith(key) && (entry.supported || query.allow_unsupported) &&
-                found_hashes.find(entry.id.toStdString()) == found_hashes.end())
+            if ((entry->supported || query.allow_unsupported) &&
+                found_hashes.find(entry->id.toStdString()) == found_hashes.end())
             {
                 images.push_back(
-                    with_location_fully_resolved(QString::fromStdString(remote_url_from(remote_name)), entry));
-                found_hashes.insert(entry.id.toStdString());
+                    with_location_fully_resolved(QString::fromStdString(remote_url_from(remote_name)), *entry));
+                found_hashes.insert(entry->id.toStdString());
             }
         }
     }
@@ -159,27 +175,26 @@ std::vector<mp::VMImageInfo> mp::UbuntuVMImageHost::all_info_for(const Query& qu
 
 mp::VMImageInfo mp::UbuntuVMImageHost::info_for_full_hash_impl(const std::string& full_hash)
 {
-    for (const auto& manifest : manifests)
+    const auto id = QString::fromStdString(full_hash);
+    for (const auto& manifest : *std::atomic_load(&manifests))
     {
-        for (const auto& product : manifest.second->products)
+        auto it = manifest.second->image_records.find(id);
+        if (it != manifest.second->image_records.end() && it.value()->id == id)
         {
-            if (product.id.toStdString() == full_hash)
-            {
-                return with_location_fully_resolved(QString::fromStdString(remote_url_from(manifest.first)), product);
-            }
+            return with_location_fully_resolved(QString::fromStdString(remote_url_from(manifest.first)), *it.value());
         }
     }
 
     throw std::runtime_error(fmt::format("Unable to find an image matching hash \"{}\"", full_hash));
 
-    return mp::VMImageInfo{{}, {}, {}, {}, {}, {}, {}, {}, {}, {}, -1};
+    return mp::VMImageInfo{{}, {}, {}, {}, {}, {}, {}, {}, {}, {}, -1, {}};
 }
 
 std::vector<mp::VMImageInfo> mp::UbuntuVMImageHost::all_images_for(const std::string& remote_name,
                                                                    const bool allow_unsupported)
 {
     std::vector<mp::VMImageInfo> images;
-    auto manifest = manifest_from(remote_name);
+    const auto manifest = manifest_from(remote_name);
 
     for (const auto& entry : manifest->products)
     {
@@ -197,7 +212,7 @@ std::vector<mp::VMImageInfo> mp::UbuntuVMImageHost::all_images_for(const std::st
 
 void mp::UbuntuVMImageHost::for_each_entry_do_impl(const Action& action)
 {
-    for (const auto& manifest : manifests)
+    for (const auto& manifest : *std::atomic_load(&manifests))
     {
         for (const auto& product : manifest.second->products)
         {
@@ -221,38 +236,159 @@ std::vector<std::string> mp::UbuntuVMImageHost::supported_remotes()
 
 void mp::UbuntuVMImageHost::fetch_manifests()
 {
+    auto updated_manifests = *std::atomic_load(&manifests);
+    auto find_manifest = [&updated_manifests](const std::string& remote_name) {
+        return std::find_if(
+            updated_manifests.begin(), updated_manifests.end(),
+            [&remote_name](const std::pair<std::string, std::shared_ptr<const SimpleStreamsManifest>>& element) {
+                return element.first == remote_name;
+            });
+    };
+
+    // Validators are updated on copies of the sources, only replacing the originals along with their manifest.
+    // Otherwise a manifest that failed to parse would be taken to be at hand, and never downloaded again.
+    std::vector<SimpleStreamsSource> staged_sources;
     for (const auto& remote : remotes)
     {
+        // Without a manifest to keep, the validators of the last one are no use
+        if (find_manifest(remote.first) == updated_manifests.end())
+            manifest_sources.erase(remote.first);
+
+        const auto source = manifest_sources.find(remote.first);
+        staged_sources.push_back(source != manifest_sources.end() ? source->second : SimpleStreamsSource{});
+    }
+
+    std::vector<std::unique_ptr<SimpleStreamsManifest>> downloaded_manifests(remotes.size());
+    std::vector<char> succeeded(remotes.size(), false);
+    fetch_concurrently(remotes.size(), [this, &staged_sources, &downloaded_manifests, &succeeded](std::size_t i) {
         try
         {
-            manifests.emplace_back(
-                std::make_pair(remote.first, download_manifest(QString::fromStdString(remote.second), url_downloader)));
+            downloaded_manifests[i] =
+                download_manifest(QString::fromStdString(remotes[i].second), url_downloader, staged_sources[i]);
+            succeeded[i] = true;
         }
-        catch (mp::DownloadException& e)
+        catch (const std::exception& e)
         {
+            // The manifest at hand keeps being served while the remote is unreachable or serves a broken one
             on_manifest_update_failure(e.what());
         }
+    });
+
+    auto fetched = false;
+    for (std::size_t i = 0; i < remotes.size(); ++i)
+    {
+        if (!succeeded[i])
+            continue;
+
+        manifest_sources[remotes[i].first] = staged_sources[i];
+
+        // The manifest at hand is kept untouched when the remote's did not change
+        auto& manifest = downloaded_manifests[i];
+        if (!manifest)
+            continue;
+
+        auto it = find_manifest(remotes[i].first);
+        if (it != updated_manifests.end())
+            it->second = std::move(manifest);
+        else
+            updated_manifests.emplace_back(remotes[i].first, std::move(manifest));
+
+        fetched = true;
+    }
+
+    if (fetched)
+    {
+        auto snapshot = std::make_shared<const Manifests>(std::move(updated_manifests));
+        std::atomic_store(&manifests, snapshot);
+
+        save_catalogue(*snapshot);
     }
 }
 
-void mp::UbuntuVMImageHost::clear()
+bool mp::UbuntuVMImageHost::has_manifests()
+{
+    return !std::atomic_load(&manifests)->empty();
+}
+
+void mp::UbuntuVMImageHost::restore_catalogue()
+{
+    Manifests restored_manifests;
+    std::unordered_map<std::string, SimpleStreamsSource> restored_sources;
+
+    const auto restored = catalogue_cache.load([this, &restored_manifests, &restored_sources](QDataStream& stream) {
+        QSet<QString> strings;
+        quint32 manifest_count{0};
+        stream >> manifest_count;
+
+        for (quint32 i = 0; i < manifest_count && stream.status() == QDataStream::Ok; ++i)
+        {
+            QString remote_name, remote_url, updated_at;
+            SimpleStreamsSource source;
+            quint32 product_count{0};
+            stream >> remote_name >> remote_url >> source.index_validators.etag >>
+                source.index_validators.last_modified >> source.manifest_path >> source.manifest_validators.etag >>
+                source.manifest_validators.last_modified >> updated_at >> product_count;
+
+            std::vector<VMImageInfo> products;
+            for (quint32 j = 0; j < product_count && stream.status() == QDataStream::Ok; ++j)
+                products.push_back(read_image_info(stream, strings));
+
+            // Remotes may have been configured differently since the catalogue was saved
+            const auto name = remote_name.toStdString();
+            if (products.empty() || remote_url.isEmpty() || remote_url.toStdString() != remote_url_from(name))
+                continue;
+
+            restored_sources[name] = std::move(source);
+            restored_manifests.emplace_back(name, SimpleStreamsManifest::fromProducts(updated_at, std::move(products)));
+        }
+    });
+
+    if (!restored)
+        return;
+
+    const auto restored_count = restored_manifests.size();
+    std::atomic_store(&manifests, std::make_shared<const Manifests>(std::move(restored_manifests)));
+    manifest_sources = std::move(restored_sources);
+
+    // Remotes missing from the catalogue are still waited on when first needed
+    if (restored_count == remotes.size())
+        on_manifests_restored();
+}
+
+void mp::UbuntuVMImageHost::save_catalogue(const Manifests& saved_manifests)
 {
-    manifests.clear();
+    catalogue_cache.save([this, &saved_manifests](QDataStream& stream) {
+        stream << static_cast<quint32>(saved_manifests.size());
+
+        for (const auto& manifest : saved_manifests)
+        {
+            const auto& source = manifest_sources[manifest.first];
+            stream << QString::fromStdString(manifest.first) << QString::fromStdString(remote_url_from(manifest.first))
+                   << source.index_validators.etag << source.index_validators.last_modified << source.manifest_path
+                   << source.manifest_validators.etag << source.manifest_validators.last_modified
+                   << manifest.second->updated_at << static_cast<quint32>(manifest.second->products.size());
+
+            for (const auto& product : manifest.second->products)
+                stream << product;
+        }
+    });
 }
 
-mp::SimpleStreamsManifest* mp::UbuntuVMImageHost::manifest_from(const std::string& remote)
+std::shared_ptr<const mp::SimpleStreamsManifest> mp::UbuntuVMImageHost::manifest_from(const std::string& remote)
 {
     update_manifests();
 
-    auto it = std::find_if(manifests.begin(), manifests.end(),
-                           [&remote](const std::pair<std::string, std::unique_ptr<SimpleStreamsManifest>>& element) {
-                               return element.first == remote;
-                           });
+    const auto snapshot = std::atomic_load(&manifests);
+    auto it = std::find_if(
+        snapshot->cbegin(), snapshot->cend(),
+        [&remote](const std::pair<std::string, std::shared_ptr<const SimpleStreamsManifest>>& element) {
+            return element.first == remote;
+        });
 
-    if (it == manifests.cend())
+    if (it == snapshot->cend())
         throw std::runtime_error(fmt::format("Remote \"{}\" is unknown or unreachable.", remote));
 
-    return it->second.get();
+    return it->second;
 }
 
 void mp::UbuntuVMImageHost::match_alias(const QString& key, const VMImageInfo** info,
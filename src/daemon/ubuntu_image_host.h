@@ -18,12 +18,16 @@
 #ifndef MULTIPASS_UBUNTU_IMAGE_HOST_H
 #define MULTIPASS_UBUNTU_IMAGE_HOST_H
 
+#include "catalogue_cache.h"
 #include "common_image_host.h"
 #include "multipass/simple_streams_manifest.h"
+#include "multipass/url_downloader.h"
 
 #include <QString>
 
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace multipass
@@ -31,12 +35,20 @@ namespace multipass
 constexpr auto release_remote = "release";
 constexpr auto daily_remote = "daily";
 
-class URLDownloader;
+// Where a remote's manifest comes from, along with the validators of what was last fetched from there
+struct SimpleStreamsSource
+{
+    URLDownloader::Validators index_validators;
+    QString manifest_path;
+    URLDownloader::Validators manifest_validators;
+};
+
 class UbuntuVMImageHost final : public CommonVMImageHost
 {
 public:
     UbuntuVMImageHost(std::vector<std::pair<std::string, std::string>> remotes, URLDownloader* downloader,
-                      std::chrono::seconds manifest_time_to_live);
+                      std::chrono::seconds manifest_time_to_live, const CatalogueCache& catalogue_cache = {});
+    ~UbuntuVMImageHost();
 
     optional<VMImageInfo> info_for(const Query& query) override;
     std::vector<VMImageInfo> all_info_for(const Query& query) override;
@@ -47,14 +59,22 @@ protected:
     void for_each_entry_do_impl(const Action& action) override;
     VMImageInfo info_for_full_hash_impl(const std::string& full_hash) override;
     void fetch_manifests() override;
-    void clear() override;
+    bool has_manifests() override;
 
 private:
-    SimpleStreamsManifest* manifest_from(const std::string& remote);
+    using Manifests = std::vector<std::pair<std::string, std::shared_ptr<const SimpleStreamsManifest>>>;
+
+    void restore_catalogue();
+    void save_catalogue(const Manifests& saved_manifests);
+
+    std::shared_ptr<const SimpleStreamsManifest> manifest_from(const std::string& remote);
     void match_alias(const QString& key, const VMImageInfo** info, const SimpleStreamsManifest& manifest);
-    std::vector<std::pair<std::string, std::unique_ptr<SimpleStreamsManifest>>> manifests;
+    // Replaced as a whole whenever a manifest changes, and only ever accessed atomically
+    std::shared_ptr<const Manifests> manifests;
     URLDownloader* const url_downloader;
     std::vector<std::pair<std::string, std::string>> remotes;
+    std::unordered_map<std::string, SimpleStreamsSource> manifest_sources;
+    const CatalogueCache catalogue_cache;
     std::string remote_url_from(const std::string& remote_name);
     QString index_path;
 };
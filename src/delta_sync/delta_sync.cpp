@@ -0,0 +1,336 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <multipass/delta_sync.h>
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QIODevice>
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace mp = multipass;
+
+namespace
+{
+constexpr uint32_t adler_modulus{65521u};
+constexpr int64_t min_block_size{2048};
+constexpr int64_t max_block_size{131072};
+constexpr qint8 copy_op{'C'};
+constexpr qint8 data_op{'D'};
+
+constexpr int64_t max_literal_size{1 << 26};
+
+void write_literal(QDataStream& stream, const char* data, int64_t length)
+{
+    for (int64_t offset = 0; offset < length; offset += max_literal_size)
+    {
+        const auto size = std::min(max_literal_size, length - offset);
+
+        stream << data_op << static_cast<quint64>(size);
+        stream.writeRawData(data + offset, static_cast<int>(size));
+    }
+}
+} // namespace
+
+mp::delta_sync::RollingChecksum::RollingChecksum(const char* data, int64_t length) : a{1u}, b{0u}, length{length}
+{
+    for (int64_t i = 0; i < length; ++i)
+    {
+        a = (a + static_cast<unsigned char>(data[i])) % adler_modulus;
+        b = (b + a) % adler_modulus;
+    }
+}
+
+void mp::delta_sync::RollingChecksum::roll(unsigned char out, unsigned char in)
+{
+    const int64_t modulus{adler_modulus};
+
+    a = static_cast<uint32_t>(((static_cast<int64_t>(a) - out + in) % modulus + modulus) % modulus);
+    b = static_cast<uint32_t>(
+        ((static_cast<int64_t>(b) - (length % modulus) * out + a - 1) % modulus + modulus) % modulus);
+}
+
+uint32_t mp::delta_sync::RollingChecksum::value() const
+{
+    return (b << 16) | a;
+}
+
+int64_t mp::delta_sync::block_size_for(int64_t file_size)
+{
+    // Same heuristic as rsync: roughly sqrt(file size), so the signature grows with sqrt(file size) too
+    auto block_size = static_cast<int64_t>(std::sqrt(static_cast<double>(file_size)));
+    block_size = (block_size + 1023) & ~int64_t{1023};
+
+    return std::min(std::max(block_size, min_block_size), max_block_size);
+}
+
+std::string mp::delta_sync::strong_checksum(const char* data, int64_t length)
+{
+    return QCryptographicHash::hash(QByteArray::fromRawData(data, static_cast<int>(length)), QCryptographicHash::Md5)
+        .toHex()
+        .toStdString();
+}
+
+mp::delta_sync::Signature mp::delta_sync::signature_for(const char* data, int64_t length, int64_t block_size)
+{
+    Signature signature{block_size, {}};
+
+    for (int64_t offset = 0; offset < length; offset += block_size)
+    {
+        const auto size = std::min(block_size, length - offset);
+        signature.blocks.push_back({RollingChecksum(data + offset, size).value(), strong_checksum(data + offset, size)});
+    }
+
+    return signature;
+}
+
+mp::delta_sync::FileSignature mp::delta_sync::file_signature_for(const char* data, int64_t length)
+{
+    return {length, signature_for(data, length, block_size_for(length))};
+}
+
+QByteArray mp::delta_sync::to_text(const FileSignature& file_signature)
+{
+    QByteArray text;
+    text += QByteArray::number(static_cast<qlonglong>(file_signature.signature.block_size)) + ' ' +
+            QByteArray::number(static_cast<qlonglong>(file_signature.length)) + '\n';
+
+    for (const auto& block : file_signature.signature.blocks)
+        text += QByteArray::number(block.weak) + ' ' + QByteArray::fromStdString(block.strong) + '\n';
+
+    return text;
+}
+
+mp::delta_sync::FileSignature mp::delta_sync::parse_file_signature(const QByteArray& text)
+{
+    const auto lines = text.split('\n');
+    const auto header = lines.front().split(' ');
+    if (header.size() != 2)
+        throw std::runtime_error("invalid signature header");
+
+    bool block_size_ok{false}, length_ok{false};
+    const auto block_size = header[0].toLongLong(&block_size_ok);
+    const auto length = header[1].toLongLong(&length_ok);
+    if (!block_size_ok || !length_ok || block_size <= 0 || length < 0)
+        throw std::runtime_error("invalid signature header");
+
+    FileSignature file_signature{length, {block_size, {}}};
+    for (auto i = 1; i < lines.size(); ++i)
+    {
+        if (lines[i].isEmpty())
+            continue;
+
+        const auto fields = lines[i].split(' ');
+        bool ok{false};
+        const auto weak = fields.size() == 2 ? fields[0].toUInt(&ok) : 0u;
+        if (!ok)
+            throw std::runtime_error("invalid signature line");
+
+        file_signature.signature.blocks.push_back({weak, fields[1].toStdString()});
+    }
+
+    if (static_cast<int64_t>(file_signature.signature.blocks.size()) != (length + block_size - 1) / block_size)
+        throw std::runtime_error("truncated signature");
+
+    return file_signature;
+}
+
+// The basis is scanned with a rolling window, as write_delta does, but for the blocks of the target rather than
+// against the blocks of the basis
+std::vector<int64_t> mp::delta_sync::locate_blocks(const char* data, int64_t length, const FileSignature& target)
+{
+    const auto block_size = target.signature.block_size;
+    if (block_size <= 0)
+        throw std::runtime_error("invalid delta block size");
+
+    const auto& blocks = target.signature.blocks;
+    const auto block_count = static_cast<int64_t>(blocks.size());
+    const auto last_size = block_count > 0 ? target.length - (block_count - 1) * block_size : 0;
+    const auto full_blocks = last_size == block_size ? block_count : block_count - 1;
+
+    std::vector<int64_t> offsets(blocks.size(), -1);
+    std::unordered_map<uint32_t, std::vector<int64_t>> blocks_by_weak;
+    for (int64_t i = 0; i < full_blocks; ++i)
+        blocks_by_weak[blocks[i].weak].push_back(i);
+
+    auto missing = full_blocks;
+    int64_t pos{0};
+
+    if (missing > 0 && length >= block_size)
+    {
+        RollingChecksum checksum{data, block_size};
+        while (true)
+        {
+            auto match = blocks_by_weak.find(checksum.value());
+            if (match != blocks_by_weak.end() &&
+                std::any_of(match->second.cbegin(), match->second.cend(),
+                            [&offsets](int64_t index) { return offsets[index] < 0; }))
+            {
+                const auto strong = strong_checksum(data + pos, block_size);
+                auto matched = false;
+
+                // Blocks the target repeats, zeroed ones above all, are all found at once
+                for (const auto index : match->second)
+                {
+                    if (offsets[index] < 0 && blocks[index].strong == strong)
+                    {
+                        offsets[index] = pos;
+                        --missing;
+                        matched = true;
+                    }
+                }
+
+                if (missing == 0)
+                    break;
+
+                if (matched && pos + 2 * block_size <= length)
+                {
+                    pos += block_size;
+                    checksum = RollingChecksum{data + pos, block_size};
+                    continue;
+                }
+            }
+
+            if (pos + block_size >= length)
+                break;
+
+            checksum.roll(static_cast<unsigned char>(data[pos]), static_cast<unsigned char>(data[pos + block_size]));
+            ++pos;
+        }
+    }
+
+    // A short trailing block is looked for where it is in the target, and at the end of data
+    if (full_blocks < block_count && last_size > 0)
+    {
+        const auto& last = blocks.back();
+        for (const auto offset : {full_blocks * block_size, length - last_size})
+        {
+            if (offset >= 0 && offset + last_size <= length &&
+                RollingChecksum(data + offset, last_size).value() == last.weak &&
+                strong_checksum(data + offset, last_size) == last.strong)
+            {
+                offsets.back() = offset;
+                break;
+            }
+        }
+    }
+
+    return offsets;
+}
+
+mp::delta_sync::DeltaStats mp::delta_sync::write_delta(const char* data, int64_t length, const Signature& basis,
+                                                        QIODevice& output)
+{
+    const auto block_size = basis.block_size;
+    if (block_size <= 0)
+        throw std::runtime_error("invalid delta block size");
+
+    // A short trailing block in the basis never matches a full window, its strong checksum covers fewer bytes
+    std::unordered_map<uint32_t, std::vector<int64_t>> blocks_by_weak;
+    for (auto i = 0u; i < basis.blocks.size(); ++i)
+        blocks_by_weak[basis.blocks[i].weak].push_back(i);
+
+    QDataStream stream{&output};
+    stream.setByteOrder(QDataStream::BigEndian);
+
+    DeltaStats stats{0, 0};
+    int64_t literal_start{0};
+    int64_t pos{0};
+
+    if (length < block_size)
+    {
+        write_literal(stream, data, length);
+        return {0, length};
+    }
+
+    RollingChecksum checksum{data, block_size};
+    while (pos + block_size <= length)
+    {
+        auto match = blocks_by_weak.find(checksum.value());
+        if (match != blocks_by_weak.end())
+        {
+            const auto strong = strong_checksum(data + pos, block_size);
+            auto block = std::find_if(match->second.cbegin(), match->second.cend(),
+                                      [&basis, &strong](int64_t index) { return basis.blocks[index].strong == strong; });
+
+            if (block != match->second.cend())
+            {
+                write_literal(stream, data + literal_start, pos - literal_start);
+                stats.literal_bytes += pos - literal_start;
+
+                stream << copy_op << static_cast<quint64>(*block);
+                ++stats.matched_blocks;
+
+                pos += block_size;
+                literal_start = pos;
+                if (pos + block_size <= length)
+                    checksum = RollingChecksum{data + pos, block_size};
+                continue;
+            }
+        }
+
+        if (pos + block_size == length)
+            break;
+
+        checksum.roll(static_cast<unsigned char>(data[pos]), static_cast<unsigned char>(data[pos + block_size]));
+        ++pos;
+    }
+
+    write_literal(stream, data + literal_start, length - literal_start);
+    stats.literal_bytes += length - literal_start;
+
+    if (stream.status() != QDataStream::Ok)
+        throw std::runtime_error("failed to write delta");
+
+    return stats;
+}
+
+QByteArray mp::delta_sync::apply_delta(const QByteArray& basis, const QByteArray& delta, int64_t block_size)
+{
+    QByteArray result;
+    QDataStream stream{delta};
+    stream.setByteOrder(QDataStream::BigEndian);
+
+    while (!stream.atEnd())
+    {
+        qint8 op;
+        quint64 value;
+        stream >> op >> value;
+
+        if (op == copy_op)
+        {
+            result.append(basis.mid(static_cast<int>(value * block_size), static_cast<int>(block_size)));
+        }
+        else if (op == data_op)
+        {
+            QByteArray literal(static_cast<int>(value), '\0');
+            if (stream.readRawData(literal.data(), literal.size()) != literal.size())
+                throw std::runtime_error("truncated delta");
+            result.append(literal);
+        }
+        else
+        {
+            throw std::runtime_error("invalid delta record");
+        }
+    }
+
+    return result;
+}
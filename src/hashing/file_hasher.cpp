@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <multipass/file_hasher.h>
+#include <multipass/sha256.h>
+
+#include <fmt/format.h>
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+
+#include <sys/mman.h>
+
+namespace mp = multipass;
+
+namespace
+{
+constexpr int64_t read_size{4 * 1024 * 1024};
+
+std::string hash_file(const mp::Path& file_path)
+{
+    QFile file{file_path};
+    if (!file.open(QIODevice::ReadOnly))
+        throw std::runtime_error(
+            fmt::format("cannot open {} for hashing: {}", file_path.toStdString(), file.errorString().toStdString()));
+
+    mp::Sha256 hash;
+    const auto size = file.size();
+
+    if (const auto data = size > 0 ? file.map(0, size) : nullptr)
+    {
+        // The whole file is read front to back exactly once
+        ::madvise(data, static_cast<size_t>(size), MADV_SEQUENTIAL);
+        hash.add_data(reinterpret_cast<const char*>(data), size);
+        file.unmap(data);
+
+        return hash.hex_result();
+    }
+
+    std::vector<char> buffer(read_size);
+    qint64 bytes_read;
+    while ((bytes_read = file.read(buffer.data(), read_size)) > 0)
+        hash.add_data(buffer.data(), bytes_read);
+
+    if (bytes_read < 0)
+        throw std::runtime_error(
+            fmt::format("cannot read {} for hashing: {}", file_path.toStdString(), file.errorString().toStdString()));
+
+    return hash.hex_result();
+}
+} // namespace
+
+mp::FileHasher::FileHasher(const Path& cache_file_path) : cache_file_path{cache_file_path}
+{
+    if (cache_file_path.isEmpty())
+        return;
+
+    QFile cache_file{cache_file_path};
+    if (!cache_file.open(QIODevice::ReadOnly))
+        return;
+
+    const auto records = QJsonDocument::fromJson(cache_file.readAll()).object();
+    for (auto it = records.constBegin(); it != records.constEnd(); ++it)
+    {
+        const auto record = it.value().toObject();
+        digests[it.key().toStdString()] = {static_cast<int64_t>(record["size"].toDouble()),
+                                           static_cast<int64_t>(record["last_modified"].toDouble()),
+                                           record["sha256"].toString().toStdString()};
+    }
+}
+
+std::string mp::FileHasher::sha256_of(const Path& file_path)
+{
+    bool hashed{false};
+    auto sha256 = cached_sha256_of(file_path, hashed);
+
+    if (hashed)
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        persist();
+    }
+
+    return sha256;
+}
+
+std::string mp::FileHasher::cached_sha256_of(const Path& file_path, bool& hashed)
+{
+    const QFileInfo info{file_path};
+    const auto key = info.absoluteFilePath().toStdString();
+    const auto size = info.size();
+    const auto last_modified = info.lastModified().toMSecsSinceEpoch();
+
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        const auto it = digests.find(key);
+        if (it != digests.end() && it->second.size == size && it->second.last_modified == last_modified)
+            return it->second.sha256;
+    }
+
+    const auto sha256 = hash_file(file_path);
+    hashed = true;
+
+    std::lock_guard<std::mutex> lock{mutex};
+    digests[key] = {size, last_modified, sha256};
+
+    return sha256;
+}
+
+std::vector<std::string> mp::FileHasher::sha256_of(const std::vector<Path>& file_paths)
+{
+    std::vector<std::string> results(file_paths.size());
+    std::vector<std::exception_ptr> errors(file_paths.size());
+    std::atomic<size_t> next_file{0};
+    std::atomic<bool> any_hashed{false};
+
+    auto hash_files = [&] {
+        for (auto i = next_file++; i < file_paths.size(); i = next_file++)
+        {
+            try
+            {
+                bool hashed{false};
+                results[i] = cached_sha256_of(file_paths[i], hashed);
+                if (hashed)
+                    any_hashed = true;
+            }
+            catch (...)
+            {
+                errors[i] = std::current_exception();
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    const auto worker_count = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), file_paths.size());
+    for (size_t i = 1; i < worker_count; ++i)
+        workers.emplace_back(hash_files);
+
+    hash_files();
+    for (auto& worker : workers)
+        worker.join();
+
+    if (any_hashed)
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        persist();
+    }
+
+    for (const auto& error : errors)
+    {
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    return results;
+}
+
+// Called with the digests locked. The digests of files that are gone are dropped rather than kept forever.
+void mp::FileHasher::persist()
+{
+    if (cache_file_path.isEmpty())
+        return;
+
+    for (auto it = digests.begin(); it != digests.end();)
+    {
+        if (QFileInfo::exists(QString::fromStdString(it->first)))
+            ++it;
+        else
+            it = digests.erase(it);
+    }
+
+    QJsonObject records;
+    for (const auto& digest : digests)
+    {
+        QJsonObject record;
+        record.insert("size", static_cast<double>(digest.second.size));
+        record.insert("last_modified", static_cast<double>(digest.second.last_modified));
+        record.insert("sha256", QString::fromStdString(digest.second.sha256));
+        records.insert(QString::fromStdString(digest.first), record);
+    }
+
+    // Failing to remember a digest only means hashing the file again next time
+    QDir().mkpath(QFileInfo{cache_file_path}.absolutePath());
+    QSaveFile cache_file{cache_file_path};
+    if (cache_file.open(QIODevice::WriteOnly))
+    {
+        cache_file.write(QJsonDocument{records}.toJson());
+        cache_file.commit();
+    }
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <multipass/sha256.h>
+
+#include <QDataStream>
+
+#include <openssl/sha.h>
+
+
+namespace mp = multipass;
+
+namespace
+{
+// The state is written field by field rather than as the bytes of the OpenSSL context, whose layout is not ours
+// to rely on across versions and builds
+constexpr quint32 state_magic{0x53484132}; // "SHA2"
+constexpr quint32 state_version{1};
+} // namespace
+
+mp::Sha256::Sha256() : context{std::make_unique<SHA256_CTX>()}
+{
+    SHA256_Init(context.get());
+}
+
+mp::Sha256::~Sha256() = default;
+
+void mp::Sha256::add_data(const char* data, int64_t size)
+{
+    SHA256_Update(context.get(), data, static_cast<size_t>(size));
+}
+
+std::string mp::Sha256::hex_result() const
+{
+    auto final_context = *context;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256_Final(digest, &final_context);
+
+    return QByteArray::fromRawData(reinterpret_cast<const char*>(digest), sizeof(digest)).toHex().toStdString();
+}
+
+// Magic and version, the eight words of the hash so far, the message length in bits and the bytes of the block
+// that is yet to be hashed
+QByteArray mp::Sha256::state() const
+{
+    QByteArray state;
+    QDataStream stream{&state, QIODevice::WriteOnly};
+
+    stream << state_magic << state_version;
+    for (const auto word : context->h)
+        stream << quint32{word};
+    stream << quint32{context->Nl} << quint32{context->Nh} << quint32{context->num};
+    stream.writeRawData(reinterpret_cast<const char*>(context->data), static_cast<int>(context->num));
+
+    return state;
+}
+
+bool mp::Sha256::restore(const QByteArray& state)
+{
+    QDataStream stream{state};
+
+    quint32 magic{0}, version{0};
+    stream >> magic >> version;
+    if (stream.status() != QDataStream::Ok || magic != state_magic || version != state_version)
+        return false;
+
+    SHA256_CTX restored;
+    SHA256_Init(&restored);
+
+    quint32 value{0};
+    for (auto& word : restored.h)
+    {
+        stream >> value;
+        word = value;
+    }
+
+    quint32 bits_low{0}, bits_high{0}, pending{0};
+    stream >> bits_low >> bits_high >> pending;
+
+    // What is left of the block has to match the length hashed so far
+    if (stream.status() != QDataStream::Ok || pending >= SHA256_CBLOCK || (bits_low / 8) % SHA256_CBLOCK != pending)
+        return false;
+
+    if (stream.readRawData(reinterpret_cast<char*>(restored.data), static_cast<int>(pending)) !=
+            static_cast<int>(pending) ||
+        !stream.atEnd())
+        return false;
+
+    restored.Nl = bits_low;
+    restored.Nh = bits_high;
+    restored.num = pending;
+    *context = restored;
+
+    return true;
+}
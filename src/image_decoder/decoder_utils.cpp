@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "decoder_utils.h"
+
+#include <multipass/rpc/multipass.grpc.pb.h>
+
+#include <fmt/format.h>
+
+#include <QIODevice>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+namespace mp = multipass;
+namespace mpd = multipass::decoding;
+
+namespace
+{
+// Zeroed blocks of decoded output are left as holes rather than written
+constexpr size_t sparse_block_size = 4096;
+
+bool is_zero(const char* data, size_t size)
+{
+    return data[0] == 0 && std::memcmp(data, data + 1, size - 1) == 0;
+}
+
+// Calls write(offset, size) for every run of data that is not zeroed
+template <typename WriteAction>
+void for_each_data_run(const char* data, size_t size, const WriteAction& write)
+{
+    size_t run_start{0};
+    for (size_t offset = 0; offset < size; offset += sparse_block_size)
+    {
+        const auto block_size = std::min(sparse_block_size, size - offset);
+        if (!is_zero(data + offset, block_size))
+            continue;
+
+        if (offset > run_start)
+            write(run_start, offset - run_start);
+        run_start = offset + block_size;
+    }
+
+    if (size > run_start)
+        write(run_start, size - run_start);
+}
+
+[[noreturn]] void throw_write_error(const QIODevice& decoded_file)
+{
+    throw std::runtime_error(
+        fmt::format("failed to write decoded image: {}", decoded_file.errorString().toStdString()));
+}
+} // namespace
+
+void mpd::write_sparse(QIODevice& decoded_file, const char* data, size_t size)
+{
+    const auto write = [&decoded_file, data](size_t offset, size_t length) {
+        if (decoded_file.write(data + offset, length) < 0)
+            throw_write_error(decoded_file);
+    };
+
+    if (decoded_file.isSequential())
+    {
+        write(0, size);
+        return;
+    }
+
+    const auto start = decoded_file.pos();
+    const auto seek = [&decoded_file](qint64 pos) {
+        if (!decoded_file.seek(pos))
+            throw_write_error(decoded_file);
+    };
+
+    for_each_data_run(data, size, [&](size_t offset, size_t length) {
+        seek(start + offset);
+        write(offset, length);
+    });
+    seek(start + size);
+}
+
+void mpd::pwrite_sparse(int decoded_fd, const char* data, size_t size, int64_t offset)
+{
+    for_each_data_run(data, size, [&](size_t run_offset, size_t length) {
+        for (size_t written = 0; written < length;)
+        {
+            const auto ret = ::pwrite(decoded_fd, data + run_offset + written, length - written,
+                                      static_cast<off_t>(offset + run_offset + written));
+            if (ret < 0)
+                throw std::runtime_error(fmt::format("failed to write decoded image: {}", std::strerror(errno)));
+            written += ret;
+        }
+    });
+}
+
+void mpd::extend_to_position(QIODevice& decoded_file)
+{
+    if (decoded_file.isSequential() || decoded_file.pos() <= decoded_file.size())
+        return;
+
+    decoded_file.seek(decoded_file.pos() - 1);
+    if (decoded_file.write("", 1) < 0)
+        throw_write_error(decoded_file);
+}
+
+void mpd::decode_in_parallel(size_t count, const std::function<void(size_t)>& decode_piece,
+                             const std::atomic<int64_t>& bytes_decoded, int64_t compressed_size,
+                             const ProgressMonitor& monitor)
+{
+    std::atomic<size_t> next_piece{0};
+    std::mutex mutex;
+    std::condition_variable workers_done;
+    std::exception_ptr error;
+    size_t running{std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), count)};
+
+    std::vector<std::thread> workers;
+    for (auto i = running; i > 0; --i)
+    {
+        workers.emplace_back([&] {
+            try
+            {
+                for (auto piece = next_piece++; piece < count; piece = next_piece++)
+                    decode_piece(piece);
+            }
+            catch (...)
+            {
+                // Stop the other workers from picking up more pieces
+                next_piece = count;
+                std::lock_guard<std::mutex> lock{mutex};
+                if (!error)
+                    error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock{mutex};
+            --running;
+            workers_done.notify_one();
+        });
+    }
+
+    ThrottledProgress progress{compressed_size, monitor};
+    {
+        std::unique_lock<std::mutex> lock{mutex};
+        while (!workers_done.wait_for(lock, std::chrono::milliseconds(100), [&running] { return running == 0; }))
+        {
+            lock.unlock();
+            progress.update(bytes_decoded);
+            lock.lock();
+        }
+    }
+
+    for (auto& worker : workers)
+        worker.join();
+
+    if (error)
+        std::rethrow_exception(error);
+
+    progress.update(compressed_size);
+}
+
+mpd::ThrottledProgress::ThrottledProgress(int64_t total, const ProgressMonitor& monitor)
+    : total{total}, monitor{monitor}
+{
+}
+
+void mpd::ThrottledProgress::update(int64_t done)
+{
+    const auto progress = total > 0 ? static_cast<int>(done * 100 / total) : 100;
+    if (progress != last_progress)
+    {
+        last_progress = progress;
+        monitor(mp::LaunchProgress::EXTRACT, progress);
+    }
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MULTIPASS_DECODER_UTILS_H
+#define MULTIPASS_DECODER_UTILS_H
+
+#include <multipass/progress_monitor.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+class QIODevice;
+
+namespace multipass
+{
+namespace decoding
+{
+// Writes decoded data at the current position of the file, leaving zeroed blocks as holes
+void write_sparse(QIODevice& decoded_file, const char* data, size_t size);
+
+// Writes decoded data at the given offset of a file sized up front, whatever is not written stays a hole
+void pwrite_sparse(int decoded_fd, const char* data, size_t size, int64_t offset);
+
+// Seeking past the end does not grow the file, a trailing hole needs its last byte written
+void extend_to_position(QIODevice& decoded_file);
+
+// Runs decode_piece for each of the count independent pieces of a compressed file on all cores. The pieces add what
+// they consumed of the compressed file to bytes_decoded, from which progress is reported meanwhile.
+void decode_in_parallel(size_t count, const std::function<void(size_t)>& decode_piece,
+                        const std::atomic<int64_t>& bytes_decoded, int64_t compressed_size,
+                        const ProgressMonitor& monitor);
+
+// Only reports whole percentage changes, decoding a large image would otherwise flood the client with updates
+class ThrottledProgress
+{
+public:
+    ThrottledProgress(int64_t total, const ProgressMonitor& monitor);
+
+    void update(int64_t done);
+
+private:
+    const int64_t total;
+    const ProgressMonitor& monitor;
+    int last_progress{-1};
+};
+} // namespace decoding
+} // namespace multipass
+#endif // MULTIPASS_DECODER_UTILS_H
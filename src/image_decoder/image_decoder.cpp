@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <multipass/image_decoder.h>
+#include <multipass/xz_image_decoder.h>
+#include <multipass/zstd_image_decoder.h>
+
+#include <QFile>
+
+#include <algorithm>
+#include <cstring>
+
+namespace mp = multipass;
+
+namespace
+{
+constexpr char xz_magic[] = {'\xfd', '7', 'z', 'X', 'Z', '\0'};
+constexpr char zstd_magic[] = {'\x28', '\xb5', '\x2f', '\xfd'};
+constexpr auto magic_size = std::max(sizeof(xz_magic), sizeof(zstd_magic));
+
+constexpr auto xz_extension = ".xz";
+constexpr auto zstd_extension = ".zst";
+
+template <size_t size>
+bool starts_with(const QByteArray& bytes, const char (&magic)[size])
+{
+    return bytes.startsWith(QByteArray::fromRawData(magic, size));
+}
+} // namespace
+
+mp::ImageDecoder::UPtr mp::make_image_decoder(const Path& image_path)
+{
+    QByteArray leading_bytes;
+    QFile image_file{image_path};
+    if (image_file.open(QIODevice::ReadOnly))
+        leading_bytes = image_file.read(magic_size);
+
+    return make_image_decoder(leading_bytes, image_path);
+}
+
+mp::ImageDecoder::UPtr mp::make_image_decoder(const QByteArray& leading_bytes, const Path& image_path)
+{
+    if (starts_with(leading_bytes, xz_magic))
+        return std::make_unique<XzImageDecoder>(image_path);
+    if (starts_with(leading_bytes, zstd_magic))
+        return std::make_unique<ZstdImageDecoder>(image_path);
+
+    // Nothing to tell from the data, the file may not even be there yet
+    if (image_path.endsWith(xz_extension))
+        return std::make_unique<XzImageDecoder>(image_path);
+    if (image_path.endsWith(zstd_extension))
+        return std::make_unique<ZstdImageDecoder>(image_path);
+
+    return nullptr;
+}
+
+mp::Path mp::decoded_path_for(const Path& image_path)
+{
+    for (const auto extension : {xz_extension, zstd_extension})
+    {
+        if (image_path.endsWith(extension))
+            return image_path.left(image_path.size() - static_cast<int>(std::strlen(extension)));
+    }
+
+    return {};
+}
@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) 2018 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <multipass/xz_image_decoder.h>
+
+#include "decoder_utils.h"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+namespace mp = multipass;
+namespace mpd = multipass::decoding;
+
+namespace
+{
+constexpr auto buffer_size = 1u << 20;
+constexpr auto dict_max = 1u << 26;
+
+constexpr size_t stream_header_size = 12;
+constexpr size_t stream_footer_size = 12;
+constexpr unsigned char footer_magic[] = {'Y', 'Z'};
+
+bool verify_decode(const xz_ret& ret)
+{
+    switch (ret)
+    {
+    case XZ_OK:
+        break;
+    case XZ_STREAM_END:
+        return false;
+    case XZ_MEM_ERROR:
+        throw std::runtime_error("xz decoder memory allocation failed");
+    case XZ_MEMLIMIT_ERROR:
+        throw std::runtime_error("xz decoder memory usage limit reached");
+    case XZ_FORMAT_ERROR:
+        throw std::runtime_error("not a xz file");
+    case XZ_OPTIONS_ERROR:
+        throw std::runtime_error("unsupported options in the xz headers");
+    case XZ_DATA_ERROR:
+    case XZ_BUF_ERROR:
+        throw std::runtime_error("xz file is corrupt");
+    default:
+        throw std::runtime_error("xz decoder unhandled error condition");
+    }
+
+    return true;
+}
+
+// A block of a multi-block stream, as listed in the stream index
+struct XzBlock
+{
+    const unsigned char* data;
+    uint64_t unpadded_size;
+    uint64_t uncompressed_size;
+    uint64_t output_offset;
+};
+
+uint32_t read_le32(const unsigned char* data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24);
+}
+
+void write_le32(std::vector<unsigned char>& out, uint32_t value)
+{
+    for (auto i = 0; i < 4; ++i)
+        out.push_back(static_cast<unsigned char>(value >> (8 * i)));
+}
+
+bool read_varint(const unsigned char*& pos, const unsigned char* end, uint64_t& value)
+{
+    value = 0;
+    for (auto shift = 0; pos < end && shift < 63; shift += 7)
+    {
+        const auto byte = *pos++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+void write_varint(std::vector<unsigned char>& out, uint64_t value)
+{
+    for (; value >= 0x80; value >>= 7)
+        out.push_back(static_cast<unsigned char>(value | 0x80));
+    out.push_back(static_cast<unsigned char>(value));
+}
+
+uint64_t padded(uint64_t size)
+{
+    return (size + 3) & ~uint64_t{3};
+}
+
+// Lists the blocks of a file holding exactly one stream from its index. Anything else, including a stream that is a
+// single block, yields no blocks at all so that it gets decoded sequentially.
+std::vector<XzBlock> blocks_of(const unsigned char* data, size_t size)
+{
+    if (size < stream_header_size + stream_footer_size ||
+        !std::equal(std::begin(footer_magic), std::end(footer_magic), data + size - 2))
+        return {};
+
+    const auto footer = data + size - stream_footer_size;
+    const uint64_t index_size = (uint64_t{read_le32(footer + 4)} + 1) * 4;
+    if (index_size > size - stream_header_size - stream_footer_size)
+        return {};
+
+    const auto index_start = footer - index_size;
+    if (index_start[0] != 0 || xz_crc32(index_start, index_size - 4, 0) != read_le32(footer - 4))
+        return {};
+
+    auto pos = index_start + 1;
+    uint64_t count;
+    if (!read_varint(pos, footer, count) || count < 2 || count > index_size)
+        return {};
+
+    std::vector<XzBlock> blocks;
+    auto block_data = data + stream_header_size;
+    uint64_t output_offset{0};
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        XzBlock block{block_data, 0, 0, output_offset};
+        if (!read_varint(pos, footer, block.unpadded_size) || !read_varint(pos, footer, block.uncompressed_size) ||
+            padded(block.unpadded_size) > static_cast<uint64_t>(index_start - block_data))
+            return {};
+
+        block_data += padded(block.unpadded_size);
+        output_offset += block.uncompressed_size;
+        blocks.push_back(block);
+    }
+
+    // Concatenated streams or stream padding would leave bytes unaccounted for
+    if (block_data != index_start)
+        return {};
+
+    return blocks;
+}
+
+// The index and footer of a stream made of nothing but the given block
+std::vector<unsigned char> trailer_for(const XzBlock& block, const unsigned char* stream_flags)
+{
+    std::vector<unsigned char> trailer{0};
+    write_varint(trailer, 1);
+    write_varint(trailer, block.unpadded_size);
+    write_varint(trailer, block.uncompressed_size);
+    trailer.resize(padded(trailer.size()), 0);
+    write_le32(trailer, xz_crc32(trailer.data(), trailer.size(), 0));
+
+    const auto footer_start = trailer.size();
+    write_le32(trailer, 0);
+    write_le32(trailer, static_cast<uint32_t>(footer_start / 4 - 1));
+    trailer.insert(trailer.end(), stream_flags, stream_flags + 2);
+    const auto footer_crc = xz_crc32(trailer.data() + footer_start + 4, 6, 0);
+    for (auto i = 0; i < 4; ++i)
+        trailer[footer_start + i] = static_cast<unsigned char>(footer_crc >> (8 * i));
+    trailer.insert(trailer.end(), std::begin(footer_magic), std::end(footer_magic));
+
+    return trailer;
+}
+
+// xz-embedded only decodes whole streams, so each block is decoded as a stream of its own: the original stream header,
+// the block as is and an index listing just that block
+void decode_block(const unsigned char* stream_header, const XzBlock& block, int decoded_fd,
+                  std::atomic<int64_t>& bytes_decoded)
+{
+    mp::XzImageDecoder::XzDecoderUPtr decoder{xz_dec_init(XZ_DYNALLOC, dict_max), xz_dec_end};
+    if (!decoder)
+        throw std::runtime_error("xz decoder memory allocation failed");
+
+    std::vector<unsigned char> output(buffer_size);
+    const auto trailer = trailer_for(block, stream_header + 6);
+    const std::pair<const unsigned char*, size_t> inputs[] = {{stream_header, stream_header_size},
+                                                              {block.data, padded(block.unpadded_size)},
+                                                              {trailer.data(), trailer.size()}};
+
+    auto offset = block.output_offset;
+    auto more = true;
+    for (const auto& input : inputs)
+    {
+        struct xz_buf decode_buf{};
+        decode_buf.in = input.first;
+        decode_buf.in_size = input.second;
+        decode_buf.out = output.data();
+        decode_buf.out_size = output.size();
+
+        do
+        {
+            decode_buf.out_pos = 0;
+            more = verify_decode(xz_dec_run(decoder.get(), &decode_buf));
+
+            // The decoded file was sized up front, so whatever is not written stays a hole
+            mpd::pwrite_sparse(decoded_fd, reinterpret_cast<const char*>(output.data()), decode_buf.out_pos, offset);
+            offset += decode_buf.out_pos;
+        } while (more && (decode_buf.in_pos < decode_buf.in_size || decode_buf.out_pos == decode_buf.out_size));
+
+        if (!more)
+            break;
+    }
+
+    if (more || offset != block.output_offset + block.uncompressed_size)
+        throw std::runtime_error("xz file is corrupt");
+
+    bytes_decoded += padded(block.unpadded_size);
+}
+
+void decode_blocks(const unsigned char* stream_header, const std::vector<XzBlock>& blocks, QFile& decoded_file,
+                   int64_t compressed_size, const mp::ProgressMonitor& monitor)
+{
+    const auto& last_block = blocks.back();
+    if (!decoded_file.resize(last_block.output_offset + last_block.uncompressed_size))
+        throw std::runtime_error(fmt::format("failed to write decoded image: {}",
+                                             decoded_file.errorString().toStdString()));
+
+    std::atomic<int64_t> bytes_decoded{0};
+    mpd::decode_in_parallel(
+        blocks.size(),
+        [&](size_t block) { decode_block(stream_header, blocks[block], decoded_file.handle(), bytes_decoded); },
+        bytes_decoded, compressed_size, monitor);
+}
+} // namespace
+
+mp::XzImageDecoder::XzImageDecoder() : XzImageDecoder{Path()}
+{
+}
+
+mp::XzImageDecoder::XzImageDecoder(const Path& xz_file_path)
+    : xz_file{xz_file_path}, xz_decoder{xz_dec_init(XZ_DYNALLOC, dict_max), xz_dec_end}, decoded_data(buffer_size)
+{
+    xz_crc32_init();
+    xz_crc64_init();
+}
+
+void mp::XzImageDecoder::decode_to(const Path& decoded_image_path, const ProgressMonitor& monitor)
+{
+    if (!xz_file.open(QIODevice::ReadOnly))
+        throw std::runtime_error(fmt::format("failed to open {} for reading", xz_file.fileName().toStdString()));
+
+    QFile decoded_file{decoded_image_path};
+    if (!decoded_file.open(QIODevice::WriteOnly))
+        throw std::runtime_error(fmt::format("failed to open {} for writing", decoded_file.fileName().toStdString()));
+
+    const auto file_size = xz_file.size();
+    const auto data = file_size > 0 ? xz_file.map(0, file_size) : nullptr;
+    if (!data)
+        throw std::runtime_error("xz file is corrupt");
+
+    const auto blocks = blocks_of(data, file_size);
+    if (!blocks.empty())
+    {
+        decode_blocks(data, blocks, decoded_file, file_size, monitor);
+        return;
+    }
+
+    mpd::ThrottledProgress progress{file_size, monitor};
+    for (qint64 offset = 0; offset < file_size; offset += buffer_size)
+    {
+        const auto size = std::min<qint64>(buffer_size, file_size - offset);
+        progress.update(offset + size);
+
+        if (!decode_chunk(reinterpret_cast<const char*>(data) + offset, size, decoded_file))
+            break;
+    }
+
+    finish(decoded_file);
+}
+
+bool mp::XzImageDecoder::decode_chunk(const char* data, size_t size, QIODevice& decoded_file)
+{
+    if (size == 0)
+        return true;
+
+    struct xz_buf decode_buf{};
+    decode_buf.in = reinterpret_cast<const unsigned char*>(data);
+    decode_buf.in_pos = 0;
+    decode_buf.in_size = size;
+    decode_buf.out = decoded_data.data();
+    decode_buf.out_pos = 0;
+    decode_buf.out_size = decoded_data.size();
+
+    while (true)
+    {
+        const auto more = verify_decode(xz_dec_run(xz_decoder.get(), &decode_buf));
+
+        if (decode_buf.out_pos > 0)
+            mpd::write_sparse(decoded_file, reinterpret_cast<const char*>(decoded_data.data()), decode_buf.out_pos);
+
+        if (!more)
+        {
+            stream_ended = true;
+            return false;
+        }
+
+        // A full output buffer may leave decoded data pending even after all of the input was consumed
+        if (decode_buf.in_pos == decode_buf.in_size && decode_buf.out_pos < decode_buf.out_size)
+            return true;
+
+        decode_buf.out_pos = 0;
+    }
+}
+
+void mp::XzImageDecoder::finish(QIODevice& decoded_file)
+{
+    if (!stream_ended)
+        throw std::runtime_error("xz file is corrupt");
+
+    mpd::extend_to_position(decoded_file);
+}
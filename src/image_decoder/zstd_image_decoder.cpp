@@ -0,0 +1,216 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <multipass/zstd_image_decoder.h>
+
+#include "decoder_utils.h"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+namespace mp = multipass;
+namespace mpd = multipass::decoding;
+
+namespace
+{
+constexpr auto buffer_size = 1u << 20;
+
+// The low nibble of the magic of skippable frames is free for applications to use
+constexpr uint32_t skippable_frame_magic = 0x184D2A50;
+constexpr uint32_t skippable_frame_mask = 0xFFFFFFF0;
+
+size_t verify_decode(size_t ret)
+{
+    if (ZSTD_isError(ret))
+        throw std::runtime_error(fmt::format("zstd file is corrupt: {}", ZSTD_getErrorName(ret)));
+
+    return ret;
+}
+
+// A frame of a multi-frame file, as listed by walking the frame headers
+struct ZstdFrame
+{
+    const char* data;
+    size_t compressed_size;
+    uint64_t decoded_size;
+    uint64_t output_offset;
+};
+
+bool is_skippable(const char* data)
+{
+    const auto bytes = reinterpret_cast<const unsigned char*>(data);
+    const auto magic = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (static_cast<uint32_t>(bytes[3]) << 24);
+
+    return (magic & skippable_frame_mask) == skippable_frame_magic;
+}
+
+// Lists the frames of a file made of several, as parallel compressors and the seekable format write them. Anything
+// else, including frames that do not record their decoded size, yields no frames at all so that it gets decoded
+// sequentially.
+std::vector<ZstdFrame> frames_of(const char* data, size_t size)
+{
+    std::vector<ZstdFrame> frames;
+    uint64_t output_offset{0};
+    for (size_t offset = 0; offset < size;)
+    {
+        const auto compressed_size = ZSTD_findFrameCompressedSize(data + offset, size - offset);
+        if (ZSTD_isError(compressed_size))
+            return {};
+
+        // Skippable frames hold metadata, such as the seek table, rather than image data
+        if (!is_skippable(data + offset))
+        {
+            const auto decoded_size = ZSTD_getFrameContentSize(data + offset, size - offset);
+            if (decoded_size == ZSTD_CONTENTSIZE_UNKNOWN || decoded_size == ZSTD_CONTENTSIZE_ERROR)
+                return {};
+
+            frames.push_back({data + offset, compressed_size, decoded_size, output_offset});
+            output_offset += decoded_size;
+        }
+
+        offset += compressed_size;
+    }
+
+    if (frames.size() < 2)
+        return {};
+
+    return frames;
+}
+
+void decode_frame(const ZstdFrame& frame, int decoded_fd, std::atomic<int64_t>& bytes_decoded)
+{
+    mp::ZstdImageDecoder::ZstdDecoderUPtr decoder{ZSTD_createDCtx(), ZSTD_freeDCtx};
+    if (!decoder)
+        throw std::runtime_error("zstd decoder memory allocation failed");
+
+    std::vector<char> output(ZSTD_DStreamOutSize());
+    ZSTD_inBuffer input{frame.data, frame.compressed_size, 0};
+    auto offset = frame.output_offset;
+    auto frame_done = false;
+    while (!frame_done)
+    {
+        ZSTD_outBuffer decode_buf{output.data(), output.size(), 0};
+        frame_done = verify_decode(ZSTD_decompressStream(decoder.get(), &decode_buf, &input)) == 0;
+
+        // The decoded file was sized up front, so whatever is not written stays a hole
+        mpd::pwrite_sparse(decoded_fd, output.data(), decode_buf.pos, offset);
+        offset += decode_buf.pos;
+
+        if (!frame_done && input.pos == input.size && decode_buf.pos < decode_buf.size)
+            break;
+    }
+
+    if (!frame_done || offset != frame.output_offset + frame.decoded_size)
+        throw std::runtime_error("zstd file is corrupt");
+
+    bytes_decoded += frame.compressed_size;
+}
+
+void decode_frames(const std::vector<ZstdFrame>& frames, QFile& decoded_file, int64_t compressed_size,
+                   const mp::ProgressMonitor& monitor)
+{
+    const auto& last_frame = frames.back();
+    if (!decoded_file.resize(last_frame.output_offset + last_frame.decoded_size))
+        throw std::runtime_error(fmt::format("failed to write decoded image: {}",
+                                             decoded_file.errorString().toStdString()));
+
+    std::atomic<int64_t> bytes_decoded{0};
+    mpd::decode_in_parallel(
+        frames.size(), [&](size_t frame) { decode_frame(frames[frame], decoded_file.handle(), bytes_decoded); },
+        bytes_decoded, compressed_size, monitor);
+}
+} // namespace
+
+mp::ZstdImageDecoder::ZstdImageDecoder() : ZstdImageDecoder{Path()}
+{
+}
+
+mp::ZstdImageDecoder::ZstdImageDecoder(const Path& zstd_file_path)
+    : zstd_file{zstd_file_path}, zstd_decoder{ZSTD_createDCtx(), ZSTD_freeDCtx}, decoded_data(ZSTD_DStreamOutSize())
+{
+    if (!zstd_decoder)
+        throw std::runtime_error("zstd decoder memory allocation failed");
+}
+
+void mp::ZstdImageDecoder::decode_to(const Path& decoded_image_path, const ProgressMonitor& monitor)
+{
+    if (!zstd_file.open(QIODevice::ReadOnly))
+        throw std::runtime_error(fmt::format("failed to open {} for reading", zstd_file.fileName().toStdString()));
+
+    QFile decoded_file{decoded_image_path};
+    if (!decoded_file.open(QIODevice::WriteOnly))
+        throw std::runtime_error(fmt::format("failed to open {} for writing", decoded_file.fileName().toStdString()));
+
+    const auto file_size = zstd_file.size();
+    const auto data = file_size > 0 ? reinterpret_cast<const char*>(zstd_file.map(0, file_size)) : nullptr;
+    if (!data)
+        throw std::runtime_error("zstd file is corrupt");
+
+    const auto frames = frames_of(data, file_size);
+    if (!frames.empty())
+    {
+        decode_frames(frames, decoded_file, file_size, monitor);
+        return;
+    }
+
+    mpd::ThrottledProgress progress{file_size, monitor};
+    for (qint64 offset = 0; offset < file_size; offset += buffer_size)
+    {
+        const auto size = std::min<qint64>(buffer_size, file_size - offset);
+        progress.update(offset + size);
+
+        decode_chunk(data + offset, size, decoded_file);
+    }
+
+    finish(decoded_file);
+}
+
+// A zstd file may hold any number of frames, so the end of one is never taken for the end of the stream
+bool mp::ZstdImageDecoder::decode_chunk(const char* data, size_t size, QIODevice& decoded_file)
+{
+    if (size == 0)
+        return true;
+
+    ZSTD_inBuffer input{data, size, 0};
+    auto output_pending = false;
+    do
+    {
+        ZSTD_outBuffer decode_buf{decoded_data.data(), decoded_data.size(), 0};
+        frame_pending = verify_decode(ZSTD_decompressStream(zstd_decoder.get(), &decode_buf, &input)) != 0;
+        frame_decoded = frame_decoded || !frame_pending;
+
+        if (decode_buf.pos > 0)
+            mpd::write_sparse(decoded_file, decoded_data.data(), decode_buf.pos);
+
+        // A full output buffer may leave decoded data pending even after all of the input was consumed
+        output_pending = frame_pending && decode_buf.pos == decode_buf.size;
+    } while (input.pos < input.size || output_pending);
+
+    return true;
+}
+
+void mp::ZstdImageDecoder::finish(QIODevice& decoded_file)
+{
+    if (frame_pending || !frame_decoded)
+        throw std::runtime_error("zstd file is corrupt");
+
+    mpd::extend_to_position(decoded_file);
+}
@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <multipass/download_scheduler.h>
+
+#include <multipass/logging/log.h>
+
+#include <algorithm>
+#include <numeric>
+
+namespace mp = multipass;
+namespace mpl = multipass::logging;
+
+namespace
+{
+constexpr auto category = "download scheduler";
+
+thread_local auto thread_priority = mp::DownloadScheduler::Priority::interactive;
+
+auto index_of(mp::DownloadScheduler::Priority priority)
+{
+    return static_cast<std::size_t>(priority);
+}
+} // namespace
+
+mp::DownloadScheduler::Transfer::Transfer(DownloadScheduler& scheduler, Priority priority)
+    : scheduler{scheduler}, priority{priority}
+{
+    std::unique_lock<std::mutex> lock{scheduler.mutex};
+    scheduler.admit(priority, lock);
+}
+
+mp::DownloadScheduler::Transfer::~Transfer()
+{
+    std::lock_guard<std::mutex> lock{scheduler.mutex};
+    if (suspended)
+        --scheduler.waiting[index_of(priority)];
+    else
+        --scheduler.active;
+    scheduler.slot_freed.notify_all();
+}
+
+std::chrono::milliseconds mp::DownloadScheduler::Transfer::pace(int64_t bytes)
+{
+    if (priority == Priority::interactive)
+        return std::chrono::milliseconds::zero();
+
+    std::lock_guard<std::mutex> lock{scheduler.mutex};
+    const auto delay = scheduler.take_tokens(bytes);
+
+    // Rounded up, for the shortfall to be paid back in full
+    const auto delay_ms = std::chrono::duration_cast<std::chrono::milliseconds>(delay);
+    return delay_ms < delay ? delay_ms + std::chrono::milliseconds(1) : delay_ms;
+}
+
+// A suspended transfer counts as waiting for a slot, so that lower priorities give way to it as well
+bool mp::DownloadScheduler::Transfer::may_proceed()
+{
+    std::lock_guard<std::mutex> lock{scheduler.mutex};
+    if (suspended)
+    {
+        if (!scheduler.can_admit(priority))
+            return false;
+
+        --scheduler.waiting[index_of(priority)];
+        ++scheduler.active;
+        suspended = false;
+        mpl::log(mpl::Level::debug, category, "resuming paused download");
+
+        return true;
+    }
+
+    if (!scheduler.preempted(priority))
+        return true;
+
+    mpl::log(mpl::Level::debug, category, "pausing download in favour of a higher priority one");
+    --scheduler.active;
+    ++scheduler.waiting[index_of(priority)];
+    suspended = true;
+    scheduler.slot_freed.notify_all();
+
+    return false;
+}
+
+mp::DownloadScheduler::PriorityScope::PriorityScope(Priority priority) : previous{thread_priority}
+{
+    thread_priority = priority;
+}
+
+mp::DownloadScheduler::PriorityScope::~PriorityScope()
+{
+    thread_priority = previous;
+}
+
+mp::DownloadScheduler::DownloadScheduler(const Limits& limits)
+    : limits{std::max(limits.max_transfers, 1), std::max(limits.background_bytes_per_second, int64_t{0})},
+      tokens{static_cast<double>(this->limits.background_bytes_per_second)},
+      last_refill{Clock::now()}
+{
+}
+
+mp::DownloadScheduler::Priority mp::DownloadScheduler::current_priority()
+{
+    return thread_priority;
+}
+
+void mp::DownloadScheduler::admit(Priority priority, std::unique_lock<std::mutex>& lock)
+{
+    ++waiting[index_of(priority)];
+    slot_freed.wait(lock, [this, priority] { return can_admit(priority); });
+    --waiting[index_of(priority)];
+    ++active;
+
+    // Lower priorities may have been waiting on this one rather than on a slot
+    slot_freed.notify_all();
+}
+
+bool mp::DownloadScheduler::can_admit(Priority priority) const
+{
+    return active < limits.max_transfers &&
+           std::accumulate(waiting.cbegin() + index_of(priority) + 1, waiting.cend(), 0) == 0;
+}
+
+bool mp::DownloadScheduler::preempted(Priority priority) const
+{
+    return active >= limits.max_transfers &&
+           std::any_of(waiting.cbegin() + index_of(priority) + 1, waiting.cend(), [](int count) { return count > 0; });
+}
+
+// Takes the bytes out of a bucket refilled at the budgeted rate and holding up to a second's worth, returning how
+// long to wait to pay back any shortfall
+mp::DownloadScheduler::Clock::duration mp::DownloadScheduler::take_tokens(int64_t bytes)
+{
+    const auto rate = static_cast<double>(limits.background_bytes_per_second);
+    if (rate == 0)
+        return Clock::duration::zero();
+
+    const auto now = Clock::now();
+    tokens = std::min(rate, tokens + std::chrono::duration<double>(now - last_refill).count() * rate);
+    last_refill = now;
+    tokens -= bytes;
+
+    if (tokens >= 0)
+        return Clock::duration::zero();
+
+    return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(-tokens / rate));
+}
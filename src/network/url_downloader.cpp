@@ -19,19 +19,35 @@
 
 #include <multipass/exceptions/download_exception.h>
 #include <multipass/logging/log.h>
+#include <multipass/optional.h>
 
 #include <fmt/format.h>
 
 #include <QDir>
 #include <QEventLoop>
 #include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
 #include <QNetworkAccessManager>
 #include <QNetworkDiskCache>
 #include <QNetworkReply>
+#include <QSaveFile>
+#include <QThread>
 #include <QTimer>
 #include <QUrl>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
 
 namespace mp = multipass;
 namespace mpl = multipass::logging;
@@ -39,45 +55,126 @@ namespace mpl = multipass::logging;
 namespace
 {
 constexpr auto category = "url downloader";
+constexpr qint64 min_segment_size{16 * 1024 * 1024};
+constexpr qint64 max_segments{4};
+constexpr qint64 checkpoint_interval{32 * 1024 * 1024};
+// Present ranges shorter than this are fetched again with their neighbours, rather than splitting requests around them
+constexpr qint64 min_present_range{256 * 1024};
+// Bounds what is received ahead of a paced or paused transfer, so that it is held back by the network rather than
+// buffered in memory
+constexpr qint64 read_buffer_size{4 * 1024 * 1024};
+constexpr mp::DownloadScheduler::Limits default_download_limits{4, 0};
+// How often a preempted transfer checks whether it can take a slot back
+constexpr std::chrono::milliseconds preempted_poll_interval{250};
+
+QNetworkRequest make_request(const QUrl& url)
+{
+    QNetworkRequest request{url};
+    request.setRawHeader("Connection", "Keep-Alive");
+    request.setAttribute(QNetworkRequest::FollowRedirectsAttribute, true);
+    request.setAttribute(QNetworkRequest::HTTP2AllowedAttribute, true);
+
+    return request;
+}
 
-auto make_network_manager(const mp::Path& cache_dir_path)
+// Images go straight from the network to their destination, the disk cache being meant for small metadata that is
+// worth revalidating. Conditional requests bypass it too, so that a 304 is not answered with the cache's own copy.
+QNetworkRequest make_uncached_request(const QUrl& url)
 {
-    auto manager = std::make_unique<QNetworkAccessManager>();
+    auto request = make_request(url);
+    request.setAttribute(QNetworkRequest::CacheLoadControlAttribute, QNetworkRequest::AlwaysNetwork);
+    request.setAttribute(QNetworkRequest::CacheSaveControlAttribute, false);
 
-    if (!cache_dir_path.isEmpty())
+    return request;
+}
+
+// Holds the reads of a transfer back while it is over the bandwidth budget or preempted, rather than blocking in the
+// reply's handlers: the read buffer limit then stops the reply from receiving more, and a timer resumes the reads.
+// The download timeout is stopped for as long as reads are held back, for a pause not to be taken for a stall.
+class ReadPacer
+{
+public:
+    ReadPacer(mp::DownloadScheduler::Transfer& transfer, QTimer& download_timeout, std::function<bool()> keep_going,
+              std::function<void()> resume)
+        : transfer{transfer}, download_timeout{download_timeout}, keep_going{keep_going}, resume{resume}
     {
-        auto network_cache = new QNetworkDiskCache;
-        network_cache->setCacheDirectory(cache_dir_path);
+        resume_timer.setSingleShot(true);
+        QObject::connect(&resume_timer, &QTimer::timeout, [this] { on_resume_timeout(); });
+    }
+
+    // Accounts for the bytes just read, returning false if reading is to stop until the pacer resumes it
+    bool pace(qint64 bytes)
+    {
+        const auto delay = transfer.pace(bytes);
+        if (delay == std::chrono::milliseconds::zero() && transfer.may_proceed())
+            return true;
+
+        held_back = true;
+        download_timeout.stop();
+        resume_timer.start(delay > std::chrono::milliseconds::zero() ? delay : preempted_poll_interval);
 
-        // Manager now owns network_cache and so it will delete it in its dtor
-        manager->setCache(network_cache);
+        return false;
     }
 
-    return manager;
-}
+    bool paused() const
+    {
+        return held_back;
+    }
+
+private:
+    void on_resume_timeout()
+    {
+        // Nothing else reports progress while paused, so this is where a cancelled download finds out
+        if (!keep_going())
+            return;
 
+        if (!transfer.may_proceed())
+            return resume_timer.start(preempted_poll_interval);
+
+        held_back = false;
+        download_timeout.start();
+        resume();
+    }
+
+    mp::DownloadScheduler::Transfer& transfer;
+    QTimer& download_timeout;
+    const std::function<bool()> keep_going;
+    const std::function<void()> resume;
+    QTimer resume_timer;
+    bool held_back{false};
+};
+
+// Replies are read whole once finished unless on_download drains them as data arrives, which the buffer limit is
+// then meant for: a limited reply that is not drained stalls once the limit is reached. What a held back reply has
+// left unread when it finishes is handed to on_download then.
 template <typename ProgressAction, typename DownloadAction, typename ErrorAction, typename Time>
-QByteArray download(QNetworkAccessManager* manager, const Time& timeout, QUrl const& url, ProgressAction&& on_progress,
-                    DownloadAction&& on_download, ErrorAction&& on_error)
+std::unique_ptr<QNetworkReply> download(QNetworkAccessManager* manager, const Time& timeout, QNetworkRequest request,
+                                        ProgressAction&& on_progress, DownloadAction&& on_download,
+                                        ErrorAction&& on_error, qint64 buffer_limit = 0)
 {
+    const auto url = request.url();
     QEventLoop event_loop;
     QTimer download_timeout;
     download_timeout.setInterval(timeout);
+    bool timed_out{false};
 
-    QNetworkRequest request{url};
-    request.setRawHeader("Connection", "Keep-Alive");
     request.setAttribute(QNetworkRequest::HttpPipeliningAllowedAttribute, true);
-    request.setAttribute(QNetworkRequest::FollowRedirectsAttribute, true);
 
-    auto reply = manager->get(request);
+    std::unique_ptr<QNetworkReply> reply{manager->get(request)};
+    reply->setReadBufferSize(buffer_limit);
 
-    QObject::connect(reply, &QNetworkReply::finished, &event_loop, &QEventLoop::quit);
-    QObject::connect(reply, &QNetworkReply::downloadProgress, [&](qint64 bytes_received, qint64 bytes_total) {
-        on_progress(reply, bytes_received, bytes_total);
+    QObject::connect(reply.get(), &QNetworkReply::finished, [&]() {
+        if (reply->error() == QNetworkReply::NoError)
+            on_download(reply.get(), download_timeout);
+        event_loop.quit();
+    });
+    QObject::connect(reply.get(), &QNetworkReply::downloadProgress, [&](qint64 bytes_received, qint64 bytes_total) {
+        on_progress(reply.get(), bytes_received, bytes_total);
     });
-    QObject::connect(reply, &QNetworkReply::readyRead, [&]() { on_download(reply, download_timeout); });
+    QObject::connect(reply.get(), &QNetworkReply::readyRead, [&]() { on_download(reply.get(), download_timeout); });
     QObject::connect(&download_timeout, &QTimer::timeout, [&]() {
         download_timeout.stop();
+        timed_out = true;
         reply->abort();
     });
 
@@ -87,32 +184,461 @@ QByteArray download(QNetworkAccessManager* manager, const Time& timeout, QUrl co
     {
         on_error();
 
-        const auto msg = download_timeout.isActive() ? reply->errorString().toStdString() : "Network timeout";
+        const auto msg = timed_out ? "Network timeout" : reply->errorString().toStdString();
         throw mp::DownloadException{url.toString().toStdString(), msg};
     }
-    return reply->readAll();
+    return reply;
+}
+
+struct Range
+{
+    qint64 start;
+    qint64 end;
+};
+
+struct RemoteInfo
+{
+    qint64 length;
+    QByteArray validator;
+};
+
+// Progress of an interrupted download, kept next to the partial file until the download completes
+struct DownloadJournal
+{
+    QString url;
+    QByteArray validator;
+    qint64 length;
+    std::vector<Range> received;
+    qint64 sink_offset;
+    QByteArray sink_state;
+};
+
+QString journal_path_for(const QString& file_name)
+{
+    return file_name + ".journal";
+}
+
+std::vector<Range> merged(std::vector<Range> ranges)
+{
+    std::sort(ranges.begin(), ranges.end(), [](const Range& a, const Range& b) { return a.start < b.start; });
+
+    std::vector<Range> result;
+    for (const auto& range : ranges)
+    {
+        if (!result.empty() && range.start <= result.back().end)
+            result.back().end = std::max(result.back().end, range.end);
+        else if (range.start < range.end)
+            result.push_back(range);
+    }
+
+    return result;
+}
+
+std::vector<Range> missing_ranges(const std::vector<Range>& received, qint64 length)
+{
+    std::vector<Range> missing;
+    qint64 position{0};
+
+    for (const auto& range : merged(received))
+    {
+        if (range.start > position)
+            missing.push_back({position, range.start});
+        position = std::max(position, range.end);
+    }
+
+    if (position < length)
+        missing.push_back({position, length});
+
+    return missing;
+}
+
+mp::optional<DownloadJournal> load_journal(const QString& journal_path)
+{
+    QFile journal_file{journal_path};
+    if (!journal_file.open(QIODevice::ReadOnly))
+        return mp::nullopt;
+
+    const auto json = QJsonDocument::fromJson(journal_file.readAll()).object();
+    if (json.isEmpty())
+        return mp::nullopt;
+
+    DownloadJournal journal{json["url"].toString(),
+                            json["validator"].toString().toUtf8(),
+                            static_cast<qint64>(json["length"].toDouble()),
+                            {},
+                            static_cast<qint64>(json["sink_offset"].toDouble()),
+                            QByteArray::fromBase64(json["sink_state"].toString().toLatin1())};
+
+    for (const auto& entry : json["received"].toArray())
+    {
+        const auto range = entry.toArray();
+        journal.received.push_back(
+            {static_cast<qint64>(range.at(0).toDouble()), static_cast<qint64>(range.at(1).toDouble())});
+    }
+
+    return journal;
+}
+
+void save_journal(const QString& journal_path, const DownloadJournal& journal)
+{
+    QJsonArray received;
+    for (const auto& range : journal.received)
+        received.append(QJsonArray{static_cast<double>(range.start), static_cast<double>(range.end)});
+
+    QJsonObject json;
+    json.insert("url", journal.url);
+    json.insert("validator", QString::fromUtf8(journal.validator));
+    json.insert("length", static_cast<double>(journal.length));
+    json.insert("received", received);
+    json.insert("sink_offset", static_cast<double>(journal.sink_offset));
+    json.insert("sink_state", QString::fromLatin1(journal.sink_state.toBase64()));
+
+    QSaveFile journal_file{journal_path};
+    if (!journal_file.open(QIODevice::WriteOnly) || journal_file.write(QJsonDocument{json}.toJson()) < 0 ||
+        !journal_file.commit())
+        mpl::log(mpl::Level::warning, category,
+                 fmt::format("failed to save download journal {}", journal_path.toStdString()));
+}
+
+// Hands the bytes of file between offset and end to the sink, advancing offset
+bool feed_sink(QFile& file, qint64& offset, qint64 end, mp::URLDownloader::DataSink* sink)
+{
+    constexpr qint64 chunk_size{1024 * 1024};
+    std::vector<char> buffer(static_cast<size_t>(std::min(chunk_size, std::max(end - offset, qint64{0}))));
+
+    while (offset < end)
+    {
+        const auto bytes = ::pread(file.handle(), buffer.data(), std::min(chunk_size, end - offset), offset);
+        if (bytes <= 0 || !sink->write(buffer.data(), bytes))
+            return false;
+
+        offset += bytes;
+    }
+
+    return true;
+}
+
+// Returns the resource length if the server can serve byte ranges of it, -1 otherwise, along with the
+// ETag or Last-Modified validator used to tell whether a partial download still matches the resource
+template <typename Time>
+RemoteInfo remote_info_of(QNetworkAccessManager* manager, const Time& timeout, const QUrl& url)
+{
+    QEventLoop event_loop;
+    QTimer head_timeout;
+    head_timeout.setSingleShot(true);
+
+    std::unique_ptr<QNetworkReply> reply{manager->head(make_uncached_request(url))};
+    QObject::connect(reply.get(), &QNetworkReply::finished, &event_loop, &QEventLoop::quit);
+    QObject::connect(&head_timeout, &QTimer::timeout, reply.get(), &QNetworkReply::abort);
+
+    head_timeout.start(timeout);
+    event_loop.exec();
+
+    if (reply->error() != QNetworkReply::NoError || reply->rawHeader("Accept-Ranges") != "bytes")
+        return {-1, {}};
+
+    bool ok{false};
+    const auto length = reply->header(QNetworkRequest::ContentLengthHeader).toLongLong(&ok);
+
+    // Weak ETags cannot be used with If-Range
+    auto validator = reply->rawHeader("ETag");
+    if (validator.isEmpty() || validator.startsWith("W/"))
+        validator = reply->rawHeader("Last-Modified");
+
+    return {ok ? length : -1, validator};
+}
+
+// Fetches the ranges of the resource still missing from the journal as concurrent requests written in place into
+// the preallocated file. Progress is checkpointed to the journal so that an interrupted download can be resumed;
+// failures other than network ones call on_error to discard the partial download.
+// Data is handed to the sink in order, read back from the file as soon as the ranges ahead of it complete.
+// Returns false if the server turns out to ignore the ranges.
+template <typename ProgressAction, typename ErrorAction, typename Time>
+bool download_ranges(QNetworkAccessManager* manager, const Time& timeout, const QUrl& url, QFile& file,
+                     DownloadJournal& journal, const QString& journal_path, qint64 sink_offset,
+                     ProgressAction&& on_progress, ErrorAction&& on_error, mp::URLDownloader::DataSink* sink,
+                     mp::DownloadScheduler::Transfer& transfer)
+{
+    struct Segment
+    {
+        std::unique_ptr<QNetworkReply> reply;
+        qint64 start;
+        qint64 offset;
+        qint64 end;
+    };
+
+    const auto length = journal.length;
+    const auto received_before = merged(journal.received);
+
+    QEventLoop event_loop;
+    QTimer download_timeout;
+    download_timeout.setInterval(timeout);
+    bool timed_out{false};
+
+    std::vector<Segment> segments;
+    std::vector<char> buffer(read_buffer_size);
+    qint64 bytes_received{0};
+    qint64 bytes_to_sink{sink_offset};
+    qint64 last_checkpoint{0};
+    std::size_t ranges_confirmed{0};
+    std::size_t remaining{0};
+    bool range_ignored{false};
+    bool sink_declined{false};
+    std::string write_error;
+
+    for (const auto& range : received_before)
+        bytes_received += range.end - range.start;
+    last_checkpoint = bytes_received;
+
+    for (const auto& range : missing_ranges(received_before, length))
+    {
+        const auto pieces = std::max(qint64{1}, std::min(max_segments, (range.end - range.start) / min_segment_size));
+        const auto piece_size = (range.end - range.start) / pieces;
+
+        for (qint64 i = 0; i < pieces; ++i)
+        {
+            const auto start = range.start + i * piece_size;
+            const auto end = i == pieces - 1 ? range.end : start + piece_size;
+
+            auto request = make_uncached_request(url);
+            request.setRawHeader("Range", QString("bytes=%1-%2").arg(start).arg(end - 1).toLatin1());
+            if (!journal.validator.isEmpty())
+                request.setRawHeader("If-Range", journal.validator);
+
+            segments.push_back({std::unique_ptr<QNetworkReply>{manager->get(request)}, start, start, end});
+            segments.back().reply->setReadBufferSize(read_buffer_size);
+        }
+    }
+
+    auto abort_all = [&segments] {
+        for (auto& segment : segments)
+            segment.reply->abort();
+    };
+
+    auto received_ranges = [&] {
+        auto ranges = received_before;
+        for (const auto& segment : segments)
+            ranges.push_back({segment.start, segment.offset});
+        return merged(ranges);
+    };
+
+    auto checkpoint = [&] {
+        if (journal.validator.isEmpty())
+            return;
+
+        ::fdatasync(file.handle());
+        journal.received = received_ranges();
+        if (sink)
+        {
+            journal.sink_offset = bytes_to_sink;
+            journal.sink_state = sink->checkpoint();
+        }
+        save_journal(journal_path, journal);
+        last_checkpoint = bytes_received;
+    };
+
+    std::vector<std::function<void()>> drains;
+    ReadPacer pacer{transfer, download_timeout,
+                    [&] {
+                        if (on_progress(bytes_received, length))
+                            return true;
+
+                        abort_all();
+                        return false;
+                    },
+                    [&] {
+                        for (auto i = 0u; i < segments.size(); ++i)
+                        {
+                            if (segments[i].reply->bytesAvailable() > 0)
+                                drains[i]();
+                        }
+                    }};
+
+    for (auto i = 0u; i < segments.size(); ++i)
+    {
+        drains.push_back([&, i, confirmed = false]() mutable {
+            auto& segment = segments[i];
+            if (pacer.paused() && !segment.reply->isFinished())
+                return;
+
+            if (segment.reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() != 206)
+            {
+                range_ignored = true;
+                return abort_all();
+            }
+
+            if (!confirmed)
+            {
+                confirmed = true;
+                ++ranges_confirmed;
+            }
+
+            qint64 bytes;
+            while ((bytes = segment.reply->read(buffer.data(), buffer.size())) > 0)
+            {
+                if (segment.offset + bytes > segment.end)
+                {
+                    write_error = "server sent more than the requested range";
+                    return abort_all();
+                }
+
+                if (::pwrite(file.handle(), buffer.data(), bytes, segment.offset) != bytes)
+                {
+                    write_error = fmt::format("error writing image: {}", std::strerror(errno ? errno : EIO));
+                    return abort_all();
+                }
+
+                segment.offset += bytes;
+                bytes_received += bytes;
+                if (!pacer.pace(bytes) && !segment.reply->isFinished())
+                    break;
+            }
+
+            if (!pacer.paused())
+                download_timeout.start();
+
+            // Nothing reaches the sink until every range is known to be honoured, so a fallback can start over
+            if (sink && ranges_confirmed == segments.size())
+            {
+                const auto ranges = received_ranges();
+                const auto frontier = !ranges.empty() && ranges.front().start == 0 ? ranges.front().end : 0;
+
+                if (!feed_sink(file, bytes_to_sink, frontier, sink))
+                {
+                    sink_declined = true;
+                    return abort_all();
+                }
+            }
+
+            if (bytes_received - last_checkpoint >= checkpoint_interval)
+                checkpoint();
+
+            if (!on_progress(bytes_received, length))
+                abort_all();
+        });
+    }
+
+    remaining = segments.size();
+    for (auto i = 0u; i < segments.size(); ++i)
+    {
+        const auto reply = segments[i].reply.get();
+        QObject::connect(reply, &QNetworkReply::readyRead, [&drains, i] { drains[i](); });
+        QObject::connect(reply, &QNetworkReply::finished, [&, reply, i] {
+            // What was held back in the reply's buffer is still to be written
+            if (reply->error() == QNetworkReply::NoError && reply->bytesAvailable() > 0)
+                drains[i]();
+
+            if (--remaining == 0)
+                event_loop.quit();
+        });
+    }
+
+    QObject::connect(&download_timeout, &QTimer::timeout, [&]() {
+        download_timeout.stop();
+        timed_out = true;
+        abort_all();
+    });
+
+    if (remaining > 0)
+    {
+        download_timeout.start();
+        event_loop.exec();
+    }
+
+    if (range_ignored)
+        return false;
+
+    if (!write_error.empty())
+    {
+        on_error();
+        throw mp::DownloadException{url.toString().toStdString(), write_error};
+    }
+
+    if (sink_declined)
+    {
+        on_error();
+        throw mp::DownloadException{url.toString().toStdString(), "Download aborted by data consumer"};
+    }
+
+    for (const auto& segment : segments)
+    {
+        if (segment.reply->error() != QNetworkReply::NoError || segment.offset != segment.end)
+        {
+            // Without a validator there is no telling whether a later attempt would still fetch the same resource
+            if (journal.validator.isEmpty())
+                on_error();
+            else
+                checkpoint();
+
+            const auto msg = timed_out ? "Network timeout"
+                                       : segment.reply->error() != QNetworkReply::NoError
+                                             ? segment.reply->errorString().toStdString()
+                                             : "Incomplete range received";
+            throw mp::DownloadException{url.toString().toStdString(), msg};
+        }
+    }
+
+    if (sink && !feed_sink(file, bytes_to_sink, length, sink))
+    {
+        on_error();
+        throw mp::DownloadException{url.toString().toStdString(), "Download aborted by data consumer"};
+    }
+
+    QFile::remove(journal_path);
+
+    return true;
 }
 } // namespace
 
+// Managers are kept per thread, a manager only being usable from the thread it was created in. Reusing them across
+// requests reuses their open connections and the TLS sessions to resume.
+struct mp::URLDownloader::NetworkManagers
+{
+    std::mutex mutex;
+    std::unordered_map<QThread*, std::unique_ptr<QNetworkAccessManager>> managers;
+};
+
 mp::URLDownloader::URLDownloader(std::chrono::milliseconds timeout) : URLDownloader{Path(), timeout}
 {
 }
 
 mp::URLDownloader::URLDownloader(const mp::Path& cache_dir, std::chrono::milliseconds timeout)
-    : cache_dir_path{QDir(cache_dir).filePath("network-cache")}, timeout{timeout}
+    : URLDownloader{cache_dir, timeout, default_download_limits}
+{
+}
+
+mp::URLDownloader::URLDownloader(const mp::Path& cache_dir, std::chrono::milliseconds timeout,
+                                 const DownloadScheduler::Limits& download_limits)
+    : cache_dir_path{QDir(cache_dir).filePath("network-cache")},
+      timeout{timeout},
+      scheduler{download_limits},
+      network_managers{std::make_shared<NetworkManagers>()}
 {
 }
 
+// Managers are deleted with the downloader rather than as their threads end, which for the main thread is only
+// once the application is gone. The threads using the downloader are expected to be done with it by now.
+mp::URLDownloader::~URLDownloader()
+{
+    decltype(network_managers->managers) managers;
+    {
+        std::lock_guard<std::mutex> lock{network_managers->mutex};
+        managers.swap(network_managers->managers);
+    }
+}
+
 void mp::URLDownloader::download_to(const QUrl& url, const QString& file_name, int64_t size, const int download_type,
-                                    const mp::ProgressMonitor& monitor)
+                                    const mp::ProgressMonitor& monitor, DataSink* sink)
 {
-    auto manager{make_network_manager(cache_dir_path)};
+    DownloadScheduler::Transfer transfer{scheduler, DownloadScheduler::current_priority()};
+    auto manager = network_manager();
 
     QFile file{file_name};
-    file.open(QIODevice::ReadWrite | QIODevice::Truncate);
+    const auto journal_path = journal_path_for(file_name);
 
-    auto progress_monitor = [&monitor, download_type, size](QNetworkReply* reply, qint64 bytes_received,
-                                                            qint64 bytes_total) {
+    int last_progress{0};
+    auto progress_monitor = [&monitor, download_type, size, &last_progress](QNetworkReply* reply,
+                                                                            qint64 bytes_received, qint64 bytes_total) {
         if (bytes_received == 0)
             return;
 
@@ -120,54 +646,290 @@ void mp::URLDownloader::download_to(const QUrl& url, const QString& file_name, i
             bytes_total = size;
 
         auto progress = (size < 0) ? size : (100 * bytes_received + bytes_total / 2) / bytes_total;
+        last_progress = progress;
         if (!monitor(download_type, progress))
         {
             reply->abort();
         }
     };
 
-    auto on_download = [&file](QNetworkReply* reply, QTimer& download_timeout) {
-        if (download_timeout.isActive())
-            download_timeout.stop();
-        else
+    // Data is read into the same buffer every time and written from there to the unbuffered file
+    std::vector<char> buffer(read_buffer_size);
+    std::unique_ptr<ReadPacer> pacer;
+    std::function<void(QNetworkReply*, QTimer&)> on_download = [&](QNetworkReply* reply, QTimer& download_timeout) {
+        if (!pacer)
+        {
+            auto keep_going = [&monitor, download_type, &last_progress, reply] {
+                if (monitor(download_type, last_progress))
+                    return true;
+
+                reply->abort();
+                return false;
+            };
+            auto resume = [&on_download, reply, &download_timeout] {
+                if (reply->bytesAvailable() > 0)
+                    on_download(reply, download_timeout);
+            };
+            pacer = std::make_unique<ReadPacer>(transfer, download_timeout, keep_going, resume);
+        }
+
+        if (pacer->paused() && !reply->isFinished())
             return;
 
-        if (file.write(reply->readAll()) < 0)
+        qint64 bytes;
+        while ((bytes = reply->read(buffer.data(), buffer.size())) > 0)
         {
-            mpl::log(mpl::Level::error, category,
-                     fmt::format("error writing image: {}", file.errorString().toStdString()));
-            reply->abort();
+            if (file.write(buffer.data(), bytes) < 0)
+            {
+                mpl::log(mpl::Level::error, category,
+                         fmt::format("error writing image: {}", file.errorString().toStdString()));
+                reply->abort();
+                break;
+            }
+
+            if (sink && !sink->write(buffer.data(), bytes))
+            {
+                mpl::log(mpl::Level::debug, category, "download aborted by data consumer");
+                reply->abort();
+                break;
+            }
+
+            if (!pacer->pace(bytes) && !reply->isFinished())
+                break;
         }
-        download_timeout.start();
+
+        if (!pacer->paused())
+            download_timeout.start();
     };
 
-    auto on_error = [&file]() { file.remove(); };
+    auto on_error = [&file, &journal_path]() {
+        file.remove();
+        QFile::remove(journal_path);
+    };
 
-    ::download(manager.get(), timeout, url, progress_monitor, on_download, on_error);
+    auto journal = load_journal(journal_path);
+
+    // Small downloads are not worth the extra round trip to find out whether ranges are supported
+    if (url.scheme().startsWith("http") && (size <= 0 || size >= 2 * min_segment_size || journal))
+    {
+        auto segment_monitor = [&monitor, download_type, size](qint64 bytes_received, qint64 bytes_total) {
+            auto progress = (size < 0) ? size : (100 * bytes_received + bytes_total / 2) / bytes_total;
+            return monitor(download_type, progress);
+        };
+
+        const auto remote = remote_info_of(manager, timeout, url);
+        auto resumable = journal && remote.length > 0 && !remote.validator.isEmpty() &&
+                               journal->url == url.toString() && journal->validator == remote.validator &&
+                               journal->length == remote.length && QFileInfo(file_name).size() == remote.length;
+
+        // The partial file is opened before anything is restored from the journal, for a fresh download to be
+        // able to take over
+        if (resumable && !file.open(QIODevice::ReadWrite))
+        {
+            mpl::log(mpl::Level::warning, category,
+                     fmt::format("cannot resume download of {}: {}", url.toString().toStdString(),
+                                 file.errorString().toStdString()));
+            resumable = false;
+        }
+
+        if (resumable)
+        {
+            mpl::log(mpl::Level::info, category, fmt::format("resuming download of {}", url.toString().toStdString()));
+
+            qint64 sink_offset{0};
+            if (sink && journal->sink_offset > 0 && sink->restore(journal->sink_state))
+                sink_offset = journal->sink_offset;
+
+            if (download_ranges(manager, timeout, url, file, *journal, journal_path, sink_offset,
+                                segment_monitor, on_error, sink, transfer))
+                return;
+
+            // The resource changed since the partial download started and the data consumer cannot start over
+            on_error();
+            throw mp::DownloadException{url.toString().toStdString(), "Image changed while resuming its download"};
+        }
+
+        QFile::remove(journal_path);
+
+        file.open(QIODevice::ReadWrite | QIODevice::Truncate | QIODevice::Unbuffered);
+        if (std::min(max_segments, remote.length / min_segment_size) >= 2 && file.resize(remote.length))
+        {
+            DownloadJournal new_journal{url.toString(), remote.validator, remote.length, {}, 0, {}};
+            if (download_ranges(manager, timeout, url, file, new_journal, journal_path, 0, segment_monitor,
+                                on_error, sink, transfer))
+                return;
+
+            QFile::remove(journal_path);
+        }
+
+        file.resize(0);
+        file.seek(0);
+    }
+    else
+    {
+        file.open(QIODevice::ReadWrite | QIODevice::Truncate | QIODevice::Unbuffered);
+    }
+
+    ::download(manager, timeout, make_uncached_request(url), progress_monitor, on_download, on_error,
+               read_buffer_size);
+}
+
+void mp::URLDownloader::download_missing_to(const QUrl& url, const QString& file_name,
+                                            const std::vector<ByteRange>& present, const int download_type,
+                                            const ProgressMonitor& monitor, DataSink* sink)
+{
+    DownloadScheduler::Transfer transfer{scheduler, DownloadScheduler::current_priority()};
+    auto manager = network_manager();
+
+    QFile file{file_name};
+    const auto journal_path = journal_path_for(file_name);
+
+    const auto remote = remote_info_of(manager, timeout, url);
+    if (remote.length <= 0 || QFileInfo(file_name).size() != remote.length)
+        throw mp::DownloadException{url.toString().toStdString(), "Ranges of the resource cannot be fetched"};
+
+    DownloadJournal journal{url.toString(), remote.validator, remote.length, {}, 0, {}};
+    for (const auto& range : present)
+    {
+        if (range.end - range.start >= min_present_range)
+            journal.received.push_back({range.start, range.end});
+    }
+
+    // What an interrupted earlier call received is kept too, the data consumer being fed it again from the file
+    const auto previous = load_journal(journal_path);
+    if (previous && !remote.validator.isEmpty() && previous->url == journal.url &&
+        previous->validator == remote.validator && previous->length == remote.length)
+    {
+        journal.received.insert(journal.received.end(), previous->received.cbegin(), previous->received.cend());
+        journal.received = merged(journal.received);
+    }
+
+    auto segment_monitor = [&monitor, download_type](qint64 bytes_received, qint64 bytes_total) {
+        return monitor(download_type, (100 * bytes_received + bytes_total / 2) / bytes_total);
+    };
+
+    auto on_error = [&file, &journal_path]() {
+        file.remove();
+        QFile::remove(journal_path);
+    };
+
+    if (!file.open(QIODevice::ReadWrite | QIODevice::Unbuffered))
+        throw mp::DownloadException{url.toString().toStdString(),
+                                    fmt::format("error opening image: {}", file.errorString().toStdString())};
+
+    if (!download_ranges(manager, timeout, url, file, journal, journal_path, 0, segment_monitor, on_error, sink,
+                         transfer))
+    {
+        on_error();
+        throw mp::DownloadException{url.toString().toStdString(), "Server ignored the range requests"};
+    }
 }
 
 QByteArray mp::URLDownloader::download(const QUrl& url)
 {
-    auto manager{make_network_manager(cache_dir_path)};
+    auto manager = network_manager();
 
     // This will connect to the QNetworkReply::readReady signal and when emitted,
     // reset the timer.
     auto on_download = [](QNetworkReply*, QTimer& download_timeout) { download_timeout.start(); };
 
-    return ::download(manager.get(), timeout, url, [](QNetworkReply*, qint64, qint64) {}, on_download, [] {});
+    auto reply = ::download(manager, timeout, make_request(url), [](QNetworkReply*, qint64, qint64) {}, on_download,
+                            [] {});
+    return reply->readAll();
+}
+
+QByteArray mp::URLDownloader::download_range(const QUrl& url, int64_t start, int64_t end)
+{
+    DownloadScheduler::Transfer transfer{scheduler, DownloadScheduler::current_priority()};
+    auto manager = network_manager();
+
+    auto request = make_uncached_request(url);
+    request.setRawHeader("Range", QString("bytes=%1-%2").arg(start).arg(end - 1).toLatin1());
+
+    auto on_download = [](QNetworkReply*, QTimer& download_timeout) { download_timeout.start(); };
+
+    auto reply = ::download(manager, timeout, request, [](QNetworkReply*, qint64, qint64) {}, on_download, [] {});
+    if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() != 206)
+        throw mp::DownloadException{url.toString().toStdString(), "Server ignored the range request"};
+
+    auto data = reply->readAll();
+    if (data.size() != end - start)
+        throw mp::DownloadException{url.toString().toStdString(), "Incomplete range received"};
+
+    return data;
+}
+
+mp::optional<QByteArray> mp::URLDownloader::download_if_changed(const QUrl& url, Validators& validators)
+{
+    auto manager = network_manager();
+
+    auto request = make_uncached_request(url);
+    if (!validators.etag.isEmpty())
+        request.setRawHeader("If-None-Match", validators.etag);
+    if (!validators.last_modified.isEmpty())
+        request.setRawHeader("If-Modified-Since", validators.last_modified);
+
+    auto on_download = [](QNetworkReply*, QTimer& download_timeout) { download_timeout.start(); };
+    auto reply = ::download(manager, timeout, request, [](QNetworkReply*, qint64, qint64) {}, on_download, [] {});
+
+    if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() == 304 ||
+        reply->attribute(QNetworkRequest::SourceIsFromCacheAttribute).toBool())
+        return nullopt;
+
+    validators = {reply->rawHeader("ETag"), reply->rawHeader("Last-Modified")};
+    return reply->readAll();
+}
+
+QNetworkAccessManager* mp::URLDownloader::network_manager()
+{
+    const auto thread = QThread::currentThread();
+
+    std::lock_guard<std::mutex> lock{network_managers->mutex};
+    auto& manager = network_managers->managers[thread];
+    if (!manager)
+    {
+        manager = std::make_unique<QNetworkAccessManager>();
+
+        if (!cache_dir_path.isEmpty())
+        {
+            auto network_cache = new QNetworkDiskCache;
+            network_cache->setCacheDirectory(cache_dir_path);
+
+            // Manager now owns network_cache and so it will delete it in its dtor
+            manager->setCache(network_cache);
+        }
+
+        // A thread's manager is deleted in that thread as it finishes. The connection goes with the manager, should
+        // the downloader be gone first.
+        std::weak_ptr<NetworkManagers> managers{network_managers};
+        QObject::connect(thread, &QThread::finished, manager.get(),
+                         [managers, thread] {
+                             std::unique_ptr<QNetworkAccessManager> finished_manager;
+                             if (auto registry = managers.lock())
+                             {
+                                 std::lock_guard<std::mutex> lock{registry->mutex};
+                                 auto it = registry->managers.find(thread);
+                                 if (it != registry->managers.end())
+                                 {
+                                     finished_manager = std::move(it->second);
+                                     registry->managers.erase(it);
+                                 }
+                             }
+                         },
+                         Qt::DirectConnection);
+    }
+
+    return manager.get();
 }
 
 QDateTime mp::URLDownloader::last_modified(const QUrl& url)
 {
-    auto manager{make_network_manager(cache_dir_path)};
+    auto manager = network_manager();
 
     QEventLoop event_loop;
 
-    QNetworkRequest request{url};
-    request.setAttribute(QNetworkRequest::FollowRedirectsAttribute, true);
-
-    auto reply = manager->head(request);
-    QObject::connect(reply, &QNetworkReply::finished, &event_loop, &QEventLoop::quit);
+    std::unique_ptr<QNetworkReply> reply{manager->head(make_request(url))};
+    QObject::connect(reply.get(), &QNetworkReply::finished, &event_loop, &QEventLoop::quit);
 
     event_loop.exec();
 
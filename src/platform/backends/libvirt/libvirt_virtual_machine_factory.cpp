@@ -131,6 +131,16 @@ void mp::LibVirtVirtualMachineFactory::prepare_instance_image(const VMImage& ins
     mp::backend::resize_instance_image(process_factory, desc.disk_space, instance_image.image_path);
 }
 
+bool mp::LibVirtVirtualMachineFactory::create_instance_overlay(const Path& base_image_path, const Path& instance_image_path)
+{
+    return mp::backend::create_overlay_image(process_factory, base_image_path, instance_image_path);
+}
+
+bool mp::LibVirtVirtualMachineFactory::rebase_instance_overlay(const Path& base_image_path, const Path& instance_image_path)
+{
+    return mp::backend::rebase_overlay_image(process_factory, base_image_path, instance_image_path);
+}
+
 void mp::LibVirtVirtualMachineFactory::configure(const std::string& /*name*/, YAML::Node& /*meta_config*/,
                                                  YAML::Node& /*user_config*/)
 {
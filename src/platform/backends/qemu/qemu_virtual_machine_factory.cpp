@@ -270,6 +270,22 @@ void mp::QemuVirtualMachineFactory::prepare_instance_image(const mp::VMImage& in
     mp::backend::resize_instance_image(process_factory, desc.disk_space, instance_image.image_path);
 }
 
+bool mp::QemuVirtualMachineFactory::create_instance_overlay(const Path& base_image_path, const Path& instance_image_path)
+{
+    return mp::backend::create_overlay_image(process_factory, base_image_path, instance_image_path);
+}
+
+bool mp::QemuVirtualMachineFactory::rebase_instance_overlay(const Path& base_image_path, const Path& instance_image_path)
+{
+    return mp::backend::rebase_overlay_image(process_factory, base_image_path, instance_image_path);
+}
+
+// QEMU runs as the daemon does
+bool mp::QemuVirtualMachineFactory::can_boot_from_streamed_images()
+{
+    return true;
+}
+
 void mp::QemuVirtualMachineFactory::configure(const std::string& /*name*/, YAML::Node& /*meta_config*/,
                                               YAML::Node& /*user_config*/)
 {
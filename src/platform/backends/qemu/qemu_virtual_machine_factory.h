@@ -39,6 +39,9 @@ public:
     FetchType fetch_type() override;
     VMImage prepare_source_image(const VMImage& source_image) override;
     void prepare_instance_image(const VMImage& instance_image, const VirtualMachineDescription& desc) override;
+    bool create_instance_overlay(const Path& base_image_path, const Path& instance_image_path) override;
+    bool rebase_instance_overlay(const Path& base_image_path, const Path& instance_image_path) override;
+    bool can_boot_from_streamed_images() override;
     void configure(const std::string& name, YAML::Node& meta_config, YAML::Node& user_config) override;
     void check_hypervisor_support() override;
 
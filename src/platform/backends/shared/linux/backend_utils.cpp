@@ -25,6 +25,7 @@
 
 #include <fmt/format.h>
 
+#include <QFile>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QProcess>
@@ -50,6 +51,12 @@ bool subnet_used_locally(const std::string& subnet)
     return output.contains(QString::fromStdString(subnet));
 }
 
+bool has_qcow2_header(const mp::Path& image_path)
+{
+    QFile image_file{image_path};
+    return image_file.open(QIODevice::ReadOnly) && image_file.read(4) == QByteArray("QFI\xfb", 4);
+}
+
 bool can_reach_gateway(const std::string& ip)
 {
     return mp::utils::run_cmd_for_status("ping", {"-n", "-q", ip.c_str(), "-c", "-1", "-W", "1"});
@@ -151,6 +158,10 @@ mp::Path mp::backend::convert_to_qcow_if_necessary(const ProcessFactory* process
     // TODO: we could support converting from other the image formats that qemu-img can deal with
     const auto qcow2_path{image_path + ".qcow2"};
 
+    // Images the vault decoded are written as qcow2 already, no need to spawn qemu-img to find that out
+    if (has_qcow2_header(image_path))
+        return image_path;
+
     auto qemuimg_spec = std::make_unique<mp::QemuImgProcessSpec>();
     auto qemuimg_process = process_factory->create_process(std::move(qemuimg_spec));
 
@@ -159,7 +170,10 @@ mp::Path mp::backend::convert_to_qcow_if_necessary(const ProcessFactory* process
 
     if (image_record["format"].toString() == "raw")
     {
-        qemuimg_process->run_and_return_status({"convert", "-p", "-O", "qcow2", image_path, qcow2_path}, -1);
+        // Given the format, qemu-img walks the raw file's data and holes with SEEK_DATA/SEEK_HOLE, so the holes left
+        // by extraction are neither read nor allocated in the qcow2 image
+        qemuimg_process->run_and_return_status({"convert", "-p", "-f", "raw", "-O", "qcow2", image_path, qcow2_path},
+                                               -1);
         return qcow2_path;
     }
     else
@@ -168,6 +182,34 @@ mp::Path mp::backend::convert_to_qcow_if_necessary(const ProcessFactory* process
     }
 }
 
+bool mp::backend::create_overlay_image(const ProcessFactory* process_factory, const mp::Path& base_image_path,
+                                       const mp::Path& overlay_image_path)
+{
+    auto qemuimg_spec = std::make_unique<mp::QemuImgProcessSpec>();
+    auto qemuimg_process = process_factory->create_process(std::move(qemuimg_spec));
+
+    auto image_info = qemuimg_process->run_and_return_output({"info", "--output=json", base_image_path});
+    auto image_record = QJsonDocument::fromJson(image_info.toUtf8(), nullptr).object();
+
+    // Prepared images are qcow2 already, anything else is left to be copied
+    if (image_record["format"].toString() != "qcow2")
+        return false;
+
+    return qemuimg_process->run_and_return_status(
+        {"create", "-f", "qcow2", "-F", "qcow2", "-b", base_image_path, overlay_image_path});
+}
+
+bool mp::backend::rebase_overlay_image(const ProcessFactory* process_factory, const mp::Path& base_image_path,
+                                       const mp::Path& overlay_image_path)
+{
+    auto qemuimg_spec = std::make_unique<mp::QemuImgProcessSpec>();
+    auto qemuimg_process = process_factory->create_process(std::move(qemuimg_spec));
+
+    // The new base holds the same data as the old one, only the overlay's header has to change
+    return qemuimg_process->run_and_return_status(
+        {"rebase", "-u", "-f", "qcow2", "-F", "qcow2", "-b", base_image_path, overlay_image_path});
+}
+
 QString mp::backend::cpu_arch()
 {
     const QHash<QString, QString> cpu_to_arch{{"x86_64", "x86_64"}, {"arm", "arm"},   {"arm64", "aarch64"},
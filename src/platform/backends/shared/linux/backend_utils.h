@@ -35,6 +35,10 @@ void check_hypervisor_support();
 void resize_instance_image(const ProcessFactory* process_factory, const MemorySize& disk_space,
                            const multipass::Path& image_path);
 Path convert_to_qcow_if_necessary(const ProcessFactory* process_factory, const Path& image_path);
+bool create_overlay_image(const ProcessFactory* process_factory, const Path& base_image_path,
+                          const Path& overlay_image_path);
+bool rebase_overlay_image(const ProcessFactory* process_factory, const Path& base_image_path,
+                          const Path& overlay_image_path);
 QString cpu_arch();
 }
 }
@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <multipass/qcow2_writer.h>
+
+#include <fmt/format.h>
+
+#include <QtEndian>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace mp = multipass;
+
+namespace
+{
+constexpr uint32_t cluster_bits{16};
+constexpr int64_t cluster_size{int64_t{1} << cluster_bits};
+constexpr uint64_t l2_entries{cluster_size / sizeof(uint64_t)};
+constexpr uint64_t refcounts_per_block{cluster_size / sizeof(uint16_t)};
+
+// Marks clusters whose refcount is exactly one, as all of them are here
+constexpr uint64_t copied_flag{uint64_t{1} << 63};
+
+struct Signature
+{
+    size_t offset;
+    const char* magic;
+    size_t length;
+};
+
+// Formats qemu-img would not treat as raw; qcow, qcow2, qed, vmdk, vhdx, vpc and vdi
+const Signature disk_image_signatures[] = {{0, "QFI\xfb", 4},      {0, "QED\0", 4},      {0, "KDMV", 4},
+                                           {0, "# Disk DescriptorFile", 21}, {0, "vhdxfile", 8},
+                                           {0, "conectix", 8},     {64, "\x7f\x10\xda\xbe", 4}};
+
+bool is_disk_image(const char* data, int64_t size)
+{
+    return std::any_of(std::begin(disk_image_signatures), std::end(disk_image_signatures),
+                       [data, size](const Signature& signature) {
+                           return static_cast<size_t>(size) >= signature.offset + signature.length &&
+                                  std::memcmp(data + signature.offset, signature.magic, signature.length) == 0;
+                       });
+}
+
+bool is_zero(const char* data, int64_t size)
+{
+    return data[0] == 0 && std::memcmp(data, data + 1, static_cast<size_t>(size - 1)) == 0;
+}
+
+uint64_t div_round_up(uint64_t value, uint64_t divisor)
+{
+    return (value + divisor - 1) / divisor;
+}
+
+template <typename T>
+void put(std::vector<char>& buffer, size_t pos, T value)
+{
+    qToBigEndian<T>(value, reinterpret_cast<uchar*>(buffer.data() + pos));
+}
+} // namespace
+
+mp::Qcow2Writer::Qcow2Writer(const Path& image_path) : image_file{image_path}
+{
+}
+
+bool mp::Qcow2Writer::open(OpenMode mode)
+{
+    if (!image_file.open(QIODevice::WriteOnly))
+    {
+        setErrorString(image_file.errorString());
+        return false;
+    }
+
+    cluster.assign(cluster_size, 0);
+    cluster_fill = 0;
+    stream_offset = 0;
+    next_host_cluster = 1;
+    format_checked = false;
+    wraps_raw_image = true;
+    host_clusters.clear();
+
+    return QIODevice::open(mode);
+}
+
+bool mp::Qcow2Writer::isSequential() const
+{
+    return true;
+}
+
+qint64 mp::Qcow2Writer::readData(char* /*data*/, qint64 /*max_size*/)
+{
+    return -1;
+}
+
+qint64 mp::Qcow2Writer::writeData(const char* data, qint64 size)
+{
+    for (qint64 done = 0; done < size;)
+    {
+        const auto length = std::min<qint64>(size - done, cluster_size - cluster_fill);
+        std::copy(data + done, data + done + length, cluster.begin() + cluster_fill);
+        cluster_fill += length;
+        done += length;
+
+        if (cluster_fill == cluster_size && !write_cluster())
+            return -1;
+    }
+
+    return size;
+}
+
+void mp::Qcow2Writer::finish()
+{
+    if (cluster_fill > 0 && !write_cluster())
+        throw std::runtime_error(fmt::format("failed to write qcow2 image: {}", errorString().toStdString()));
+
+    if (wraps_raw_image && !write_metadata())
+        throw std::runtime_error(fmt::format("failed to write qcow2 image: {}", errorString().toStdString()));
+
+    if (!image_file.flush())
+        throw std::runtime_error(
+            fmt::format("failed to write qcow2 image: {}", image_file.errorString().toStdString()));
+
+    image_file.close();
+    close();
+}
+
+bool mp::Qcow2Writer::write_cluster()
+{
+    const auto size = cluster_fill;
+    cluster_fill = 0;
+
+    if (!format_checked)
+    {
+        format_checked = true;
+        wraps_raw_image = !is_disk_image(cluster.data(), size);
+    }
+
+    if (!wraps_raw_image)
+    {
+        stream_offset += size;
+        return write_at(stream_offset - size, cluster.data(), size);
+    }
+
+    // The tail of the last cluster reads back as zeroes
+    std::fill(cluster.begin() + size, cluster.end(), 0);
+    stream_offset += size;
+
+    if (is_zero(cluster.data(), cluster_size))
+    {
+        host_clusters.push_back(0);
+        return true;
+    }
+
+    const auto host_offset = next_host_cluster++ * cluster_size;
+    host_clusters.push_back(host_offset);
+
+    return write_at(host_offset, cluster.data(), cluster_size);
+}
+
+// Lays out the L2 tables, the L1 table and the refcounts after the data clusters, then writes the header in the
+// first cluster that was left empty for it
+bool mp::Qcow2Writer::write_metadata()
+{
+    const auto l1_size = std::max<uint64_t>(1, div_round_up(host_clusters.size(), l2_entries));
+    std::vector<char> l1_table(div_round_up(l1_size * sizeof(uint64_t), cluster_size) * cluster_size, 0);
+    std::vector<char> table(cluster_size);
+    auto host_cluster = static_cast<uint64_t>(next_host_cluster);
+
+    for (uint64_t l1_index = 0; l1_index < l1_size; ++l1_index)
+    {
+        const auto begin = host_clusters.begin() + std::min<uint64_t>(l1_index * l2_entries, host_clusters.size());
+        const auto end = host_clusters.begin() + std::min<uint64_t>((l1_index + 1) * l2_entries, host_clusters.size());
+        if (std::all_of(begin, end, [](uint64_t host_offset) { return host_offset == 0; }))
+            continue;
+
+        std::fill(table.begin(), table.end(), 0);
+        for (auto it = begin; it != end; ++it)
+        {
+            if (*it != 0)
+                put<quint64>(table, (it - begin) * sizeof(uint64_t), *it | copied_flag);
+        }
+
+        const auto l2_offset = host_cluster++ * cluster_size;
+        put<quint64>(l1_table, l1_index * sizeof(uint64_t), l2_offset | copied_flag);
+        if (!write_at(l2_offset, table.data(), cluster_size))
+            return false;
+    }
+
+    const auto l1_offset = host_cluster * cluster_size;
+    host_cluster += l1_table.size() / cluster_size;
+    if (!write_at(l1_offset, l1_table.data(), l1_table.size()))
+        return false;
+
+    // The refcounts have to cover the clusters that hold them as well
+    uint64_t refcount_blocks{0}, refcount_table_clusters{0};
+    while (true)
+    {
+        const auto total_clusters = host_cluster + refcount_blocks + refcount_table_clusters;
+        const auto blocks_needed = div_round_up(total_clusters, refcounts_per_block);
+        const auto table_clusters_needed = div_round_up(blocks_needed * sizeof(uint64_t), cluster_size);
+        if (blocks_needed == refcount_blocks && table_clusters_needed == refcount_table_clusters)
+            break;
+
+        refcount_blocks = blocks_needed;
+        refcount_table_clusters = table_clusters_needed;
+    }
+
+    const auto total_clusters = host_cluster + refcount_blocks + refcount_table_clusters;
+    std::vector<char> refcount_table(refcount_table_clusters * cluster_size, 0);
+    for (uint64_t block = 0; block < refcount_blocks; ++block)
+    {
+        std::fill(table.begin(), table.end(), 0);
+        const auto first_cluster = block * refcounts_per_block;
+        for (auto cluster_index = first_cluster;
+             cluster_index < std::min(total_clusters, first_cluster + refcounts_per_block); ++cluster_index)
+            put<quint16>(table, (cluster_index - first_cluster) * sizeof(uint16_t), 1);
+
+        const auto block_offset = (host_cluster + block) * cluster_size;
+        put<quint64>(refcount_table, block * sizeof(uint64_t), block_offset);
+        if (!write_at(block_offset, table.data(), cluster_size))
+            return false;
+    }
+
+    const auto refcount_table_offset = (host_cluster + refcount_blocks) * cluster_size;
+    if (!write_at(refcount_table_offset, refcount_table.data(), refcount_table.size()))
+        return false;
+
+    // Version 2 header; the rest of the cluster stays zeroed, which ends the (empty) list of header extensions
+    std::vector<char> header(72, 0);
+    put<quint32>(header, 0, 0x514649fb);
+    put<quint32>(header, 4, 2);
+    put<quint32>(header, 20, cluster_bits);
+    put<quint64>(header, 24, (stream_offset + 511) / 512 * 512);
+    put<quint32>(header, 36, static_cast<quint32>(l1_size));
+    put<quint64>(header, 40, l1_offset);
+    put<quint64>(header, 48, refcount_table_offset);
+    put<quint32>(header, 56, static_cast<quint32>(refcount_table_clusters));
+
+    return write_at(0, header.data(), header.size());
+}
+
+bool mp::Qcow2Writer::write_at(int64_t offset, const char* data, int64_t size)
+{
+    if (!image_file.seek(offset) || image_file.write(data, size) != size)
+    {
+        setErrorString(image_file.errorString());
+        return false;
+    }
+
+    return true;
+}
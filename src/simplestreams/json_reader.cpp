@@ -0,0 +1,370 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "json_reader.h"
+
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace mp = multipass;
+
+namespace
+{
+constexpr auto max_depth = 256;
+
+int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+void append_utf8(QByteArray& out, uint32_t code_point)
+{
+    if (code_point < 0x80)
+    {
+        out.append(static_cast<char>(code_point));
+    }
+    else if (code_point < 0x800)
+    {
+        out.append(static_cast<char>(0xc0 | (code_point >> 6)));
+        out.append(static_cast<char>(0x80 | (code_point & 0x3f)));
+    }
+    else if (code_point < 0x10000)
+    {
+        out.append(static_cast<char>(0xe0 | (code_point >> 12)));
+        out.append(static_cast<char>(0x80 | ((code_point >> 6) & 0x3f)));
+        out.append(static_cast<char>(0x80 | (code_point & 0x3f)));
+    }
+    else
+    {
+        out.append(static_cast<char>(0xf0 | (code_point >> 18)));
+        out.append(static_cast<char>(0x80 | ((code_point >> 12) & 0x3f)));
+        out.append(static_cast<char>(0x80 | ((code_point >> 6) & 0x3f)));
+        out.append(static_cast<char>(0x80 | (code_point & 0x3f)));
+    }
+}
+} // namespace
+
+mp::JsonReader::JsonReader(const QByteArray& json)
+    : begin{json.constData()}, pos{json.constData()}, end{json.constData() + json.size()}
+{
+}
+
+bool mp::JsonReader::enter_object()
+{
+    if (peek() != '{')
+    {
+        skip_value();
+        return false;
+    }
+
+    ++pos;
+    first_member.push_back(true);
+    return true;
+}
+
+bool mp::JsonReader::next_member()
+{
+    if (peek() == '}')
+    {
+        ++pos;
+        first_member.pop_back();
+        return false;
+    }
+
+    if (!first_member.back())
+        expect(',');
+    first_member.back() = false;
+
+    if (peek() != '"')
+        fail("expected a member name");
+
+    current_key = string_bytes();
+    expect(':');
+
+    return true;
+}
+
+const QByteArray& mp::JsonReader::key() const
+{
+    return current_key;
+}
+
+QString mp::JsonReader::read_string()
+{
+    if (peek() != '"')
+    {
+        skip_value();
+        return {};
+    }
+
+    return QString::fromUtf8(string_bytes());
+}
+
+bool mp::JsonReader::read_bool()
+{
+    switch (peek())
+    {
+    case 't':
+        skip_literal("true");
+        return true;
+    case 'f':
+        skip_literal("false");
+        return false;
+    default:
+        skip_value();
+        return false;
+    }
+}
+
+int64_t mp::JsonReader::read_integer(int64_t default_value)
+{
+    const auto c = peek();
+    if (c != '-' && (c < '0' || c > '9'))
+    {
+        skip_value();
+        return default_value;
+    }
+
+    const auto start = pos;
+    skip_number();
+    const auto number = QByteArray::fromRawData(start, static_cast<int>(pos - start));
+
+    bool ok{false};
+    const auto integer = number.toLongLong(&ok);
+    if (ok)
+        return integer;
+
+    const auto real = number.toDouble(&ok);
+    if (ok && std::floor(real) == real && std::abs(real) < 9e18)
+        return static_cast<int64_t>(real);
+
+    return default_value;
+}
+
+void mp::JsonReader::skip_value()
+{
+    skip_value(static_cast<int>(first_member.size()));
+}
+
+void mp::JsonReader::expect_end()
+{
+    skip_whitespace();
+    if (pos != end)
+        fail("unexpected data after the document");
+}
+
+void mp::JsonReader::skip_whitespace()
+{
+    while (pos != end && (*pos == ' ' || *pos == '\n' || *pos == '\r' || *pos == '\t'))
+        ++pos;
+}
+
+char mp::JsonReader::peek()
+{
+    skip_whitespace();
+    if (pos == end)
+        fail("unexpected end of document");
+
+    return *pos;
+}
+
+void mp::JsonReader::expect(char c)
+{
+    if (peek() != c)
+        fail((std::string{"expected '"} + c + "'").c_str());
+
+    ++pos;
+}
+
+// Returns the unescaped contents of the string at the current position, pointing into the document unless they
+// contain escapes
+QByteArray mp::JsonReader::string_bytes()
+{
+    expect('"');
+
+    const auto start = pos;
+    while (pos != end && *pos != '"' && *pos != '\\')
+        ++pos;
+
+    if (pos != end && *pos == '"')
+        return QByteArray::fromRawData(start, static_cast<int>(pos++ - start));
+
+    QByteArray bytes{start, static_cast<int>(pos - start)};
+    while (pos != end)
+    {
+        const auto c = *pos++;
+        if (c == '"')
+            return bytes;
+
+        if (c != '\\')
+        {
+            bytes.append(c);
+            continue;
+        }
+
+        if (pos == end)
+            break;
+
+        switch (const auto escaped = *pos++)
+        {
+        case 'b':
+            bytes.append('\b');
+            break;
+        case 'f':
+            bytes.append('\f');
+            break;
+        case 'n':
+            bytes.append('\n');
+            break;
+        case 'r':
+            bytes.append('\r');
+            break;
+        case 't':
+            bytes.append('\t');
+            break;
+        case 'u':
+        {
+            auto read_code_unit = [this] {
+                uint32_t code_unit{0};
+                for (auto i = 0; i < 4; ++i)
+                {
+                    const auto digit = pos != end ? hex_value(*pos++) : -1;
+                    if (digit < 0)
+                        fail("invalid unicode escape");
+                    code_unit = code_unit << 4 | static_cast<uint32_t>(digit);
+                }
+                return code_unit;
+            };
+
+            auto code_point = read_code_unit();
+            if (code_point >= 0xd800 && code_point < 0xdc00 && end - pos >= 6 && pos[0] == '\\' && pos[1] == 'u')
+            {
+                pos += 2;
+                const auto low = read_code_unit();
+                code_point = low >= 0xdc00 && low < 0xe000 ? 0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00)
+                                                           : 0xfffd;
+            }
+            else if (code_point >= 0xd800 && code_point < 0xe000)
+            {
+                code_point = 0xfffd;
+            }
+
+            append_utf8(bytes, code_point);
+            break;
+        }
+        default:
+            bytes.append(escaped);
+            break;
+        }
+    }
+
+    fail("unterminated string");
+}
+
+void mp::JsonReader::skip_value(int depth)
+{
+    if (depth > max_depth)
+        fail("document nested too deeply");
+
+    switch (peek())
+    {
+    case '{':
+        ++pos;
+        first_member.push_back(true);
+        while (next_member())
+            skip_value(depth + 1);
+        break;
+    case '[':
+    {
+        ++pos;
+        auto first = true;
+        while (peek() != ']')
+        {
+            if (!first)
+                expect(',');
+            first = false;
+            skip_value(depth + 1);
+        }
+        ++pos;
+        break;
+    }
+    case '"':
+        skip_string();
+        break;
+    case 't':
+        skip_literal("true");
+        break;
+    case 'f':
+        skip_literal("false");
+        break;
+    case 'n':
+        skip_literal("null");
+        break;
+    default:
+        skip_number();
+        break;
+    }
+}
+
+void mp::JsonReader::skip_string()
+{
+    expect('"');
+
+    while (pos != end)
+    {
+        const auto c = *pos++;
+        if (c == '"')
+            return;
+
+        if (c == '\\' && pos != end)
+            ++pos;
+    }
+
+    fail("unterminated string");
+}
+
+void mp::JsonReader::skip_literal(const char* literal)
+{
+    const auto length = std::strlen(literal);
+    if (static_cast<size_t>(end - pos) < length || std::strncmp(pos, literal, length) != 0)
+        fail("invalid literal");
+
+    pos += length;
+}
+
+void mp::JsonReader::skip_number()
+{
+    const auto start = pos;
+    while (pos != end && *pos != 0 && (std::strchr("+-.eE", *pos) || (*pos >= '0' && *pos <= '9')))
+        ++pos;
+
+    if (pos == start)
+        fail("unexpected character");
+}
+
+void mp::JsonReader::fail(const char* what) const
+{
+    throw std::runtime_error(std::string{"invalid JSON: "} + what + " at offset " + std::to_string(pos - begin));
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MULTIPASS_JSON_READER_H
+#define MULTIPASS_JSON_READER_H
+
+#include <QByteArray>
+#include <QString>
+
+#include <cstdint>
+#include <vector>
+
+namespace multipass
+{
+// Pulls values out of a JSON document one at a time, so that only what is asked for gets decoded and anything else
+// is skipped over without building anything. Reading a value of another type than expected skips it and yields the
+// same as QJsonValue would for it. The document is not copied, so it has to outlive the reader.
+class JsonReader
+{
+public:
+    explicit JsonReader(const QByteArray& json);
+
+    // Returns false, skipping the value, if it is not an object
+    bool enter_object();
+    // Moves on to the next member of the object entered last, returning false once there are none left
+    bool next_member();
+    // The name of the current member, only valid until the next one is read
+    const QByteArray& key() const;
+
+    QString read_string();
+    bool read_bool();
+    int64_t read_integer(int64_t default_value);
+    void skip_value();
+
+    // Throws unless only whitespace is left
+    void expect_end();
+
+private:
+    void skip_whitespace();
+    char peek();
+    void expect(char c);
+    QByteArray string_bytes();
+    void skip_value(int depth);
+    void skip_string();
+    void skip_literal(const char* literal);
+    void skip_number();
+    [[noreturn]] void fail(const char* what) const;
+
+    const char* const begin;
+    const char* pos;
+    const char* const end;
+    std::vector<bool> first_member;
+    QByteArray current_key;
+};
+} // namespace multipass
+#endif // MULTIPASS_JSON_READER_H
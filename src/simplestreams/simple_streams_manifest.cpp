@@ -20,12 +20,16 @@
 
 #include <multipass/simple_streams_manifest.h>
 
+#include "json_reader.h"
+
 #include <QFileInfo>
 #include <QHash>
-#include <QJsonDocument>
-#include <QJsonObject>
+#include <QSet>
 #include <QSysInfo>
 
+#include <algorithm>
+#include <map>
+
 namespace mp = multipass;
 
 namespace
@@ -34,30 +38,42 @@ const QHash<QString, QString> arch_to_manifest{{"x86_64", "amd64"}, {"arm", "arm
                                                {"i386", "i386"},    {"power", "powerpc"}, {"power64", "ppc64el"},
                                                {"s390x", "s390x"}};
 
-QJsonObject parse_manifest(const QByteArray& json)
+struct ImageItem
 {
-    QJsonParseError parse_error;
-    const auto doc = QJsonDocument::fromJson(json, &parse_error);
-    if (doc.isNull())
-        throw std::runtime_error(parse_error.errorString().toStdString());
+    QString location;
+    QString sha256;
+    int64_t size;
+    QString delta_signature_location;
+};
 
-    if (!doc.isObject())
-        throw std::runtime_error("invalid manifest object");
-    return doc.object();
-}
+struct Product
+{
+    QString arch;
+    QStringList aliases;
+    QString release;
+    QString release_title;
+    bool supported{false};
+    QString latest_version;
+    std::map<QString, ImageItem> versions;
+};
 
-QString latest_version_in(const QJsonObject& versions)
+// Hands out a single copy of equal strings, which then share their data
+class StringPool
 {
-    QString max_version;
-    for (auto it = versions.constBegin(); it != versions.constEnd(); ++it)
+public:
+    QString intern(const QString& string)
     {
-        const auto version = it.key();
-        if (version < max_version)
-            continue;
-        max_version = version;
+        auto it = strings.constFind(string);
+        if (it != strings.constEnd())
+            return *it;
+
+        strings.insert(string);
+        return string;
     }
-    return max_version;
-}
+
+private:
+    QSet<QString> strings;
+};
 
 QString derive_unpacked_file_path_prefix_from(const QString& image_location)
 {
@@ -72,72 +88,207 @@ QString derive_unpacked_file_path_prefix_from(const QString& image_location)
 
     return prefix;
 }
+
+// Returns whether the version has any items at all, reading the disk image one if it is there
+bool read_version(mp::JsonReader& reader, ImageItem& image)
+{
+    auto has_items = false;
+
+    if (!reader.enter_object())
+        return false;
+
+    while (reader.next_member())
+    {
+        if (reader.key() != "items" || !reader.enter_object())
+        {
+            reader.skip_value();
+            continue;
+        }
+
+        while (reader.next_member())
+        {
+            has_items = true;
+
+            // Remotes that support delta downloads publish the block checksums of the image as an item of its own
+            if (reader.key() == "disk1.img.delta-signature" && reader.enter_object())
+            {
+                while (reader.next_member())
+                {
+                    if (reader.key() == "path")
+                        image.delta_signature_location = reader.read_string();
+                    else
+                        reader.skip_value();
+                }
+                continue;
+            }
+
+            if (reader.key() != "disk1.img" || !reader.enter_object())
+            {
+                reader.skip_value();
+                continue;
+            }
+
+            while (reader.next_member())
+            {
+                if (reader.key() == "path")
+                    image.location = reader.read_string();
+                else if (reader.key() == "sha256")
+                    image.sha256 = reader.read_string();
+                else if (reader.key() == "size")
+                    image.size = reader.read_integer(-1);
+                else
+                    reader.skip_value();
+            }
+        }
+    }
+
+    return has_items;
 }
 
-std::unique_ptr<mp::SimpleStreamsManifest> mp::SimpleStreamsManifest::fromJson(const QByteArray& json)
+void read_versions(mp::JsonReader& reader, Product& product, StringPool& pool)
 {
-    const auto manifest = parse_manifest(json);
-    const auto updated = manifest["updated"].toString();
+    if (!reader.enter_object())
+        return;
 
-    const auto manifest_products = manifest["products"].toObject();
-    if (manifest_products.isEmpty())
-        throw std::runtime_error("No products found");
+    while (reader.next_member())
+    {
+        const auto version = pool.intern(QString::fromUtf8(reader.key()));
+        if (version > product.latest_version)
+            product.latest_version = version;
+
+        ImageItem image{{}, {}, -1, {}};
+        if (read_version(reader, image))
+            product.versions.emplace(version, std::move(image));
+    }
+}
+
+// Products of other architectures are skipped over as soon as their architecture is known. Their versions are only
+// read when they come first, since members can be in any order.
+bool read_product(mp::JsonReader& reader, const QString& arch, Product& product, StringPool& pool)
+{
+    if (!reader.enter_object())
+        return false;
+
+    while (reader.next_member())
+    {
+        if (reader.key() == "arch")
+        {
+            product.arch = reader.read_string();
+            if (product.arch != arch)
+            {
+                while (reader.next_member())
+                    reader.skip_value();
+                return false;
+            }
+        }
+        else if (reader.key() == "aliases")
+        {
+            for (const auto& alias : reader.read_string().split(","))
+                product.aliases.append(pool.intern(alias));
+        }
+        else if (reader.key() == "release")
+            product.release = pool.intern(reader.read_string());
+        else if (reader.key() == "release_title")
+            product.release_title = pool.intern(reader.read_string());
+        else if (reader.key() == "supported")
+            product.supported = reader.read_bool();
+        else if (reader.key() == "versions")
+            read_versions(reader, product, pool);
+        else
+            reader.skip_value();
+    }
 
+    return product.arch == arch;
+}
+} // namespace
+
+std::unique_ptr<mp::SimpleStreamsManifest> mp::SimpleStreamsManifest::fromJson(const QByteArray& json)
+{
     auto arch = arch_to_manifest.value(QSysInfo::currentCpuArchitecture());
 
     if (arch.isEmpty())
         throw std::runtime_error("Unsupported cloud image architecture");
 
-    std::vector<VMImageInfo> products;
-    for (const auto& value : manifest_products)
-    {
-        const auto product = value.toObject();
+    JsonReader reader{json};
+    if (!reader.enter_object())
+        throw std::runtime_error("invalid manifest object");
 
-        if (product["arch"].toString() != arch)
-            continue;
+    QString updated;
+    auto has_products = false;
+    StringPool pool;
+    const auto ubuntu = pool.intern("Ubuntu");
 
-        const auto product_aliases = product["aliases"].toString().split(",");
+    // Ordered by name as the products used to be, for the same ones to win when aliases clash
+    std::map<QString, Product> host_products;
 
-        const auto release = product["release"].toString();
-        const auto release_title = product["release_title"].toString();
-        const auto supported = product["supported"].toBool();
+    while (reader.next_member())
+    {
+        if (reader.key() == "updated")
+        {
+            updated = reader.read_string();
+        }
+        else if (reader.key() == "products" && reader.enter_object())
+        {
+            while (reader.next_member())
+            {
+                has_products = true;
 
-        const auto versions = product["versions"].toObject();
-        if (versions.isEmpty())
-            continue;
+                const auto name = QString::fromUtf8(reader.key());
+                Product product;
+                if (read_product(reader, arch, product, pool) && !product.versions.empty())
+                    host_products.emplace(name, std::move(product));
+            }
+        }
+        else
+        {
+            reader.skip_value();
+        }
+    }
+    reader.expect_end();
 
-        const auto latest_version = latest_version_in(versions);
+    if (!has_products)
+        throw std::runtime_error("No products found");
 
-        for (auto it = versions.constBegin(); it != versions.constEnd(); ++it)
-        {
-            const auto version_string = it.key();
-            const auto version = versions[version_string].toObject();
-            const auto items = version["items"].toObject();
-            if (items.isEmpty())
-                continue;
+    std::size_t version_count{0};
+    for (const auto& product : host_products)
+        version_count += product.second.versions.size();
 
-            const auto image = items["disk1.img"].toObject();
-            const auto image_location = image["path"].toString();
-            const auto sha256 = image["sha256"].toString();
-            const auto size = image["size"].toInt(-1);
+    std::vector<VMImageInfo> products;
+    products.reserve(version_count);
+    for (const auto& entry : host_products)
+    {
+        const auto& product = entry.second;
+        for (const auto& version : product.versions)
+        {
+            const auto& image = version.second;
 
             // NOTE: These are not defined in the manifest itself
             // so they are not guaranteed to be correct or exist in the server
-            const auto prefix = derive_unpacked_file_path_prefix_from(image_location);
+            const auto prefix = derive_unpacked_file_path_prefix_from(image.location);
             const auto kernel_location = prefix + "-vmlinuz-generic";
             const auto initrd_location = prefix + "-initrd-generic";
 
             // Aliases always alias to the latest version
-            const QStringList& aliases = version_string == latest_version ? product_aliases : QStringList();
-            products.push_back({aliases, "Ubuntu", release, release_title, supported, image_location, kernel_location,
-                                initrd_location, sha256, version_string, size});
+            const QStringList& aliases = version.first == product.latest_version ? product.aliases : QStringList();
+            products.push_back({aliases, ubuntu, product.release, product.release_title, product.supported,
+                                image.location, kernel_location, initrd_location, image.sha256, version.first,
+                                image.size, image.delta_signature_location});
         }
     }
 
     if (products.empty())
         throw std::runtime_error("failed to parse any products");
 
-    QMap<QString, const VMImageInfo*> map;
+    return fromProducts(updated, std::move(products));
+}
+
+std::unique_ptr<mp::SimpleStreamsManifest> mp::SimpleStreamsManifest::fromProducts(const QString& updated_at,
+                                                                                   std::vector<VMImageInfo> products)
+{
+    QHash<QString, const VMImageInfo*> map;
+    map.reserve(static_cast<int>(products.size()));
+    std::vector<const VMImageInfo*> products_by_id;
+    products_by_id.reserve(products.size());
 
     for (const auto& product : products)
     {
@@ -146,8 +297,24 @@ std::unique_ptr<mp::SimpleStreamsManifest> mp::SimpleStreamsManifest::fromJson(c
         {
             map[alias] = &product;
         }
+        products_by_id.push_back(&product);
     }
 
+    std::stable_sort(products_by_id.begin(), products_by_id.end(),
+                     [](const VMImageInfo* a, const VMImageInfo* b) { return a->id < b->id; });
+
     return std::unique_ptr<SimpleStreamsManifest>(
-        new SimpleStreamsManifest{updated, std::move(products), std::move(map)});
+        new SimpleStreamsManifest{updated_at, std::move(products), std::move(map), std::move(products_by_id)});
+}
+
+std::vector<const mp::VMImageInfo*> mp::SimpleStreamsManifest::products_with_id_prefix(const QString& prefix) const
+{
+    auto it = std::lower_bound(products_by_id.cbegin(), products_by_id.cend(), prefix,
+                               [](const VMImageInfo* info, const QString& id) { return info->id < id; });
+
+    std::vector<const VMImageInfo*> matches;
+    for (; it != products_by_id.cend() && (*it)->id.startsWith(prefix); ++it)
+        matches.push_back(*it);
+
+    return matches;
 }
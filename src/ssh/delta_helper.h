@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MULTIPASS_DELTA_HELPER_H
+#define MULTIPASS_DELTA_HELPER_H
+
+namespace multipass
+{
+namespace delta_sync
+{
+// Runs on the instance, which holds the old version of the file. Usage: <mode> <path> <name> [args...], where the
+// file is <path>/<name> when <path> is a directory. An "apply" removes the delta whether or not it succeeds.
+constexpr auto remote_helper = R"(
+import sys, os, zlib, hashlib, struct
+mode, path, name = sys.argv[1], sys.argv[2], sys.argv[3]
+if os.path.isdir(path):
+    path = os.path.join(path, name)
+if mode == "sig":
+    block_size, size, mtime = int(sys.argv[4]), int(sys.argv[5]), int(sys.argv[6])
+    try:
+        st = os.stat(path)
+    except OSError:
+        print("NONE")
+        sys.exit(0)
+    if st.st_size == size and int(st.st_mtime) == mtime:
+        print("SAME")
+        sys.exit(0)
+    whole = hashlib.sha256()
+    with open(path, "rb") as f:
+        while True:
+            block = f.read(block_size)
+            if not block:
+                break
+            whole.update(block)
+            print("%d %s" % (zlib.adler32(block) & 0xffffffff, hashlib.md5(block).hexdigest()))
+    print("H " + whole.hexdigest())
+elif mode == "apply":
+    delta, block_size, mtime = sys.argv[4], int(sys.argv[5]), int(sys.argv[6])
+    new_path = path + ".multipass-delta"
+    try:
+        with open(path, "rb") as old, open(delta, "rb") as d, open(new_path, "wb") as out:
+            while True:
+                op = d.read(1)
+                if not op:
+                    break
+                value = struct.unpack(">Q", d.read(8))[0]
+                if op == b"C":
+                    old.seek(value * block_size)
+                    out.write(old.read(block_size))
+                else:
+                    while value > 0:
+                        data = d.read(min(value, 1048576))
+                        if not data:
+                            sys.exit(1)
+                        out.write(data)
+                        value -= len(data)
+        os.chmod(new_path, os.stat(path).st_mode)
+        os.replace(new_path, path)
+        os.utime(path, (mtime, mtime))
+    finally:
+        for leftover in (delta, new_path):
+            if os.path.exists(leftover):
+                os.remove(leftover)
+elif mode == "discard":
+    if os.path.exists(path):
+        os.remove(path)
+elif mode == "touch":
+    mtime = int(sys.argv[4])
+    os.utime(path, (mtime, mtime))
+)";
+} // namespace delta_sync
+} // namespace multipass
+#endif // MULTIPASS_DELTA_HELPER_H
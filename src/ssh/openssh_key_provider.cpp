@@ -28,11 +28,13 @@
 namespace mp = multipass;
 namespace
 {
+constexpr auto priv_key_name = "id_ed25519";
+constexpr auto legacy_priv_key_name = "id_rsa";
 
 mp::OpenSSHKeyProvider::KeyUPtr create_priv_key(const QString& priv_key_path)
 {
     ssh_key priv_key;
-    auto ret = ssh_pki_generate(SSH_KEYTYPE_RSA, 2048, &priv_key);
+    auto ret = ssh_pki_generate(SSH_KEYTYPE_ED25519, 0, &priv_key);
     if (ret != SSH_OK)
         throw std::runtime_error("unable to generate ssh key");
 
@@ -46,18 +48,27 @@ mp::OpenSSHKeyProvider::KeyUPtr create_priv_key(const QString& priv_key_path)
     return key;
 }
 
+mp::OpenSSHKeyProvider::KeyUPtr import_priv_key(const QString& priv_key_path)
+{
+    if (!QFile::exists(priv_key_path))
+        return nullptr;
+
+    ssh_key priv_key;
+    auto imported =
+        ssh_pki_import_privkey_file(priv_key_path.toStdString().c_str(), nullptr, nullptr, nullptr, &priv_key);
+    if (imported != SSH_OK)
+        return nullptr;
+
+    return mp::OpenSSHKeyProvider::KeyUPtr{priv_key};
+}
+
 mp::OpenSSHKeyProvider::KeyUPtr get_priv_key(const QDir& key_dir)
 {
-    auto priv_key_path = key_dir.filePath("id_rsa");
-    if (QFile::exists(priv_key_path))
-    {
-        ssh_key priv_key;
-        auto imported =
-            ssh_pki_import_privkey_file(priv_key_path.toStdString().c_str(), nullptr, nullptr, nullptr, &priv_key);
-        if (imported != SSH_OK)
-            return create_priv_key(priv_key_path);
-        return mp::OpenSSHKeyProvider::KeyUPtr{priv_key};
-    }
+    auto priv_key_path = key_dir.filePath(priv_key_name);
+    auto priv_key = import_priv_key(priv_key_path);
+    if (priv_key)
+        return priv_key;
+
     return create_priv_key(priv_key_path);
 }
 } // namespace
@@ -68,13 +79,16 @@ void mp::OpenSSHKeyProvider::KeyDeleter::operator()(ssh_key key)
 }
 
 mp::OpenSSHKeyProvider::OpenSSHKeyProvider(const mp::Path& cache_dir)
-    : ssh_key_dir{mp::utils::make_dir(cache_dir, "ssh-keys")}, priv_key{get_priv_key(ssh_key_dir)}
+    : ssh_key_dir{mp::utils::make_dir(cache_dir, "ssh-keys")},
+      priv_key{get_priv_key(ssh_key_dir)},
+      // Instances launched before the switch to ed25519 only authorize the RSA key, keep it around to migrate them
+      legacy_priv_key{import_priv_key(ssh_key_dir.filePath(legacy_priv_key_name))}
 {
 }
 
 std::string mp::OpenSSHKeyProvider::private_key_as_base64() const
 {
-    QFile key_file{ssh_key_dir.filePath("id_rsa")};
+    QFile key_file{ssh_key_dir.filePath(priv_key_name)};
     auto opened = key_file.open(QIODevice::ReadOnly);
     if (!opened)
         throw std::runtime_error(
@@ -97,7 +111,17 @@ std::string mp::OpenSSHKeyProvider::public_key_as_base64() const
     return {base64};
 }
 
+std::string mp::OpenSSHKeyProvider::public_key_type() const
+{
+    return ssh_key_type_to_char(ssh_key_type(priv_key.get()));
+}
+
 ssh_key mp::OpenSSHKeyProvider::private_key() const
 {
     return priv_key.get();
 }
+
+ssh_key mp::OpenSSHKeyProvider::legacy_private_key() const
+{
+    return legacy_priv_key.get();
+}
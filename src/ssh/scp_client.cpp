@@ -15,18 +15,26 @@
  *
  */
 
+#include <multipass/delta_sync.h>
+#include <multipass/file_hasher.h>
+#include <multipass/optional.h>
+#include <multipass/sha256.h>
 #include <multipass/ssh/scp_client.h>
 #include <multipass/ssh/throw_on_error.h>
 #include <multipass/utils.h>
 
+#include "delta_helper.h"
 #include "ssh_client_key_provider.h"
 
 #include <fmt/format.h>
 
+#include <algorithm>
 #include <array>
 
+#include <QDateTime>
 #include <QFile>
 #include <QFileInfo>
+#include <QTemporaryFile>
 
 namespace mp = multipass;
 
@@ -57,6 +65,61 @@ std::string full_destination(const std::string& destination_path, const std::str
 
     return destination_path;
 }
+
+mp::optional<std::string> run_delta_helper(mp::SSHSession& session, const std::vector<std::string>& args)
+{
+    std::vector<std::string> cmd{"python3", "-c", mp::delta_sync::remote_helper};
+    cmd.insert(cmd.end(), args.cbegin(), args.cend());
+
+    // Paths come from the user, so every argument is single-quoted to keep the shell from expanding anything
+    std::transform(cmd.begin(), cmd.end(), cmd.begin(), mp::utils::quote_for_shell);
+    auto proc = session.exec(mp::utils::to_cmd(cmd, mp::utils::QuoteType::no_quotes));
+
+    // Drain the output before waiting for the exit status so a large signature cannot stall the channel
+    auto output = proc.read_std_output();
+    if (proc.exit_code(std::chrono::minutes(5)) != 0)
+        return mp::nullopt;
+
+    return output;
+}
+
+mp::delta_sync::Signature parse_signature(const std::string& output, int64_t block_size, std::string& whole_hash)
+{
+    mp::delta_sync::Signature signature{block_size, {}};
+
+    for (const auto& line : QString::fromStdString(output).split('\n', QString::SkipEmptyParts))
+    {
+        const auto fields = line.split(' ');
+        if (fields.size() != 2)
+            throw std::runtime_error(fmt::format("[scp sync] invalid signature line: {}", line.toStdString()));
+
+        if (fields[0] == "H")
+        {
+            whole_hash = fields[1].toStdString();
+            continue;
+        }
+
+        bool ok{false};
+        const auto weak = fields[0].toUInt(&ok);
+        if (!ok)
+            throw std::runtime_error(fmt::format("[scp sync] invalid signature line: {}", line.toStdString()));
+
+        signature.blocks.push_back({weak, fields[1].toStdString()});
+    }
+
+    if (whole_hash.empty())
+        throw std::runtime_error("[scp sync] truncated signature");
+
+    return signature;
+}
+
+std::string sha256_of(const char* data, int64_t length)
+{
+    mp::Sha256 hash;
+    hash.add_data(data, length);
+
+    return hash.hex_result();
+}
 } // namespace
 
 mp::SCPClient::SCPClient(const std::string& host, int port, const std::string& username,
@@ -148,3 +211,75 @@ void mp::SCPClient::pull_file(const std::string& source_path, const std::string&
 
     SSH::throw_on_error(scp, *ssh_session, "[scp pull] close failed", ssh_scp_close);
 }
+
+void mp::SCPClient::sync_file(const std::string& source_path, const std::string& destination_path,
+                              FileHasher* hasher)
+{
+    QFile source(QString::fromStdString(source_path));
+    if (!source.open(QIODevice::ReadOnly))
+        throw std::runtime_error(
+            fmt::format("[scp sync] error opening file for reading: {}", source.errorString().toStdString()));
+
+    const auto size = source.size();
+    const auto mtime = std::to_string(QFileInfo(source).lastModified().toMSecsSinceEpoch() / 1000);
+    const auto filename = mp::utils::filename_for(source_path);
+    const auto block_size = mp::delta_sync::block_size_for(size);
+
+    auto push_whole_file = [&] {
+        push_file(source_path, destination_path);
+        // Stamp the local mtime so the next sync can skip an unchanged file on size and mtime alone
+        run_delta_helper(*ssh_session, {"touch", destination_path, filename, mtime});
+    };
+
+    // First stage: a missing or unchanged (size and mtime) destination needs no signature at all
+    auto output = run_delta_helper(*ssh_session, {"sig", destination_path, filename, std::to_string(block_size),
+                                                  std::to_string(size), mtime});
+    if (!output || *output == "NONE\n" || size == 0)
+        return push_whole_file();
+    if (*output == "SAME\n")
+        return;
+
+    std::string remote_hash;
+    const auto signature = parse_signature(*output, block_size, remote_hash);
+
+    const auto data = reinterpret_cast<const char*>(source.map(0, size));
+    if (data == nullptr)
+        return push_whole_file();
+
+    // Second stage: identical content with a different mtime only needs the timestamp fixed up
+    const auto local_hash = hasher ? hasher->sha256_of(QString::fromStdString(source_path)) : sha256_of(data, size);
+    if (local_hash == remote_hash)
+    {
+        run_delta_helper(*ssh_session, {"touch", destination_path, filename, mtime});
+        return;
+    }
+
+    QTemporaryFile delta_file;
+    if (!delta_file.open())
+        throw std::runtime_error(
+            fmt::format("[scp sync] error creating delta file: {}", delta_file.errorString().toStdString()));
+
+    const auto stats = mp::delta_sync::write_delta(data, size, signature, delta_file);
+    if (!delta_file.flush())
+        throw std::runtime_error(
+            fmt::format("[scp sync] error writing delta file: {}", delta_file.errorString().toStdString()));
+
+    // Nothing in common, the delta would only add overhead on top of the whole file
+    if (stats.matched_blocks == 0)
+        return push_whole_file();
+
+    const auto remote_delta_path = fmt::format("/tmp/multipass-delta-{}", mp::utils::make_uuid().toStdString());
+    try
+    {
+        push_file(delta_file.fileName().toStdString(), remote_delta_path);
+    }
+    catch (const std::exception&)
+    {
+        run_delta_helper(*ssh_session, {"discard", remote_delta_path, filename});
+        throw;
+    }
+
+    if (!run_delta_helper(*ssh_session, {"apply", destination_path, filename, remote_delta_path,
+                                         std::to_string(block_size), mtime}))
+        throw std::runtime_error(fmt::format("[scp sync] failed to apply delta to {}", destination_path));
+}
@@ -50,7 +50,17 @@ std::string mp::SSHClientKeyProvider::public_key_as_base64() const
     throw std::runtime_error("Unimplemented");
 }
 
+std::string mp::SSHClientKeyProvider::public_key_type() const
+{
+    throw std::runtime_error("Unimplemented");
+}
+
 ssh_key mp::SSHClientKeyProvider::private_key() const
 {
     return priv_key.get();
 }
+
+ssh_key mp::SSHClientKeyProvider::legacy_private_key() const
+{
+    return nullptr;
+}
@@ -37,7 +37,9 @@ public:
 
     std::string private_key_as_base64() const override;
     std::string public_key_as_base64() const override;
+    std::string public_key_type() const override;
     ssh_key private_key() const override;
+    ssh_key legacy_private_key() const override;
 
 private:
     KeyUPtr priv_key;
@@ -17,6 +17,7 @@
 
 #include <multipass/ssh/ssh_session.h>
 
+#include <multipass/logging/log.h>
 #include <multipass/ssh/ssh_key_provider.h>
 #include <multipass/ssh/throw_on_error.h>
 
@@ -25,11 +26,49 @@
 
 #include <fmt/format.h>
 
+#include <QByteArray>
+
 #include <sstream>
 #include <stdexcept>
 #include <string>
 
+#if defined(__linux__) && defined(__aarch64__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
 namespace mp = multipass;
+namespace mpl = multipass::logging;
+
+namespace
+{
+constexpr auto category = "ssh session";
+
+bool has_hardware_aes()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_cpu_supports("aes");
+#elif defined(__linux__) && defined(__aarch64__)
+    return getauxval(AT_HWCAP) & HWCAP_AES;
+#else
+    return false;
+#endif
+}
+
+std::string preferred_ciphers()
+{
+    auto ciphers = qgetenv("MULTIPASS_SSH_CIPHERS");
+    if (!ciphers.isEmpty())
+        return ciphers.toStdString();
+
+    // AES-GCM runs at several times the speed of ChaCha20 when the CPU has AES instructions, but is much slower
+    // without them. Ciphers unknown to libssh are dropped from the list when it is set.
+    if (has_hardware_aes())
+        return "aes128-gcm@openssh.com,aes256-gcm@openssh.com,aes128-ctr,chacha20-poly1305@openssh.com";
+
+    return "chacha20-poly1305@openssh.com,aes256-ctr";
+}
+} // namespace
 
 mp::SSHSession::SSHSession(const std::string& host, int port, const std::string& username,
                            const SSHKeyProvider* key_provider, const std::chrono::milliseconds timeout)
@@ -46,15 +85,13 @@ mp::SSHSession::SSHSession(const std::string& host, int port, const std::string&
     set_option(SSH_OPTIONS_USER, username.c_str());
     set_option(SSH_OPTIONS_TIMEOUT, &timeout_secs);
     set_option(SSH_OPTIONS_NODELAY, &nodelay);
-    set_option(SSH_OPTIONS_CIPHERS_C_S, "chacha20-poly1305@openssh.com,aes256-ctr");
-    set_option(SSH_OPTIONS_CIPHERS_S_C, "chacha20-poly1305@openssh.com,aes256-ctr");
+    const auto ciphers = preferred_ciphers();
+    set_option(SSH_OPTIONS_CIPHERS_C_S, ciphers.c_str());
+    set_option(SSH_OPTIONS_CIPHERS_S_C, ciphers.c_str());
 
     SSH::throw_on_error(session, "ssh connection failed", ssh_connect);
     if (key_provider)
-    {
-        SSH::throw_on_error(session, "ssh failed to authenticate", ssh_userauth_publickey, nullptr,
-                            key_provider->private_key());
-    }
+        authenticate(*key_provider);
 }
 
 mp::SSHSession::SSHSession(const std::string& host, int port, const std::string& username,
@@ -86,6 +123,44 @@ mp::SSHSession::operator ssh_session() const
     return session.get();
 }
 
+void mp::SSHSession::authenticate(const SSHKeyProvider& key_provider)
+{
+    auto legacy_key = key_provider.legacy_private_key();
+    if (legacy_key == nullptr)
+    {
+        SSH::throw_on_error(session, "ssh failed to authenticate", ssh_userauth_publickey, nullptr,
+                            key_provider.private_key());
+        return;
+    }
+
+    if (ssh_userauth_publickey(session.get(), nullptr, key_provider.private_key()) == SSH_AUTH_SUCCESS)
+        return;
+
+    SSH::throw_on_error(session, "ssh failed to authenticate", ssh_userauth_publickey, nullptr, legacy_key);
+    authorize_public_key(key_provider);
+}
+
+void mp::SSHSession::authorize_public_key(const SSHKeyProvider& key_provider)
+{
+    try
+    {
+        const auto key_line = fmt::format("{} {} multipass@localhost", key_provider.public_key_type(),
+                                          key_provider.public_key_as_base64());
+
+        auto proc = exec(fmt::format("mkdir -p ~/.ssh && (grep -qxF '{0}' ~/.ssh/authorized_keys 2>/dev/null || "
+                                     "echo '{0}' >> ~/.ssh/authorized_keys)",
+                                     key_line));
+        if (proc.exit_code() != 0)
+            throw std::runtime_error(proc.read_std_error());
+
+        mpl::log(mpl::Level::info, category, "migrated instance to the current ssh key");
+    }
+    catch (const std::exception& e)
+    {
+        mpl::log(mpl::Level::warning, category, fmt::format("failed to migrate instance ssh key: {}", e.what()));
+    }
+}
+
 namespace
 {
 const char* name_for(ssh_options_e type)
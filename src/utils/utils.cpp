@@ -120,6 +120,12 @@ std::string mp::utils::escape_char(const std::string& in, char c)
     return std::regex_replace(in, std::regex({c}), fmt::format("\\{}", c));
 }
 
+std::string mp::utils::quote_for_shell(const std::string& in)
+{
+    // Nothing is special inside single quotes, so only the quotes themselves need closing, escaping and reopening
+    return fmt::format("'{}'", std::regex_replace(in, std::regex("'"), "'\\''"));
+}
+
 std::vector<std::string> mp::utils::split(const std::string& string, const std::string& delimiter)
 {
     std::regex regex(delimiter);
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "local_http_server.h"
+
+#include <QEventLoop>
+#include <QTcpServer>
+#include <QTcpSocket>
+
+#include <algorithm>
+#include <future>
+#include <memory>
+#include <stdexcept>
+
+namespace mpt = multipass::test;
+
+namespace
+{
+QByteArray reason_for(int status)
+{
+    switch (status)
+    {
+    case 200:
+        return "OK";
+    case 206:
+        return "Partial Content";
+    case 304:
+        return "Not Modified";
+    case 404:
+        return "Not Found";
+    default:
+        return "Status";
+    }
+}
+
+mpt::LocalHTTPServer::Request parse_request(const QByteArray& head)
+{
+    mpt::LocalHTTPServer::Request request;
+
+    const auto lines = head.split('\n');
+    const auto request_line = lines.front().trimmed().split(' ');
+    request.method = request_line.value(0);
+    request.path = request_line.value(1);
+
+    for (auto i = 1; i < lines.size(); ++i)
+    {
+        const auto separator = lines[i].indexOf(':');
+        if (separator > 0)
+            request.headers[lines[i].left(separator).trimmed().toLower()] = lines[i].mid(separator + 1).trimmed();
+    }
+
+    return request;
+}
+
+QByteArray serialize(const mpt::LocalHTTPServer::Response& response, bool with_body)
+{
+    auto data = "HTTP/1.1 " + QByteArray::number(response.status) + " " + reason_for(response.status) + "\r\n";
+    for (const auto& header : response.headers)
+        data += header.first + ": " + header.second + "\r\n";
+    data += "Content-Length: " + QByteArray::number(response.body.size()) + "\r\n\r\n";
+
+    if (with_body)
+        data += response.body;
+
+    return data;
+}
+} // namespace
+
+mpt::LocalHTTPServer::LocalHTTPServer(const Handler& handler) : handler{handler}
+{
+    std::promise<quint16> listening;
+    auto port_future = listening.get_future();
+
+    thread = std::thread([this, &listening] {
+        QEventLoop loop;
+        QTcpServer server;
+        if (!server.listen(QHostAddress::LocalHost))
+        {
+            listening.set_exception(std::make_exception_ptr(std::runtime_error("test server failed to listen")));
+            return;
+        }
+
+        QObject::connect(&server, &QTcpServer::newConnection, [this, &server] {
+            while (auto socket = server.nextPendingConnection())
+            {
+                auto pending = std::make_shared<QByteArray>();
+                QObject::connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+                QObject::connect(socket, &QTcpSocket::readyRead, [this, socket, pending] {
+                    *pending += socket->readAll();
+
+                    int end;
+                    while ((end = pending->indexOf("\r\n\r\n")) >= 0)
+                    {
+                        const auto request = parse_request(pending->left(end));
+                        pending->remove(0, end + 4);
+
+                        socket->write(serialize(this->handler(request), request.method != "HEAD"));
+                    }
+                });
+            }
+        });
+
+        event_loop = &loop;
+        listening.set_value(server.serverPort());
+        loop.exec();
+    });
+
+    try
+    {
+        port = port_future.get();
+    }
+    catch (...)
+    {
+        thread.join();
+        throw;
+    }
+}
+
+mpt::LocalHTTPServer::~LocalHTTPServer()
+{
+    if (event_loop)
+        QMetaObject::invokeMethod(event_loop, "quit", Qt::QueuedConnection);
+
+    thread.join();
+}
+
+QUrl mpt::LocalHTTPServer::url_for(const QString& path) const
+{
+    return QUrl{QString("http://127.0.0.1:%1%2").arg(port).arg(path)};
+}
+
+mpt::LocalHTTPServer::Response mpt::LocalHTTPServer::content_response(const QByteArray& content,
+                                                                        const Request& request, bool honour_ranges)
+{
+    Response response{200, {{"ETag", "\"content\""}}, content};
+    if (honour_ranges)
+        response.headers.push_back({"Accept-Ranges", "bytes"});
+
+    const auto range = request.headers.value("range");
+    if (!honour_ranges || !range.startsWith("bytes="))
+        return response;
+
+    const auto bounds = range.mid(6).split('-');
+    const auto start = bounds.value(0).toInt();
+    const auto last = content.size() - 1;
+    const auto end = bounds.value(1).isEmpty() ? last : std::min(bounds.value(1).toInt(), last);
+
+    response.status = 206;
+    response.headers.push_back(
+        {"Content-Range", QString("bytes %1-%2/%3").arg(start).arg(end).arg(content.size()).toLatin1()});
+    response.body = content.mid(start, end - start + 1);
+
+    return response;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MULTIPASS_LOCAL_HTTP_SERVER_H
+#define MULTIPASS_LOCAL_HTTP_SERVER_H
+
+#include <QByteArray>
+#include <QMap>
+#include <QUrl>
+
+#include <functional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class QEventLoop;
+
+namespace multipass
+{
+namespace test
+{
+// Serves HTTP/1.1 on the loopback interface from a thread of its own, so that clients blocking their thread on a
+// request are answered all the same. The handler is called on the server's thread.
+class LocalHTTPServer
+{
+public:
+    struct Request
+    {
+        QByteArray method;
+        QByteArray path;
+        QMap<QByteArray, QByteArray> headers; // Names are lowercase
+    };
+
+    struct Response
+    {
+        int status;
+        std::vector<std::pair<QByteArray, QByteArray>> headers;
+        QByteArray body;
+    };
+
+    using Handler = std::function<Response(const Request&)>;
+
+    explicit LocalHTTPServer(const Handler& handler);
+    ~LocalHTTPServer();
+
+    QUrl url_for(const QString& path) const;
+
+    // Answers with the content, or the requested range of it unless ranges are to be ignored
+    static Response content_response(const QByteArray& content, const Request& request, bool honour_ranges = true);
+
+private:
+    LocalHTTPServer(const LocalHTTPServer&) = delete;
+    LocalHTTPServer& operator=(const LocalHTTPServer&) = delete;
+
+    Handler handler;
+    quint16 port{0};
+    QEventLoop* event_loop{nullptr};
+    std::thread thread;
+};
+} // namespace test
+} // namespace multipass
+#endif // MULTIPASS_LOCAL_HTTP_SERVER_H
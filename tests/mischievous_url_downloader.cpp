@@ -25,9 +25,10 @@ mpt::MischievousURLDownloader::MischievousURLDownloader(std::chrono::millisecond
 }
 
 void mpt::MischievousURLDownloader::download_to(const QUrl& url, const QString& file_name, int64_t size,
-                                                const int download_type, const mp::ProgressMonitor& monitor)
+                                                const int download_type, const mp::ProgressMonitor& monitor,
+                                                DataSink* sink)
 {
-    URLDownloader::download_to(choose_url(url), file_name, size, download_type, monitor);
+    URLDownloader::download_to(choose_url(url), file_name, size, download_type, monitor, sink);
 }
 
 QByteArray mpt::MischievousURLDownloader::download(const QUrl& url)
@@ -35,6 +36,11 @@ QByteArray mpt::MischievousURLDownloader::download(const QUrl& url)
     return URLDownloader::download(choose_url(url));
 }
 
+mp::optional<QByteArray> mpt::MischievousURLDownloader::download_if_changed(const QUrl& url, Validators& validators)
+{
+    return URLDownloader::download_if_changed(choose_url(url), validators);
+}
+
 QDateTime mpt::MischievousURLDownloader::last_modified(const QUrl& url)
 {
     return URLDownloader::last_modified(choose_url(url));
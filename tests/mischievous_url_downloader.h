@@ -22,6 +22,8 @@
 
 #include <QUrl>
 
+#include <atomic>
+
 namespace multipass
 {
 namespace test
@@ -32,12 +34,14 @@ public:
     MischievousURLDownloader(std::chrono::milliseconds timeout);
 
     void download_to(const QUrl& url, const QString& file_name, int64_t size, const int download_type,
-                     const ProgressMonitor& monitor) override;
+                     const ProgressMonitor& monitor, DataSink* sink) override;
     QByteArray download(const QUrl& url) override;
+    optional<QByteArray> download_if_changed(const QUrl& url, Validators& validators) override;
     QDateTime last_modified(const QUrl& url) override;
 
 public:
-    int mischiefs = 0;
+    // Counted down by every request, which hosts may make from several threads at once
+    std::atomic<int> mischiefs{0};
 
 private:
     const QUrl& choose_url(const QUrl& url);
@@ -39,10 +39,20 @@ public:
         return {};
     }
 
+    std::string public_key_type() const override
+    {
+        return "ssh-ed25519";
+    }
+
     ssh_key private_key() const override
     {
         return nullptr;
     }
+
+    ssh_key legacy_private_key() const override
+    {
+        return nullptr;
+    }
 };
 }
 }
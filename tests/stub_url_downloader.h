@@ -30,13 +30,17 @@ struct StubURLDownloader : public multipass::URLDownloader
     {
     }
     void download_to(const QUrl& url, const QString& file_name, int64_t size, const int download_type,
-                     const multipass::ProgressMonitor&) override
+                     const multipass::ProgressMonitor&, DataSink*) override
     {
     }
     QByteArray download(const QUrl& url) override
     {
         return {};
     }
+    optional<QByteArray> download_if_changed(const QUrl& url, Validators&) override
+    {
+        return download(url);
+    }
 };
 } // namespace test
 } // namespace multipass
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "src/daemon/chunk_store.h"
+
+#include "file_operations.h"
+#include "temp_dir.h"
+
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+
+#include <gmock/gmock.h>
+
+#include <string>
+
+namespace mp = multipass;
+namespace mpt = multipass::test;
+
+using namespace testing;
+
+namespace
+{
+constexpr auto chunk_size = 64 * 1024;
+
+struct ChunkStore : public testing::Test
+{
+    ChunkStore()
+    {
+        // Repeated data, a zeroed chunk and a partial tail chunk
+        content = std::string(chunk_size, 'a') + std::string(chunk_size, 'a') + std::string(chunk_size, '\0') +
+                  std::string(100, 'b');
+        mpt::make_file_with_content(image_path, content);
+    }
+
+    int chunk_count()
+    {
+        int count{0};
+        QDirIterator it{store_dir.filePath("chunks"), QDir::Files, QDirIterator::Subdirectories};
+        while (it.hasNext())
+        {
+            it.next();
+            ++count;
+        }
+        return count;
+    }
+
+    mpt::TempDir image_dir;
+    mpt::TempDir store_path;
+    QDir store_dir{store_path.path()};
+    QString image_path{QDir(image_dir.path()).filePath("image.img")};
+    std::string content;
+};
+} // namespace
+
+TEST_F(ChunkStore, keeps_file_contents)
+{
+    mp::ChunkStore store{store_dir.path()};
+
+    store.add(image_path);
+
+    EXPECT_THAT(mpt::load(image_path).toStdString(), Eq(content));
+}
+
+TEST_F(ChunkStore, contains_added_file)
+{
+    mp::ChunkStore store{store_dir.path()};
+
+    EXPECT_FALSE(store.contains(image_path));
+
+    store.add(image_path);
+
+    EXPECT_TRUE(store.contains(image_path));
+}
+
+TEST_F(ChunkStore, does_not_contain_changed_file)
+{
+    mp::ChunkStore store{store_dir.path()};
+    store.add(image_path);
+
+    QFile::remove(image_path);
+    mpt::make_file_with_content(image_path, "a different image");
+
+    EXPECT_FALSE(store.contains(image_path));
+}
+
+TEST_F(ChunkStore, does_not_contain_removed_file)
+{
+    mp::ChunkStore store{store_dir.path()};
+    store.add(image_path);
+
+    store.remove(image_path);
+
+    EXPECT_FALSE(store.contains(image_path));
+}
+
+TEST_F(ChunkStore, collects_unreferenced_chunks)
+{
+    mp::ChunkStore store{store_dir.path()};
+    store.add(image_path);
+    store.remove(image_path);
+
+    store.collect_garbage();
+
+    EXPECT_THAT(chunk_count(), Eq(0));
+}
+
+TEST_F(ChunkStore, keeps_referenced_chunks)
+{
+    mp::ChunkStore store{store_dir.path()};
+    store.add(image_path);
+    const auto stored_chunks = chunk_count();
+
+    store.collect_garbage();
+
+    EXPECT_THAT(chunk_count(), Eq(stored_chunks));
+}
@@ -168,6 +168,21 @@ TEST_F(Client, copy_files_cmd_good_destination_remote)
                 Eq(mp::ReturnCode::Ok));
 }
 
+TEST_F(Client, copy_files_cmd_delta_destination_remote)
+{
+    EXPECT_CALL(mock_daemon, ssh_info(_, _, _));
+    EXPECT_THAT(send_command({"copy-files", "--delta", mpt::test_data_path().toStdString() + "good_index.json",
+                              "test-vm:bar"}),
+                Eq(mp::ReturnCode::Ok));
+}
+
+TEST_F(Client, copy_files_cmd_delta_fails_source_remote)
+{
+    EXPECT_THAT(send_command({"copy-files", "--delta", "test-vm:foo",
+                              mpt::test_data_path().toStdString() + "good_index.json"}),
+                Eq(mp::ReturnCode::CommandLineError));
+}
+
 TEST_F(Client, copy_files_cmd_help_ok)
 {
     EXPECT_THAT(send_command({"copy-files", "-h"}), Eq(mp::ReturnCode::Ok));
@@ -20,6 +20,7 @@
 #include "image_host_remote_count.h"
 #include "mischievous_url_downloader.h"
 #include "path.h"
+#include "temp_dir.h"
 
 #include <multipass/query.h>
 
@@ -180,8 +181,12 @@ TEST_F(CustomImageHost, handles_and_recovers_from_later_network_failure)
     const auto query = make_query("core", "snapcraft");
     EXPECT_TRUE(host.info_for(query));
 
+    // What was fetched last keeps being served, while refreshing and once refreshing failed
     url_downloader.mischiefs = 1000;
-    EXPECT_THROW(host.info_for(query), std::runtime_error);
+    EXPECT_TRUE(host.info_for(query));
+    host.wait_for_refresh();
+    EXPECT_TRUE(host.info_for(query));
+    host.wait_for_refresh();
 
     url_downloader.mischiefs = 0;
     EXPECT_TRUE(host.info_for(query));
@@ -195,9 +200,35 @@ TEST_F(CustomImageHost, handles_and_recovers_from_independent_server_failures)
     const auto num_remotes = mpt::count_remotes(host);
     EXPECT_GT(num_remotes, 0u);
 
+    // Remotes that were reached once keep being served, so failures only show on those never reached
     for (size_t i = 0; i < num_remotes; ++i)
     {
         url_downloader.mischiefs = i;
-        EXPECT_EQ(mpt::count_remotes(host), num_remotes - i);
+        mp::CustomVMImageHost failing_host{&url_downloader, ttl, test_path};
+        EXPECT_EQ(mpt::count_remotes(failing_host), num_remotes - i);
     }
 }
+
+TEST_F(CustomImageHost, serves_saved_catalogue_without_reaching_remotes)
+{
+    const auto ttl = 1h;
+    mpt::TempDir cache_dir;
+    const mp::CatalogueCache catalogue_cache{cache_dir.path() + "/custom.catalogue"};
+    const auto query = make_query("core", "snapcraft");
+
+    mp::optional<mp::VMImageInfo> fetched_info;
+    {
+        mp::CustomVMImageHost host{&url_downloader, ttl, test_path, catalogue_cache};
+        fetched_info = host.info_for(query);
+        ASSERT_TRUE(fetched_info);
+    }
+
+    url_downloader.mischiefs = 1000;
+    mp::CustomVMImageHost host{&url_downloader, ttl, test_path, catalogue_cache};
+
+    auto info = host.info_for(query);
+    ASSERT_TRUE(info);
+    EXPECT_THAT(info->id, Eq(fetched_info->id));
+    EXPECT_THAT(info->image_location, Eq(fetched_info->image_location));
+    EXPECT_THAT(info->aliases, Eq(fetched_info->aliases));
+}
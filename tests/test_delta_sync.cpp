@@ -0,0 +1,279 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "src/ssh/delta_helper.h"
+#include "temp_dir.h"
+
+#include <multipass/delta_sync.h>
+
+#include <gmock/gmock.h>
+
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QProcess>
+#include <QStandardPaths>
+
+#include <random>
+
+namespace mp = multipass;
+namespace mpd = multipass::delta_sync;
+namespace mpt = multipass::test;
+
+using namespace testing;
+
+namespace
+{
+constexpr int64_t block_size{2048};
+
+QByteArray random_data(int size)
+{
+    std::mt19937 gen{42};
+    std::uniform_int_distribution<int> dist{0, 255};
+
+    QByteArray data(size, '\0');
+    for (auto& byte : data)
+        byte = static_cast<char>(dist(gen));
+
+    return data;
+}
+
+mpd::DeltaStats delta_between(const QByteArray& basis, const QByteArray& target, QByteArray& delta)
+{
+    const auto signature = mpd::signature_for(basis.constData(), basis.size(), block_size);
+
+    QBuffer buffer{&delta};
+    buffer.open(QIODevice::WriteOnly);
+    return mpd::write_delta(target.constData(), target.size(), signature, buffer);
+}
+
+void write_file(const QString& path, const QByteArray& data)
+{
+    QFile file{path};
+    ASSERT_TRUE(file.open(QIODevice::WriteOnly));
+    ASSERT_THAT(file.write(data), Eq(data.size()));
+}
+
+QByteArray read_file(const QString& path)
+{
+    QFile file{path};
+    return file.open(QIODevice::ReadOnly) ? file.readAll() : QByteArray{};
+}
+
+// Runs the instance side of a delta sync locally, as python3 is all it needs
+struct RemoteDeltaHelper : public Test
+{
+    int run(const QStringList& args)
+    {
+        QProcess python;
+        python.start("python3", QStringList{"-c", mpd::remote_helper} + args);
+        python.waitForFinished();
+        output = python.readAllStandardOutput();
+        return python.exitStatus() == QProcess::NormalExit ? python.exitCode() : -1;
+    }
+
+    const bool has_python{!QStandardPaths::findExecutable("python3").isEmpty()};
+    mpt::TempDir dir;
+    QString path{dir.path() + "/file"};
+    QString delta_path{dir.path() + "/delta"};
+    QByteArray output;
+};
+} // namespace
+
+TEST(DeltaSync, rolling_checksum_matches_fresh_checksum)
+{
+    const auto data = random_data(3 * block_size);
+    mpd::RollingChecksum checksum{data.constData(), block_size};
+
+    for (int64_t pos = 0; pos + block_size < data.size(); ++pos)
+    {
+        checksum.roll(static_cast<unsigned char>(data[static_cast<int>(pos)]),
+                      static_cast<unsigned char>(data[static_cast<int>(pos + block_size)]));
+        ASSERT_THAT(checksum.value(), Eq(mpd::RollingChecksum(data.constData() + pos + 1, block_size).value()));
+    }
+}
+
+TEST(DeltaSync, weak_checksum_is_adler32)
+{
+    const QByteArray data{"Wikipedia"};
+
+    EXPECT_THAT(mpd::RollingChecksum(data.constData(), data.size()).value(), Eq(0x11E60398u));
+}
+
+TEST(DeltaSync, identical_files_only_copy_blocks)
+{
+    const auto data = random_data(10 * block_size);
+    QByteArray delta;
+
+    auto stats = delta_between(data, data, delta);
+
+    EXPECT_THAT(stats.matched_blocks, Eq(10));
+    EXPECT_THAT(stats.literal_bytes, Eq(0));
+    EXPECT_THAT(mpd::apply_delta(data, delta, block_size), Eq(data));
+}
+
+TEST(DeltaSync, inserted_bytes_are_sent_as_literal)
+{
+    const auto basis = random_data(10 * block_size + 100);
+    auto target = basis;
+    target.insert(3 * block_size + 7, QByteArray(13, 'x'));
+    QByteArray delta;
+
+    auto stats = delta_between(basis, target, delta);
+
+    EXPECT_THAT(stats.matched_blocks, Eq(9));
+    EXPECT_THAT(stats.literal_bytes, Eq(block_size + 13 + 100));
+    EXPECT_THAT(mpd::apply_delta(basis, delta, block_size), Eq(target));
+}
+
+TEST(DeltaSync, unrelated_files_are_all_literal)
+{
+    const auto basis = random_data(4 * block_size);
+    const auto target = QByteArray(5 * block_size, 'a');
+    QByteArray delta;
+
+    auto stats = delta_between(basis, target, delta);
+
+    EXPECT_THAT(stats.matched_blocks, Eq(0));
+    EXPECT_THAT(stats.literal_bytes, Eq(target.size()));
+    EXPECT_THAT(mpd::apply_delta(basis, delta, block_size), Eq(target));
+}
+
+TEST(DeltaSync, block_size_is_bounded)
+{
+    EXPECT_THAT(mpd::block_size_for(0), Eq(2048));
+    EXPECT_THAT(mpd::block_size_for(1LL << 40), Eq(131072));
+    EXPECT_THAT(mpd::block_size_for(1LL << 30) % 1024, Eq(0));
+}
+
+TEST(DeltaSync, file_signature_survives_text_round_trip)
+{
+    const auto data = random_data(10 * block_size + 100);
+    const auto signature = mpd::file_signature_for(data.constData(), data.size());
+
+    const auto parsed = mpd::parse_file_signature(mpd::to_text(signature));
+
+    EXPECT_THAT(parsed.length, Eq(signature.length));
+    EXPECT_THAT(parsed.signature.block_size, Eq(signature.signature.block_size));
+    ASSERT_THAT(parsed.signature.blocks.size(), Eq(signature.signature.blocks.size()));
+    for (auto i = 0u; i < parsed.signature.blocks.size(); ++i)
+    {
+        EXPECT_THAT(parsed.signature.blocks[i].weak, Eq(signature.signature.blocks[i].weak));
+        EXPECT_THAT(parsed.signature.blocks[i].strong, Eq(signature.signature.blocks[i].strong));
+    }
+}
+
+TEST(DeltaSync, truncated_file_signature_is_rejected)
+{
+    const auto data = random_data(10 * block_size);
+    auto text = mpd::to_text(mpd::file_signature_for(data.constData(), data.size()));
+    text.truncate(text.lastIndexOf('\n', -2) + 1);
+
+    EXPECT_THROW(mpd::parse_file_signature(text), std::runtime_error);
+    EXPECT_THROW(mpd::parse_file_signature("not a signature"), std::runtime_error);
+}
+
+TEST(DeltaSync, locates_blocks_shifted_in_older_version)
+{
+    const auto basis = random_data(10 * block_size);
+    auto target = basis;
+    target.insert(3 * block_size + 10, "inserted");
+    const auto changed = static_cast<int>(7 * block_size);
+    target[changed] = static_cast<char>(~target[changed]);
+
+    const auto signature = mpd::signature_for(target.constData(), target.size(), block_size);
+    const auto offsets =
+        mpd::locate_blocks(basis.constData(), basis.size(), mpd::FileSignature{target.size(), signature});
+
+    ASSERT_THAT(offsets.size(), Eq(signature.blocks.size()));
+
+    auto located = 0;
+    for (auto i = 0u; i < offsets.size(); ++i)
+    {
+        if (offsets[i] < 0)
+            continue;
+
+        const auto start = static_cast<int>(i * block_size);
+        const auto size = std::min(static_cast<int>(block_size), target.size() - start);
+        EXPECT_THAT(basis.mid(static_cast<int>(offsets[i]), size), Eq(target.mid(start, size)));
+        ++located;
+    }
+
+    // Only the block with the insertion and the changed one are missing, the trailing one being at the basis' end
+    EXPECT_THAT(located, Eq(static_cast<int>(offsets.size()) - 2));
+}
+
+TEST_F(RemoteDeltaHelper, signature_matches_local_one)
+{
+    if (!has_python)
+        return;
+
+    const auto basis = random_data(5 * block_size + 100);
+    write_file(path, basis);
+
+    ASSERT_THAT(run({"sig", dir.path(), "file", QString::number(block_size), QString::number(basis.size() + 1), "0"}),
+                Eq(0));
+
+    QByteArray expected;
+    for (const auto& block : mpd::signature_for(basis.constData(), basis.size(), block_size).blocks)
+        expected += QString("%1 %2\n").arg(block.weak).arg(QString::fromStdString(block.strong)).toUtf8();
+    expected += "H " + QCryptographicHash::hash(basis, QCryptographicHash::Sha256).toHex() + "\n";
+
+    EXPECT_THAT(output, Eq(expected));
+}
+
+TEST_F(RemoteDeltaHelper, applies_delta_and_removes_it)
+{
+    if (!has_python)
+        return;
+
+    const auto basis = random_data(10 * block_size);
+    auto target = basis;
+    target.insert(3 * block_size + 10, "inserted");
+    QByteArray delta;
+    delta_between(basis, target, delta);
+    write_file(path, basis);
+    write_file(delta_path, delta);
+
+    ASSERT_THAT(run({"apply", path, "file", delta_path, QString::number(block_size), "1000000000"}), Eq(0));
+
+    EXPECT_THAT(read_file(path), Eq(target));
+    EXPECT_THAT(QFileInfo(path).lastModified().toSecsSinceEpoch(), Eq(1000000000));
+    EXPECT_FALSE(QFile::exists(delta_path));
+}
+
+TEST_F(RemoteDeltaHelper, failed_apply_leaves_file_alone_and_removes_delta)
+{
+    if (!has_python)
+        return;
+
+    const auto basis = random_data(10 * block_size);
+    auto target = basis;
+    target.insert(3 * block_size + 10, "inserted");
+    QByteArray delta;
+    delta_between(basis, target, delta);
+    write_file(path, basis);
+    write_file(delta_path, delta.left(delta.size() - 4));
+
+    EXPECT_THAT(run({"apply", path, "file", delta_path, QString::number(block_size), "0"}), Ne(0));
+
+    EXPECT_THAT(read_file(path), Eq(basis));
+    EXPECT_FALSE(QFile::exists(delta_path));
+    EXPECT_THAT(QDir(dir.path()).entryList(QDir::Files), ElementsAre("file"));
+}
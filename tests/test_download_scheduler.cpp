@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <multipass/download_scheduler.h>
+
+#include <gmock/gmock.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mp = multipass;
+
+using namespace testing;
+using Priority = mp::DownloadScheduler::Priority;
+
+namespace
+{
+constexpr auto settle_time = std::chrono::milliseconds(100);
+
+struct DownloadScheduler : public Test
+{
+    std::thread start_transfer(mp::DownloadScheduler& scheduler, Priority priority, const std::string& name)
+    {
+        return std::thread{[this, &scheduler, priority, name] {
+            mp::DownloadScheduler::Transfer transfer{scheduler, priority};
+            std::lock_guard<std::mutex> lock{mutex};
+            admitted.push_back(name);
+        }};
+    }
+
+    std::vector<std::string> admitted_transfers()
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        return admitted;
+    }
+
+    std::mutex mutex;
+    std::vector<std::string> admitted;
+};
+} // namespace
+
+TEST_F(DownloadScheduler, caps_concurrent_transfers)
+{
+    mp::DownloadScheduler scheduler{{1, 0}};
+    std::thread waiter;
+
+    {
+        mp::DownloadScheduler::Transfer transfer{scheduler, Priority::interactive};
+        waiter = start_transfer(scheduler, Priority::interactive, "waiter");
+
+        std::this_thread::sleep_for(settle_time);
+        EXPECT_THAT(admitted_transfers(), IsEmpty());
+    }
+
+    waiter.join();
+    EXPECT_THAT(admitted_transfers(), ElementsAre("waiter"));
+}
+
+TEST_F(DownloadScheduler, admits_higher_priorities_first)
+{
+    mp::DownloadScheduler scheduler{{1, 0}};
+    std::vector<std::thread> waiters;
+
+    {
+        mp::DownloadScheduler::Transfer transfer{scheduler, Priority::interactive};
+        waiters.push_back(start_transfer(scheduler, Priority::prefetch, "prefetch"));
+        std::this_thread::sleep_for(settle_time);
+        waiters.push_back(start_transfer(scheduler, Priority::background, "background"));
+        std::this_thread::sleep_for(settle_time);
+        waiters.push_back(start_transfer(scheduler, Priority::interactive, "interactive"));
+        std::this_thread::sleep_for(settle_time);
+    }
+
+    for (auto& waiter : waiters)
+        waiter.join();
+
+    EXPECT_THAT(admitted_transfers(), ElementsAre("interactive", "background", "prefetch"));
+}
+
+TEST_F(DownloadScheduler, background_transfer_gives_way_to_interactive_one)
+{
+    mp::DownloadScheduler scheduler{{1, 0}};
+    mp::DownloadScheduler::Transfer background{scheduler, Priority::background};
+
+    std::atomic<bool> interactive_done{false};
+    std::thread interactive{[&scheduler, &interactive_done] {
+        mp::DownloadScheduler::Transfer transfer{scheduler, Priority::interactive};
+        std::this_thread::sleep_for(settle_time);
+        interactive_done = true;
+    }};
+
+    std::this_thread::sleep_for(settle_time);
+    EXPECT_FALSE(background.may_proceed());
+
+    while (!background.may_proceed())
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_TRUE(interactive_done);
+
+    interactive.join();
+}
+
+TEST_F(DownloadScheduler, interactive_transfer_is_not_preempted)
+{
+    mp::DownloadScheduler scheduler{{1, 0}};
+    std::thread waiter;
+
+    {
+        mp::DownloadScheduler::Transfer transfer{scheduler, Priority::interactive};
+        waiter = start_transfer(scheduler, Priority::interactive, "waiter");
+
+        std::this_thread::sleep_for(settle_time);
+        EXPECT_TRUE(transfer.may_proceed());
+        EXPECT_THAT(admitted_transfers(), IsEmpty());
+    }
+
+    waiter.join();
+}
+
+TEST_F(DownloadScheduler, paused_transfer_keeps_lower_priorities_waiting)
+{
+    mp::DownloadScheduler scheduler{{1, 0}};
+    std::thread prefetch;
+
+    {
+        mp::DownloadScheduler::Transfer background{scheduler, Priority::background};
+
+        auto interactive = start_transfer(scheduler, Priority::interactive, "interactive");
+        std::this_thread::sleep_for(settle_time);
+        EXPECT_FALSE(background.may_proceed());
+        interactive.join();
+
+        prefetch = start_transfer(scheduler, Priority::prefetch, "prefetch");
+        std::this_thread::sleep_for(settle_time);
+        EXPECT_THAT(admitted_transfers(), ElementsAre("interactive"));
+
+        EXPECT_TRUE(background.may_proceed());
+        EXPECT_THAT(admitted_transfers(), ElementsAre("interactive"));
+    }
+
+    prefetch.join();
+    EXPECT_THAT(admitted_transfers(), ElementsAre("interactive", "prefetch"));
+}
+
+TEST_F(DownloadScheduler, paces_background_transfers)
+{
+    mp::DownloadScheduler scheduler{{1, 1000}};
+    mp::DownloadScheduler::Transfer transfer{scheduler, Priority::background};
+
+    const auto start = std::chrono::steady_clock::now();
+    EXPECT_THAT(transfer.pace(1000), Eq(std::chrono::milliseconds::zero()));
+    EXPECT_THAT(transfer.pace(500), Ge(std::chrono::milliseconds(400)));
+    EXPECT_THAT(std::chrono::steady_clock::now() - start, Lt(std::chrono::milliseconds(250)));
+}
+
+TEST_F(DownloadScheduler, does_not_pace_interactive_transfers)
+{
+    mp::DownloadScheduler scheduler{{1, 1000}};
+    mp::DownloadScheduler::Transfer transfer{scheduler, Priority::interactive};
+
+    EXPECT_THAT(transfer.pace(100000), Eq(std::chrono::milliseconds::zero()));
+}
+
+TEST_F(DownloadScheduler, priority_scope_sets_thread_priority)
+{
+    EXPECT_THAT(mp::DownloadScheduler::current_priority(), Eq(Priority::interactive));
+
+    {
+        mp::DownloadScheduler::PriorityScope scope{Priority::background};
+        EXPECT_THAT(mp::DownloadScheduler::current_priority(), Eq(Priority::background));
+
+        std::thread other{[] { EXPECT_THAT(mp::DownloadScheduler::current_priority(), Eq(Priority::interactive)); }};
+        other.join();
+    }
+
+    EXPECT_THAT(mp::DownloadScheduler::current_priority(), Eq(Priority::interactive));
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <multipass/file_hasher.h>
+
+#include "file_operations.h"
+#include "temp_dir.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+
+#include <gmock/gmock.h>
+
+#include <string>
+#include <vector>
+
+#include <utime.h>
+
+namespace mp = multipass;
+namespace mpt = multipass::test;
+
+using namespace testing;
+
+namespace
+{
+constexpr auto abc_sha256 = "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad";
+constexpr auto empty_sha256 = "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855";
+
+struct FileHasher : public testing::Test
+{
+    QString make_file(const QString& name, const std::string& content)
+    {
+        const auto path = QDir(temp_dir.path()).filePath(name);
+        QFile::remove(path);
+        mpt::make_file_with_content(path, content);
+        return path;
+    }
+
+    void set_last_modified(const QString& path, time_t last_modified)
+    {
+        utimbuf times{last_modified, last_modified};
+        ASSERT_THAT(::utime(path.toStdString().c_str(), &times), Eq(0));
+    }
+
+    mpt::TempDir temp_dir;
+    QString cache_path{QDir(temp_dir.path()).filePath("hashes.json")};
+};
+} // namespace
+
+TEST_F(FileHasher, hashes_file)
+{
+    mp::FileHasher hasher;
+
+    EXPECT_THAT(hasher.sha256_of(make_file("abc", "abc")), Eq(abc_sha256));
+}
+
+TEST_F(FileHasher, hashes_empty_file)
+{
+    mp::FileHasher hasher;
+
+    EXPECT_THAT(hasher.sha256_of(make_file("empty", "")), Eq(empty_sha256));
+}
+
+TEST_F(FileHasher, hashes_files_in_order)
+{
+    mp::FileHasher hasher;
+    std::vector<mp::Path> paths;
+    for (auto i = 0; i < 8; ++i)
+        paths.push_back(make_file(QString::number(i), i % 2 ? "abc" : ""));
+
+    const auto digests = hasher.sha256_of(paths);
+
+    ASSERT_THAT(digests.size(), Eq(paths.size()));
+    for (auto i = 0u; i < digests.size(); ++i)
+        EXPECT_THAT(digests[i], Eq(i % 2 ? abc_sha256 : empty_sha256));
+}
+
+TEST_F(FileHasher, throws_for_missing_file)
+{
+    mp::FileHasher hasher;
+
+    EXPECT_THROW(hasher.sha256_of(QDir(temp_dir.path()).filePath("missing")), std::runtime_error);
+}
+
+TEST_F(FileHasher, remembers_digests_across_instances)
+{
+    const auto path = make_file("file", "abc");
+    set_last_modified(path, 1000000000);
+    {
+        mp::FileHasher hasher{cache_path};
+        hasher.sha256_of(path);
+    }
+
+    // Same size and modification time, so the file is taken to be unchanged
+    make_file("file", "xyz");
+    set_last_modified(path, 1000000000);
+
+    mp::FileHasher hasher{cache_path};
+
+    EXPECT_THAT(hasher.sha256_of(path), Eq(abc_sha256));
+}
+
+TEST_F(FileHasher, rehashes_changed_file)
+{
+    const auto path = make_file("file", "abc");
+    mp::FileHasher hasher{cache_path};
+    hasher.sha256_of(path);
+
+    make_file("file", "");
+
+    EXPECT_THAT(hasher.sha256_of(path), Eq(empty_sha256));
+}
+
+TEST_F(FileHasher, forgets_digests_of_removed_files)
+{
+    const auto removed = make_file("removed", "abc");
+    const auto kept = make_file("kept", "abc");
+    {
+        mp::FileHasher hasher{cache_path};
+        hasher.sha256_of(std::vector<mp::Path>{removed, kept});
+    }
+    ASSERT_TRUE(QFile::remove(removed));
+
+    {
+        mp::FileHasher hasher{cache_path};
+        hasher.sha256_of(make_file("new", ""));
+    }
+
+    const auto cache = QString::fromUtf8(mpt::load(cache_path));
+    EXPECT_THAT(cache.toStdString(), HasSubstr(QFileInfo{kept}.absoluteFilePath().toStdString()));
+    EXPECT_THAT(cache.toStdString(), Not(HasSubstr(QFileInfo{removed}.absoluteFilePath().toStdString())));
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <multipass/image_decoder.h>
+#include <multipass/xz_image_decoder.h>
+#include <multipass/zstd_image_decoder.h>
+
+#include "file_operations.h"
+#include "path.h"
+#include "temp_dir.h"
+
+#include <QDir>
+
+#include <gmock/gmock.h>
+
+namespace mp = multipass;
+namespace mpt = multipass::test;
+
+using namespace testing;
+
+namespace
+{
+struct ImageDecoder : public testing::Test
+{
+    template <typename Decoder>
+    bool is_a(const mp::ImageDecoder::UPtr& decoder)
+    {
+        return dynamic_cast<Decoder*>(decoder.get()) != nullptr;
+    }
+
+    QString copy_test_file(const char* file_name, const QString& copy_name)
+    {
+        const auto path = QDir(temp_dir.path()).filePath(copy_name);
+        mpt::make_file_with_content(path, mpt::load_test_file(file_name).toStdString());
+        return path;
+    }
+
+    mpt::TempDir temp_dir;
+};
+} // namespace
+
+TEST_F(ImageDecoder, picks_decoder_by_leading_bytes)
+{
+    EXPECT_TRUE(is_a<mp::XzImageDecoder>(mp::make_image_decoder(mpt::test_data_path_for("xz/single_block.img.xz"))));
+    EXPECT_TRUE(
+        is_a<mp::ZstdImageDecoder>(mp::make_image_decoder(mpt::test_data_path_for("zstd/single_frame.img.zst"))));
+}
+
+TEST_F(ImageDecoder, leading_bytes_take_precedence_over_extension)
+{
+    const auto image_path = copy_test_file("zstd/single_frame.img.zst", "image.img.xz");
+
+    EXPECT_TRUE(is_a<mp::ZstdImageDecoder>(mp::make_image_decoder(image_path)));
+}
+
+TEST_F(ImageDecoder, picks_decoder_by_extension_of_missing_file)
+{
+    EXPECT_TRUE(is_a<mp::XzImageDecoder>(mp::make_image_decoder(QDir(temp_dir.path()).filePath("image.img.xz"))));
+    EXPECT_TRUE(is_a<mp::ZstdImageDecoder>(mp::make_image_decoder(QDir(temp_dir.path()).filePath("image.img.zst"))));
+}
+
+TEST_F(ImageDecoder, picks_no_decoder_for_uncompressed_image)
+{
+    const auto image_path = QDir(temp_dir.path()).filePath("image.img");
+    mpt::make_file_with_content(image_path, "QFI\xfb");
+
+    EXPECT_THAT(mp::make_image_decoder(image_path), IsNull());
+}
+
+TEST_F(ImageDecoder, strips_compression_extension_from_decoded_path)
+{
+    EXPECT_THAT(mp::decoded_path_for("/images/image.img.xz"), Eq("/images/image.img"));
+    EXPECT_THAT(mp::decoded_path_for("/images/image.img.zst"), Eq("/images/image.img"));
+    EXPECT_THAT(mp::decoded_path_for("/images/image.img"), Eq(QString{}));
+}
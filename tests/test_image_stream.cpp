@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "src/daemon/image_stream.h"
+
+#include "temp_dir.h"
+
+#include <QDir>
+#include <QFile>
+
+#include <gmock/gmock.h>
+
+#include <random>
+#include <vector>
+
+namespace mp = multipass;
+namespace mpt = multipass::test;
+
+using namespace testing;
+
+namespace
+{
+constexpr int chunk_size{1024 * 1024};
+
+QByteArray random_data(int size)
+{
+    std::mt19937 gen{42};
+    std::uniform_int_distribution<int> dist{0, 255};
+
+    QByteArray data(size, '\0');
+    for (auto& byte : data)
+        byte = static_cast<char>(dist(gen));
+
+    return data;
+}
+
+// Serves an image from memory, keeping track of what it is asked for
+struct ImageURLDownloader : public mp::URLDownloader
+{
+    ImageURLDownloader(const QByteArray& content) : mp::URLDownloader{std::chrono::seconds(10)}, content{content}
+    {
+    }
+
+    void download_missing_to(const QUrl&, const QString& file_name, const std::vector<ByteRange>& present,
+                             const int, const mp::ProgressMonitor&, DataSink* sink) override
+    {
+        present_ranges = present;
+
+        QFile file{file_name};
+        if (!file.open(QIODevice::ReadWrite) || file.write(content) != content.size())
+            throw std::runtime_error("cannot write image");
+
+        if (sink)
+            sink->write(content.constData(), content.size());
+    }
+
+    QByteArray download_range(const QUrl&, int64_t start, int64_t end) override
+    {
+        requested_ranges.push_back({start, end});
+        return content.mid(static_cast<int>(start), static_cast<int>(end - start));
+    }
+
+    const QByteArray content;
+    std::vector<ByteRange> present_ranges;
+    std::vector<ByteRange> requested_ranges;
+};
+
+struct RecordingSink : public mp::URLDownloader::DataSink
+{
+    bool write(const char* data, int64_t size) override
+    {
+        received.append(data, static_cast<int>(size));
+        return true;
+    }
+
+    QByteArray received;
+};
+
+struct ImageStream : public testing::Test
+{
+    QByteArray read(mp::ImageStream& stream, int offset, int size)
+    {
+        QByteArray data(size, '\0');
+        if (!stream.read(data.data(), offset, size))
+            return {};
+
+        return data;
+    }
+
+    const QByteArray content{random_data(3 * chunk_size + 100)};
+    ImageURLDownloader downloader{content};
+    mpt::TempDir image_dir;
+    QString image_path{QDir(image_dir.path()).filePath("image.img")};
+    mp::ProgressMonitor monitor{[](int, int) { return true; }};
+};
+} // namespace
+
+TEST_F(ImageStream, reads_bytes_before_they_are_downloaded)
+{
+    mp::ImageStream stream{&downloader, "http://foo/image.img", image_path, content.size()};
+
+    EXPECT_THAT(read(stream, chunk_size + 10, 100), Eq(content.mid(chunk_size + 10, 100)));
+
+    ASSERT_THAT(downloader.requested_ranges.size(), Eq(1u));
+    EXPECT_THAT(downloader.requested_ranges[0].start, Eq(chunk_size));
+    EXPECT_THAT(downloader.requested_ranges[0].end, Eq(2 * chunk_size));
+}
+
+TEST_F(ImageStream, fetches_each_chunk_once)
+{
+    mp::ImageStream stream{&downloader, "http://foo/image.img", image_path, content.size()};
+
+    read(stream, 10, 100);
+    read(stream, chunk_size - 10, 20);
+    read(stream, 3 * chunk_size, 100);
+
+    EXPECT_THAT(downloader.requested_ranges.size(), Eq(3u));
+    EXPECT_THAT(read(stream, 0, content.size()), Eq(content));
+    EXPECT_THAT(downloader.requested_ranges.size(), Eq(4u));
+}
+
+TEST_F(ImageStream, fill_skips_chunks_already_read)
+{
+    mp::ImageStream stream{&downloader, "http://foo/image.img", image_path, content.size()};
+    read(stream, 2 * chunk_size, 10);
+
+    RecordingSink sink;
+    stream.fill(monitor, &sink);
+
+    ASSERT_THAT(downloader.present_ranges.size(), Eq(1u));
+    EXPECT_THAT(downloader.present_ranges[0].start, Eq(2 * chunk_size));
+    EXPECT_THAT(downloader.present_ranges[0].end, Eq(3 * chunk_size));
+    EXPECT_THAT(sink.received, Eq(content));
+}
+
+TEST_F(ImageStream, reads_filled_image_without_fetching)
+{
+    mp::ImageStream stream{&downloader, "http://foo/image.img", image_path, content.size()};
+
+    RecordingSink sink;
+    stream.fill(monitor, &sink);
+
+    EXPECT_THAT(read(stream, 0, content.size()), Eq(content));
+    EXPECT_THAT(downloader.requested_ranges, IsEmpty());
+}
+
+TEST_F(ImageStream, refuses_reads_past_the_end)
+{
+    mp::ImageStream stream{&downloader, "http://foo/image.img", image_path, content.size()};
+
+    QByteArray data(2, '\0');
+    EXPECT_FALSE(stream.read(data.data(), content.size() - 1, 2));
+}
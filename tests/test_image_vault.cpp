@@ -23,16 +23,22 @@
 #include "temp_dir.h"
 #include "temp_file.h"
 
+#include <multipass/exceptions/download_exception.h>
 #include <multipass/optional.h>
 #include <multipass/query.h>
 #include <multipass/url_downloader.h>
 #include <multipass/utils.h>
 #include <multipass/vm_image_host.h>
 
+#include <QCryptographicHash>
 #include <QUrl>
 
 #include <gmock/gmock.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
 #include <unordered_set>
 
 namespace mp = multipass;
@@ -59,7 +65,8 @@ struct ImageHost : public mp::VMImageHost
                                                              initrd.url(),
                                                              default_id,
                                                              default_version,
-                                                             1}};
+                                                             1,
+                                                             {}}};
     }
 
     std::vector<mp::VMImageInfo> all_info_for(const mp::Query& query) override
@@ -69,7 +76,7 @@ struct ImageHost : public mp::VMImageHost
 
     mp::VMImageInfo info_for_full_hash(const std::string& full_hash) override
     {
-        return {{}, {}, {}, {}, {}, {}, {}, {}, {}, {}, -1};
+        return {{}, {}, {}, {}, {}, {}, {}, {}, {}, {}, -1, {}};
     }
 
     std::vector<mp::VMImageInfo> all_images_for(const std::string& remote_name, const bool allow_unsupported) override
@@ -97,7 +104,7 @@ struct TrackingURLDownloader : public mp::URLDownloader
     {
     }
     void download_to(const QUrl& url, const QString& file_name, int64_t size, const int download_type,
-                     const mp::ProgressMonitor&) override
+                     const mp::ProgressMonitor&, DataSink*) override
     {
         mpt::make_file_with_content(file_name, "");
         downloaded_urls << url.toString();
@@ -124,9 +131,12 @@ struct BadURLDownloader : public mp::URLDownloader
     {
     }
     void download_to(const QUrl& url, const QString& file_name, int64_t size, const int download_type,
-                     const mp::ProgressMonitor&) override
+                     const mp::ProgressMonitor&, DataSink* sink) override
     {
-        mpt::make_file_with_content(file_name, "Bad hash");
+        const std::string content{"Bad hash"};
+        mpt::make_file_with_content(file_name, content);
+        if (sink)
+            sink->write(content.data(), content.size());
     }
 
     QByteArray download(const QUrl& url) override
@@ -135,6 +145,172 @@ struct BadURLDownloader : public mp::URLDownloader
     }
 };
 
+// "pied piper image\n" compressed with xz
+const std::string xz_image(
+    "\xfd\x37\x7a\x58\x5a\x00\x00\x01\x69\x22\xde\x36\x02\x00\x21\x01\x16\x00\x00\x00\x74\x2f\xe5\xa3"
+    "\x01\x00\x10\x70\x69\x65\x64\x20\x70\x69\x70\x65\x72\x20\x69\x6d\x61\x67\x65\x0a\x00\x00\x00\x00"
+    "\x22\x1d\x75\xa8\x00\x01\x25\x11\x3e\x45\xc5\xa2\x90\x42\x99\x0d\x01\x00\x00\x00\x00\x01\x59\x5a",
+    72);
+constexpr auto xz_image_id = "fb33323e33a1916126968bd73a2e6837b8a54e4a900f65302b562a0585a65e9e";
+
+struct XzImageHost : public ImageHost
+{
+    mp::optional<mp::VMImageInfo> info_for(const mp::Query& query) override
+    {
+        auto info = *ImageHost::info_for(query);
+        return mp::optional<mp::VMImageInfo>{mp::VMImageInfo{info.aliases,
+                                                             info.os,
+                                                             info.release,
+                                                             info.release_title,
+                                                             info.supported,
+                                                             "http://www.foo.com/fake.img.xz",
+                                                             info.kernel_location,
+                                                             info.initrd_location,
+                                                             xz_image_id,
+                                                             info.version,
+                                                             info.size,
+                                                             {}}};
+    }
+};
+
+// "pied piper image\n" compressed with zstd
+const std::string zstd_image("\x28\xb5\x2f\xfd\x24\x11\x89\x00\x00\x70\x69\x65\x64\x20\x70\x69\x70\x65\x72\x20\x69"
+                             "\x6d\x61\x67\x65\x0a\x99\x91\xd3\xe0",
+                             30);
+constexpr auto zstd_image_id = "fb5e0910fd67dbf3bfe05ecc3a19bd8ef6ae0302a0b87de07649a3b955160313";
+
+struct ZstdImageHost : public ImageHost
+{
+    mp::optional<mp::VMImageInfo> info_for(const mp::Query& query) override
+    {
+        auto info = *ImageHost::info_for(query);
+        return mp::optional<mp::VMImageInfo>{mp::VMImageInfo{info.aliases,
+                                                             info.os,
+                                                             info.release,
+                                                             info.release_title,
+                                                             info.supported,
+                                                             "http://www.foo.com/fake.img.zst",
+                                                             info.kernel_location,
+                                                             info.initrd_location,
+                                                             zstd_image_id,
+                                                             info.version,
+                                                             info.size,
+                                                             {}}};
+    }
+};
+
+struct StreamingURLDownloader : public mp::URLDownloader
+{
+    explicit StreamingURLDownloader(const std::string& image = xz_image)
+        : mp::URLDownloader{std::chrono::seconds(10)}, image{image}
+    {
+    }
+    void download_to(const QUrl& url, const QString& file_name, int64_t size, const int download_type,
+                     const mp::ProgressMonitor&, DataSink* sink) override
+    {
+        mpt::make_file_with_content(file_name, image);
+        for (auto offset = 0u; offset < image.size(); offset += 7)
+            sink->write(image.data() + offset, std::min<size_t>(7, image.size() - offset));
+    }
+
+    QByteArray download(const QUrl& url) override
+    {
+        return {};
+    }
+
+    const std::string image;
+};
+
+// A qcow2 header followed by some data, served by range or whole
+const QByteArray qcow2_image{QByteArray{"QFI\xfb", 4} + QByteArray(100, 'q')};
+
+struct QcowImageHost : public ImageHost
+{
+    mp::optional<mp::VMImageInfo> info_for(const mp::Query& query) override
+    {
+        auto info = *ImageHost::info_for(query);
+        return mp::optional<mp::VMImageInfo>{
+            mp::VMImageInfo{info.aliases, info.os, info.release, info.release_title, info.supported,
+                            "http://www.foo.com/fake.img", info.kernel_location, info.initrd_location,
+                            QCryptographicHash::hash(qcow2_image, QCryptographicHash::Sha256).toHex(), info.version,
+                            qcow2_image.size(), {}}};
+    }
+};
+
+struct RangeURLDownloader : public mp::URLDownloader
+{
+    RangeURLDownloader() : mp::URLDownloader{std::chrono::seconds(10)}
+    {
+    }
+    void download_missing_to(const QUrl& url, const QString& file_name, const std::vector<ByteRange>& present,
+                             const int download_type, const mp::ProgressMonitor&, DataSink* sink) override
+    {
+        mpt::make_file_with_content(file_name, qcow2_image.toStdString());
+        if (sink)
+            sink->write(qcow2_image.constData(), qcow2_image.size());
+    }
+
+    QByteArray download_range(const QUrl& url, int64_t start, int64_t end) override
+    {
+        ++ranges;
+        return qcow2_image.mid(start, end - start);
+    }
+
+    QByteArray download(const QUrl& url) override
+    {
+        return {};
+    }
+
+    std::atomic<int> ranges{0};
+};
+
+struct InterruptedURLDownloader : public mp::URLDownloader
+{
+    InterruptedURLDownloader(bool resumable) : mp::URLDownloader{std::chrono::seconds(10)}, resumable{resumable}
+    {
+    }
+    void download_to(const QUrl& url, const QString& file_name, int64_t size, const int download_type,
+                     const mp::ProgressMonitor&, DataSink*) override
+    {
+        partial_file = file_name;
+        if (resumable)
+            mpt::make_file_with_content(file_name, "partial");
+
+        throw mp::DownloadException{url.toString().toStdString(), "Network timeout"};
+    }
+
+    QByteArray download(const QUrl& url) override
+    {
+        return {};
+    }
+
+    const bool resumable;
+    QString partial_file;
+};
+
+struct SlowURLDownloader : public mp::URLDownloader
+{
+    SlowURLDownloader() : mp::URLDownloader{std::chrono::seconds(10)}
+    {
+    }
+    void download_to(const QUrl& url, const QString& file_name, int64_t size, const int download_type,
+                     const mp::ProgressMonitor& monitor, DataSink*) override
+    {
+        ++downloads;
+        monitor(download_type, 0);
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        mpt::make_file_with_content(file_name, "");
+        monitor(download_type, 100);
+    }
+
+    QByteArray download(const QUrl& url) override
+    {
+        return {};
+    }
+
+    std::atomic<int> downloads{0};
+};
+
 struct ImageVault : public testing::Test
 {
     void SetUp()
@@ -340,6 +516,160 @@ TEST_F(ImageVault, image_exists_not_expired)
     EXPECT_TRUE(QFileInfo::exists(file_name));
 }
 
+TEST_F(ImageVault, layers_instance_images_on_prepared_image)
+{
+    QStringList base_images;
+    auto create_overlay = [&base_images](const mp::Path& base_image_path, const mp::Path& instance_image_path) {
+        base_images << base_image_path;
+        mpt::make_file_with_content(instance_image_path, "overlay");
+        return true;
+    };
+    mp::DefaultVMImageVault vault{hosts, &url_downloader, cache_dir.path(), data_dir.path(), mp::days{0},
+                                  create_overlay};
+
+    auto vm_image = vault.fetch_image(mp::FetchType::ImageOnly, default_query, stub_prepare, stub_monitor);
+
+    ASSERT_THAT(base_images.size(), Eq(1));
+    EXPECT_TRUE(QFileInfo::exists(base_images.first()));
+    EXPECT_THAT(mp::utils::contents_of(vm_image.image_path), StrEq("overlay"));
+}
+
+TEST_F(ImageVault, streams_instance_image_while_it_downloads)
+{
+    QcowImageHost qcow_host;
+    RangeURLDownloader range_downloader;
+    QStringList base_images, rebased_images;
+    auto create_overlay = [&base_images](const mp::Path& base_image_path, const mp::Path& instance_image_path) {
+        base_images << base_image_path;
+        mpt::make_file_with_content(instance_image_path, "overlay");
+        return true;
+    };
+    auto rebase_overlay = [&rebased_images](const mp::Path& base_image_path, const mp::Path& instance_image_path) {
+        rebased_images << base_image_path;
+        return true;
+    };
+
+    mp::VMImage vm_image;
+    {
+        mp::DefaultVMImageVault vault{{&qcow_host}, &range_downloader, cache_dir.path(), data_dir.path(), mp::days{0},
+                                      create_overlay, 0, rebase_overlay, true};
+        vm_image = vault.fetch_image(mp::FetchType::ImageOnly, default_query, stub_prepare, stub_monitor);
+
+        ASSERT_THAT(base_images.size(), Eq(1));
+        EXPECT_TRUE(base_images.first().startsWith("nbd+unix:///"));
+        EXPECT_THAT(range_downloader.ranges.load(), Gt(0));
+        EXPECT_THAT(mp::utils::contents_of(vm_image.image_path), StrEq("overlay"));
+    }
+
+    mp::DefaultVMImageVault vault{{&qcow_host}, &range_downloader, cache_dir.path(), data_dir.path(), mp::days{0},
+                                  create_overlay, 0, rebase_overlay, true};
+
+    ASSERT_THAT(rebased_images.size(), Eq(1));
+    EXPECT_THAT(mp::utils::contents_of(rebased_images.first()), StrEq(qcow2_image.toStdString()));
+}
+
+TEST_F(ImageVault, copies_instance_image_when_overlay_unsupported)
+{
+    constexpr auto expected_data = "12345-pied-piper-rats";
+
+    QDir dir{cache_dir.path()};
+    auto file_name = dir.filePath("prepared-image");
+    mpt::make_file_with_content(file_name, expected_data);
+
+    auto prepare = [&file_name](const mp::VMImage& source_image) -> mp::VMImage {
+        return {file_name, "", "", source_image.id, "", "", "", {}};
+    };
+    auto create_overlay = [](const mp::Path&, const mp::Path&) { return false; };
+    mp::DefaultVMImageVault vault{hosts, &url_downloader, cache_dir.path(), data_dir.path(), mp::days{0},
+                                  create_overlay};
+
+    auto vm_image = vault.fetch_image(mp::FetchType::ImageOnly, default_query, prepare, stub_monitor);
+
+    EXPECT_THAT(mp::utils::contents_of(vm_image.image_path), StrEq(expected_data));
+}
+
+TEST_F(ImageVault, expired_image_kept_while_backing_instances)
+{
+    auto create_overlay = [](const mp::Path&, const mp::Path& instance_image_path) {
+        mpt::make_file_with_content(instance_image_path, "overlay");
+        return true;
+    };
+    mp::DefaultVMImageVault vault{hosts, &url_downloader, cache_dir.path(), data_dir.path(), mp::days{0},
+                                  create_overlay};
+
+    QDir images_dir{mp::utils::make_dir(cache_dir.path(), "images")};
+    auto file_name = images_dir.filePath("mock_image.img");
+
+    auto prepare = [&file_name](const mp::VMImage& source_image) -> mp::VMImage {
+        mpt::make_file_with_content(file_name);
+        return {file_name, "", "", source_image.id, "", "", "", {}};
+    };
+    vault.fetch_image(mp::FetchType::ImageOnly, default_query, prepare, stub_monitor);
+
+    vault.prune_expired_images();
+    EXPECT_TRUE(QFileInfo::exists(file_name));
+
+    vault.remove(instance_name);
+    vault.prune_expired_images();
+    EXPECT_FALSE(QFileInfo::exists(file_name));
+}
+
+TEST_F(ImageVault, evicts_images_over_cache_budget)
+{
+    auto create_overlay = [](const mp::Path&, const mp::Path&) { return false; };
+    mp::DefaultVMImageVault vault{hosts, &url_downloader, cache_dir.path(), data_dir.path(), mp::days{1},
+                                  create_overlay, 1};
+
+    QDir images_dir{mp::utils::make_dir(cache_dir.path(), "vault/images/prepared")};
+    auto file_name = images_dir.filePath("mock_image.img");
+
+    auto prepare = [&file_name](const mp::VMImage& source_image) -> mp::VMImage {
+        mpt::make_file_with_content(file_name, std::string(4096, 'x'));
+        return {file_name, "", "", source_image.id, "", "", "", {}};
+    };
+    vault.fetch_image(mp::FetchType::ImageOnly, default_query, prepare, stub_monitor);
+
+    vault.prune_expired_images();
+    EXPECT_FALSE(QFileInfo::exists(file_name));
+}
+
+TEST_F(ImageVault, rejects_inconsistent_cache_watermarks)
+{
+    auto create_overlay = [](const mp::Path&, const mp::Path&) { return false; };
+    auto make_vault = [&](int64_t budget, int64_t low_watermark, int64_t high_watermark) {
+        mp::DefaultVMImageVault vault{hosts, &url_downloader, cache_dir.path(), data_dir.path(), mp::days{1},
+                                      create_overlay, budget, nullptr, false, low_watermark, high_watermark};
+    };
+
+    EXPECT_NO_THROW(make_vault(1000, 500, 900));
+    EXPECT_NO_THROW(make_vault(1000, 0, 0));
+    EXPECT_THROW(make_vault(1000, 900, 500), std::runtime_error);
+    EXPECT_THROW(make_vault(1000, 500, 2000), std::runtime_error);
+    EXPECT_THROW(make_vault(0, 500, 0), std::runtime_error);
+}
+
+TEST_F(ImageVault, image_backing_instances_kept_over_cache_budget)
+{
+    auto create_overlay = [](const mp::Path&, const mp::Path& instance_image_path) {
+        mpt::make_file_with_content(instance_image_path, "overlay");
+        return true;
+    };
+    mp::DefaultVMImageVault vault{hosts, &url_downloader, cache_dir.path(), data_dir.path(), mp::days{1},
+                                  create_overlay, 1};
+
+    QDir images_dir{mp::utils::make_dir(cache_dir.path(), "vault/images/prepared")};
+    auto file_name = images_dir.filePath("mock_image.img");
+
+    auto prepare = [&file_name](const mp::VMImage& source_image) -> mp::VMImage {
+        mpt::make_file_with_content(file_name, std::string(4096, 'x'));
+        return {file_name, "", "", source_image.id, "", "", "", {}};
+    };
+    vault.fetch_image(mp::FetchType::ImageOnly, default_query, prepare, stub_monitor);
+
+    vault.prune_expired_images();
+    EXPECT_TRUE(QFileInfo::exists(file_name));
+}
+
 TEST_F(ImageVault, invalid_custom_image_file_throws)
 {
     mp::DefaultVMImageVault vault{hosts, &url_downloader, cache_dir.path(), data_dir.path(), mp::days{0}};
@@ -365,6 +695,47 @@ TEST_F(ImageVault, custom_image_url_downloads)
     EXPECT_TRUE(url_downloader.downloaded_urls.contains(QString::fromStdString(query.release)));
 }
 
+TEST_F(ImageVault, superseded_custom_image_removed_once_unused)
+{
+    struct ModifiedURLDownloader : public TrackingURLDownloader
+    {
+        QDateTime last_modified(const QUrl&) override
+        {
+            return modified;
+        }
+
+        QDateTime modified{QDate{2019, 1, 1}, QTime{12, 0}};
+    } modified_url_downloader;
+    auto create_overlay = [](const mp::Path&, const mp::Path& instance_image_path) {
+        mpt::make_file_with_content(instance_image_path, "overlay");
+        return true;
+    };
+    mp::DefaultVMImageVault vault{hosts, &modified_url_downloader, cache_dir.path(), data_dir.path(), mp::days{0},
+                                  create_overlay};
+    auto query = default_query;
+    query.release = "http://www.foo.com/fake.img";
+    query.query_type = mp::Query::Type::HttpDownload;
+
+    vault.fetch_image(mp::FetchType::ImageOnly, query, stub_prepare, stub_monitor);
+
+    modified_url_downloader.modified = modified_url_downloader.modified.addDays(1);
+    query.name = "other-instance";
+    vault.fetch_image(mp::FetchType::ImageOnly, query, stub_prepare, stub_monitor);
+
+    ASSERT_THAT(modified_url_downloader.downloaded_files.size(), Eq(2));
+    const auto superseded_image = modified_url_downloader.downloaded_files.first();
+    const auto current_image = modified_url_downloader.downloaded_files.last();
+    EXPECT_THAT(superseded_image, Ne(current_image));
+
+    vault.prune_expired_images();
+    EXPECT_TRUE(QFileInfo::exists(superseded_image));
+
+    vault.remove(instance_name);
+    vault.prune_expired_images();
+    EXPECT_FALSE(QFileInfo::exists(superseded_image));
+    EXPECT_TRUE(QFileInfo::exists(current_image));
+}
+
 TEST_F(ImageVault, missing_downloaded_image_throws)
 {
     mpt::StubURLDownloader stub_url_downloader;
@@ -381,6 +752,91 @@ TEST_F(ImageVault, hash_mismatch_throws)
                  std::runtime_error);
 }
 
+TEST_F(ImageVault, extracts_xz_image_while_downloading)
+{
+    XzImageHost xz_host;
+    StreamingURLDownloader streaming_url_downloader;
+    mp::DefaultVMImageVault vault{{&xz_host}, &streaming_url_downloader, cache_dir.path(), data_dir.path(),
+                                  mp::days{0}};
+
+    mp::VMImage source_image;
+    auto prepare = [&source_image](const mp::VMImage& image) -> mp::VMImage {
+        source_image = image;
+        return image;
+    };
+    auto vm_image = vault.fetch_image(mp::FetchType::ImageOnly, default_query, prepare, stub_monitor);
+
+    EXPECT_FALSE(source_image.image_path.endsWith(".xz"));
+    EXPECT_FALSE(QFileInfo::exists(source_image.image_path + ".xz"));
+    // The decoded image is written as qcow2 straight away
+    const auto image = mpt::load(vm_image.image_path);
+    EXPECT_TRUE(image.startsWith(QByteArray("QFI\xfb", 4)));
+    EXPECT_TRUE(image.contains("pied piper image\n"));
+}
+
+TEST_F(ImageVault, extracts_zstd_image_while_downloading)
+{
+    ZstdImageHost zstd_host;
+    StreamingURLDownloader streaming_url_downloader{zstd_image};
+    mp::DefaultVMImageVault vault{{&zstd_host}, &streaming_url_downloader, cache_dir.path(), data_dir.path(),
+                                  mp::days{0}};
+
+    mp::VMImage source_image;
+    auto prepare = [&source_image](const mp::VMImage& image) -> mp::VMImage {
+        source_image = image;
+        return image;
+    };
+    auto vm_image = vault.fetch_image(mp::FetchType::ImageOnly, default_query, prepare, stub_monitor);
+
+    EXPECT_FALSE(source_image.image_path.endsWith(".zst"));
+    EXPECT_FALSE(QFileInfo::exists(source_image.image_path + ".zst"));
+    const auto image = mpt::load(vm_image.image_path);
+    EXPECT_TRUE(image.startsWith(QByteArray("QFI\xfb", 4)));
+    EXPECT_TRUE(image.contains("pied piper image\n"));
+}
+
+TEST_F(ImageVault, concurrent_fetches_download_image_once)
+{
+    SlowURLDownloader slow_url_downloader;
+    mp::DefaultVMImageVault vault{hosts, &slow_url_downloader, cache_dir.path(), data_dir.path(), mp::days{0}};
+
+    std::vector<std::thread> launches;
+    for (auto i = 0; i < 4; ++i)
+    {
+        launches.emplace_back([this, &vault, i] {
+            mp::Query query{"instance-" + std::to_string(i), "xenial", false, "", mp::Query::Type::Alias};
+            vault.fetch_image(mp::FetchType::ImageOnly, query, stub_prepare, stub_monitor);
+        });
+    }
+
+    for (auto& launch : launches)
+        launch.join();
+
+    EXPECT_THAT(slow_url_downloader.downloads.load(), Eq(1));
+    for (auto i = 0; i < 4; ++i)
+        EXPECT_TRUE(vault.has_record_for("instance-" + std::to_string(i)));
+}
+
+TEST_F(ImageVault, keeps_resumable_partial_download)
+{
+    InterruptedURLDownloader interrupted_url_downloader{true};
+    mp::DefaultVMImageVault vault{hosts, &interrupted_url_downloader, cache_dir.path(), data_dir.path(), mp::days{0}};
+
+    EXPECT_THROW(vault.fetch_image(mp::FetchType::ImageOnly, default_query, stub_prepare, stub_monitor),
+                 mp::DownloadException);
+    EXPECT_TRUE(QFileInfo::exists(interrupted_url_downloader.partial_file));
+}
+
+TEST_F(ImageVault, failed_download_leaves_no_partial_file)
+{
+    InterruptedURLDownloader interrupted_url_downloader{false};
+    mp::DefaultVMImageVault vault{hosts, &interrupted_url_downloader, cache_dir.path(), data_dir.path(), mp::days{0}};
+
+    EXPECT_THROW(vault.fetch_image(mp::FetchType::ImageOnly, default_query, stub_prepare, stub_monitor),
+                 mp::DownloadException);
+    EXPECT_FALSE(QFileInfo::exists(interrupted_url_downloader.partial_file));
+}
+
 TEST_F(ImageVault, invalid_remote_throws)
 {
     mpt::StubURLDownloader stub_url_downloader;
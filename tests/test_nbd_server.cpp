@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "src/daemon/nbd_server.h"
+
+#include "temp_dir.h"
+
+#include <QByteArray>
+#include <QDir>
+#include <QtEndian>
+
+#include <gmock/gmock.h>
+
+#include <stdexcept>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace mp = multipass;
+namespace mpt = multipass::test;
+
+using namespace testing;
+
+namespace
+{
+constexpr quint64 server_magic{0x4e42444d41474943};
+constexpr quint64 option_magic{0x49484156454f5054};
+constexpr quint64 option_reply_magic{0x3e889045565a9};
+constexpr quint32 request_magic{0x25609513};
+constexpr quint32 simple_reply_magic{0x67446698};
+
+constexpr quint32 option_go{7};
+constexpr quint32 reply_ack{1};
+constexpr quint32 reply_info{3};
+constexpr quint32 reply_error_unknown{(1u << 31) + 6};
+
+constexpr quint16 command_read{0};
+constexpr quint16 command_write{1};
+
+// Speaks just enough of the protocol to get at an export the way QEMU does
+struct NBDClient
+{
+    explicit NBDClient(const QString& socket_path) : fd{::socket(AF_UNIX, SOCK_STREAM, 0)}
+    {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        const auto path = socket_path.toLocal8Bit();
+        std::copy(path.cbegin(), path.cend(), address.sun_path);
+
+        if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof address) < 0)
+            throw std::runtime_error("cannot connect");
+    }
+
+    ~NBDClient()
+    {
+        ::close(fd);
+    }
+
+    QByteArray receive_bytes(int size)
+    {
+        QByteArray data(size, '\0');
+        for (int received = 0; received < size;)
+        {
+            const auto bytes = ::recv(fd, data.data() + received, static_cast<size_t>(size - received), 0);
+            if (bytes <= 0)
+                throw std::runtime_error("connection closed");
+            received += static_cast<int>(bytes);
+        }
+
+        return data;
+    }
+
+    template <typename T>
+    T receive()
+    {
+        return qFromBigEndian<T>(reinterpret_cast<const uchar*>(receive_bytes(sizeof(T)).constData()));
+    }
+
+    void send_bytes(const QByteArray& data)
+    {
+        if (::send(fd, data.constData(), static_cast<size_t>(data.size()), MSG_NOSIGNAL) != data.size())
+            throw std::runtime_error("cannot send");
+    }
+
+    template <typename T>
+    void send(T value)
+    {
+        value = qToBigEndian(value);
+        send_bytes(QByteArray(reinterpret_cast<const char*>(&value), sizeof value));
+    }
+
+    void handshake()
+    {
+        if (receive<quint64>() != server_magic || receive<quint64>() != option_magic)
+            throw std::runtime_error("not an NBD server");
+
+        receive<quint16>();
+        send<quint32>(3);
+    }
+
+    // Returns the type of the first reply to the option, after reading the export size out of an information reply
+    quint32 go(const std::string& name)
+    {
+        send(option_magic);
+        send(option_go);
+        send(static_cast<quint32>(sizeof(quint32) + name.size() + sizeof(quint16)));
+        send(static_cast<quint32>(name.size()));
+        send_bytes(QByteArray::fromStdString(name));
+        send<quint16>(0);
+
+        receive<quint64>();
+        receive<quint32>();
+        const auto type = receive<quint32>();
+        const auto length = receive<quint32>();
+        const auto data = receive_bytes(static_cast<int>(length));
+
+        if (type == reply_info)
+        {
+            export_size = qFromBigEndian<quint64>(reinterpret_cast<const uchar*>(data.constData()) + 2);
+
+            if (receive<quint64>() != option_reply_magic || receive<quint32>() != option_go ||
+                receive<quint32>() != reply_ack || receive<quint32>() != 0)
+                throw std::runtime_error("missing acknowledgement");
+        }
+
+        return type;
+    }
+
+    // Returns the error of the reply
+    quint32 request(quint16 type, quint64 offset, quint32 length, const QByteArray& payload = {})
+    {
+        send(request_magic);
+        send<quint16>(0);
+        send(type);
+        send<quint64>(42);
+        send(offset);
+        send(length);
+        send_bytes(payload);
+
+        if (receive<quint32>() != simple_reply_magic)
+            throw std::runtime_error("not a reply");
+
+        const auto error = receive<quint32>();
+        if (receive<quint64>() != 42)
+            throw std::runtime_error("reply to another request");
+
+        return error;
+    }
+
+    const int fd;
+    quint64 export_size{0};
+};
+
+struct NBDServer : public testing::Test
+{
+    NBDServer()
+    {
+        server.add_export("image", content.size(), [this](char* data, int64_t offset, int64_t size) {
+            std::copy_n(content.constData() + offset, size, data);
+            return true;
+        });
+    }
+
+    mpt::TempDir socket_dir;
+    QString socket_path{QDir(socket_dir.path()).filePath("nbd.sock")};
+    const QByteArray content{QByteArray(1000, 'a') + QByteArray(1000, 'b')};
+    mp::NBDServer server{socket_path};
+};
+} // namespace
+
+TEST_F(NBDServer, serves_export)
+{
+    NBDClient client{socket_path};
+    client.handshake();
+
+    ASSERT_THAT(client.go("image"), Eq(reply_info));
+    EXPECT_THAT(client.export_size, Eq(static_cast<quint64>(content.size())));
+
+    ASSERT_THAT(client.request(command_read, 900, 200), Eq(0u));
+    EXPECT_THAT(client.receive_bytes(200), Eq(content.mid(900, 200)));
+}
+
+TEST_F(NBDServer, reports_unknown_export)
+{
+    NBDClient client{socket_path};
+    client.handshake();
+
+    EXPECT_THAT(client.go("other"), Eq(reply_error_unknown));
+    EXPECT_THAT(client.go("image"), Eq(reply_info));
+}
+
+TEST_F(NBDServer, refuses_reads_past_the_end)
+{
+    NBDClient client{socket_path};
+    client.handshake();
+    client.go("image");
+
+    EXPECT_THAT(client.request(command_read, content.size() - 10, 20), Eq(static_cast<quint32>(EINVAL)));
+}
+
+TEST_F(NBDServer, refuses_writes)
+{
+    NBDClient client{socket_path};
+    client.handshake();
+    client.go("image");
+
+    EXPECT_THAT(client.request(command_write, 0, 4, "abcd"), Eq(static_cast<quint32>(EPERM)));
+
+    ASSERT_THAT(client.request(command_read, 0, 4), Eq(0u));
+    EXPECT_THAT(client.receive_bytes(4), Eq(content.left(4)));
+}
+
+TEST_F(NBDServer, reports_failed_reads)
+{
+    server.add_export("broken", 100, [](char*, int64_t, int64_t) { return false; });
+
+    NBDClient client{socket_path};
+    client.handshake();
+    client.go("broken");
+
+    EXPECT_THAT(client.request(command_read, 0, 10), Eq(static_cast<quint32>(EIO)));
+}
+
+TEST_F(NBDServer, names_export_and_socket_in_url)
+{
+    EXPECT_THAT(server.url_for("image"), Eq(QString("nbd+unix:///image?socket=%1").arg(socket_path)));
+}
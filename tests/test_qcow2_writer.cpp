@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <multipass/qcow2_writer.h>
+
+#include "file_operations.h"
+#include "temp_dir.h"
+
+#include <QDir>
+#include <QtEndian>
+
+#include <gmock/gmock.h>
+
+#include <algorithm>
+
+namespace mp = multipass;
+namespace mpt = multipass::test;
+
+using namespace testing;
+
+namespace
+{
+constexpr int cluster_size{65536};
+constexpr quint64 offset_mask{0x00fffffffffffe00};
+
+quint64 be64(const QByteArray& data, int pos)
+{
+    return qFromBigEndian<quint64>(reinterpret_cast<const uchar*>(data.constData() + pos));
+}
+
+quint32 be32(const QByteArray& data, int pos)
+{
+    return qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(data.constData() + pos));
+}
+
+quint16 be16(const QByteArray& data, int pos)
+{
+    return qFromBigEndian<quint16>(reinterpret_cast<const uchar*>(data.constData() + pos));
+}
+
+struct Qcow2Writer : public testing::Test
+{
+    QByteArray write_image(const QByteArray& data)
+    {
+        mp::Qcow2Writer writer{image_path};
+        EXPECT_TRUE(writer.open(QIODevice::WriteOnly));
+
+        // Uneven writes, as the decoder would do
+        for (int pos = 0; pos < data.size(); pos += 10000)
+            writer.write(data.mid(pos, 10000));
+        writer.finish();
+
+        return mpt::load(image_path);
+    }
+
+    // Reads the guest data back through the L1 and L2 tables
+    QByteArray guest_data(const QByteArray& image)
+    {
+        const auto size = be64(image, 24);
+        const auto l1_size = be32(image, 36);
+        const auto l1_offset = be64(image, 40);
+
+        QByteArray data(static_cast<int>(size), '\0');
+        for (quint32 l1_index = 0; l1_index < l1_size; ++l1_index)
+        {
+            const auto l2_offset = be64(image, l1_offset + l1_index * 8) & offset_mask;
+            if (l2_offset == 0)
+                continue;
+
+            for (int l2_index = 0; l2_index < cluster_size / 8; ++l2_index)
+            {
+                const auto host_offset = be64(image, l2_offset + l2_index * 8) & offset_mask;
+                const auto guest_offset = (quint64{l1_index} * cluster_size / 8 + l2_index) * cluster_size;
+                if (host_offset == 0 || guest_offset >= size)
+                    continue;
+
+                const auto length = std::min<quint64>(cluster_size, size - guest_offset);
+                data.replace(guest_offset, length, image.mid(host_offset, length));
+            }
+        }
+
+        return data;
+    }
+
+    QByteArray sample_data()
+    {
+        QByteArray data;
+        data += QByteArray(cluster_size, 'a');
+        data += QByteArray(3 * cluster_size, '\0');
+        data += QByteArray(cluster_size / 2, 'b');
+        data += QByteArray(cluster_size / 2, '\0');
+        data += QByteArray(1000, 'c');
+        return data;
+    }
+
+    mpt::TempDir temp_dir;
+    QString image_path{QDir(temp_dir.path()).filePath("image.qcow2")};
+};
+} // namespace
+
+TEST_F(Qcow2Writer, writes_qcow2_header)
+{
+    const auto data = sample_data();
+    const auto image = write_image(data);
+
+    EXPECT_THAT(be32(image, 0), Eq(0x514649fbu));
+    EXPECT_THAT(be32(image, 4), Eq(2u));
+    EXPECT_THAT(be32(image, 20), Eq(16u));
+    EXPECT_THAT(be64(image, 24), Eq(static_cast<quint64>((data.size() + 511) / 512 * 512)));
+}
+
+TEST_F(Qcow2Writer, image_holds_written_data)
+{
+    const auto data = sample_data();
+    const auto image = write_image(data);
+
+    const auto padding = QByteArray((data.size() + 511) / 512 * 512 - data.size(), '\0');
+    EXPECT_THAT(guest_data(image), Eq(data + padding));
+}
+
+TEST_F(Qcow2Writer, does_not_allocate_zeroed_clusters)
+{
+    const auto image = write_image(QByteArray(64 * cluster_size, '\0') + QByteArray(10, 'a'));
+
+    // Header, one data cluster, one L2 table, the L1 table, one refcount block and the refcount table
+    EXPECT_THAT(image.size(), Le(6 * cluster_size));
+    EXPECT_THAT(guest_data(image).right(10), Eq(QByteArray(10, 'a')));
+}
+
+TEST_F(Qcow2Writer, refcounts_cover_every_cluster)
+{
+    const auto image = write_image(sample_data());
+    const auto host_clusters = (image.size() + cluster_size - 1) / cluster_size;
+
+    const auto refcount_table_offset = be64(image, 48);
+    const auto refcount_block_offset = be64(image, refcount_table_offset);
+    ASSERT_THAT(refcount_block_offset, Ne(0u));
+
+    for (int cluster = 0; cluster < host_clusters; ++cluster)
+        EXPECT_THAT(be16(image, refcount_block_offset + cluster * 2), Eq(1u)) << "cluster " << cluster;
+    EXPECT_THAT(be16(image, refcount_block_offset + host_clusters * 2), Eq(0u));
+}
+
+TEST_F(Qcow2Writer, writes_other_disk_images_as_they_are)
+{
+    auto data = QByteArray("QFI\xfb", 4) + QByteArray(cluster_size * 2, 'x');
+
+    EXPECT_THAT(write_image(data), Eq(data));
+}
+
+TEST_F(Qcow2Writer, writes_empty_image)
+{
+    const auto image = write_image({});
+
+    EXPECT_THAT(be32(image, 0), Eq(0x514649fbu));
+    EXPECT_THAT(be64(image, 24), Eq(0u));
+}
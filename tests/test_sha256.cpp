@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <multipass/sha256.h>
+
+#include <gmock/gmock.h>
+
+#include <string>
+
+namespace mp = multipass;
+
+using namespace testing;
+
+TEST(Sha256, hashes_data)
+{
+    mp::Sha256 hash;
+    hash.add_data("abc", 3);
+
+    EXPECT_THAT(hash.hex_result(), Eq("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"));
+}
+
+TEST(Sha256, empty_hash)
+{
+    mp::Sha256 hash;
+
+    EXPECT_THAT(hash.hex_result(), Eq("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"));
+}
+
+TEST(Sha256, restored_state_continues_hash)
+{
+    const std::string data(1000, 'p');
+
+    mp::Sha256 full_hash;
+    full_hash.add_data(data.data(), data.size());
+
+    mp::Sha256 first_half;
+    first_half.add_data(data.data(), 333);
+
+    mp::Sha256 second_half;
+    ASSERT_TRUE(second_half.restore(first_half.state()));
+    second_half.add_data(data.data() + 333, data.size() - 333);
+
+    EXPECT_THAT(second_half.hex_result(), Eq(full_hash.hex_result()));
+}
+
+TEST(Sha256, rejects_invalid_state)
+{
+    mp::Sha256 hash;
+
+    EXPECT_FALSE(hash.restore("not a hash state"));
+}
+
+TEST(Sha256, rejects_state_of_another_version)
+{
+    mp::Sha256 hash;
+    hash.add_data("abc", 3);
+
+    auto state = hash.state();
+    state[7] = state[7] + 1;
+
+    mp::Sha256 restored;
+    EXPECT_FALSE(restored.restore(state));
+}
+
+TEST(Sha256, rejects_truncated_state)
+{
+    mp::Sha256 hash;
+    hash.add_data("abc", 3);
+
+    const auto state = hash.state();
+
+    mp::Sha256 restored;
+    EXPECT_FALSE(restored.restore(state.left(state.size() - 1)));
+    EXPECT_THAT(restored.hex_result(), Eq("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"));
+}
@@ -125,3 +125,70 @@ TEST(SimpleStreamsManifest, info_has_kernel_and_initrd_paths)
     EXPECT_FALSE(info->kernel_location.isEmpty());
     EXPECT_FALSE(info->initrd_location.isEmpty());
 }
+
+TEST(SimpleStreamsManifest, reads_products_whatever_their_member_order)
+{
+    const QByteArray json{R"({"products": {"com.ubuntu.cloud:server:16.04:amd64": {
+        "versions": {"20170516": {"items": {"disk1.img": {"path": "xenial.img", "sha256": "1797c5c8", "size": 42}}}},
+        "supported": true, "arch": "amd64", "release": "xenial", "aliases": "default,xenial"}},
+        "updated": "Thu, 18 May 2017 09:18:01 +0000"})"};
+    auto manifest = mp::SimpleStreamsManifest::fromJson(json);
+
+    EXPECT_THAT(manifest->updated_at, Eq("Thu, 18 May 2017 09:18:01 +0000"));
+
+    const auto info = manifest->image_records["xenial"];
+    ASSERT_THAT(info, NotNull());
+    EXPECT_THAT(info->image_location, Eq("xenial.img"));
+    EXPECT_THAT(info->id, Eq("1797c5c8"));
+    EXPECT_THAT(info->size, Eq(42));
+    EXPECT_TRUE(info->supported);
+}
+
+TEST(SimpleStreamsManifest, skips_products_of_other_architectures)
+{
+    const QByteArray json{R"({"products": {
+        "com.ubuntu.cloud:server:16.04:s390x": {"arch": "s390x", "aliases": "default",
+            "versions": {"20170516": {"items": {"disk1.img": {"path": "s390x.img", "sha256": "ab115b83"}}}}},
+        "com.ubuntu.cloud:server:16.04:amd64": {"arch": "amd64", "aliases": "default",
+            "versions": {"20170516": {"items": {"disk1.img": {"path": "amd64.img", "sha256": "1797c5c8"}}}}}}})"};
+    auto manifest = mp::SimpleStreamsManifest::fromJson(json);
+
+    EXPECT_THAT(manifest->products.size(), Eq(1u));
+
+    const auto info = manifest->image_records["default"];
+    ASSERT_THAT(info, NotNull());
+    EXPECT_THAT(info->image_location, Eq("amd64.img"));
+}
+
+TEST(SimpleStreamsManifest, reads_delta_signature_only_when_published)
+{
+    const QByteArray json{R"({"products": {
+        "com.ubuntu.cloud:server:16.04:amd64": {"arch": "amd64", "aliases": "xenial",
+            "versions": {"20170516": {"items": {
+                "disk1.img.delta-signature": {"path": "xenial.img.delta-signature"},
+                "disk1.img": {"path": "xenial.img", "sha256": "1797c5c8"}}}}},
+        "com.ubuntu.cloud:server:18.04:amd64": {"arch": "amd64", "aliases": "bionic",
+            "versions": {"20180516": {"items": {"disk1.img": {"path": "bionic.img", "sha256": "ab115b83"}}}}}}})"};
+    auto manifest = mp::SimpleStreamsManifest::fromJson(json);
+
+    const auto xenial = manifest->image_records["xenial"];
+    ASSERT_THAT(xenial, NotNull());
+    EXPECT_THAT(xenial->delta_signature_location, Eq("xenial.img.delta-signature"));
+
+    const auto bionic = manifest->image_records["bionic"];
+    ASSERT_THAT(bionic, NotNull());
+    EXPECT_TRUE(bionic->delta_signature_location.isEmpty());
+}
+
+TEST(SimpleStreamsManifest, finds_products_by_id_prefix)
+{
+    auto json = mpt::load_test_file("releases/multiple_versions_manifest.json");
+    auto manifest = mp::SimpleStreamsManifest::fromJson(json);
+
+    const auto matches = manifest->products_with_id_prefix("1");
+
+    ASSERT_THAT(matches.size(), Eq(2u));
+    EXPECT_THAT(matches[0]->id, Eq("1507bd2b3288ef4bacd3e699fe71b827b7ccf321ec4487e168a30d7089d3c8e4"));
+    EXPECT_THAT(matches[1]->id, Eq("1797c5c82016c1e65f4008fcf89deae3a044ef76087a9ec5b907c6d64a3609ac"));
+    EXPECT_TRUE(manifest->products_with_id_prefix("f").empty());
+}
@@ -22,6 +22,9 @@
 
 #include <gmock/gmock.h>
 
+#include <string>
+#include <vector>
+
 namespace mp = multipass;
 using namespace testing;
 
@@ -51,6 +54,95 @@ TEST(SSHSession, throws_when_unable_to_auth)
     EXPECT_THROW(mp::SSHSession("theanswertoeverything", 42, "ubuntu", key_provider), std::runtime_error);
 }
 
+TEST(SSHSession, falls_back_to_legacy_key)
+{
+    struct LegacyKeyProvider : public mp::test::StubSSHKeyProvider
+    {
+        std::string public_key_as_base64() const override
+        {
+            return "AAAAC3NzaC1lZDI1NTE5AAAAIcurrent";
+        }
+        ssh_key legacy_private_key() const override
+        {
+            return reinterpret_cast<ssh_key>(&legacy_key);
+        }
+        int legacy_key{0};
+    } key_provider;
+
+    REPLACE(ssh_connect, [](auto...) { return SSH_OK; });
+    REPLACE(ssh_userauth_publickey,
+            [](ssh_session, const char*, ssh_key key) { return key ? SSH_AUTH_SUCCESS : SSH_AUTH_DENIED; });
+    REPLACE(ssh_is_connected, [](auto...) { return true; });
+    REPLACE(ssh_channel_open_session, [](auto...) { return SSH_OK; });
+
+    std::vector<std::string> commands;
+    REPLACE(ssh_channel_request_exec, [&commands](ssh_channel, const char* cmd) {
+        commands.push_back(cmd);
+        return SSH_OK;
+    });
+
+    ssh_channel_callbacks callbacks{nullptr};
+    REPLACE(ssh_add_channel_callbacks, [&callbacks](ssh_channel, ssh_channel_callbacks cb) {
+        callbacks = cb;
+        return SSH_OK;
+    });
+    REPLACE(ssh_event_dopoll, [&callbacks](auto...) {
+        callbacks->channel_exit_status_function(nullptr, nullptr, 0, callbacks->userdata);
+        return SSH_OK;
+    });
+
+    EXPECT_NO_THROW(mp::SSHSession("theanswertoeverything", 42, "ubuntu", key_provider));
+
+    // Authenticating with the legacy key adds the current one to the instance's authorized keys
+    ASSERT_THAT(commands.size(), Eq(1u));
+    EXPECT_THAT(commands[0], HasSubstr("ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAIcurrent multipass@localhost"));
+    EXPECT_THAT(commands[0], HasSubstr(">> ~/.ssh/authorized_keys"));
+}
+
+TEST(SSHSession, current_key_needs_no_migration)
+{
+    struct LegacyKeyProvider : public mp::test::StubSSHKeyProvider
+    {
+        ssh_key private_key() const override
+        {
+            return reinterpret_cast<ssh_key>(&key);
+        }
+        ssh_key legacy_private_key() const override
+        {
+            return reinterpret_cast<ssh_key>(&key);
+        }
+        int key{0};
+    } key_provider;
+
+    auto exec_requested = false;
+    REPLACE(ssh_connect, [](auto...) { return SSH_OK; });
+    REPLACE(ssh_userauth_publickey, [](auto...) { return SSH_AUTH_SUCCESS; });
+    REPLACE(ssh_channel_request_exec, [&exec_requested](auto...) {
+        exec_requested = true;
+        return SSH_OK;
+    });
+
+    EXPECT_NO_THROW(mp::SSHSession("theanswertoeverything", 42, "ubuntu", key_provider));
+    EXPECT_FALSE(exec_requested);
+}
+
+TEST(SSHSession, uses_cipher_override)
+{
+    std::vector<std::string> ciphers;
+    REPLACE(ssh_options_set, [&ciphers](ssh_session, ssh_options_e type, const void* value) {
+        if (type == SSH_OPTIONS_CIPHERS_C_S || type == SSH_OPTIONS_CIPHERS_S_C)
+            ciphers.push_back(reinterpret_cast<const char*>(value));
+        return SSH_OK;
+    });
+    REPLACE(ssh_connect, [](auto...) { return SSH_OK; });
+
+    qputenv("MULTIPASS_SSH_CIPHERS", "aes256-ctr");
+    mp::SSHSession session{"theanswertoeverything", 42};
+    qunsetenv("MULTIPASS_SSH_CIPHERS");
+
+    EXPECT_THAT(ciphers, ElementsAre("aes256-ctr", "aes256-ctr"));
+}
+
 TEST(SSHSession, exec_throws_on_a_dead_session)
 {
     REPLACE(ssh_connect, [](auto...) { return SSH_OK; });
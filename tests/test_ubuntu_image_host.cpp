@@ -21,6 +21,7 @@
 #include "mischievous_url_downloader.h"
 #include "path.h"
 #include "stub_url_downloader.h"
+#include "temp_dir.h"
 
 #include <multipass/query.h>
 
@@ -28,7 +29,11 @@
 
 #include <gmock/gmock.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <cstddef>
+#include <mutex>
 #include <unordered_set>
 
 namespace mp = multipass;
@@ -39,6 +44,84 @@ using namespace std::literals::chrono_literals;
 
 namespace
 {
+// Serves every resource as unchanged once it was downloaded
+struct RevalidatingURLDownloader : public mp::URLDownloader
+{
+    RevalidatingURLDownloader() : mp::URLDownloader{std::chrono::seconds(10)}
+    {
+    }
+
+    mp::optional<QByteArray> download_if_changed(const QUrl& url, Validators& validators) override
+    {
+        if (validators.etag == etag)
+        {
+            ++not_modified;
+            return mp::nullopt;
+        }
+
+        validators.etag = etag;
+        return download(url);
+    }
+
+    const QByteArray etag{"\"pied-piper\""};
+    int not_modified{0};
+};
+
+// Publishes a new version of the manifest whenever the ETag changes, which can be a malformed one
+struct PublishingURLDownloader : public mp::URLDownloader
+{
+    PublishingURLDownloader() : mp::URLDownloader{std::chrono::seconds(10)}
+    {
+    }
+
+    mp::optional<QByteArray> download_if_changed(const QUrl& url, Validators& validators) override
+    {
+        if (validators.etag == etag)
+            return mp::nullopt;
+
+        validators.etag = etag;
+        if (url.path().endsWith("index.json"))
+            return download(url);
+
+        if (malformed)
+            return QByteArray{"{ not a manifest"};
+
+        ++manifests_served;
+        return download(url);
+    }
+
+    QByteArray etag{"\"v1\""};
+    std::atomic<bool> malformed{false};
+    std::atomic<int> manifests_served{0};
+};
+
+// Holds manifest requests until two were in flight at once, or a while if that does not happen
+struct OverlapURLDownloader : public mp::URLDownloader
+{
+    OverlapURLDownloader() : mp::URLDownloader{std::chrono::seconds(10)}
+    {
+    }
+
+    mp::optional<QByteArray> download_if_changed(const QUrl& url, Validators& /*validators*/) override
+    {
+        if (!url.path().endsWith("index.json"))
+        {
+            std::unique_lock<std::mutex> lock{mutex};
+            max_in_flight = std::max(max_in_flight, ++in_flight);
+            overlapped.notify_all();
+            overlapped.wait_for(lock, std::chrono::seconds(5), [this] { return max_in_flight > 1; });
+            --in_flight;
+        }
+
+        return download(url);
+    }
+
+    std::mutex mutex;
+    std::condition_variable overlapped;
+    int in_flight{0};
+    int max_in_flight{0};
+};
+
 struct UbuntuImageHost : public testing::Test
 {
     mp::Query make_query(std::string release, std::string remote)
@@ -255,8 +338,12 @@ TEST_F(UbuntuImageHost, handles_and_recovers_from_later_network_failure)
     const auto query = make_query("xenial", release_remote_spec.first);
     EXPECT_TRUE(host.info_for(query));
 
+    // What was fetched last keeps being served, while refreshing and once refreshing failed
     url_downloader.mischiefs = 1000;
-    EXPECT_THROW(host.info_for(query), std::runtime_error);
+    EXPECT_TRUE(host.info_for(query));
+    host.wait_for_refresh();
+    EXPECT_TRUE(host.info_for(query));
+    host.wait_for_refresh();
 
     url_downloader.mischiefs = 0;
     EXPECT_TRUE(host.info_for(query));
@@ -270,9 +357,104 @@ TEST_F(UbuntuImageHost, handles_and_recovers_from_independent_server_failures)
     const auto num_remotes = mpt::count_remotes(host);
     EXPECT_GT(num_remotes, 0u);
 
+    // Remotes that were reached once keep being served, so failures only show on those never reached
     for (size_t i = 0; i < num_remotes; ++i)
     {
         url_downloader.mischiefs = i;
-        EXPECT_EQ(mpt::count_remotes(host), num_remotes - i);
+        mp::UbuntuVMImageHost failing_host{all_remote_specs, &url_downloader, ttl};
+        EXPECT_EQ(mpt::count_remotes(failing_host), num_remotes - i);
+    }
+}
+
+TEST_F(UbuntuImageHost, keeps_manifest_that_did_not_change)
+{
+    RevalidatingURLDownloader revalidating_url_downloader;
+    mp::UbuntuVMImageHost host{{release_remote_spec}, &revalidating_url_downloader, 0s};
+
+    const auto query = make_query("xenial", release_remote_spec.first);
+    auto info = host.info_for(query);
+    ASSERT_TRUE(info);
+    EXPECT_THAT(revalidating_url_downloader.not_modified, Eq(0));
+
+    auto revalidated_info = host.info_for(query);
+    ASSERT_TRUE(revalidated_info);
+    EXPECT_THAT(revalidated_info->id, Eq(info->id));
+
+    host.wait_for_refresh();
+    EXPECT_THAT(revalidating_url_downloader.not_modified, Eq(2));
+}
+
+TEST_F(UbuntuImageHost, downloads_manifest_again_after_a_malformed_one)
+{
+    PublishingURLDownloader publishing_url_downloader;
+    mp::UbuntuVMImageHost host{{release_remote_spec}, &publishing_url_downloader, 0s};
+
+    const auto query = make_query("xenial", release_remote_spec.first);
+    ASSERT_TRUE(host.info_for(query));
+    host.wait_for_refresh();
+    ASSERT_THAT(publishing_url_downloader.manifests_served.load(), Eq(1));
+
+    // The broken version is not taken to be at hand, so the next refresh does not get told it is unchanged
+    publishing_url_downloader.etag = "\"v2\"";
+    publishing_url_downloader.malformed = true;
+    EXPECT_TRUE(host.info_for(query));
+    host.wait_for_refresh();
+
+    publishing_url_downloader.malformed = false;
+    EXPECT_TRUE(host.info_for(query));
+    host.wait_for_refresh();
+
+    EXPECT_THAT(publishing_url_downloader.manifests_served.load(), Eq(2));
+}
+
+TEST_F(UbuntuImageHost, fetches_remotes_concurrently)
+{
+    OverlapURLDownloader overlap_url_downloader;
+    mp::UbuntuVMImageHost host{all_remote_specs, &overlap_url_downloader, 0s};
+
+    EXPECT_TRUE(host.info_for(make_query("xenial", release_remote_spec.first)));
+    host.wait_for_refresh();
+
+    std::lock_guard<std::mutex> lock{overlap_url_downloader.mutex};
+    EXPECT_THAT(overlap_url_downloader.max_in_flight, Eq(2));
+}
+
+TEST_F(UbuntuImageHost, serves_saved_catalogue_without_reaching_remotes)
+{
+    const auto ttl = 1h;
+    mpt::TempDir cache_dir;
+    const mp::CatalogueCache catalogue_cache{cache_dir.path() + "/ubuntu.catalogue"};
+    const auto query = make_query("xenial", release_remote_spec.first);
+
+    {
+        mp::UbuntuVMImageHost host{all_remote_specs, &url_downloader, ttl, catalogue_cache};
+        ASSERT_TRUE(host.info_for(query));
     }
+
+    url_downloader.mischiefs = 1000;
+    mp::UbuntuVMImageHost host{all_remote_specs, &url_downloader, ttl, catalogue_cache};
+
+    auto info = host.info_for(query);
+    ASSERT_TRUE(info);
+    EXPECT_THAT(info->image_location, Eq(expected_location));
+    EXPECT_THAT(info->id, Eq(expected_id));
+    EXPECT_THAT(host.all_images_for(daily_remote_spec.first, false).size(), Eq(2u));
+}
+
+TEST_F(UbuntuImageHost, ignores_catalogue_of_another_remote)
+{
+    mpt::TempDir cache_dir;
+    const mp::CatalogueCache catalogue_cache{cache_dir.path() + "/ubuntu.catalogue"};
+    const auto query = make_query("xenial", release_remote_spec.first);
+
+    {
+        mp::UbuntuVMImageHost host{{release_remote_spec}, &url_downloader, default_ttl, catalogue_cache};
+        ASSERT_TRUE(host.info_for(query));
+    }
+
+    url_downloader.mischiefs = 1000;
+    mp::UbuntuVMImageHost host{{{release_remote_spec.first, daily_url.toStdString()}}, &url_downloader, default_ttl,
+                               catalogue_cache};
+
+    EXPECT_THROW(host.info_for(query), std::runtime_error);
 }
@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "local_http_server.h"
+#include "temp_dir.h"
+
+#include <multipass/exceptions/download_exception.h>
+#include <multipass/url_downloader.h>
+
+#include <gmock/gmock.h>
+
+#include <QFile>
+
+#include <mutex>
+#include <vector>
+
+namespace mp = multipass;
+namespace mpt = multipass::test;
+
+using namespace testing;
+
+namespace
+{
+// Large enough to be fetched in several concurrent ranges
+constexpr int segmented_size{40 * 1024 * 1024};
+
+QByteArray make_content(int size)
+{
+    QByteArray content(size, '\0');
+    for (auto i = 0; i < size; ++i)
+        content[i] = static_cast<char>(i * 7 + i / 4096);
+
+    return content;
+}
+
+struct URLDownloader : public Test
+{
+    mpt::LocalHTTPServer::Handler recording(const mpt::LocalHTTPServer::Handler& handler)
+    {
+        return [this, handler](const mpt::LocalHTTPServer::Request& request) {
+            {
+                std::lock_guard<std::mutex> lock{mutex};
+                requests.push_back(request);
+            }
+            return handler(request);
+        };
+    }
+
+    std::vector<QByteArray> range_requests()
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+
+        std::vector<QByteArray> ranges;
+        for (const auto& request : requests)
+        {
+            if (request.method == "GET" && request.headers.contains("range"))
+                ranges.push_back(request.headers.value("range"));
+        }
+
+        return ranges;
+    }
+
+    mpt::LocalHTTPServer::Request last_request()
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        return requests.back();
+    }
+
+    QByteArray load_download()
+    {
+        QFile file{file_name};
+        return file.open(QIODevice::ReadOnly) ? file.readAll() : QByteArray{};
+    }
+
+    mpt::TempDir cache_dir;
+    mpt::TempDir dir;
+    QString file_name{dir.path() + "/image"};
+    mp::URLDownloader downloader{cache_dir.path(), std::chrono::seconds(10)};
+    mp::ProgressMonitor monitor{[](int, int) { return true; }};
+    std::mutex mutex;
+    std::vector<mpt::LocalHTTPServer::Request> requests;
+};
+} // namespace
+
+TEST_F(URLDownloader, fetches_large_files_in_concurrent_ranges)
+{
+    const auto content = make_content(segmented_size);
+    mpt::LocalHTTPServer server{recording([&content](const mpt::LocalHTTPServer::Request& request) {
+        return mpt::LocalHTTPServer::content_response(content, request);
+    })};
+
+    downloader.download_to(server.url_for("/image"), file_name, -1, 0, monitor);
+
+    EXPECT_THAT(load_download(), Eq(content));
+    EXPECT_THAT(range_requests(), UnorderedElementsAre("bytes=0-20971519", "bytes=20971520-41943039"));
+}
+
+TEST_F(URLDownloader, falls_back_to_whole_download_when_server_ignores_ranges)
+{
+    const auto content = make_content(segmented_size);
+    mpt::LocalHTTPServer server{recording([&content](const mpt::LocalHTTPServer::Request& request) {
+        auto response = mpt::LocalHTTPServer::content_response(content, request, false);
+        response.headers.push_back({"Accept-Ranges", "bytes"});
+        return response;
+    })};
+
+    downloader.download_to(server.url_for("/image"), file_name, -1, 0, monitor);
+
+    EXPECT_THAT(load_download(), Eq(content));
+    EXPECT_THAT(range_requests(), Not(IsEmpty()));
+    EXPECT_FALSE(last_request().headers.contains("range"));
+}
+
+TEST_F(URLDownloader, missing_ranges_fail_when_server_ignores_ranges)
+{
+    const auto content = make_content(1024 * 1024);
+    mpt::LocalHTTPServer server{[&content](const mpt::LocalHTTPServer::Request& request) {
+        auto response = mpt::LocalHTTPServer::content_response(content, request, false);
+        response.headers.push_back({"Accept-Ranges", "bytes"});
+        return response;
+    }};
+
+    QFile file{file_name};
+    ASSERT_TRUE(file.open(QIODevice::WriteOnly) && file.resize(content.size()));
+    file.close();
+
+    EXPECT_THROW(downloader.download_missing_to(server.url_for("/image"), file_name, {}, 0, monitor),
+                 mp::DownloadException);
+}
+
+TEST_F(URLDownloader, fetches_only_missing_ranges)
+{
+    const auto content = make_content(1024 * 1024);
+    mpt::LocalHTTPServer server{recording([&content](const mpt::LocalHTTPServer::Request& request) {
+        return mpt::LocalHTTPServer::content_response(content, request);
+    })};
+
+    QFile file{file_name};
+    ASSERT_TRUE(file.open(QIODevice::WriteOnly));
+    file.write(content.left(512 * 1024));
+    ASSERT_TRUE(file.resize(content.size()));
+    file.close();
+
+    downloader.download_missing_to(server.url_for("/image"), file_name, {{0, 512 * 1024}}, 0, monitor);
+
+    EXPECT_THAT(load_download(), Eq(content));
+    EXPECT_THAT(range_requests(), ElementsAre("bytes=524288-1048575"));
+}
+
+TEST_F(URLDownloader, reports_ranges_longer_than_requested)
+{
+    const auto content = make_content(segmented_size);
+    mpt::LocalHTTPServer server{[&content](const mpt::LocalHTTPServer::Request& request) {
+        auto response = mpt::LocalHTTPServer::content_response(content, request);
+        if (response.status == 206)
+            response.body = content;
+        return response;
+    }};
+
+    try
+    {
+        downloader.download_to(server.url_for("/image"), file_name, -1, 0, monitor);
+        FAIL() << "the download should have failed";
+    }
+    catch (const mp::DownloadException& e)
+    {
+        EXPECT_THAT(e.what(), HasSubstr("server sent more than the requested range"));
+    }
+    EXPECT_FALSE(QFile::exists(file_name));
+}
+
+TEST_F(URLDownloader, downloads_bodies_larger_than_the_read_buffer)
+{
+    // Over the 4 MiB that replies drained as they arrive are limited to
+    const auto content = make_content(6 * 1024 * 1024);
+    mpt::LocalHTTPServer server{[&content](const mpt::LocalHTTPServer::Request& request) {
+        return mpt::LocalHTTPServer::content_response(content, request);
+    }};
+    mp::URLDownloader quick_downloader{cache_dir.path(), std::chrono::seconds(2)};
+
+    EXPECT_THAT(quick_downloader.download(server.url_for("/index.json")), Eq(content));
+}
@@ -20,6 +20,7 @@
 #include "file_operations.h"
 #include "temp_dir.h"
 
+#include <QProcess>
 #include <QRegExp>
 
 #include <gmock/gmock.h>
@@ -201,6 +202,17 @@ TEST(Utils, escape_char_actually_escapes)
     EXPECT_THAT(res, ::testing::StrEq("I've got \\\"quotes\\\""));
 }
 
+TEST(Utils, quote_for_shell_survives_the_shell)
+{
+    std::string s{"it's $HOME `id` \"quoted\" \\ *"};
+
+    QProcess shell;
+    shell.start("sh", {"-c", QString::fromStdString("printf %s " + mp::utils::quote_for_shell(s))});
+    ASSERT_TRUE(shell.waitForFinished());
+
+    EXPECT_THAT(shell.readAllStandardOutput().toStdString(), ::testing::StrEq(s));
+}
+
 TEST(Utils, try_action_actually_times_out)
 {
     bool on_timeout_called{false};
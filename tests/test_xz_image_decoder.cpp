@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <multipass/xz_image_decoder.h>
+
+#include "file_operations.h"
+#include "path.h"
+#include "temp_dir.h"
+
+#include <QDir>
+
+#include <gmock/gmock.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace mp = multipass;
+namespace mpt = multipass::test;
+
+using namespace testing;
+
+namespace
+{
+struct XzImageDecoder : public testing::Test
+{
+    QByteArray decode(const char* xz_file_name)
+    {
+        mp::XzImageDecoder decoder{mpt::test_data_path_for(xz_file_name)};
+        decoder.decode_to(decoded_path, [this](int /*type*/, int percentage) {
+            progress.push_back(percentage);
+            return true;
+        });
+
+        return mpt::load(decoded_path);
+    }
+
+    QByteArray expected_image()
+    {
+        QByteArray image;
+        for (auto i = 0; i < 8; ++i)
+            image += "pied piper image\n";
+        return image;
+    }
+
+    mpt::TempDir temp_dir;
+    QString decoded_path{QDir(temp_dir.path()).filePath("image.img")};
+    std::vector<int> progress;
+};
+} // namespace
+
+TEST_F(XzImageDecoder, decodes_single_block_image)
+{
+    EXPECT_THAT(decode("xz/single_block.img.xz"), Eq(expected_image()));
+}
+
+TEST_F(XzImageDecoder, decodes_multi_block_image)
+{
+    EXPECT_THAT(decode("xz/multi_block.img.xz"), Eq(expected_image()));
+}
+
+TEST_F(XzImageDecoder, keeps_zeroed_tail_of_image)
+{
+    const auto expected = QByteArray("pied piper image\n") + QByteArray(65536, '\0');
+
+    EXPECT_THAT(decode("xz/zero_tail.img.xz"), Eq(expected));
+}
+
+TEST_F(XzImageDecoder, keeps_zeroed_tail_of_multi_block_image)
+{
+    const auto expected = QByteArray("pied piper image\n") + QByteArray(65536, '\0');
+
+    EXPECT_THAT(decode("xz/multi_block_zero_tail.img.xz"), Eq(expected));
+}
+
+TEST_F(XzImageDecoder, reports_each_percentage_once)
+{
+    decode("xz/multi_block.img.xz");
+
+    ASSERT_THAT(progress, Not(IsEmpty()));
+    EXPECT_THAT(progress.back(), Eq(100));
+    EXPECT_TRUE(std::is_sorted(progress.begin(), progress.end()));
+    EXPECT_THAT(std::adjacent_find(progress.begin(), progress.end()), Eq(progress.end()));
+}
+
+TEST_F(XzImageDecoder, throws_on_truncated_image)
+{
+    const auto xz_data = mpt::load_test_file("xz/multi_block.img.xz");
+    const auto truncated_path = QDir(temp_dir.path()).filePath("truncated.img.xz");
+    mpt::make_file_with_content(truncated_path, xz_data.left(xz_data.size() - 20).toStdString());
+
+    mp::XzImageDecoder decoder{truncated_path};
+    EXPECT_THROW(decoder.decode_to(decoded_path, [](int, int) { return true; }), std::runtime_error);
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2019 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <multipass/zstd_image_decoder.h>
+
+#include "file_operations.h"
+#include "path.h"
+#include "temp_dir.h"
+
+#include <QDir>
+
+#include <gmock/gmock.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace mp = multipass;
+namespace mpt = multipass::test;
+
+using namespace testing;
+
+namespace
+{
+struct ZstdImageDecoder : public testing::Test
+{
+    QByteArray decode(const char* zstd_file_name)
+    {
+        mp::ZstdImageDecoder decoder{mpt::test_data_path_for(zstd_file_name)};
+        decoder.decode_to(decoded_path, [this](int /*type*/, int percentage) {
+            progress.push_back(percentage);
+            return true;
+        });
+
+        return mpt::load(decoded_path);
+    }
+
+    QByteArray expected_image()
+    {
+        QByteArray image;
+        for (auto i = 0; i < 8; ++i)
+            image += "pied piper image\n";
+        return image;
+    }
+
+    mpt::TempDir temp_dir;
+    QString decoded_path{QDir(temp_dir.path()).filePath("image.img")};
+    std::vector<int> progress;
+};
+} // namespace
+
+TEST_F(ZstdImageDecoder, decodes_single_frame_image)
+{
+    EXPECT_THAT(decode("zstd/single_frame.img.zst"), Eq(expected_image()));
+}
+
+TEST_F(ZstdImageDecoder, decodes_multi_frame_image)
+{
+    EXPECT_THAT(decode("zstd/multi_frame.img.zst"), Eq(expected_image()));
+}
+
+TEST_F(ZstdImageDecoder, decodes_frames_without_decoded_size)
+{
+    EXPECT_THAT(decode("zstd/unsized_frames.img.zst"), Eq(expected_image()));
+}
+
+TEST_F(ZstdImageDecoder, skips_skippable_frames)
+{
+    EXPECT_THAT(decode("zstd/skippable_frames.img.zst"), Eq(expected_image()));
+}
+
+TEST_F(ZstdImageDecoder, keeps_zeroed_tail_of_image)
+{
+    const auto expected = QByteArray("pied piper image\n") + QByteArray(65536, '\0');
+
+    EXPECT_THAT(decode("zstd/zero_tail.img.zst"), Eq(expected));
+}
+
+TEST_F(ZstdImageDecoder, keeps_zeroed_tail_of_multi_frame_image)
+{
+    const auto expected = QByteArray("pied piper image\n") + QByteArray(65536, '\0');
+
+    EXPECT_THAT(decode("zstd/multi_frame_zero_tail.img.zst"), Eq(expected));
+}
+
+TEST_F(ZstdImageDecoder, reports_each_percentage_once)
+{
+    decode("zstd/multi_frame.img.zst");
+
+    ASSERT_THAT(progress, Not(IsEmpty()));
+    EXPECT_THAT(progress.back(), Eq(100));
+    EXPECT_TRUE(std::is_sorted(progress.begin(), progress.end()));
+    EXPECT_THAT(std::adjacent_find(progress.begin(), progress.end()), Eq(progress.end()));
+}
+
+TEST_F(ZstdImageDecoder, throws_on_truncated_image)
+{
+    const auto zstd_data = mpt::load_test_file("zstd/multi_frame.img.zst");
+    const auto truncated_path = QDir(temp_dir.path()).filePath("truncated.img.zst");
+    mpt::make_file_with_content(truncated_path, zstd_data.left(zstd_data.size() - 10).toStdString());
+
+    mp::ZstdImageDecoder decoder{truncated_path};
+    EXPECT_THROW(decoder.decode_to(decoded_path, [](int, int) { return true; }), std::runtime_error);
+}
+
+TEST_F(ZstdImageDecoder, decodes_image_fed_in_pieces)
+{
+    const auto zstd_data = mpt::load_test_file("zstd/multi_frame_zero_tail.img.zst");
+    QFile decoded_file{decoded_path};
+    ASSERT_TRUE(decoded_file.open(QIODevice::WriteOnly));
+
+    mp::ZstdImageDecoder decoder;
+    for (auto offset = 0; offset < zstd_data.size(); offset += 7)
+        EXPECT_TRUE(decoder.decode_chunk(zstd_data.constData() + offset, std::min(7, zstd_data.size() - offset),
+                                         decoded_file));
+    decoder.finish(decoded_file);
+    decoded_file.close();
+
+    EXPECT_THAT(mpt::load(decoded_path), Eq(QByteArray("pied piper image\n") + QByteArray(65536, '\0')));
+}
+
+TEST_F(ZstdImageDecoder, throws_on_image_fed_in_pieces_cut_short)
+{
+    const auto zstd_data = mpt::load_test_file("zstd/single_frame.img.zst");
+    QFile decoded_file{decoded_path};
+    ASSERT_TRUE(decoded_file.open(QIODevice::WriteOnly));
+
+    mp::ZstdImageDecoder decoder;
+    decoder.decode_chunk(zstd_data.constData(), zstd_data.size() - 4, decoded_file);
+
+    EXPECT_THROW(decoder.finish(decoded_file), std::runtime_error);
+}